@@ -5,9 +5,11 @@
  */
 
 
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>	//for sortage
+#include <string.h>
 
 #include "ecuid_list.h"
 #include "stypes.h"
@@ -309,81 +311,195 @@ static int ecuid_calcdiff(const char *ecuid, const char *item) {
 #if 1
 	/* algo 5 : weighted comparison, index=0 is more important, wildcards count for less than identical chars */
 	diff = 0;
-	int weight = 5;
-	for (idx=0; idx <= 4; idx += 1, weight -= 1) {
-		if (ecuid[idx] == '.') {
-			diff += (weight / 2);
-			continue;
+	for (idx=0; idx <= 4; idx += 1) {
+		diff += ecuid_chardiff(idx, ecuid[idx], item[idx]);
+		if (!ecuid[idx]) {
+			//short query : rest is wildcards
+			for (idx += 1; idx <= 4; idx += 1) {
+				diff += ecuid_chardiff(idx, 0, item[idx]);
+			}
+			break;
 		}
-		if (ecuid[idx] != item[idx]) diff += weight;
 	}
 	return diff;
 #endif
 }
 
+int ecuid_chardiff(unsigned pos, char q, char item) {
+	int weight = 5 - (int) pos;
+	if ((q == '.') || !q) {
+		return weight / 2;
+	}
+	return (q != item) ? weight : 0;
+}
+
+
+/** @return 1 if a is a worse candidate than b */
+static bool km_worse(const struct ecuid_keymatch_t *a, const struct ecuid_keymatch_t *b) {
+	if (a->dist != b->dist) return (a->dist > b->dist);
+	return (a->kidx > b->kidx);
+}
+
+static void km_swap(struct ecuid_keymatch_t *a, struct ecuid_keymatch_t *b) {
+	struct ecuid_keymatch_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void topk_siftup(struct ecuid_topk *tk, unsigned pos) {
+	while (pos) {
+		unsigned parent = (pos - 1) / 2;
+		if (!km_worse(&tk->k[pos], &tk->k[parent])) break;
+		km_swap(&tk->k[pos], &tk->k[parent]);
+		pos = parent;
+	}
+}
+
+static void topk_siftdown(struct ecuid_topk *tk, unsigned pos) {
+	while (1) {
+		unsigned worst = pos;
+		unsigned child = (2 * pos) + 1;
+		if ((child < tk->num) && km_worse(&tk->k[child], &tk->k[worst])) worst = child;
+		child++;
+		if ((child < tk->num) && km_worse(&tk->k[child], &tk->k[worst])) worst = child;
+		if (worst == pos) break;
+		km_swap(&tk->k[pos], &tk->k[worst]);
+		pos = worst;
+	}
+}
+
+void ecuid_topk_init(struct ecuid_topk *tk, struct ecuid_keymatch_t *slots, unsigned max) {
+	tk->k = slots;
+	tk->num = 0;
+	tk->max = max;
+}
+
+bool ecuid_topk_wants(const struct ecuid_topk *tk, int dist, unsigned kidx) {
+	struct ecuid_keymatch_t cand = {0, kidx, dist, NULL};
+	if (tk->num < tk->max) return 1;
+	return (tk->max) && km_worse(&tk->k[0], &cand);
+}
+
+void ecuid_topk_add(struct ecuid_topk *tk, uint32_t key, unsigned kidx, int dist, const char *ecuid) {
+	struct ecuid_keymatch_t cand = {key, kidx, dist, ecuid};
+	unsigned idx;
+
+	if (!tk->max) return;
+
+	//already there ? The set is small, a linear search is fine
+	for (idx = 0; idx < tk->num; idx++) {
+		if (tk->k[idx].key != key) continue;
+		if (km_worse(&tk->k[idx], &cand)) {
+			tk->k[idx] = cand;
+			topk_siftdown(tk, idx);
+		}
+		return;
+	}
+
+	if (tk->num < tk->max) {
+		tk->k[tk->num] = cand;
+		topk_siftup(tk, tk->num);
+		tk->num++;
+		return;
+	}
+	if (km_worse(&tk->k[0], &cand)) {
+		tk->k[0] = cand;
+		topk_siftdown(tk, 0);
+	}
+}
 
 //gadget to use qsort()
-static int bs_compar(const void *a, const void *b) {
-	const struct ecuid_keymatch_t *ka, *kb;
-	ka = a;
-	kb = b;
-	return ka->dist - kb->dist;
+static int km_compar(const void *a, const void *b) {
+	const struct ecuid_keymatch_t *ka = a, *kb = b;
+	if (km_worse(ka, kb)) return 1;
+	if (km_worse(kb, ka)) return -1;
+	return 0;
+}
+
+unsigned ecuid_topk_finish(struct ecuid_topk *tk) {
+	unsigned idx;
+
+	qsort(tk->k, tk->num, sizeof(*tk->k), km_compar);
+	for (idx = tk->num; idx < tk->max; idx++) {
+		tk->k[idx].key = 0;
+		tk->k[idx].kidx = 0;
+		tk->k[idx].dist = ECUID_MAXDIST;
+		tk->k[idx].ecuid = NULL;
+	}
+	return tk->num;
 }
 
 void ecuid_getkeys(const char *ECUID, struct ecuid_keymatch_t *kclist, unsigned candidates) {
-	
-	#define MAXDIST 100
+	struct ecuid_topk tk;
 	unsigned i;
 
-	for (i = 0; i < candidates; i++) {
-		kclist[i].key = 0;
-		kclist[i].kidx = 0;
-		kclist[i].dist = MAXDIST;
+	ecuid_topk_init(&tk, kclist, candidates);
+	for (i=0; ecuid_list[i].s27k != 0; i++) {
+		int dist = ecuid_calcdiff(ECUID, ecuid_list[i].ecuid);
+		ecuid_topk_add(&tk, ecuid_list[i].s27k, i, dist, ecuid_list[i].ecuid);
 	}
+	ecuid_topk_finish(&tk);
+	return;
+}
 
+const char *ecuid_list_entry(unsigned idx, uint32_t *s27k) {
+	if (!ecuid_list[idx].s27k) return NULL;
+	*s27k = ecuid_list[idx].s27k;
+	return ecuid_list[idx].ecuid;
+}
 
+bool ecuid_from_filename(const char *filename, char *ecuid) {
+	// first : search backwards for a fwd/back slash
+	// pathological test cases : "/", "abc"
+	const char *pfile;
+    pfile = filename + strlen(filename);
+    for (; pfile > filename; pfile--) {
+        if ((*pfile == '\\') || (*pfile == '/')) {
+            pfile++;
+            break;
+        }
+    }
 
-	//const char spacing[]="      ";
-	for (i=0; ecuid_list[i].s27k != 0; i++) {
-		int dist = ecuid_calcdiff(ECUID, ecuid_list[i].ecuid);
-		//printf("%s\t%.*s%d\n", ecuid_list[i].ecuid, dist, spacing, dist);
-
-
-		//find the first slot with the same key and a worse distance
-		//check if key already in the candidate list
-		bool already_there = 0;
-		unsigned loopc;
-		for (loopc = 0; loopc < candidates; loopc += 1) {
-			unsigned idxmod = loopc;
-
-			if (kclist[idxmod].key == ecuid_list[i].s27k) {
-				already_there = 1;
-				//already in list: better distance?
-				if (dist < kclist[idxmod].dist) {
-					kclist[idxmod].dist = dist;
-				}
-				break;
-			}
-		}
-		//else, replace the slot with the worse distance
-		if (!already_there) {
-			int maxdist = 0;
-			int maxdist_idx = 0;
-			//find worse distance
-			for (loopc = 0; loopc < candidates; loopc += 1) {
-				int idxmod = loopc;
-	
-				if (kclist[idxmod].dist > maxdist) {
-					maxdist = kclist[idxmod].dist;
-					maxdist_idx = idxmod;
-				}
-			}
-			
-			kclist[maxdist_idx].key = ecuid_list[i].s27k;
-			kclist[maxdist_idx].kidx = i;
-			kclist[maxdist_idx].dist = dist;
+    unsigned basename_len = strlen(pfile);
+    if (basename_len < ECUID_LEN) {
+		return 0;
+    }
+
+    // make temp copy because strtok_r needs a writeable char *
+    char tmp_basename[1 + ECUID_LEN +2] =  {0};	//possible '1' prefix, + separator, + 0-term
+	strncpy(tmp_basename, pfile, ECUID_LEN+2);
+
+    // next : take first "token" of filename as the ECUID
+    char *saveptr;
+    char *tok = strtok_r(tmp_basename, "-_. ", &saveptr);
+    if (!tok) {
+		return 0;
+    }
+    unsigned tok_len = strlen(tok);
+    if ((tok_len != ECUID_LEN) &&
+		(tok_len != (1 + ECUID_LEN))) {
+		return 0;
+    }
+
+    //validate chars and make uppercase : 0-9, a-z, A-Z
+    for (unsigned idx = 0; idx < tok_len; idx++) {
+		if (!isalnum(tok[idx])) {
+			return 0;
 		}
+		tok[idx] = toupper(tok[idx]);
+    }
+
+
+    if ((tok_len == (ECUID_LEN + 1)) &&
+		(tok[0] == '1')) {
+		// 6-char string starting with '1' , e.g. 18U92A
+		memcpy(ecuid, &tok[1], ECUID_STR_LEN);
+		return 1;
+	} else if (tok_len == ECUID_LEN) {
+		//normal ECUID
+		memcpy(ecuid, tok, ECUID_STR_LEN);
+		return 1;
 	}
-	qsort(kclist, candidates, sizeof(struct ecuid_keymatch_t), bs_compar);
-	return;
+
+	return 0;
 }
@@ -7,18 +7,74 @@
  * Licensed under GPLv3
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define ECUID_LEN 5	//excluding 0-term
+#define ECUID_STR_LEN (ECUID_LEN + 1)	//includes 0-term
+
+#define ECUID_MAXDIST 100	//distance for unused candidate slots
+
 struct ecuid_keymatch_t {
 	uint32_t key;
-	unsigned kidx;	//index into ecuid_list[]
+	unsigned kidx;	//index into ecuid_list[], or source-specific index; breaks distance ties (lower wins)
 	int dist;
+	const char *ecuid;	//closest ECUID with this key; NULL for unused slots
 };
 
-/** Fill list with best key match candidates
+/** Distance contribution of one ECUID character; the total distance is the sum over the 5 positions.
+ * Leftmost chars weigh more, and wildcards ('.') in the query count for less than a mismatch.
+ * A query shorter than 5 chars is padded with wildcards.
+ *
+ * @param pos : 0-4
+ * @param q : query char, '.' or 0 for a wildcard
+ */
+int ecuid_chardiff(unsigned pos, char q, char item);
+
+/** Fill list with best key match candidates : the <candidates> distinct keys with the smallest distance,
+ * sorted by distance, then by kidx (earlier ecuid_list[] entry first). Unused slots have key = 0 and dist = ECUID_MAXDIST.
 Caller must provide this array:
 	struct ecuid_keymatch_t k_candidates[candidates];	//for the best N keys found
 */
 void ecuid_getkeys(const char *ECUID, struct ecuid_keymatch_t *k, const unsigned candidates);
 
+/** entry <idx> of the built-in list, for indexing it elsewhere (see romdb_nearest_keys()).
+ * Call with idx = 0, 1, ... and stop at the first NULL.
+ * @return ECUID, 0-terminated; NULL past the end
+ */
+const char *ecuid_list_entry(unsigned idx, uint32_t *s27k);
+
+
+/** bounded "top K" set of keys, kept as a max-heap so the worst candidate is at [0].
+ * Each key appears once, with its best distance.
+ */
+struct ecuid_topk {
+	struct ecuid_keymatch_t *k;	//caller-provided, max elements
+	unsigned num;
+	unsigned max;
+};
+
+void ecuid_topk_init(struct ecuid_topk *tk, struct ecuid_keymatch_t *slots, unsigned max);
+
+/** @return 1 if a candidate with this distance and index can still enter the set, or improve a key in it.
+ * Also holds for any candidate with dist and kidx at least as large.
+ */
+bool ecuid_topk_wants(const struct ecuid_topk *tk, int dist, unsigned kidx);
+
+void ecuid_topk_add(struct ecuid_topk *tk, uint32_t key, unsigned kidx, int dist, const char *ecuid);
+
+/** sort candidates by distance, and fill unused slots. The set can't be added to after this.
+ * @return number of valid candidates
+ */
+unsigned ecuid_topk_finish(struct ecuid_topk *tk);
+
+/** try to extract an ECUID from given full filename
+ *
+ * @param [out] ecuid if found, write 5+1 bytes here (includes 0 term)
+ * @param filename can be full abs/rel path, or just filename. Must be 0-terminated
+ *
+ * return 1 if ok
+*/
+bool ecuid_from_filename(const char *filename, char *ecuid);
+
 #endif
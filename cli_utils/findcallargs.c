@@ -13,41 +13,69 @@
  *    <tgt> = function address
  *    <r4val> = argument value
  * Example: test_findcallargs.exe 0x56738 0xB0 rom.bin
+ *
+ * Many calls at once : -t <calllist>, one "[<name>,]<tgt>,<r4val>" per line. Output is CSV:
+ * name,tgt,r4val,pos
+ *
+ * Over sibling ROMs : with -r, the ROM args are files, directories or "-" (list on stdin) as for nisrom,
+ * searched in parallel (-j). Rows get a leading rom column, in ROM order :
+> findcallargs -r -j 0 -t dtcs.csv ../roms/
+rom,name,tgt,r4val,pos
+"../roms/8U92A.bin",P0100,0x00056738,0xB0,0x0123AC
  *
  *
  * (c) fenugrec 2016-2017
  * GPLv3
  */
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>	//getopt
 
 #include "nislib.h"
+#include "nislib_callgraph.h"
+#include "nislib_corpus.h"
+#include "nislib_shindex.h"
 #include "nislib_shtools.h"
 #include "stypes.h"
 #include "sh_opcodes.h"
 
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
 
-static void report_hit(u32 pos) {
-	printf("\t\t**** @ 0x%06lX\n", (unsigned long) pos);
+/** one search : calls to <base> with r4 == <arg>, and where to report them.
+ * Passed to all levels of tracking.
+ */
+struct callctx {
+	u32 base;
+	u32 arg;
+	FILE *out;
+	bool csv;	//report format
+	const char *name;	//CSV name column
+	const char *rom;	//if set, prefix CSV rows with this ROM name
+};
+
+static void report_hit(const struct callctx *cc, u32 pos) {
+	if (cc->csv) {
+		if (cc->rom) fprintf(cc->out, "\"%s\",", cc->rom);
+		fprintf(cc->out, "%s,0x%08lX,0x%lX,0x%06lX\n", cc->name,
+			(unsigned long) cc->base, (unsigned long) cc->arg, (unsigned long) pos);
+		return;
+	}
+	fprintf(cc->out, "\t\t**** @ 0x%06lX\n", (unsigned long) pos);
 }
 
 /**** RECURSIV HELL ****/
 
 
-u32 glob_base;
-u32 glob_arg;	//fugly shit to have access throughout all levels
-
-
 /* test for "jsr @regno" */
 #define JSR_R4_MAXBT	10	//how far back to search for r4 loadage
 void test_goodcall(const u8 *buf, u32 pos, unsigned regno, void *data) {
-	(void) data;	//unused
+	const struct callctx *cc = data;
 	u16 code = reconst_16(&buf[pos]);
 
 	if (regno == 4) return;	//r4 would defeat the purpose !
@@ -58,27 +86,22 @@ void test_goodcall(const u8 *buf, u32 pos, unsigned regno, void *data) {
 	//cool, now we need to find what the value of r4 was. Start at pos + 2 because of delay slot !
 	u32 r4val;
 	if (sh_bt_immload(&r4val, buf, pos - JSR_R4_MAXBT, pos + 2, 4)) {
-		if (r4val == glob_arg) report_hit(pos);
+		if (r4val == cc->arg) report_hit(cc, pos);
 	}
 	return;
 }
 
 
-
-struct bsrcb_data {
-	u32 expected_r4val;
-	};
-
-//called every time a "bsr tgt" is found. *data is a struct with required data to do the r4 search
+//called every time a "bsr tgt" is found. *data is the callctx with required data to do the r4 search
 #define BSR_R4_MAXBT	JSR_R4_MAXBT	//how far back to search for r4 loadage
 void bsr_callback(const u8 *buf, u32 pos, void *data) {
-	struct bsrcb_data *bcbd = data;
+	const struct callctx *cc = data;
 
 	//cool, now we need to find what the value of r4 was. Start at pos + 2 because of delay slot !
 	u32 r4val;
 	if (sh_bt_immload(&r4val, buf, pos - BSR_R4_MAXBT, pos + 2, 4)) {
-		if (r4val == bcbd->expected_r4val) {
-			report_hit(pos);
+		if (r4val == cc->arg) {
+			report_hit(cc, pos);
 		}
 	}
 	return;
@@ -101,122 +124,321 @@ void bsr_callback(const u8 *buf, u32 pos, void *data) {
  *
  *
  * **** 2 : for "bsr &FUNC" form :
+ *
+ * the bsr callers come from the call graph. Its jsr edges only cover calls shortly after the literal
+ * load, so the tracker still follows every load of <base>.
+ *
+ * @param trk : tracker for this ROM; not shared with other threads
  */
 
-void findcalls(FILE *i_file, u32 base, u32 arg) {
-	uint8_t *src;
-	u16 *visited;
+void findcalls(const struct sh_index *idx, const struct sh_callgraph *cg, struct sh_tracker *trk,
+			const uint8_t *src, u32 file_len, const struct callctx *cc) {
+	const struct cg_edge *callers = NULL;
+	u32 ncallers = 0;
+	u32 base = cc->base;
+	u32 cur;
 
-	u32 file_len;
+	u32 fi = sh_callgraph_find(cg, base);
+	if (fi != CG_NOFUNC) {
+		ncallers = sh_callgraph_callers(cg, fi, &callers);
+	}
 
-	glob_base = base;
-	glob_arg = arg;
+	//2 possible opcodes : -  mov.w @(i, pc), Rn  : (0x1001nnnn 0xii) , or
+	//  mov.l @(i, pc), Rn : (0x1101nnnn 0xii)
+	//that load the specified base.
+	const struct sh_xref *sites;
+	u32 nsites = sh_index_pcimm(idx, base, &sites);
+	for (cur = 0; cur < nsites; cur++) {
+		u32 romcurs = sites[cur].pos;
+		u16 opc = reconst_16(&src[romcurs]);
 
-	file_len = flen(i_file);
-	if ((!file_len) || (file_len > 3*1024*1024UL)) {
-		printf("huge file (length %lu)\n", (unsigned long) file_len);
-	}
+		// match ! start recursion.
+		unsigned regno = sh_getopcode_dest(opc);
+		sh_tracker_reset(trk);
+		TRACE(TC_TRACKER, TL_DEBUG, "Entering 00.%6lX.R%d\n", (unsigned long) romcurs + 2, regno);
+		sh_track_reg(trk, src, romcurs + 2, file_len, regno, test_goodcall, (void *) cc);
 
-	src = malloc(file_len);
-	if (!src) {
-		printf("malloc choke\n");
-		return;
-	}
-	visited = malloc(file_len * 2);
-	if (!visited) {
-		printf("malloc choke\n");
-		free(src);
-		return;
 	}
 
-	/* load whole ROM */
-	if (fread(src,1,file_len,i_file) != file_len) {
-		printf("trouble reading\n");
-		goto exitfc;
+	// 2 : BSR occurences
+	for (cur = 0; cur < ncallers; cur++) {
+		if (callers[cur].kind != CG_BSR) continue;
+		bsr_callback(src, callers[cur].site, (void *) cc);
 	}
+	return;
+}
 
-	u32 romcurs = 0;
-	for (; romcurs < file_len; romcurs += 2) {
-		u16 opc;
 
-		opc = reconst_16(&src[romcurs]);
 
-		//2 possible opcodes : -  mov.w @(i, pc), Rn  : (0x1001nnnn 0xii) , or
-		//  mov.l @(i, pc), Rn : (0x1101nnnn 0xii)
-		uint8_t optop = (opc & 0xB000) >> 8;
-		if (optop != 0x90) {
-			continue;
+/** One call to look for, with an optional name (from a call list) */
+#define CALLTARGET_NAMELEN 64
+struct calltarget {
+	char name[CALLTARGET_NAMELEN];
+	u32 tgt;
+	u32 r4val;
+};
+
+/** parse a call list : one "[<name>,]<tgt>,<r4val>" per line.
+ * Lines that don't parse (headers, comments) are skipped.
+ *
+ * @param fname : "-" for stdin
+ * @param calls : caller must free
+ * @return number of calls, 0 if none or error
+ */
+static unsigned load_calls(const char *fname, struct calltarget **calls) {
+	FILE *fh;
+	char line[256];
+	unsigned ncalls = 0, alloc = 0;
+	struct calltarget *list = NULL;
+
+	if (strcmp(fname, "-") == 0) {
+		fh = stdin;
+	} else {
+		fh = fopen(fname, "r");
+		if (!fh) {
+			fprintf(stderr, "cannot open %s\n", fname);
+			return 0;
 		}
+	}
+
+	while (fgets(line, sizeof(line), fh)) {
+		struct calltarget c = {0};
+		unsigned long tgt, r4val;
 
-		u32 imm = sh_get_PCimm(src, romcurs);
-		if (imm != base) {
-			continue;
+		if (sscanf(line, "%63[^,\n],%lx,%lx", c.name, &tgt, &r4val) != 3) {
+			c.name[0] = 0;
+			if (sscanf(line, "%lx,%lx", &tgt, &r4val) != 2) continue;
 		}
+		c.tgt = tgt;
+		c.r4val = r4val;
+
+		if (ncalls == alloc) {
+			alloc = alloc ? (alloc * 2) : 64;
+			struct calltarget *tmp = realloc(list, alloc * sizeof(*list));
+			if (!tmp) {
+				free(list);
+				list = NULL;
+				ncalls = 0;
+				break;
+			}
+			list = tmp;
+		}
+		list[ncalls++] = c;
+	}
 
-		// match ! start recursion.
-		unsigned regno = sh_getopcode_dest(opc);
-		memset(visited, 0, file_len * 2);
-		fprintf(dbg_stream, "Entering 00.%6lX.R%d\n", (unsigned long) romcurs + 2, regno);
-		sh_track_reg(src, romcurs + 2, file_len, regno, visited, test_goodcall, NULL);
+	if (fh != stdin) fclose(fh);
+	*calls = list;
+	return ncalls;
+}
 
+struct calllist {
+	const struct calltarget *calls;
+	unsigned ncalls;
+};
+
+/** search every call of <cl> in one ROM, as CSV rows */
+static void findcalls_multi(const struct sh_index *idx, const struct sh_callgraph *cg, struct sh_tracker *trk,
+			const u8 *src, u32 siz, const struct calllist *cl, FILE *out, const char *rom) {
+	unsigned cur;
+
+	for (cur = 0; cur < cl->ncalls; cur++) {
+		struct callctx cc = {
+			.base = cl->calls[cur].tgt,
+			.arg = cl->calls[cur].r4val,
+			.out = out,
+			.csv = 1,
+			.name = cl->calls[cur].name,
+			.rom = rom,
+		};
+		findcalls(idx, cg, trk, src, siz, &cc);
 	}
+}
 
-	// 2 : find BSR occurences
-	struct bsrcb_data bcbd;
-	bcbd.expected_r4val = arg;
-	find_bsr(src, base, bsr_callback, &bcbd);
+/** corpus_run() callback; ctx is the calllist */
+static int corpus_findcalls(struct corpus_rom *cr, void *ctx) {
+	struct sh_callgraph *cg = sh_callgraph_build(cr->idx, cr->buf, cr->siz);
+	if (!cg) return -1;
 
+	findcalls_multi(cr->idx, cg, cr->trk, cr->buf, cr->siz, ctx, cr->out, cr->fname);
+	sh_callgraph_free(cg);
+	return 0;
+}
 
-exitfc:
-	free(src);
-	free(visited);
-	return;
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+		"**** Find function calls with matching r4 argument\n"
+		"**** (c) 2015-2017 fenugrec\n", progname);
+	printf("%s <tgt> <r4val> <in_file>"
+		"\n\tExample: %s 0x56738 0x66 rom.bin\n"
+		"%s -t <calllist> <in_file>"
+		"\n\tSearch all calls listed in <calllist> (\"-\" for stdin), one \"[<name>,]<tgt>,<r4val>\" per line;"
+		"\n\tprints CSV.\n"
+		"%s -r [-j <n>] {-t <calllist> | <tgt> <r4val>} <ROMFILE> [ROMFILE...]"
+		"\n\tSame, over several ROMs. Each ROMFILE can be a directory (scanned recursively),"
+		"\n\tor \"-\" to read a list of filenames from stdin. Prints CSV with a leading rom column."
+		"\n\t-j <n>: search <n> ROMs in parallel (0 = one per CPU). Output order is unchanged\n",
+		progname, progname, progname, progname);
 }
 
+/** -r mode : search every call of <cl> in every ROM */
+static int findcalls_corpus(const struct calllist *cl, unsigned njobs, int nroms, char **roms) {
+	struct filelist files = {0};
+	unsigned failed;
+	int idx;
+
+	for (idx = 0; idx < nroms; idx++) {
+		if (!filelist_addarg(&files, roms[idx])) {
+			printf("trouble building file list\n");
+			filelist_free(&files);
+			return 1;
+		}
+	}
 
+	dbg_stream = tmpfile();	//before calling nislib funcs
+	if (dbg_stream == NULL) {
+		printf("problem creating temp file!?\n");
+		filelist_free(&files);
+		return 1;
+	}
+
+	printf("rom,name,tgt,r4val,pos\n");
+	failed = corpus_run(&files, njobs, corpus_findcalls, (void *) cl, stdout);
+	if (failed) {
+		fprintf(stderr, "%u / %u ROMs could not be searched\n", failed, files.num);
+	}
+	fclose(dbg_stream);
+	filelist_free(&files);
+	return failed ? 1 : 0;
+}
 
 int main(int argc, char * argv[]) {
 	unsigned long tgt, r4val;
-	FILE *i_file;
-
-	if (argc != 4) {
-		printf(	"**** %s\n"
-			"**** Find function calls with matching r4 argument\n"
-			"**** (c) 2015-2017 fenugrec\n", argv[0]);
-		printf("%s <tgt> <r4val> <in_file>"
-			"\n\tExample: %s 0x56738 0x66 rom.bin\n", argv[0], argv[0]);
-		return 0;
+	struct rom_image img;
+	struct calltarget *calls = NULL;
+	struct calltarget single = {0};
+	struct calllist cl = {0};
+	const char *calllist = NULL;
+	bool corpus = 0;
+	unsigned njobs = 1;
+	int rv = 1;
+	int opt;
+
+	if (!trace_config(getenv(TRACE_ENV))) return -1;
+
+	while ((opt = getopt(argc, argv, "j:rt:")) != -1) {
+		switch (opt) {
+		case 'j':
+			njobs = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			corpus = 1;
+			break;
+		case 't':
+			calllist = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
 	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
-	// arg 1,2 : orig checksum locations
-	if (sscanf(argv[1], "%lx", &tgt) != 1) {
-		printf("did not understand %s\n", argv[1]);
-		return 0;
+	if (!calllist) {
+		if (argc < 4) {
+			usage(argv[0]);
+			return 0;
+		}
+		if (sscanf(argv[1], "%lx", &tgt) != 1) {
+			printf("did not understand %s\n", argv[1]);
+			return 0;
+		}
+		if (sscanf(argv[2], "%lx", &r4val) != 1) {
+			printf("did not understand %s\n", argv[2]);
+			return 0;
+		}
+		single.tgt = tgt;
+		single.r4val = r4val;
+		cl.calls = &single;
+		cl.ncalls = 1;
+		argc -= 2;
+		argv += 2;
+	} else {
+		if (argc < 2) {
+			usage(argv[0]);
+			return 0;
+		}
+		cl.ncalls = load_calls(calllist, &calls);
+		cl.calls = calls;
+		if (!cl.ncalls) {
+			printf("no calls in %s\n", calllist);
+			return 0;
+		}
+	}
+
+	if (corpus) {
+		int idx;
+		for (idx = 1; idx < argc; idx++) {
+			if (calllist && (strcmp(calllist, "-") == 0) && (strcmp(argv[idx], "-") == 0)) {
+				printf("stdin can't hold both call and ROM lists\n");
+				free(calls);
+				return 1;
+			}
+		}
+		rv = findcalls_corpus(&cl, njobs, argc - 1, &argv[1]);
+		free(calls);
+		return rv;
 	}
-	if (sscanf(argv[2], "%lx", &r4val) != 1) {
-		printf("did not understand %s\n", argv[2]);
+
+	if (argc != 2) {
+		usage(argv[0]);
+		free(calls);
 		return 0;
 	}
 
 	dbg_stream = tmpfile();	//before calling nislib funcs
 	if (dbg_stream == NULL) {
 		printf("problem creating temp file!?\n");
+		free(calls);
 		return 1;
 	}
 
 	//input file
-	if ((i_file=fopen(argv[3],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[3]);
+	if (romimg_open(&img, argv[1], 0)) {
 		fclose(dbg_stream);
+		free(calls);
 		return 1;
 	}
+	if (img.siz > 3*1024*1024UL) {
+		printf("huge file (length %lu)\n", (unsigned long) img.siz);
+	}
 
-	rewind(i_file);
-	findcalls(i_file, tgt, r4val);
+	struct sh_index *idx = sh_index_build(img.buf, img.siz);
+	struct sh_callgraph *cg = idx ? sh_callgraph_build(idx, img.buf, img.siz) : NULL;
+	struct sh_tracker *trk = sh_tracker_new(img.siz);
+	if (!cg || !trk) {
+		printf("malloc choke\n");
+		goto exit;
+	}
+	sh_tracker_setdecoded(trk, sh_index_decoded(idx));
+
+	if (calllist) {
+		printf("name,tgt,r4val,pos\n");
+		findcalls_multi(idx, cg, trk, img.buf, img.siz, &cl, stdout, NULL);
+	} else {
+		struct callctx cc = {.base = tgt, .arg = r4val, .out = stdout};
+		findcalls(idx, cg, trk, img.buf, img.siz, &cc);
+	}
+	rv = 0;
 
+exit:
+	sh_tracker_free(trk);
+	sh_callgraph_free(cg);
+	sh_index_free(idx);
 	fclose(dbg_stream);
-	fclose(i_file);
+	romimg_close(&img);
+	free(calls);
 
-	return 0;
+	return rv;
 }
-
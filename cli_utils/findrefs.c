@@ -39,6 +39,19 @@
 		**** R @ 0x059470 : 0xFFFF9FE8 + 0x2
 		**** R @ 0x05AA68 : 0xFFFF9FE8 + 0x2
 >
+ *
+ * Many targets at once : give a list (e.g. ../ghidra_helpers/regs_7058.csv, or one address per line)
+ * with -t. Every base within DEFAULT_MAXDIST of any target is looked up once, and each seed is tracked
+ * once for all the targets it can reach. Output is CSV:
+> findrefs -t ramvars.csv ..\8U92A
+name,tgt,access,pos,base,offs
+somevar,0xFFFF9FEA,R,0x05945C,0xFFFF9FE8,0x2
+ *
+ * Same search over sibling ROMs : with -r, the ROM args are files, directories or "-" (list on stdin)
+ * as for nisrom. ROMs are searched in parallel (-j), and rows get a leading rom column, in ROM order:
+> findrefs -r -j 0 -t ramvars.csv ../roms/
+rom,name,tgt,access,pos,base,offs
+"../roms/8U92A.bin",somevar,0xFFFF9FEA,R,0x05945C,0xFFFF9FE8,0x2
  *
  *
  * (c) fenugrec 2016-2017
@@ -52,50 +65,103 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
 
 #include "nislib.h"
+#include "nislib_corpus.h"
+#include "nislib_shindex.h"
 #include "nislib_shtools.h"
 #include "stypes.h"
 #include "sh_opcodes.h"
 
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
-//silence some debug output
-#define DEBUG 0
-#define dbgprint(fmt, ...) \
-            do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+/** One target address, with an optional name (from a target list) */
+#define REFTARGET_NAMELEN 64
+struct reftarget {
+	char name[REFTARGET_NAMELEN];
+	u32 addr;
+};
 
-static void report_hit(bool is_write, u32 pos, u32 base, u32 offs) {
-	if (is_write) {
-		printf("\t\t**** W @ 0x%06lX : 0x%08lX + 0x%lX\n", (unsigned long) pos,
-				(unsigned long) base, (unsigned long) offs);
-	} else {
-		printf("\t\t**** R @ 0x%06lX : 0x%08lX + 0x%lX\n", (unsigned long) pos,
-				(unsigned long) base, (unsigned long) offs);
-	}
-}
+/** (offset, target) pair; one per target reachable from a given base */
+struct offs_ent {
+	u32 offs;	//target addr - base
+	unsigned tgt;	//index in target list
+};
 
 
 /**** RECURSIV HELL ****/
 
-u32 glob_base;	//fugly shit to have access throughout all levels
-//TODO : move glob_* to this
+/** tracking that must restart after an "add #imm, Rn", with a new base */
+struct deferred_seed {
+	u32 pos;
+	unsigned regno;
+	u32 base;
+	u32 adj;
+	const struct offs_ent *ofs;
+	unsigned nofs;
+};
+
+/** Shared by all levels of tracking for one seed. */
 struct recursedata {
 	u32 siz;
-	//u32 base;
-	u32 offs;
-	void *visited;
+	u32 base;	//value loaded in the tracked reg
+	const struct offs_ent *ofs;	//offsets of interest for this base, sorted by offs
+	unsigned nofs;
+	u32 adj;	//ofs[].offs are relative to (base - adj); nonzero after an "add #imm"
+	const struct reftarget *tgts;
+	bool csv;	//report format
+	FILE *out;
+	const char *rom;	//if set, prefix CSV rows with this ROM name
+	struct sh_tracker *trk;
+	struct deferred_seed *pend;	//caller must free
+	unsigned npend;
+	unsigned pend_alloc;
 };
 
 void test_callback(const u8 *buf, u32 pos, unsigned regno, void *data);
 
 
+/** find first ofs[] element with ofs.offs >= offs */
+static unsigned offs_lbound(const struct recursedata *rd, u32 offs) {
+	unsigned lo = 0, hi = rd->nofs;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (rd->ofs[mid].offs < offs) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/** report every target reached by (base + offs) */
+static void report_hit(const struct recursedata *rd, bool is_write, u32 pos, u32 offs) {
+	unsigned i;
+	for (i = offs_lbound(rd, offs + rd->adj); i < rd->nofs; i++) {
+		if (rd->ofs[i].offs != (offs + rd->adj)) break;
+		if (rd->csv) {
+			const struct reftarget *tgt = &rd->tgts[rd->ofs[i].tgt];
+			if (rd->rom) fprintf(rd->out, "\"%s\",", rd->rom);
+			fprintf(rd->out, "%s,0x%08lX,%c,0x%06lX,0x%08lX,0x%lX\n", tgt->name,
+				(unsigned long) tgt->addr, is_write ? 'W':'R', (unsigned long) pos,
+				(unsigned long) rd->base, (unsigned long) offs);
+			continue;
+		}
+		fprintf(rd->out, "\t\t**** %c @ 0x%06lX : 0x%08lX + 0x%lX\n", is_write ? 'W':'R',
+				(unsigned long) pos, (unsigned long) rd->base, (unsigned long) offs);
+	}
+}
+
+
 
 /*** test functions ***/
 
 //check and report if hit (GBR already == base)
-void test_gbrref(const u8 *buf, u32 pos, u32 offs) {
+void test_gbrref(const u8 *buf, u32 pos, const struct recursedata *rd) {
 	u16 opc = reconst_16(&buf[pos]);
 	int dir = 0;	//0 : R. 1: W
 	unsigned mul = 0;
@@ -110,14 +176,11 @@ void test_gbrref(const u8 *buf, u32 pos, u32 offs) {
 	}
 	if (!mul) return;	//not a GBR opcode
 
-	if (offs == (opc & 0xFF) * mul) {
-		//match !
-		report_hit(dir, pos, glob_base, offs);
-	}
+	report_hit(rd, dir, pos, (opc & 0xFF) * mul);
 }
 
 //test @(disp,Rn) forms
-void test_rnrel(const u8 *buf, u32 pos, u32 offs, unsigned regno) {
+void test_rnrel(const u8 *buf, u32 pos, const struct recursedata *rd, unsigned regno) {
 	u16 opc = reconst_16(&buf[pos]);
 	u32 disp = 0;
 	int dir = 0;	//0 : R. 1: W
@@ -146,17 +209,14 @@ void test_rnrel(const u8 *buf, u32 pos, u32 offs, unsigned regno) {
 		return;
 	}
 
-	if (offs == disp) {
-		//match !
-		report_hit(dir, pos, glob_base, offs);
-	}
+	report_hit(rd, dir, pos, disp);
 }
 
 
 
 // @(R0, Rn) forms
 #define R0RN_MAXBT	20	//how far back (in bytes) to search for an immediate load for the offset
-void test_r0rn(const u8 *buf, u32 pos, u32 offs, unsigned regno) {
+void test_r0rn(const u8 *buf, u32 pos, const struct recursedata *rd, unsigned regno) {
 	u16 opc = reconst_16(&buf[pos]);
 	int dir = 0;	//0 : R. 1: W
 	unsigned newreg;
@@ -192,20 +252,17 @@ void test_r0rn(const u8 *buf, u32 pos, u32 offs, unsigned regno) {
 		if (!sh_bt_immload(&disp, buf, pos - R0RN_MAXBT, pos - 2, R0)) return;
 	}
 
-	if (offs == disp) {
-		//match !
-		report_hit(dir, pos, glob_base, offs);
-	}
+	report_hit(rd, dir, pos, disp);
 }
 
 /* test "@Rn, Rm" and "Rn, @Rm" variants (REGREF) */
-void test_regref(const u8 *buf, u32 pos, u32 offs, unsigned regno) {
+void test_regref(const u8 *buf, u32 pos, const struct recursedata *rd, unsigned regno) {
 	int dir = 0;
 	unsigned newreg;
 	u16 opc=reconst_16(&buf[pos]);
 
 	// offset must be 0 for these to work
-	if (offs) return;
+	if (rd->ofs[0].offs != rd->adj) return;	//ofs[] is sorted
 
 	// patterns :
 	// 0010nnnnmmmm0000 mov.b <REG_M>,@<REG_N>
@@ -229,14 +286,14 @@ void test_regref(const u8 *buf, u32 pos, u32 offs, unsigned regno) {
 			dir = 1;
 		}
 		if (newreg != regno) return;	//mismatch
-		report_hit(dir, pos, glob_base, 0);
+		report_hit(rd, dir, pos, 0);
 	}
 	return;
 }
 
 //test [logic].b  #imm, @(R0, GBR) forms
 #define LOGICGBR_MAXBT	20
-void test_logicgbr(const u8 *buf, u32 pos, u32 offs) {
+void test_logicgbr(const u8 *buf, u32 pos, const struct recursedata *rd) {
 	u16 opc=reconst_16(&buf[pos]);
 	u32 r0val;
 
@@ -248,7 +305,7 @@ void test_logicgbr(const u8 *buf, u32 pos, u32 offs) {
 
 	if ((opc & 0xFC00) != 0xCC00) return;
 	if (!sh_bt_immload(&r0val, buf, pos - LOGICGBR_MAXBT, pos - 2, 0)) return;
-	if (offs == r0val) report_hit(1, pos, glob_base, offs);
+	report_hit(rd, 1, pos, r0val);
 	return;
 }
 
@@ -257,26 +314,50 @@ void test_logicgbr(const u8 *buf, u32 pos, u32 offs) {
  * Only checks "add imm8, <regno>". TODO maybe : "add  RM, Rn" ?
  */
 void test_regadd(const u8 *buf, u32 pos, unsigned regno, struct recursedata *rd) {
-	u32 temp_base, temp_offs;
 	u16 opc=reconst_16(&buf[pos]);
 
 	/* 0111nnnni8*1.... add #<imm>,<REG_N>  */
 	if ((opc & 0xF000) != 0x7000) return;
-	if (rd->offs > 0x7F) return;	//signed imm8 !
-	if ((opc & 0xFF) == rd->offs) {
-		temp_base = glob_base;
-		temp_offs = rd->offs;
-
-		//start new partial recursion
-		glob_base = glob_base + rd->offs;
-		rd->offs = 0;
-		sh_track_reg(buf, pos + 2, rd->siz, regno, rd->visited, test_callback, rd);
-
-		// and resume
-		glob_base = temp_base;
-		rd->offs = temp_offs;
-		return;
+	u32 imm = opc & 0xFF;
+	if (imm > 0x7F) return;	//signed imm8 !
+
+	unsigned lo = offs_lbound(rd, imm + rd->adj);
+	unsigned hi;
+	for (hi = lo; hi < rd->nofs; hi++) {
+		if (rd->ofs[hi].offs != (imm + rd->adj)) break;
+	}
+	if (hi == lo) return;
+
+	/* queue a new partial tracking; only the targets reached by this add are still of interest.
+	 * It runs after the current one with its own visited set, so what it explores doesn't
+	 * depend on which other offsets were being tracked along with it.
+	 */
+	struct deferred_seed ds = {
+		.pos = pos + 2,
+		.regno = regno,
+		.base = rd->base + imm,
+		.adj = rd->adj + imm,
+		.ofs = &rd->ofs[lo],
+		.nofs = hi - lo,
+	};
+	unsigned i;
+	for (i = 0; i < rd->npend; i++) {
+		//already queued, e.g. when looping back to an "add #0"
+		const struct deferred_seed *q = &rd->pend[i];
+		if ((q->pos == ds.pos) && (q->regno == ds.regno) && (q->base == ds.base) &&
+			(q->ofs == ds.ofs) && (q->nofs == ds.nofs)) return;
 	}
+	if (rd->npend == rd->pend_alloc) {
+		unsigned alloc = rd->pend_alloc ? (rd->pend_alloc * 2) : 16;
+		struct deferred_seed *tmp = realloc(rd->pend, alloc * sizeof(*tmp));
+		if (!tmp) {
+			fprintf(stderr, "malloc choke, dropping seed @ 0x%06lX\n", (unsigned long) pos);
+			return;
+		}
+		rd->pend = tmp;
+		rd->pend_alloc = alloc;
+	}
+	rd->pend[rd->npend++] = ds;
 
 
 	/* 0011nnnnmmmm1100 add <REG_M>,<REG_N> */
@@ -286,19 +367,18 @@ void test_regadd(const u8 *buf, u32 pos, unsigned regno, struct recursedata *rd)
 
 /* This is run on every position where <regno> is of interest.
  * special feature : if we're adding the offset to the reg of interest,
- * need to start another recursion with a temporary base + offset !
+ * need to start another tracking with a temporary base + offset ! (see track_seed())
  */
 void test_callback(const u8 *buf, u32 pos, unsigned regno, void *data) {
 	struct recursedata *rd = data;
-	u32 offs = rd->offs;
 
 	if (regno == GBR) {
-		test_gbrref(buf, pos, offs);
-		test_logicgbr(buf, pos, offs);
+		test_gbrref(buf, pos, rd);
+		test_logicgbr(buf, pos, rd);
 	}
-	test_rnrel(buf, pos, offs, regno);	//test naive @(disp+Rn) forms
-	test_r0rn(buf, pos, offs, regno);	//test @(R0,Rn) forms
-	test_regref(buf, pos, offs, regno);	//test @R, R forms
+	test_rnrel(buf, pos, rd, regno);	//test naive @(disp+Rn) forms
+	test_r0rn(buf, pos, rd, regno);	//test @(R0,Rn) forms
+	test_regref(buf, pos, rd, regno);	//test @R, R forms
 
 	test_regadd(buf, pos, regno, rd);
 	return;
@@ -306,23 +386,54 @@ void test_callback(const u8 *buf, u32 pos, unsigned regno, void *data) {
 
 
 
+/** track <regno> from <pos>, then every partial tracking queued by test_regadd() */
+static void track_seed(const u8 *src, u32 pos, unsigned regno, struct recursedata *rd) {
+	struct recursedata top = *rd;
+	unsigned i;
+
+	rd->npend = 0;
+	sh_tracker_reset(rd->trk);
+	sh_track_reg(rd->trk, src, pos, rd->siz, regno, test_callback, rd);
+
+	//rd->pend may grow while this runs
+	for (i = 0; i < rd->npend; i++) {
+		struct deferred_seed ds = rd->pend[i];
+		rd->base = ds.base;
+		rd->adj = ds.adj;
+		rd->ofs = ds.ofs;
+		rd->nofs = ds.nofs;
+		sh_tracker_reset(rd->trk);
+		sh_track_reg(rd->trk, src, ds.pos, rd->siz, ds.regno, test_callback, rd);
+	}
+
+	rd->base = top.base;
+	rd->adj = top.adj;
+	rd->ofs = top.ofs;
+	rd->nofs = top.nofs;
+}
+
+
 /**
  * core function. strategy:
  *
- * - locate mov.w or mov.l instructions that load the specified <base> value, or an evil trick like "mov #imm8, Rn" followed by "shll8 Rn" for when ((<base> & 0xFFFF00FF) == 0xFFFF0000)
+ * - look up mov.w or mov.l instructions that load the specified <base> value in the code index, or an evil trick like "mov #imm8, Rn" followed by "shll8 Rn" for when ((<base> & 0xFFFF00FF) == 0xFFFF0000)
  * - follow code recursively with tracked register (sh_track_reg()).
  *
  * of course, print any base+offset matches, whether reading or writing.
+ * Every seed is tracked once, and tested against all the offsets in rd->ofs.
+ *
+ * @param rd : siz, base, ofs, tgts, csv, out and trk must be set; adj must be 0.
  */
 
 #define FINDREFS_SHLL8_MAXDIST 10	//in bytes
-void findrefs(const u8 *src, u32 siz, u32 base, u32 offs) {
-	struct recursedata rd;
-	u16 *visited;	//array of bytes, set to 1 when a certain area is "visited"
+void findrefs(const struct sh_index *idx, const u8 *src, struct recursedata *rd) {
+	u32 siz = rd->siz;
+	u32 base = rd->base;
 	u8 shll8_base;
 	bool try_shll8 = 0;
 
-	glob_base = base;
+	assert(rd->nofs && !rd->adj);
+
 	shll8_base = (base & 0xFF00) >> 8;
 	if (	((base & 0xFFFF80FF) == 0xFFFF8000) ||
 		((base & 0xFFFF80FF) == 0x00000000)) {
@@ -330,152 +441,421 @@ void findrefs(const u8 *src, u32 siz, u32 base, u32 offs) {
 		try_shll8 = 1;
 	}
 
-	visited = malloc(siz * 2);
-	if (!visited) {
-		printf("malloc choke\n");
-		return;
+	//A) 2 possible opcodes : -  mov.w @(i, pc), Rn  : (0x1001nnnn 0xii) , or
+	//  mov.l @(i, pc), Rn : (0x1101nnnn 0xii) that load <base>
+	const struct sh_xref *pc_sites;
+	u32 npc = sh_index_pcimm(idx, base, &pc_sites);
+
+	//B) mov imm8 + shll8 trick . first, find mov : b'1110nnnniiiiiiii'
+	u32 *s8_sites = NULL;
+	u32 ns8 = 0;
+	if (try_shll8) {
+		ns8 = sh_index_opcode_masked(idx, 0xE000 | shll8_base, 0xF0FF, &s8_sites);
 	}
 
-	rd.siz = siz;
-	rd.visited = visited;
-	rd.offs = offs;
-
-	u32 romcurs = 0;
-	for (; romcurs < siz; romcurs += 2) {
-		u16 opc;
-
-		opc = reconst_16(&src[romcurs]);
-
-		//A) 2 possible opcodes : -  mov.w @(i, pc), Rn  : (0x1001nnnn 0xii) , or
-		//  mov.l @(i, pc), Rn : (0x1101nnnn 0xii)
-		uint8_t optop = (opc & 0xB000) >> 8;
-		if (optop == 0x90) {
-			u32 imm = sh_get_PCimm(src, romcurs);
-			if (imm == base) {
-				// match ! start recursion.
-				unsigned regno = sh_getopcode_dest(opc);
-				memset(visited, 0, siz * 2);
-				dbgprint("Entering 00.%6lX.R%d\n", (unsigned long) romcurs + 2, regno);
-				sh_track_reg(src, romcurs + 2, siz, regno, visited, test_callback, &rd);
-			}
+	//visit both site lists in ROM order
+	const struct sh_opinfo *dec = sh_index_decoded(idx);
+	u32 ipc = 0, is8 = 0;
+	while ((ipc < npc) || (is8 < ns8)) {
+		bool take_pc = (is8 == ns8) || ((ipc < npc) && (pc_sites[ipc].pos < s8_sites[is8]));
+		u32 romcurs;
+
+		if (take_pc) {
+			romcurs = pc_sites[ipc++].pos;
+			// match ! start recursion.
+			unsigned regno = dec[romcurs / 2].dest;
+			TRACE(TC_TRACKER, TL_DEBUG, "Entering 00.%6lX.R%d\n", (unsigned long) romcurs + 2, regno);
+			track_seed(src, romcurs + 2, regno, rd);
+			continue;
 		}
 
-		//B) mov imm8 + shll8 trick . first, find mov : b'1110nnnniiiiiiii'
-		if (!try_shll8) continue;
-		if ((opc & 0xF000) != 0xE000) continue;
-		if (shll8_base != (opc & 0xFF)) continue;
+		romcurs = s8_sites[is8++];
 
 		u32 s8_offs;
-		unsigned regno = sh_getopcode_dest(opc);
+		unsigned regno = dec[romcurs / 2].dest;
 		u32 stopcond = romcurs + FINDREFS_SHLL8_MAXDIST;
 			/* naively assume that the shll8 should be pretty soon after the mov.s8 */
 		if (stopcond > siz) stopcond = siz;
 		for (s8_offs = 2; (romcurs + s8_offs) < stopcond; s8_offs += 2) {
-			u16 shll8_maybe;
-			shll8_maybe = reconst_16(&src[romcurs + s8_offs]);
+			u32 pos = romcurs + s8_offs;
 
-			if (regno == sh_getopcode_dest(shll8_maybe)) break;	//check for clobber
+			if (regno == dec[pos / 2].dest) break;	//check for clobber
 
 			// shll8: 0100nnnn00011000
-			if (shll8_maybe == (0x4018 | regno << 8)) {
+			if (reconst_16(&src[pos]) == (0x4018 | regno << 8)) {
 				//match ! start recursion.
-				memset(visited, 0, siz * 2);
-				dbgprint("Entering 00.%6lX.R%d with mov+shll8\n", (unsigned long) romcurs + s8_offs + 2, regno);
-				sh_track_reg(src, romcurs + s8_offs + 2, siz, regno, visited, test_callback, &rd);
+				TRACE(TC_TRACKER, TL_DEBUG, "Entering 00.%6lX.R%d with mov+shll8\n", (unsigned long) romcurs + s8_offs + 2, regno);
+				track_seed(src, romcurs + s8_offs + 2, regno, rd);
 			}
 		}
+	}
+
+	free(s8_sites);
+}
 
 
+
+/** parse a target list : one "[<name>,]<addr>" per line, e.g. the ghidra_helpers/regs_*.csv files.
+ * Lines that don't parse (headers, comments) are skipped.
+ *
+ * @param fname : "-" for stdin
+ * @param tgts : caller must free
+ * @return number of targets, 0 if none or error
+ */
+static unsigned load_targets(const char *fname, struct reftarget **tgts) {
+	FILE *fh;
+	char line[256];
+	unsigned ntgt = 0, alloc = 0;
+	struct reftarget *list = NULL;
+
+	if (strcmp(fname, "-") == 0) {
+		fh = stdin;
+	} else {
+		fh = fopen(fname, "r");
+		if (!fh) {
+			fprintf(stderr, "cannot open %s\n", fname);
+			return 0;
+		}
 	}
 
-	free(visited);
+	while (fgets(line, sizeof(line), fh)) {
+		struct reftarget t = {0};
+		unsigned long addr;
+
+		if (sscanf(line, "%63[^,\n],%lx", t.name, &addr) != 2) {
+			t.name[0] = 0;
+			if (sscanf(line, "%lx", &addr) != 1) continue;
+		}
+		t.addr = addr;
+
+		if (ntgt == alloc) {
+			alloc = alloc ? (alloc * 2) : 64;
+			struct reftarget *tmp = realloc(list, alloc * sizeof(*list));
+			if (!tmp) {
+				free(list);
+				list = NULL;
+				ntgt = 0;
+				break;
+			}
+			list = tmp;
+		}
+		list[ntgt++] = t;
+	}
+
+	if (fh != stdin) fclose(fh);
+	*tgts = list;
+	return ntgt;
 }
 
+/** for qsort; by base, then offs */
+static int cmp_baseofs(const void *a, const void *b) {
+	const u32 *x = a;
+	const u32 *y = b;
+	if (x[0] != y[0]) return (x[0] < y[0]) ? -1 : 1;
+	if (x[1] != y[1]) return (x[1] < y[1]) ? -1 : 1;
+	if (x[2] != y[2]) return (x[2] < y[2]) ? -1 : 1;
+	return 0;
+}
 
+/** every (base, offs, target) with a base within DEFAULT_MAXDIST of some target, sorted by base.
+ * Read-only once built, so all ROMs of a corpus share it.
+ */
+struct tgtplan {
+	const struct reftarget *tgts;
+	u32 (*bo)[3];	//{base, offs, tgt}
+	struct offs_ent *ofs;	//same order as bo
+	unsigned long nents;
+};
 
-int main(int argc, char * argv[]) {
-	unsigned long tgt, minbase, base, offs;
-	FILE *i_file = NULL;
-	u8 *src = NULL;
+static void tgtplan_free(struct tgtplan *tp) {
+	free(tp->bo);
+	free(tp->ofs);
+	tp->bo = NULL;
+	tp->ofs = NULL;
+}
 
-	if ((argc < 3) || (argc > 4)) {
-		printf(	"**** %s\n"
-			"**** Find memory accesses to a given address.\n"
-			"**** (c) 2015-2017 fenugrec\n", argv[0]);
+/** @return 0 if ok */
+static int tgtplan_build(struct tgtplan *tp, const struct reftarget *tgts, unsigned ntgt) {
+	unsigned long maxents = (unsigned long) ntgt * (DEFAULT_MAXDIST + 1);
+	unsigned long nents = 0, cur;
+	unsigned tgt;
+
+	tp->tgts = tgts;
+	tp->bo = malloc(maxents * sizeof(*tp->bo));
+	tp->ofs = malloc(maxents * sizeof(*tp->ofs));
+	if (!tp->bo || !tp->ofs) {
+		tgtplan_free(tp);
+		return -1;
+	}
 
-		printf("%s <in_file> <tgt> [<minbase>]"
-			"\n\tExample: %s rom.bin 0xffff40ff 0xffff4000\n", argv[0], argv[0]);
-		return 0;
+	for (tgt = 0; tgt < ntgt; tgt++) {
+		u32 offs;
+		for (offs = 0; offs <= DEFAULT_MAXDIST; offs++) {
+			if (offs > tgts[tgt].addr) break;
+			tp->bo[nents][0] = tgts[tgt].addr - offs;
+			tp->bo[nents][1] = offs;
+			tp->bo[nents][2] = tgt;
+			nents++;
+		}
+	}
+	qsort(tp->bo, nents, sizeof(*tp->bo), cmp_baseofs);
+	for (cur = 0; cur < nents; cur++) {
+		tp->ofs[cur].offs = tp->bo[cur][1];
+		tp->ofs[cur].tgt = tp->bo[cur][2];
 	}
+	tp->nents = nents;
+	return 0;
+}
+
+/** Multi-target search : run findrefs() once per distinct base of the plan.
+ * Hits for all targets are printed as CSV rows, without header.
+ *
+ * @param rom : if set, first column of every row
+ */
+static void findrefs_multi(const struct sh_index *idx, struct sh_tracker *trk, const u8 *src, u32 siz,
+			const struct tgtplan *tp, FILE *out, const char *rom) {
+	unsigned long cur;
 
-	if (sscanf(argv[2], "%lx", &tgt) != 1) {
-		printf("did not understand %s\n", argv[1]);
+	struct recursedata rd = {0};
+	rd.siz = siz;
+	rd.tgts = tp->tgts;
+	rd.csv = 1;
+	rd.trk = trk;
+	rd.out = out;
+	rd.rom = rom;
+
+	for (cur = 0; cur < tp->nents; ) {
+		unsigned long next;
+		for (next = cur + 1; (next < tp->nents) && (tp->bo[next][0] == tp->bo[cur][0]); next++);
+
+		rd.base = tp->bo[cur][0];
+		rd.ofs = &tp->ofs[cur];
+		rd.nofs = next - cur;
+		findrefs(idx, src, &rd);
+		cur = next;
+	}
+
+	free(rd.pend);
+}
+
+/** corpus_run() callback; ctx is the tgtplan */
+static int corpus_findrefs(struct corpus_rom *cr, void *ctx) {
+	findrefs_multi(cr->idx, cr->trk, cr->buf, cr->siz, ctx, cr->out, cr->fname);
+	return 0;
+}
+
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+		"**** Find memory accesses to a given address.\n"
+		"**** (c) 2015-2017 fenugrec\n", progname);
+
+	printf("%s <in_file> <tgt> [<minbase>]"
+		"\n\tExample: %s rom.bin 0xffff40ff 0xffff4000\n"
+		"%s -t <tgtlist> <in_file>"
+		"\n\tSearch all targets listed in <tgtlist> (\"-\" for stdin), one \"[<name>,]<addr>\" per line;"
+		"\n\tprints CSV. Example: %s -t ../ghidra_helpers/regs_7058.csv rom.bin\n"
+		"%s -r [-j <n>] -t <tgtlist> <ROMFILE> [ROMFILE...]"
+		"\n\tSame, over several ROMs. Each ROMFILE can be a directory (scanned recursively),"
+		"\n\tor \"-\" to read a list of filenames from stdin. Prints CSV with a leading rom column."
+		"\n\t-j <n>: search <n> ROMs in parallel (0 = one per CPU). Output order is unchanged\n",
+		progname, progname, progname, progname, progname);
+}
+
+/** -r mode : search every target of <tgtlist> in every ROM */
+static int findrefs_corpus(const char *tgtlist, unsigned njobs, int nroms, char **roms) {
+	struct filelist files = {0};
+	struct tgtplan tp = {0};
+	struct reftarget *tgts = NULL;
+	unsigned ntgt, failed;
+	int idx;
+	int rv = 1;
+
+	for (idx = 0; idx < nroms; idx++) {
+		if ((strcmp(roms[idx], "-") == 0) && (strcmp(tgtlist, "-") == 0)) {
+			printf("stdin can't hold both target and ROM lists\n");
+			return 1;
+		}
+	}
+
+	ntgt = load_targets(tgtlist, &tgts);
+	if (!ntgt) {
+		printf("no targets in %s\n", tgtlist);
 		return 0;
 	}
+	for (idx = 0; idx < nroms; idx++) {
+		if (!filelist_addarg(&files, roms[idx])) {
+			printf("trouble building file list\n");
+			goto exit;
+		}
+	}
+	if (tgtplan_build(&tp, tgts, ntgt)) {
+		printf("malloc choke\n");
+		goto exit;
+	}
 
-	if (argc == 4) {
-		//minbase was specified:
-		if (sscanf(argv[3], "%lx", &minbase) != 1) {
-			printf("did not understand %s\n", argv[2]);
+	dbg_stream = tmpfile();	//before calling nislib funcs
+	if (dbg_stream == NULL) {
+		printf("problem creating temp file!?\n");
+		goto exit;
+	}
+
+	printf("rom,name,tgt,access,pos,base,offs\n");
+	failed = corpus_run(&files, njobs, corpus_findrefs, &tp, stdout);
+	if (failed) {
+		fprintf(stderr, "%u / %u ROMs could not be searched\n", failed, files.num);
+	} else {
+		rv = 0;
+	}
+	fclose(dbg_stream);
+
+exit:
+	tgtplan_free(&tp);
+	filelist_free(&files);
+	free(tgts);
+	return rv;
+}
+
+int main(int argc, char * argv[]) {
+	unsigned long tgt, minbase, base;
+	struct rom_image img = {0};
+	struct sh_tracker *trk = NULL;
+	struct sh_index *idx = NULL;
+	struct reftarget *tgts = NULL;
+	unsigned ntgt = 0;
+	const char *tgtlist = NULL;
+	bool corpus = 0;
+	unsigned njobs = 1;
+	int opt;
+
+	if (!trace_config(getenv(TRACE_ENV))) return -1;
+
+	while ((opt = getopt(argc, argv, "j:rt:")) != -1) {
+		switch (opt) {
+		case 'j':
+			njobs = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			corpus = 1;
+			break;
+		case 't':
+			tgtlist = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (corpus) {
+		if (!tgtlist || (argc < 2)) {
+			usage(argv[0]);
+			return 0;
+		}
+		return findrefs_corpus(tgtlist, njobs, argc - 1, &argv[1]);
+	}
+
+	if (tgtlist) {
+		if (argc != 2) {
+			usage(argv[0]);
+			return 0;
+		}
+		ntgt = load_targets(tgtlist, &tgts);
+		if (!ntgt) {
+			printf("no targets in %s\n", tgtlist);
 			return 0;
 		}
 	} else {
-		//calc default minbase
-		minbase = tgt - DEFAULT_MAXDIST;
+		if ((argc < 3) || (argc > 4)) {
+			usage(argv[0]);
+			return 0;
+		}
+
+		if (sscanf(argv[2], "%lx", &tgt) != 1) {
+			printf("did not understand %s\n", argv[2]);
+			return 0;
+		}
+
+		if (argc == 4) {
+			//minbase was specified:
+			if (sscanf(argv[3], "%lx", &minbase) != 1) {
+				printf("did not understand %s\n", argv[3]);
+				return 0;
+			}
+		} else {
+			//calc default minbase
+			minbase = tgt - DEFAULT_MAXDIST;
+		}
 	}
 
 	//input file
-	if ((i_file=fopen(argv[1],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[1]);
+	if (romimg_open(&img, argv[1], 0)) {
+		free(tgts);
 		return 0;
 	}
 
-	u32 file_len;
-
 	dbg_stream = tmpfile();	//before calling nislib funcs
 	if (dbg_stream == NULL) {
 		printf("problem creating temp file!?\n");
 		goto badexit;
 	}
 
-	rewind(i_file);
-	file_len = flen(i_file);
-	if ((!file_len) || (file_len > 3*1024*1024UL)) {
-		printf("huge file (length %lu)\n", (unsigned long) file_len);
+	if (img.siz > 3*1024*1024UL) {
+		fprintf(stderr, "huge file (length %lu)\n", (unsigned long) img.siz);
 	}
 
-	src = malloc(file_len);
-	if (!src) {
+	trk = sh_tracker_new(img.siz);
+	idx = sh_index_build(img.buf, img.siz);
+	if (!trk || !idx) {
 		printf("malloc choke\n");
 		goto badexit;
 	}
+	sh_tracker_setdecoded(trk, sh_index_decoded(idx));
 
-	/* load whole ROM */
-	if (fread(src,1,file_len,i_file) != file_len) {
-		printf("trouble reading\n");
-		goto badexit;
-	}
-	fclose(i_file);
-
-	for (base=tgt; base >= minbase; base -= 1) {
-		offs = tgt - base;
-		findrefs(src, (u32) file_len, base, offs);
+	if (tgtlist) {
+		struct tgtplan tp = {0};
+		if (tgtplan_build(&tp, tgts, ntgt)) {
+			printf("malloc choke\n");
+			goto badexit;
+		}
+		printf("name,tgt,access,pos,base,offs\n");
+		findrefs_multi(idx, trk, img.buf, img.siz, &tp, stdout, NULL);
+		tgtplan_free(&tp);
+	} else {
+		struct reftarget single = {.addr = tgt};
+		struct offs_ent ent = {0};
+		struct recursedata rd = {0};
+
+		rd.siz = img.siz;
+		rd.ofs = &ent;
+		rd.nofs = 1;
+		rd.tgts = &single;
+		rd.trk = trk;
+		rd.out = stdout;
+		for (base=tgt; base >= minbase; base -= 1) {
+			rd.base = base;
+			ent.offs = tgt - base;
+			findrefs(idx, img.buf, &rd);
+		}
+		free(rd.pend);
 	}
 
-	free(src);
+	free(tgts);
+	sh_index_free(idx);
+	sh_tracker_free(trk);
+	romimg_close(&img);
 	fclose(dbg_stream);
 	return 0;
 
 badexit:
-	if (src) {
-		free(src);
-	}
-	if (i_file) {
-		fclose(i_file);
-	}
+	free(tgts);
+	sh_index_free(idx);
+	sh_tracker_free(trk);
+	romimg_close(&img);
 	if (dbg_stream) {
 		fclose(dbg_stream);
 	}
 	return 1;
 }
-
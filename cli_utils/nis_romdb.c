@@ -15,8 +15,10 @@
 #include "stypes.h"
 
 #include "nislib.h"
+#include "nislib_arena.h"
 #include "nissan_romdefs.h"
 #include "nis_romdb.h"
+#include "ecuid_list.h"
 
 #include "libcsv/csv.h"
 #include "uthash/uthash.h"
@@ -48,15 +50,101 @@ struct keyset_rec {
 };
 
 
+#define HALFKEY_BITMAP_LEN	(65536 / 32)
+
+
+/********** compiled db format (see romdb_compile())
+ * All fields are u32 in host byte order; the header has a byte-order mark.
+ * Offsets are from the start of the file, and 4-byte aligned.
+ */
+#define ROMDB_BIN_MAGIC "NISRDB\0\0"
+#define ROMDB_BIN_BOM 0x01020304UL
+#define ROMDB_BIN_VERS 1
+
+struct romdb_bin_hdr {
+	char magic[8];
+	u32 bom;
+	u32 vers;
+	u32 num_ecuid;
+	u32 num_keyset;
+	u32 ofs_ecuid;	//struct romdb_bin_ecuid[num_ecuid], sorted by ECUID
+	u32 ofs_keyset;	//struct keyset_t[num_keyset], in keysets_iterate() order
+	u32 ofs_kidx[KEY_INVALID];	//u32[num_keyset] each : indexes in keyset[] sorted by that key, then index
+};
+
+struct romdb_bin_ecuid {
+	char ecuid[8];	//0-padded
+	u32 fidtype;
+	u32 s27k;
+};
+
+
+/** reverse index node : key value => keyset */
+struct key_ent {
+	u32 key;
+	const struct keyset_t *keyset;
+	UT_hash_handle hh;
+};
+
 /** opaque struct to keep track of db data and state */
 struct s_nis_romdb {
 	struct ecuid_rec *ecuid_table;
 	struct keyset_rec *keyset_table;
+	struct slab ecuid_slab;	//storage for ecuid_table records
+	struct slab keyset_slab;	//storage for keyset_table records
+
+	/* optional compiled db; entries here take precedence over the hash tables */
+	struct rom_image bin_img;
+	const struct romdb_bin_ecuid *bin_ecuid;
+	u32 bin_necuid;
+	const struct keyset_t *bin_ks;
+	u32 bin_nks;
+	const u32 *bin_kidx[KEY_INVALID];
+
+	/* derived from keyset_table */
+	struct halfkey_ent *hk_ents;
+	unsigned hk_num;
+	unsigned hk_numkeysets;
+	u32 hk_bitmap[HALFKEY_BITMAP_LEN];
+
+	/* reverse indexes, one per key type, of keysets in keyset_table (not shadowed by the compiled db).
+	 * Only the first keyset in keysets_iterate() order is indexed for a given key value.
+	 */
+	struct key_ent *kx_table[KEY_INVALID];
+	struct key_ent *kx_ents;	//storage for all kx_table nodes
+
+	/* ecuid_table entries not shadowed by the compiled db, sorted like bin_ecuid[] for romdb_nearest_keys() */
+	struct romdb_bin_ecuid *csv_ecuid;
+	u32 csv_necuid;
+
+	/* built-in ecuid_list[] entries not in the compiled db or ecuid_table, sorted the same way */
+	struct romdb_bin_ecuid *lst_ecuid;
+	u32 lst_necuid;
 };
 
 
+static void free_key_indexes(nis_romdb *romdb) {
+	enum key_type kt;
+	for (kt = KEY_S27; kt < KEY_INVALID; kt++) {
+		HASH_CLEAR(hh, romdb->kx_table[kt]);
+	}
+	free(romdb->kx_ents);
+	romdb->kx_ents = NULL;
+}
+
+#define ROMDB_SLAB_RECS	1024	//records per slab chunk
+
+static bool build_ecuid_index(nis_romdb *romdb);
+
 nis_romdb *romdb_new(void) {
 	nis_romdb *temp = calloc(1, sizeof(nis_romdb));
+	if (!temp) return NULL;
+	slab_init(&temp->ecuid_slab, sizeof(struct ecuid_rec), ROMDB_SLAB_RECS);
+	slab_init(&temp->keyset_slab, sizeof(struct keyset_rec), ROMDB_SLAB_RECS);
+	if (!build_ecuid_index(temp)) {
+		romdb_close(temp);
+		return NULL;
+	}
 	return temp;
 }
 
@@ -67,23 +155,81 @@ nis_romdb *romdb_new(void) {
 void romdb_close(nis_romdb *romdb) {
 	assert(romdb);
 
-	if (romdb->ecuid_table) {
-		struct ecuid_rec *ecr, *tmp;
-		HASH_ITER(hh, romdb->ecuid_table, ecr, tmp) {
-			HASH_DEL(romdb->ecuid_table, ecr);
-			free(ecr);             /* optional- if you want to free  */
+	//records are in the slabs
+	HASH_CLEAR(hh, romdb->ecuid_table);
+	HASH_CLEAR(hh, romdb->keyset_table);
+	slab_done(&romdb->ecuid_slab);
+	slab_done(&romdb->keyset_slab);
+	free(romdb->hk_ents);
+	free_key_indexes(romdb);
+	free(romdb->csv_ecuid);
+	free(romdb->lst_ecuid);
+	romimg_close(&romdb->bin_img);
+	free(romdb);
+}
+
+
+/************************** compiled db lookups */
+
+/** @return record in a sorted ECUID table, or NULL */
+static const struct romdb_bin_ecuid *tab_find_ecuid(const struct romdb_bin_ecuid *tab, u32 num, const char *ecuid) {
+	u32 lo = 0, hi = num;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		int rv = strncmp(tab[mid].ecuid, ecuid, ECUID_LEN);
+		if (rv == 0) return &tab[mid];
+		if (rv < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
-		romdb->ecuid_table = NULL;
 	}
-	if (romdb->keyset_table) {
-		struct keyset_rec *ksr, *tmp;
-		HASH_ITER(hh, romdb->keyset_table, ksr, tmp) {
-			HASH_DEL(romdb->keyset_table, ksr);
-			free(ksr);             /* optional- if you want to free  */
+	return NULL;
+}
+
+/** @return compiled ECUID record, or NULL */
+static const struct romdb_bin_ecuid *bin_find_ecuid(const nis_romdb *romdb, const char *ecuid) {
+	return tab_find_ecuid(romdb->bin_ecuid, romdb->bin_necuid, ecuid);
+}
+
+static u32 keyset_key(const struct keyset_t *ks, enum key_type ktype) {
+	switch (ktype) {
+	case KEY_S27:
+		return ks->s27k;
+	case KEY_S36K1:
+		return ks->s36k1;
+	case KEY_S36K2:
+		return ks->s36k2;
+	default:
+		assert(0);
+		break;
+	}
+	return 0;
+}
+
+/** @return first compiled keyset (in keysets_iterate() order) with this key, or NULL */
+static const struct keyset_t *bin_find_key(const nis_romdb *romdb, enum key_type ktype, u32 key) {
+	const u32 *kidx = romdb->bin_kidx[ktype];
+	u32 lo = 0, hi = romdb->bin_nks;
+
+	//lower bound
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (keyset_key(&romdb->bin_ks[kidx[mid]], ktype) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
-		romdb->keyset_table = NULL;
 	}
-	free(romdb);
+	if ((lo == romdb->bin_nks) || (keyset_key(&romdb->bin_ks[kidx[lo]], ktype) != key)) {
+		return NULL;
+	}
+	return &romdb->bin_ks[kidx[lo]];
+}
+
+/** @return 1 if a keyset with the same s27k is in the compiled db */
+static bool keyset_shadowed(const nis_romdb *romdb, const struct keyset_t *keyset) {
+	return bin_find_key(romdb, KEY_S27, keyset->s27k) != NULL;
 }
 
 
@@ -92,6 +238,7 @@ void romdb_close(nis_romdb *romdb) {
 /** track state while parsing the ecuid db */
 struct csvinfo_ecuid {
 	struct ecuid_rec **ecuid_table;	//callbacks need access to the hashtable pointer
+	struct slab *recs;	//where new records go
 
 	unsigned num_recs;	//number of valid records parsed
 	unsigned num_fields;	//to enforce uniform lines
@@ -111,6 +258,7 @@ struct csvinfo_ecuid {
 /** track state while parsing the keyset db */
 struct csvinfo_keyset {
 	struct keyset_rec **keyset_table;	//callbacks need access to the hashtable pointer
+	struct slab *recs;	//where new records go
 
 	unsigned num_recs;	//number of valid records parsed
 	unsigned num_fields;	//to enforce uniform lines
@@ -332,7 +480,7 @@ static void csv_ecuid_rec_cb(int c, void *data) {
 		struct ecuid_rec *ecr;
 		HASH_FIND_STR(*ci->ecuid_table, ci->current_ecr.ecuid, ecr);
 		if (ecr == NULL) {
-			ecr = calloc(1, sizeof(struct ecuid_rec));
+			ecr = slab_alloc(ci->recs);
 			if (!ecr) {
 				return;
 			}
@@ -367,7 +515,7 @@ static void csv_keyset_rec_cb(int c, void *data) {
 		struct keyset_rec *ksr;
 		HASH_FIND_U32(*ci->keyset_table, &ci->current_ks.keyset.s27k, ksr);
 		if (ksr == NULL) {
-			ksr = calloc(1, sizeof(struct keyset_rec));
+			ksr = slab_alloc(ci->recs);
 			if (!ksr) {
 				return;
 			}
@@ -431,11 +579,77 @@ badexit:
 	return 0;
 }
 
+static int cmp_bin_ecuid(const void *a, const void *b) {
+	const struct romdb_bin_ecuid *ea = a, *eb = b;
+	return strncmp(ea->ecuid, eb->ecuid, sizeof(ea->ecuid));
+}
+
+/** (re)build sorted copy of the built-in ECUID list, minus the ECUIDs known to the db
+ * @return 1 if ok
+ */
+static bool build_list_index(nis_romdb *romdb) {
+	const char *ecuid;
+	u32 s27k;
+	unsigned num;
+
+	free(romdb->lst_ecuid);
+	romdb->lst_ecuid = NULL;
+	romdb->lst_necuid = 0;
+
+	for (num = 0; ecuid_list_entry(num, &s27k); num++);
+	if (!num) return 1;
+	romdb->lst_ecuid = calloc(num, sizeof(*romdb->lst_ecuid));
+	if (!romdb->lst_ecuid) return 0;
+
+	for (num = 0; (ecuid = ecuid_list_entry(num, &s27k)); num++) {
+		struct romdb_bin_ecuid *bec = &romdb->lst_ecuid[romdb->lst_necuid];
+		struct ecuid_rec *ecr;
+
+		if (bin_find_ecuid(romdb, ecuid)) continue;
+		HASH_FIND_STR(romdb->ecuid_table, ecuid, ecr);
+		if (ecr) continue;
+		strncpy(bec->ecuid, ecuid, ECUID_LEN);
+		bec->fidtype = FID_UNK;
+		bec->s27k = s27k;
+		romdb->lst_necuid++;
+	}
+	qsort(romdb->lst_ecuid, romdb->lst_necuid, sizeof(*romdb->lst_ecuid), cmp_bin_ecuid);
+	return 1;
+}
+
+/** (re)build sorted copies of ecuid_table and of the built-in list
+ * @return 1 if ok
+ */
+static bool build_ecuid_index(nis_romdb *romdb) {
+	unsigned num = HASH_COUNT(romdb->ecuid_table);
+
+	free(romdb->csv_ecuid);
+	romdb->csv_ecuid = NULL;
+	romdb->csv_necuid = 0;
+	if (!num) return build_list_index(romdb);
+
+	romdb->csv_ecuid = calloc(num, sizeof(*romdb->csv_ecuid));
+	if (!romdb->csv_ecuid) return 0;
+
+	const struct ecuid_rec *ecr, *tmp;
+	HASH_ITER(hh, romdb->ecuid_table, ecr, tmp) {
+		struct romdb_bin_ecuid *bec = &romdb->csv_ecuid[romdb->csv_necuid];
+		if (bin_find_ecuid(romdb, ecr->ecuid)) continue;
+		memcpy(bec->ecuid, ecr->ecuid, ECUID_LEN);
+		bec->fidtype = ecr->fidtype;
+		bec->s27k = ecr->s27k;
+		romdb->csv_necuid++;
+	}
+	qsort(romdb->csv_ecuid, romdb->csv_necuid, sizeof(*romdb->csv_ecuid), cmp_bin_ecuid);
+	return build_list_index(romdb);
+}
+
 bool romdb_ecuid_addcsv(nis_romdb *romdb, const char *fname) {
 	assert(romdb && fname);
 
 	struct csvinfo_ecuid ci = {0};
 	ci.ecuid_table = &romdb->ecuid_table;
+	ci.recs = &romdb->ecuid_slab;
 
 		//initialize indices to invalid value to identify any missing fields
 	ci.idx_ecuid = UINT_MAX;
@@ -448,15 +662,121 @@ bool romdb_ecuid_addcsv(nis_romdb *romdb, const char *fname) {
 		return 0;
 	}
 
-	DBG_PRINTF("ecuid parsage done : added %u records\n", ci.num_recs);
+	TRACE(TC_ROMDB, TL_INFO, "ecuid parsage done : added %u records\n", ci.num_recs);
+	return build_ecuid_index(romdb);
+}
+
+static int cmp_halfkey(const void *a, const void *b) {
+	const struct halfkey_ent *ha = a, *hb = b;
+	if (ha->hi != hb->hi) return (ha->hi < hb->hi) ? -1 : 1;
+	if (ha->ordinal != hb->ordinal) return (ha->ordinal < hb->ordinal) ? -1 : 1;
+	return (int) ha->ktype - (int) hb->ktype;
+}
+
+/** (re)build half-key index from the keyset table
+ * @return 1 if ok
+ */
+struct hk_build {
+	nis_romdb *romdb;
+	struct halfkey_ent *ents;
+	unsigned num;
+	unsigned ordinal;
+};
+
+static bool hk_add_keyset(const struct keyset_t *keyset, void *data) {
+	struct hk_build *hb = data;
+	const u32 keys[KEY_INVALID] = {
+		[KEY_S27] = keyset->s27k,
+		[KEY_S36K1] = keyset->s36k1,
+		[KEY_S36K2] = keyset->s36k2,
+	};
+	enum key_type kt;
+	for (kt = KEY_S27; kt < KEY_INVALID; kt++) {
+		struct halfkey_ent *ent = &hb->ents[hb->num];
+		if (!keys[kt]) continue;
+		ent->hi = keys[kt] >> 16;
+		ent->lo = keys[kt] & 0xFFFF;
+		ent->ktype = kt;
+		ent->ordinal = hb->ordinal;
+		ent->keyset = keyset;
+		hb->romdb->hk_bitmap[ent->hi >> 5] |= 1UL << (ent->hi & 31);
+		hb->num++;
+	}
+	hb->ordinal++;
+	return 0;
+}
+
+static bool build_halfkey_index(nis_romdb *romdb) {
+	unsigned numkeysets = HASH_COUNT(romdb->keyset_table) + romdb->bin_nks;
+	struct halfkey_ent *ents;
+
+	free(romdb->hk_ents);
+	romdb->hk_ents = NULL;
+	romdb->hk_num = 0;
+	romdb->hk_numkeysets = 0;
+	memset(romdb->hk_bitmap, 0, sizeof(romdb->hk_bitmap));
+
+	if (!numkeysets) return 1;
+
+	ents = malloc(numkeysets * KEY_INVALID * sizeof(*ents));
+	if (!ents) return 0;
+
+	struct hk_build hb = {
+		.romdb = romdb,
+		.ents = ents,
+	};
+	keysets_iterate(romdb, hk_add_keyset, &hb);
+
+	qsort(ents, hb.num, sizeof(*ents), cmp_halfkey);
+	romdb->hk_ents = ents;
+	romdb->hk_num = hb.num;
+	romdb->hk_numkeysets = hb.ordinal;
 	return 1;
 }
 
+/** (re)build reverse key indexes from the keyset table
+ * @return 1 if ok
+ */
+static bool build_key_indexes(nis_romdb *romdb) {
+	unsigned numkeysets = HASH_COUNT(romdb->keyset_table);
+	unsigned num = 0;
+
+	free_key_indexes(romdb);
+	if (!numkeysets) return 1;
+
+	romdb->kx_ents = calloc(numkeysets * KEY_INVALID, sizeof(*romdb->kx_ents));
+	if (!romdb->kx_ents) return 0;
+
+	const struct keyset_rec *ksr, *tmp;
+	HASH_ITER(hh, romdb->keyset_table, ksr, tmp) {
+		enum key_type kt;
+		if (keyset_shadowed(romdb, &ksr->keyset)) continue;
+		for (kt = KEY_S27; kt < KEY_INVALID; kt++) {
+			struct key_ent *ke;
+			u32 key = keyset_key(&ksr->keyset, kt);
+			if (!key) continue;
+			HASH_FIND_U32(romdb->kx_table[kt], &key, ke);
+			if (ke) continue;	//keep first
+			ke = &romdb->kx_ents[num++];
+			ke->key = key;
+			ke->keyset = &ksr->keyset;
+			HASH_ADD_U32(romdb->kx_table[kt], key, ke);
+		}
+	}
+	return 1;
+}
+
+/** rebuild all derived indexes, after the keysets changed */
+static bool build_indexes(nis_romdb *romdb) {
+	return build_key_indexes(romdb) && build_halfkey_index(romdb);
+}
+
 bool romdb_keyset_addcsv(nis_romdb *romdb, const char *fname) {
 	assert(romdb && fname);
 
 	struct csvinfo_keyset ci = {0};
 	ci.keyset_table = &romdb->keyset_table;
+	ci.recs = &romdb->keyset_slab;
 
 		//initialize indices to invalid value to identify any missing fields
 	ci.idx_s27k = UINT_MAX;
@@ -469,8 +789,8 @@ bool romdb_keyset_addcsv(nis_romdb *romdb, const char *fname) {
 		return 0;
 	}
 
-	DBG_PRINTF("keyset parsage done : added %u records\n", ci.num_recs);
-	return 1;
+	TRACE(TC_ROMDB, TL_INFO, "keyset parsage done : added %u records\n", ci.num_recs);
+	return build_indexes(romdb);
 }
 
 /************************** queries for basic fields.
@@ -479,6 +799,11 @@ bool romdb_keyset_addcsv(nis_romdb *romdb, const char *fname) {
 
 enum fidtype_ic romdb_q_fidtype(nis_romdb *romdb, const char *ecuid) {
 	assert(romdb && ecuid);
+	const struct romdb_bin_ecuid *bec = bin_find_ecuid(romdb, ecuid);
+	if (bec) {
+		return (enum fidtype_ic) bec->fidtype;
+	}
+
 	struct ecuid_rec *ecr;
 	HASH_FIND_STR(romdb->ecuid_table, ecuid, ecr);
 	if (!ecr) {
@@ -489,72 +814,92 @@ enum fidtype_ic romdb_q_fidtype(nis_romdb *romdb, const char *ecuid) {
 
 const struct keyset_t *romdb_q_keyset(nis_romdb *romdb, const char *ecuid) {
 	assert(romdb && ecuid);
+	u32 s27k;
 
-	if (!romdb->ecuid_table) {
-		//no assert for this, since caller can't tell if db exists
-		return NULL;
-	}
-	if (!romdb->keyset_table) {
-		//no assert for this, since caller can't tell if db exists
-		return NULL;
+	const struct romdb_bin_ecuid *bec = bin_find_ecuid(romdb, ecuid);
+	if (bec) {
+		s27k = bec->s27k;
+	} else {
+		struct ecuid_rec *ecr;
+		HASH_FIND_STR(romdb->ecuid_table, ecuid, ecr);
+		if (!ecr) {
+			//no assert for this, since caller can't tell if db exists
+			return NULL;
+		}
+		s27k = ecr->s27k;
 	}
 
+	return find_knownkey(romdb, KEY_S27, s27k);
+}
+
+
+u32 romdb_q_s27k(nis_romdb *romdb, const char *ecuid) {
+	assert(romdb && ecuid);
+
+	const struct romdb_bin_ecuid *bec = bin_find_ecuid(romdb, ecuid);
+	if (bec) return bec->s27k;
+
 	struct ecuid_rec *ecr;
 	HASH_FIND_STR(romdb->ecuid_table, ecuid, ecr);
-	if (!ecr) {
-		return NULL;
-	}
+	if (ecr) return ecr->s27k;
 
-	struct keyset_rec *ksr;
-	HASH_FIND_U32(romdb->keyset_table, &ecr->s27k, ksr);
-	if (!ksr) {
-		return NULL;
-	}
-
-	return &ksr->keyset;
+	bec = tab_find_ecuid(romdb->lst_ecuid, romdb->lst_necuid, ecuid);
+	return bec ? bec->s27k : 0;
 }
 
-
 const struct keyset_t *find_knownkey(nis_romdb *romdb, enum key_type ktype, u32 candidate) {
 	assert(romdb);
 
-	if (!romdb->keyset_table) {
-		//no assert for this, since caller can't tell if this table exists
+	if ((ktype >= KEY_INVALID) || !candidate) {
 		return NULL;
 	}
 
-	if ((ktype >= KEY_INVALID) || !candidate) {
-		return NULL;
+	const struct keyset_t *bks = bin_find_key(romdb, ktype, candidate);
+	if (bks) {
+		return bks;
 	}
 
-	const struct keyset_rec *ksr, *tmp;
-	HASH_ITER(hh, romdb->keyset_table, ksr, tmp) {
-		switch (ktype) {
-		case KEY_S27:
-			if (ksr->keyset.s27k == candidate) {
-				return &ksr->keyset;
-			}
-			break;
-		case KEY_S36K1:
-			if (ksr->keyset.s36k1 == candidate) {
-				return &ksr->keyset;
-			}
-			break;
-		case KEY_S36K2:
-			if (ksr->keyset.s36k2 == candidate) {
-				return &ksr->keyset;
-			}
-			break;
-		default:
-			assert(0);
-			break;
+	const struct key_ent *ke;
+	HASH_FIND_U32(romdb->kx_table[ktype], &candidate, ke);
+	return ke ? ke->keyset : NULL;
+}
+
+unsigned find_knownkeys(nis_romdb *romdb, const u32 *candidates, unsigned num,
+			const struct keyset_t *(*results)[KEY_INVALID]) {
+	assert(romdb && candidates && results);
+	unsigned idx, found = 0;
+
+	for (idx = 0; idx < num; idx++) {
+		enum key_type kt;
+		bool any = 0;
+		for (kt = KEY_S27; kt < KEY_INVALID; kt++) {
+			results[idx][kt] = find_knownkey(romdb, kt, candidates[idx]);
+			any |= (results[idx][kt] != NULL);
 		}
+		found += any;
 	}
-	return NULL;
+	return found;
+}
+
+bool romdb_halfkey_index(nis_romdb *romdb, struct halfkey_index *hki) {
+	assert(romdb && hki);
+
+	hki->ents = romdb->hk_ents;
+	hki->num_ents = romdb->hk_num;
+	hki->num_keysets = romdb->hk_numkeysets;
+	hki->hi_bitmap = romdb->hk_bitmap;
+	return (romdb->hk_num != 0);
 }
 
 void keysets_iterate(nis_romdb *romdb, bool (*cb1)(const struct keyset_t *keyset, void *data), void *data) {
 	assert(romdb && cb1);
+	u32 idx;
+
+	for (idx = 0; idx < romdb->bin_nks; idx++) {
+		if (cb1(&romdb->bin_ks[idx], data)) {
+			return;
+		}
+	}
 
 	if (!romdb->keyset_table) {
 		//no assert for this, since caller can't tell if this table exists
@@ -563,9 +908,273 @@ void keysets_iterate(nis_romdb *romdb, bool (*cb1)(const struct keyset_t *keyset
 
 	const struct keyset_rec *ksr, *tmp;
 	HASH_ITER(hh, romdb->keyset_table, ksr, tmp) {
+		if (keyset_shadowed(romdb, &ksr->keyset)) {
+			continue;
+		}
 		bool rv = cb1(&ksr->keyset, data);
 		if (rv) {
 			return;
 		}
 	}
 }
+
+
+/************************** nearest ECUID search
+ * ECUID tables are sorted, so every prefix is a contiguous range : walk it like a trie,
+ * one char position per level, and skip any range whose distance so far already
+ * can't make it into the result set. Leftmost chars weigh the most, so this prunes early.
+ */
+
+struct nearest_ctx {
+	const struct romdb_bin_ecuid *tab;
+	char q[ECUID_STR_LEN];	//query, 0-padded
+	unsigned kidx_base;	//so that compiled and CSV entries have distinct indexes
+	struct ecuid_topk *tk;
+};
+
+/** @return first entry of [lo, hi[ whose char at pos is >= c */
+static u32 prefix_lbound(const struct romdb_bin_ecuid *tab, u32 lo, u32 hi, unsigned pos, unsigned char c) {
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if ((unsigned char) tab[mid].ecuid[pos] < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/** all entries in [lo, hi[ share the first <pos> chars, for a total distance of <dist> */
+static void nearest_walk(const struct nearest_ctx *nc, u32 lo, u32 hi, unsigned pos, int dist) {
+	if ((lo == hi) || !ecuid_topk_wants(nc->tk, dist, nc->kidx_base + lo)) return;
+
+	if (pos == ECUID_LEN) {
+		for (; lo < hi; lo++) {
+			ecuid_topk_add(nc->tk, nc->tab[lo].s27k, nc->kidx_base + lo, dist, nc->tab[lo].ecuid);
+		}
+		return;
+	}
+
+	/* visit the exact match first, to tighten the bound sooner */
+	const unsigned char qc = nc->q[pos];
+	u32 mlo = lo, mhi = lo;
+	if (qc && (qc != '.')) {
+		mlo = prefix_lbound(nc->tab, lo, hi, pos, qc);
+		mhi = prefix_lbound(nc->tab, mlo, hi, pos, qc + 1);
+		nearest_walk(nc, mlo, mhi, pos + 1, dist);
+	}
+
+	while (lo < hi) {
+		if (lo == mlo) {
+			lo = mhi;
+			if (lo == hi) break;
+		}
+		const unsigned char c = nc->tab[lo].ecuid[pos];
+		u32 end = prefix_lbound(nc->tab, lo, hi, pos, c + 1);
+		nearest_walk(nc, lo, end, pos + 1, dist + ecuid_chardiff(pos, qc, c));
+		lo = end;
+	}
+}
+
+unsigned romdb_nearest_keys(nis_romdb *romdb, const char *ecuid, struct ecuid_keymatch_t *k, unsigned candidates) {
+	assert(romdb && ecuid && k);
+	struct ecuid_topk tk;
+	struct nearest_ctx nc = {0};
+
+	strncpy(nc.q, ecuid, ECUID_LEN);
+	nc.tk = &tk;
+	ecuid_topk_init(&tk, k, candidates);
+
+	nc.tab = romdb->bin_ecuid;
+	nearest_walk(&nc, 0, romdb->bin_necuid, 0, 0);
+
+	nc.tab = romdb->csv_ecuid;
+	nc.kidx_base = romdb->bin_necuid;
+	nearest_walk(&nc, 0, romdb->csv_necuid, 0, 0);
+
+	nc.tab = romdb->lst_ecuid;
+	nc.kidx_base = romdb->bin_necuid + romdb->csv_necuid;
+	nearest_walk(&nc, 0, romdb->lst_necuid, 0, 0);
+
+	return ecuid_topk_finish(&tk);
+}
+
+
+/************************** compiled db */
+
+bool romdb_load_compiled(nis_romdb *romdb, const char *fname) {
+	assert(romdb && fname);
+	const struct romdb_bin_hdr *hdr;
+	enum key_type kt;
+	u32 idx;
+
+	if (romdb->bin_img.buf) {
+		ERR_PRINTF("a compiled db is already loaded\n");
+		return 0;
+	}
+	if (romimg_open(&romdb->bin_img, fname, 0)) {
+		return 0;
+	}
+
+	const u8 *buf = romdb->bin_img.buf;
+	u32 siz = romdb->bin_img.siz;
+
+	hdr = (const struct romdb_bin_hdr *) buf;
+	if ((siz < sizeof(*hdr)) ||
+		memcmp(hdr->magic, ROMDB_BIN_MAGIC, sizeof(hdr->magic)) ||
+		(hdr->bom != ROMDB_BIN_BOM) ||
+		(hdr->vers != ROMDB_BIN_VERS)) {
+		ERR_PRINTF("%s : not a compiled romdb, or wrong version / byte order\n", fname);
+		goto badexit;
+	}
+
+	/* bounds-check every table before trusting the file */
+	uint64_t ecuid_len = (uint64_t) hdr->num_ecuid * sizeof(struct romdb_bin_ecuid);
+	uint64_t ks_len = (uint64_t) hdr->num_keyset * sizeof(struct keyset_t);
+	uint64_t kidx_len = (uint64_t) hdr->num_keyset * sizeof(u32);
+	bool bad = 0;
+
+	bad |= (hdr->ofs_ecuid & 3) || ((hdr->ofs_ecuid + ecuid_len) > siz);
+	bad |= (hdr->ofs_keyset & 3) || ((hdr->ofs_keyset + ks_len) > siz);
+	for (kt = KEY_S27; kt < KEY_INVALID; kt++) {
+		bad |= (hdr->ofs_kidx[kt] & 3) || ((hdr->ofs_kidx[kt] + kidx_len) > siz);
+	}
+	if (bad) {
+		ERR_PRINTF("%s : truncated or corrupt\n", fname);
+		goto badexit;
+	}
+
+	for (kt = KEY_S27; kt < KEY_INVALID; kt++) {
+		const u32 *kidx = (const u32 *) &buf[hdr->ofs_kidx[kt]];
+		for (idx = 0; idx < hdr->num_keyset; idx++) {
+			if (kidx[idx] >= hdr->num_keyset) {
+				ERR_PRINTF("%s : corrupt key index\n", fname);
+				goto badexit;
+			}
+		}
+		romdb->bin_kidx[kt] = kidx;
+	}
+
+	romdb->bin_ecuid = (const struct romdb_bin_ecuid *) &buf[hdr->ofs_ecuid];
+	romdb->bin_necuid = hdr->num_ecuid;
+	romdb->bin_ks = (const struct keyset_t *) &buf[hdr->ofs_keyset];
+	romdb->bin_nks = hdr->num_keyset;
+
+	TRACE(TC_ROMDB, TL_INFO, "compiled romdb : %lu ECUIDs, %lu keysets\n",
+			(unsigned long) romdb->bin_necuid, (unsigned long) romdb->bin_nks);
+	return build_ecuid_index(romdb) && build_indexes(romdb);
+
+badexit:
+	romimg_close(&romdb->bin_img);
+	memset(romdb->bin_kidx, 0, sizeof(romdb->bin_kidx));
+	return 0;
+}
+
+
+/** scratch for sorting key indexes */
+struct kidx_sort {
+	u32 key;
+	u32 idx;
+};
+
+static int cmp_kidx(const void *a, const void *b) {
+	const struct kidx_sort *ka = a, *kb = b;
+	if (ka->key != kb->key) return (ka->key < kb->key) ? -1 : 1;
+	if (ka->idx != kb->idx) return (ka->idx < kb->idx) ? -1 : 1;
+	return 0;
+}
+
+struct ks_collect {
+	struct keyset_t *ks;
+	u32 num;
+};
+
+static bool collect_keyset(const struct keyset_t *keyset, void *data) {
+	struct ks_collect *kc = data;
+	kc->ks[kc->num++] = *keyset;
+	return 0;
+}
+
+bool romdb_compile(nis_romdb *romdb, const char *fname) {
+	assert(romdb && fname);
+	struct romdb_bin_hdr hdr = {0};
+	struct romdb_bin_ecuid *ecuids = NULL;
+	struct kidx_sort *ksort = NULL;
+	u32 *kidx = NULL;
+	struct ks_collect kc = {0};
+	FILE *fh = NULL;
+	enum key_type kt;
+	u32 idx, necuid = 0;
+	bool ok = 0;
+
+	u32 maxecuid = romdb->bin_necuid + HASH_COUNT(romdb->ecuid_table);
+	u32 maxks = romdb->bin_nks + HASH_COUNT(romdb->keyset_table);
+
+	ecuids = calloc(maxecuid + 1, sizeof(*ecuids));
+	kc.ks = calloc(maxks + 1, sizeof(*kc.ks));
+	ksort = calloc(maxks + 1, sizeof(*ksort));
+	kidx = calloc(maxks + 1, sizeof(*kidx));
+	if (!ecuids || !kc.ks || !ksort || !kidx) goto exit;
+
+	// ECUIDs : compiled ones, then those only in the hash table
+	if (romdb->bin_necuid) memcpy(ecuids, romdb->bin_ecuid, romdb->bin_necuid * sizeof(*ecuids));
+	necuid = romdb->bin_necuid;
+	const struct ecuid_rec *ecr, *etmp;
+	HASH_ITER(hh, romdb->ecuid_table, ecr, etmp) {
+		if (bin_find_ecuid(romdb, ecr->ecuid)) continue;
+		memcpy(ecuids[necuid].ecuid, ecr->ecuid, ECUID_LEN);
+		ecuids[necuid].fidtype = ecr->fidtype;
+		ecuids[necuid].s27k = ecr->s27k;
+		necuid++;
+	}
+	qsort(ecuids, necuid, sizeof(*ecuids), cmp_bin_ecuid);
+
+	keysets_iterate(romdb, collect_keyset, &kc);
+
+	memcpy(hdr.magic, ROMDB_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.bom = ROMDB_BIN_BOM;
+	hdr.vers = ROMDB_BIN_VERS;
+	hdr.num_ecuid = necuid;
+	hdr.num_keyset = kc.num;
+	hdr.ofs_ecuid = sizeof(hdr);
+	hdr.ofs_keyset = hdr.ofs_ecuid + necuid * sizeof(*ecuids);
+	hdr.ofs_kidx[0] = hdr.ofs_keyset + kc.num * sizeof(*kc.ks);
+	for (kt = 1; kt < KEY_INVALID; kt++) {
+		hdr.ofs_kidx[kt] = hdr.ofs_kidx[kt - 1] + kc.num * sizeof(u32);
+	}
+
+	fh = fopen(fname, "wb");
+	if (!fh) {
+		ERR_PRINTF("can't open \"%s\": %s\n", fname, strerror(errno));
+		goto exit;
+	}
+	if ((fwrite(&hdr, sizeof(hdr), 1, fh) != 1) ||
+		(fwrite(ecuids, sizeof(*ecuids), necuid, fh) != necuid) ||
+		(fwrite(kc.ks, sizeof(*kc.ks), kc.num, fh) != kc.num)) {
+		goto exit;
+	}
+	for (kt = KEY_S27; kt < KEY_INVALID; kt++) {
+		for (idx = 0; idx < kc.num; idx++) {
+			ksort[idx].key = keyset_key(&kc.ks[idx], kt);
+			ksort[idx].idx = idx;
+		}
+		qsort(ksort, kc.num, sizeof(*ksort), cmp_kidx);
+		for (idx = 0; idx < kc.num; idx++) {
+			kidx[idx] = ksort[idx].idx;
+		}
+		if (fwrite(kidx, sizeof(*kidx), kc.num, fh) != kc.num) goto exit;
+	}
+	ok = 1;
+	TRACE(TC_ROMDB, TL_INFO, "compiled romdb %s : %lu ECUIDs, %lu keysets\n", fname,
+			(unsigned long) necuid, (unsigned long) kc.num);
+
+exit:
+	if (fh && fclose(fh)) ok = 0;
+	if (!ok) ERR_PRINTF("trouble writing %s\n", fname);
+	free(ecuids);
+	free(kc.ks);
+	free(ksort);
+	free(kidx);
+	return ok;
+}
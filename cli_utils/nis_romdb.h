@@ -9,6 +9,7 @@
  * -
  *
  * for now, it holds one 'table' with ECUID as the primary key.
+ * The db can also be loaded from a precompiled file; see romdb_compile().
  */
 
 #ifndef NIS_ROMDB_H
@@ -17,13 +18,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "ecuid_list.h"
 #include "nissan_romdefs.h"
 #include "stypes.h"
 
 
-#define ECUID_LEN 5	//excluding 0-term
-#define ECUID_STR_LEN (ECUID_LEN + 1)	//includes 0-term
-
 /*********** some incomplete decls just as placeholders */
 
 struct s_nis_romdb;
@@ -46,11 +45,20 @@ struct keyset_t {
 	};
 
 /** try to see if candidate matches one known keyset.
+ * Hashed / binary-searched for every key type.
  *
- * return NULL if not found
+ * return NULL if not found. When several keysets share that key, the first in keysets_iterate() order
  */
 const struct keyset_t *find_knownkey(nis_romdb *romdb, enum key_type ktype, u32 candidate);
 
+/** batch version of find_knownkey() : check each candidate against every key type.
+ *
+ * @param results : num elements; results[i][ktype] is set as find_knownkey(romdb, ktype, candidates[i]) would return
+ * @return number of candidates that matched at least one key type
+ */
+unsigned find_knownkeys(nis_romdb *romdb, const u32 *candidates, unsigned num,
+			const struct keyset_t *(*results)[KEY_INVALID]);
+
 
 /** iterate over known keysets and call user func.
  *
@@ -62,6 +70,32 @@ const struct keyset_t *find_knownkey(nis_romdb *romdb, enum key_type ktype, u32
 void keysets_iterate(nis_romdb *romdb, bool (*cb1)(const struct keyset_t *keyset, void *data), void *data);
 
 
+/** one known key, split in 16-bit halves for literal searches */
+struct halfkey_ent {
+	u16 hi;	//high half : index is sorted on this
+	u16 lo;
+	enum key_type ktype;
+	unsigned ordinal;	//position of the keyset in keysets_iterate() order
+	const struct keyset_t *keyset;
+};
+
+/** index of every known key, to find all of them in a single pass over a ROM */
+struct halfkey_index {
+	const struct halfkey_ent *ents;	//sorted by hi, then ordinal
+	unsigned num_ents;
+	unsigned num_keysets;	//ordinals are [0, num_keysets[
+	const u32 *hi_bitmap;	//bit (hi & 31) of hi_bitmap[hi >> 5] is set if any entry has that hi value
+};
+
+/** get the half-key index, rebuilt whenever keysets are added.
+ *
+ * Contents stay valid until the next romdb_keyset_addcsv() or romdb_close().
+ * Zero keys (e.g. missing s36k2) are not indexed.
+ * @return 0 if there are no keys at all
+ */
+bool romdb_halfkey_index(nis_romdb *romdb, struct halfkey_index *hki);
+
+
 /** initialize and return a new, empty rom db 'handle'
  *
  * @return NULL if error
@@ -86,6 +120,25 @@ bool romdb_ecuid_addcsv(nis_romdb *romdb, const char *fname);
  */
 bool romdb_keyset_addcsv(nis_romdb *romdb, const char *fname);
 
+/** load a compiled db made by romdb_compile(). It is mmapped, not parsed :
+ * startup cost does not depend on its size, and queries on it don't allocate.
+ *
+ * Can be combined with CSV files; entries in the compiled db take precedence.
+ * Only one compiled db can be loaded.
+ *
+ * @return 1 if ok
+ */
+bool romdb_load_compiled(nis_romdb *romdb, const char *fname);
+
+/** write all current entries (compiled + CSV) as a compiled db.
+ *
+ * The file holds the ECUID records sorted by ECUID, the keysets in keysets_iterate() order
+ * and one sorted index per key type; it is only valid on hosts with the same byte order.
+ *
+ * @return 1 if ok
+ */
+bool romdb_compile(nis_romdb *romdb, const char *fname);
+
 /************************** queries for basic fields. *****************************
  * the ecuid param must be a u8[5] ; 0-termination optional
  */
@@ -102,6 +155,25 @@ enum fidtype_ic romdb_q_fidtype(nis_romdb *romdb, const char *ecuid);
  */
 const struct keyset_t *romdb_q_keyset(nis_romdb *romdb, const char *ecuid);
 
+/** get s27k : from the db, or else from the built-in ecuid_list[]. Same as an exact (dist 0) match
+ * of romdb_nearest_keys(), but a few binary searches.
+ *
+ * @return 0 if ECUID not found
+ */
+u32 romdb_q_s27k(nis_romdb *romdb, const char *ecuid);
+
+/** guess keys for an unknown ECUID : find the <candidates> distinct s27k keys whose ECUIDs are
+ * closest to <ecuid>, as measured by ecuid_chardiff(). Searches compiled and CSV ECUIDs, then
+ * the built-in ecuid_list[] entries that neither of those has.
+ * Sorted by distance, then by kidx : ties go to compiled entries, then CSV, then built-in,
+ * and to the lower ECUID within each.
+ *
+ * @param ecuid : may be shorter than 5 chars or contain '.' wildcards, e.g. while being typed
+ * @param k : filled and sorted like ecuid_getkeys(). k[].ecuid points in the db, and is not 0-terminated
+ * @return number of valid candidates
+ */
+unsigned romdb_nearest_keys(nis_romdb *romdb, const char *ecuid, struct ecuid_keymatch_t *k, unsigned candidates);
+
 
 
 #endif // NIS_ROMDB_H
@@ -0,0 +1,311 @@
+/* hot-reloadable romdb for long-running processes
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * Reclamation is hazard-pointer style : a reader publishes the version it's about to use in its slot,
+ * then checks it's still current. The reloader swaps the current pointer first, then waits until
+ * no slot holds the old one; since both sides use seq_cst, either the reader sees the new version
+ * and retries, or the reloader sees the reader's slot.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+#include "nis_romdb.h"
+#include "nis_romdb_live.h"
+
+/* one slot per cache line, so readers on different threads don't contend */
+struct romdb_reader {
+	nis_romdb *hazard;	//version in use, or NULL
+	struct romdb_live *live;
+	int used;
+} __attribute__((aligned(64)));
+
+struct live_src {
+	enum romdb_srctype type;
+	char *fname;
+	bool have_st;	//st valid : the file existed at the last reload
+	struct stat st;
+};
+
+struct romdb_live {
+	struct romdb_reader readers[ROMDB_LIVE_MAXREADERS];
+
+	nis_romdb *cur;	//current version; only swapped atomically
+	unsigned long version;
+
+	pthread_mutex_t reload_mtx;	//serializes reloads, protects srcs[]
+	struct live_src *srcs;
+	unsigned nsrcs;
+
+	/* watcher thread */
+	pthread_mutex_t watch_mtx;
+	pthread_cond_t watch_cond;
+	pthread_t watcher;
+	bool watching;
+	bool stop;
+	unsigned interval_ms;
+	FILE *dbg_out;	//dbg_stream of the thread that started the watcher
+};
+
+
+struct romdb_live *romdb_live_new(void) {
+	struct romdb_live *live = calloc(1, sizeof(*live));
+	unsigned i;
+
+	if (!live) return NULL;
+	for (i = 0; i < ROMDB_LIVE_MAXREADERS; i++) {
+		live->readers[i].live = live;
+	}
+	pthread_mutex_init(&live->reload_mtx, NULL);
+	pthread_mutex_init(&live->watch_mtx, NULL);
+	pthread_cond_init(&live->watch_cond, NULL);
+	return live;
+}
+
+void romdb_live_close(struct romdb_live *live) {
+	unsigned i;
+	assert(live);
+
+	if (live->watching) {
+		pthread_mutex_lock(&live->watch_mtx);
+		live->stop = 1;
+		pthread_cond_signal(&live->watch_cond);
+		pthread_mutex_unlock(&live->watch_mtx);
+		pthread_join(live->watcher, NULL);
+	}
+	for (i = 0; i < ROMDB_LIVE_MAXREADERS; i++) {
+		assert(!live->readers[i].hazard);
+	}
+	if (live->cur) romdb_close(live->cur);
+	for (i = 0; i < live->nsrcs; i++) {
+		free(live->srcs[i].fname);
+	}
+	free(live->srcs);
+	pthread_cond_destroy(&live->watch_cond);
+	pthread_mutex_destroy(&live->watch_mtx);
+	pthread_mutex_destroy(&live->reload_mtx);
+	free(live);
+}
+
+bool romdb_live_addsrc(struct romdb_live *live, enum romdb_srctype type, const char *fname) {
+	assert(live && fname);
+	bool rv = 0;
+	unsigned i;
+
+	pthread_mutex_lock(&live->reload_mtx);
+	if (type == ROMDB_SRC_COMPILED) {
+		for (i = 0; i < live->nsrcs; i++) {
+			if (live->srcs[i].type == ROMDB_SRC_COMPILED) {
+				ERR_PRINTF("only one compiled db can be loaded\n");
+				goto exit;
+			}
+		}
+	}
+	struct live_src *newsrcs = realloc(live->srcs, (live->nsrcs + 1) * sizeof(*newsrcs));
+	if (!newsrcs) goto exit;
+	live->srcs = newsrcs;
+
+	struct live_src *src = &live->srcs[live->nsrcs];
+	memset(src, 0, sizeof(*src));
+	src->type = type;
+	src->fname = strdup(fname);
+	if (!src->fname) goto exit;
+	live->nsrcs++;
+	rv = 1;
+exit:
+	pthread_mutex_unlock(&live->reload_mtx);
+	return rv;
+}
+
+static bool load_src(nis_romdb *db, const struct live_src *src) {
+	switch (src->type) {
+	case ROMDB_SRC_COMPILED:
+		return romdb_load_compiled(db, src->fname);
+	case ROMDB_SRC_ECUID:
+		return romdb_ecuid_addcsv(db, src->fname);
+	case ROMDB_SRC_KEYSET:
+		return romdb_keyset_addcsv(db, src->fname);
+	}
+	return 0;
+}
+
+/** wait until no reader uses <old> anymore. It's not current, so no reader can start using it again. */
+static void wait_readers(struct romdb_live *live, const nis_romdb *old) {
+	const struct timespec pause = {.tv_sec = 0, .tv_nsec = 100 * 1000};
+	unsigned i;
+
+	for (i = 0; i < ROMDB_LIVE_MAXREADERS; i++) {
+		while (__atomic_load_n(&live->readers[i].hazard, __ATOMIC_SEQ_CST) == old) {
+			nanosleep(&pause, NULL);
+		}
+	}
+}
+
+bool romdb_live_reload(struct romdb_live *live) {
+	assert(live);
+	nis_romdb *db, *old;
+	unsigned i;
+
+	pthread_mutex_lock(&live->reload_mtx);
+
+	/* stat before loading : a file replaced during the load is seen as changed next time */
+	for (i = 0; i < live->nsrcs; i++) {
+		struct live_src *src = &live->srcs[i];
+		src->have_st = (stat(src->fname, &src->st) == 0);
+	}
+
+	db = romdb_new();
+	if (!db) {
+		ERR_PRINTF("trouble in romdb_new\n");
+		goto badexit;
+	}
+	for (i = 0; i < live->nsrcs; i++) {
+		if (!load_src(db, &live->srcs[i])) {
+			ERR_PRINTF("romdb reload : trouble with %s, keeping current db\n", live->srcs[i].fname);
+			romdb_close(db);
+			goto badexit;
+		}
+	}
+
+	old = __atomic_exchange_n(&live->cur, db, __ATOMIC_SEQ_CST);
+	unsigned long vers = __atomic_add_fetch(&live->version, 1, __ATOMIC_RELEASE);
+	if (old) {
+		wait_readers(live, old);
+		romdb_close(old);
+	}
+	pthread_mutex_unlock(&live->reload_mtx);
+	TRACE(TC_ROMDB, TL_INFO, "romdb version %lu loaded\n", vers);
+	trace_flush();
+	return 1;
+
+badexit:
+	pthread_mutex_unlock(&live->reload_mtx);
+	return 0;
+}
+
+bool romdb_live_changed(struct romdb_live *live) {
+	assert(live);
+	bool changed = 0;
+	unsigned i;
+
+	pthread_mutex_lock(&live->reload_mtx);
+	for (i = 0; i < live->nsrcs; i++) {
+		const struct live_src *src = &live->srcs[i];
+		struct stat st;
+		bool have_st = (stat(src->fname, &st) == 0);
+
+		if (have_st != src->have_st) {
+			changed = 1;
+		} else if (have_st) {
+			changed = (st.st_dev != src->st.st_dev) ||
+				(st.st_ino != src->st.st_ino) ||
+				(st.st_size != src->st.st_size) ||
+				(st.st_mtim.tv_sec != src->st.st_mtim.tv_sec) ||
+				(st.st_mtim.tv_nsec != src->st.st_mtim.tv_nsec);
+		}
+		if (changed) break;
+	}
+	pthread_mutex_unlock(&live->reload_mtx);
+	return changed;
+}
+
+static void *watch_thread(void *arg) {
+	struct romdb_live *live = arg;
+
+	dbg_stream = live->dbg_out;
+	pthread_mutex_lock(&live->watch_mtx);
+	while (!live->stop) {
+		struct timeval now;
+		struct timespec deadline;
+
+		gettimeofday(&now, NULL);
+		unsigned long long ns = (unsigned long long) now.tv_usec * 1000 +
+					(unsigned long long) live->interval_ms * 1000 * 1000;
+		deadline.tv_sec = now.tv_sec + (time_t) (ns / 1000000000ULL);
+		deadline.tv_nsec = (long) (ns % 1000000000ULL);
+
+		int rc = pthread_cond_timedwait(&live->watch_cond, &live->watch_mtx, &deadline);
+		if (live->stop) break;
+		if ((rc != ETIMEDOUT) && (rc != 0)) break;
+
+		pthread_mutex_unlock(&live->watch_mtx);
+		if (romdb_live_changed(live)) {
+			(void) romdb_live_reload(live);
+		}
+		pthread_mutex_lock(&live->watch_mtx);
+	}
+	pthread_mutex_unlock(&live->watch_mtx);
+	return NULL;
+}
+
+int romdb_live_watch(struct romdb_live *live, unsigned interval_ms) {
+	assert(live);
+	if (live->watching) return -1;
+
+	live->interval_ms = interval_ms ? interval_ms : 1;
+	live->stop = 0;
+	live->dbg_out = dbg_stream ? dbg_stream : stderr;
+	if (pthread_create(&live->watcher, NULL, watch_thread, live)) {
+		ERR_PRINTF("can't start romdb watcher\n");
+		return -1;
+	}
+	live->watching = 1;
+	return 0;
+}
+
+unsigned long romdb_live_version(struct romdb_live *live) {
+	assert(live);
+	return __atomic_load_n(&live->version, __ATOMIC_ACQUIRE);
+}
+
+
+struct romdb_reader *romdb_live_reader(struct romdb_live *live) {
+	assert(live);
+	unsigned i;
+
+	for (i = 0; i < ROMDB_LIVE_MAXREADERS; i++) {
+		int expected = 0;
+		if (__atomic_compare_exchange_n(&live->readers[i].used, &expected, 1, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return &live->readers[i];
+		}
+	}
+	ERR_PRINTF("no free romdb reader slot\n");
+	return NULL;
+}
+
+void romdb_reader_free(struct romdb_reader *rd) {
+	if (!rd) return;
+	assert(!rd->hazard);
+	__atomic_store_n(&rd->used, 0, __ATOMIC_RELEASE);
+}
+
+nis_romdb *romdb_live_enter(struct romdb_reader *rd) {
+	assert(rd && !rd->hazard);
+	struct romdb_live *live = rd->live;
+	nis_romdb *db;
+
+	do {
+		db = __atomic_load_n(&live->cur, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&rd->hazard, db, __ATOMIC_SEQ_CST);
+	} while (db != __atomic_load_n(&live->cur, __ATOMIC_SEQ_CST));
+	return db;
+}
+
+void romdb_live_exit(struct romdb_reader *rd) {
+	assert(rd);
+	__atomic_store_n(&rd->hazard, NULL, __ATOMIC_RELEASE);
+}
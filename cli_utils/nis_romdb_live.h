@@ -0,0 +1,95 @@
+/* hot-reloadable romdb for long-running processes
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * A romdb_live holds the current version of a ROM db, built from a list of source files
+ * (compiled db, ECUID and keyset CSVs). Versions are never modified once published :
+ * romdb_live_reload() builds a complete new nis_romdb from the sources, swaps it in atomically,
+ * and frees the old one once no reader still uses it.
+ *
+ * Readers don't take locks; each reader thread gets a slot with romdb_live_reader() and brackets
+ * its queries with romdb_live_enter() / romdb_live_exit() :
+ *
+ *	struct romdb_reader *rd = romdb_live_reader(live);
+ *	...
+ *	nis_romdb *db = romdb_live_enter(rd);
+ *	const struct keyset_t *ks = romdb_q_keyset(db, ecuid);
+ *	... use ks ...
+ *	romdb_live_exit(rd);	// ks is invalid after this
+ *
+ * enter / exit are a few atomic loads and stores on a slot private to the reader; a reload in
+ * progress never blocks them. It's the reloading thread that waits for readers to leave the old version.
+ */
+
+#ifndef NIS_ROMDB_LIVE_H
+#define NIS_ROMDB_LIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nis_romdb.h"
+
+#define ROMDB_LIVE_MAXREADERS	64
+
+enum romdb_srctype {
+	ROMDB_SRC_COMPILED,	//see romdb_load_compiled()
+	ROMDB_SRC_ECUID,	//see romdb_ecuid_addcsv()
+	ROMDB_SRC_KEYSET,	//see romdb_keyset_addcsv()
+};
+
+struct romdb_live;	//opaque
+struct romdb_reader;	//opaque
+
+/** @return NULL if error. There is no current version until the first successful romdb_live_reload(). */
+struct romdb_live *romdb_live_new(void);
+
+/** stop the watcher, and free everything. All readers must have been released. */
+void romdb_live_close(struct romdb_live *live);
+
+/** add a source file, loaded in the order added by every reload. Only one ROMDB_SRC_COMPILED.
+ *
+ * @return 1 if ok
+ */
+bool romdb_live_addsrc(struct romdb_live *live, enum romdb_srctype type, const char *fname);
+
+/** build a new version from all sources and publish it. If any source fails to load,
+ * the current version is kept. Can be called from any thread; reloads are serialized.
+ *
+ * Returns after the previous version is freed, i.e. once every reader that was using it has exited.
+ * @return 1 if a new version was published
+ */
+bool romdb_live_reload(struct romdb_live *live);
+
+/** @return 1 if a source file changed (mtime, size or inode) since the last romdb_live_reload(),
+ * whether it succeeded or not */
+bool romdb_live_changed(struct romdb_live *live);
+
+/** start a background thread that checks the sources every <interval_ms> and reloads when they changed.
+ *
+ * @return 0 if ok
+ */
+int romdb_live_watch(struct romdb_live *live, unsigned interval_ms);
+
+/** @return number of versions published so far; a reader can compare it to notice reloads */
+unsigned long romdb_live_version(struct romdb_live *live);
+
+
+/** get a reader slot, to be used by one thread at a time.
+ * @return NULL if all ROMDB_LIVE_MAXREADERS slots are in use
+ */
+struct romdb_reader *romdb_live_reader(struct romdb_live *live);
+
+/** release a reader slot; it must not be inside enter / exit */
+void romdb_reader_free(struct romdb_reader *rd);
+
+/** start using the current version. Doesn't nest : one enter, one exit.
+ *
+ * @return current version, valid until romdb_live_exit(). NULL if none was loaded yet
+ * (romdb_live_exit() is still required).
+ */
+nis_romdb *romdb_live_enter(struct romdb_reader *rd);
+
+/** stop using the version returned by romdb_live_enter(), and anything obtained from it */
+void romdb_live_exit(struct romdb_reader *rd);
+
+#endif
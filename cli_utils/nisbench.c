@@ -0,0 +1,522 @@
+/* nisbench : timings of the hot kernels, and of nisrom over a ROM corpus.
+ *
+ * Kernels run on tests/testrom.bin, and on synthetic images (testrom.bin followed by
+ * pseudo-random data, same seed every run) from 128k to 2M.
+ * Each measurement repeats the kernel for at least BENCH_MIN_NS, and the best of
+ * BENCH_ROUNDS rounds is kept : that is much more stable than the mean on a busy machine.
+ *
+ * Needles for the memstr kernels are scrubbed from the images, so every search is a full scan.
+ *
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "nislib.h"
+#include "nislib_patset.h"
+#include "nislib_shindex.h"
+#include "nislib_shtools.h"
+#include "nisrom_anchors.h"
+#include "nisrom_keyfinders.h"
+#include "nis_romdb.h"
+
+#include "stypes.h"
+
+__thread FILE *dbg_stream;
+
+#define BENCH_ROUNDS	5
+#define BENCH_MIN_NS	50000000ULL	//per round
+#define BENCH_SEED	0x4E495342	//"NISB"
+
+#define NEEDLE16	0xDEAD
+#define NEEDLE32	0xC0FFEE11UL
+static const u8 needle8[] = "NISBENCH";
+
+#define CRYPT_BATCH	4096	//values per enc1 / dec1 call of the kernel
+#define TRACK_MAXSEEDS	256
+#define BENCH_NPATS	256	//size of the synthetic signature library
+#define BENCH_PATMAX	5	//opcodes per signature, max
+#define BENCH_SCODE	0x1234ABCDUL
+
+static const u32 synth_sizes[] = {128 * 1024, 512 * 1024, 1024 * 1024, 2048 * 1024};
+
+//results go here so the compiler can't drop the kernels
+static volatile uintptr_t bench_sink;
+
+struct bench_img {
+	const char *label;
+	u8 *buf;
+	u32 siz;
+	struct sh_index *idx;
+	nis_romdb *romdb;	//NULL if no keysets
+	struct sh_tracker *trk;
+	u8 *scratch;	//siz bytes, for enc1_buf / dec1_buf
+	u32 *seeds;	//mov.l @(disp, PC), Rn sites
+	u32 nseeds;
+	struct sh_pattern pats[BENCH_NPATS];	//opcode sequences picked from the image, partly masked
+	u16 patdata[2][BENCH_NPATS][BENCH_PATMAX];	//pat, mask
+	struct sh_patset *ps;
+};
+
+struct bench_kernel {
+	const char *name;
+	void (*run)(struct bench_img *bi);
+	unsigned (*bytes)(const struct bench_img *bi);	//per run, for ns/byte; NULL : siz
+	unsigned ops;	//ops per run, for ops/s; 0 : 1
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static u32 xorshift32(u32 *state) {
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/** fill image : seed contents, then pseudo-random data. Needles are scrubbed */
+static void synth_fill(u8 *buf, u32 siz, const u8 *seed, u32 seedlen) {
+	u32 state = BENCH_SEED ^ siz;
+	u32 pos;
+
+	for (pos = 0; (pos + 4) <= siz; pos += 4) {
+		write_32b(xorshift32(&state), &buf[pos]);
+	}
+	for (; pos < siz; pos++) {
+		buf[pos] = (u8) xorshift32(&state);
+	}
+	memcpy(buf, seed, MIN(seedlen, siz));
+
+	for (pos = 0; (pos + 2) <= siz; pos += 2) {
+		if (reconst_16(&buf[pos]) == NEEDLE16) buf[pos + 1] ^= 1;
+	}
+	for (pos = 0; (pos + 4) <= siz; pos += 4) {
+		if (reconst_32(&buf[pos]) == NEEDLE32) buf[pos + 3] ^= 1;
+	}
+	for (pos = 0; (pos + sizeof(needle8) - 1) <= siz; pos++) {
+		if (memcmp(&buf[pos], needle8, sizeof(needle8) - 1) == 0) buf[pos] ^= 1;
+	}
+}
+
+/******* kernels */
+
+static void k_u8memstr(struct bench_img *bi) {
+	bench_sink = (uintptr_t) u8memstr(bi->buf, bi->siz, needle8, sizeof(needle8) - 1);
+}
+
+static void k_u16memstr(struct bench_img *bi) {
+	bench_sink = (uintptr_t) u16memstr(bi->buf, bi->siz, NEEDLE16);
+}
+
+static void k_u32memstr(struct bench_img *bi) {
+	bench_sink = (uintptr_t) u32memstr(bi->buf, bi->siz, NEEDLE32);
+}
+
+/* ECUID-shaped runs, as scanned by find_ecuid() */
+static void k_idchar_run(struct bench_img *bi) {
+	u32 pos = 0, len = 0, n = 0;
+	while ((pos = idchar_run(bi->buf, bi->siz, pos, 5, &len)) != UINT32_MAX) {
+		pos += len;
+		n++;
+	}
+	bench_sink = n;
+}
+
+static void k_anchors(struct bench_img *bi) {
+	struct rom_anchors *ra = anchors_scan(bi->buf, bi->siz);
+	bench_sink = (uintptr_t) ra;
+	anchors_free(ra);
+}
+
+static void k_sum32(struct bench_img *bi) {
+	u32 sum = 0, xor = 0;
+	sum32(bi->buf, bi->siz & ~3, &sum, &xor);
+	bench_sink = sum ^ xor;
+}
+
+static void k_checksum_alt2(struct bench_img *bi) {
+	u32 p_s, p_x;
+	bench_sink = (uintptr_t) checksum_alt2(bi->buf, bi->siz, &p_s, &p_x, UINT32_MAX, UINT32_MAX);
+}
+
+static void k_enc1(struct bench_img *bi) {
+	u32 acc = 0;
+	u32 idx;
+	(void) bi;
+	for (idx = 0; idx < CRYPT_BATCH; idx++) {
+		acc ^= enc1(idx * 0x9E3779B9UL, BENCH_SCODE);
+	}
+	bench_sink = acc;
+}
+
+static void k_dec1(struct bench_img *bi) {
+	u32 acc = 0;
+	u32 idx;
+	(void) bi;
+	for (idx = 0; idx < CRYPT_BATCH; idx++) {
+		acc ^= dec1(idx * 0x9E3779B9UL, BENCH_SCODE);
+	}
+	bench_sink = acc;
+}
+
+static void k_enc1_buf(struct bench_img *bi) {
+	enc1_buf(bi->buf, bi->scratch, bi->siz & ~3, BENCH_SCODE);
+	bench_sink = bi->scratch[0];
+}
+
+static void k_dec1_buf(struct bench_img *bi) {
+	dec1_buf(bi->buf, bi->scratch, bi->siz & ~3, BENCH_SCODE);
+	bench_sink = bi->scratch[0];
+}
+
+static void k_bruteforce(struct bench_img *bi) {
+	enum key_quality keyq = KEYQ_UNK;
+	bench_sink = (uintptr_t) find_keys_bruteforce(bi->romdb, bi->buf, bi->siz, &keyq, 0);
+}
+
+static void track_cb(const uint8_t *buf, uint32_t pos, unsigned regno, void *data) {
+	(void) buf;
+	(void) regno;
+	*(u32 *) data += pos;
+}
+
+/* same seeding as findrefs : follow the register loaded by each mov.l @(disp, PC) */
+static void k_track_reg(struct bench_img *bi) {
+	u32 acc = 0;
+	u32 idx;
+
+	for (idx = 0; idx < bi->nseeds; idx++) {
+		u32 pos = bi->seeds[idx];
+		u16 opc = reconst_16(&bi->buf[pos]);
+		if ((pos + 2) >= bi->siz) continue;
+		sh_tracker_reset(bi->trk);
+		sh_track_reg(bi->trk, bi->buf, pos + 2, bi->siz, (opc >> 8) & 0x0F, track_cb, &acc);
+	}
+	bench_sink = acc;
+}
+
+/* same, with the per-ROM decoded array instead of the decode table */
+static void k_track_reg_dec(struct bench_img *bi) {
+	sh_tracker_setdecoded(bi->trk, sh_index_decoded(bi->idx));
+	k_track_reg(bi);
+	sh_tracker_setdecoded(bi->trk, NULL);
+}
+
+static void k_patset_scan(struct bench_img *bi) {
+	bench_sink = sh_patset_scan(bi->ps, bi->buf, bi->siz, NULL, NULL);
+}
+
+static void k_patset_index(struct bench_img *bi) {
+	bench_sink = sh_patset_scan_index(bi->ps, bi->idx, bi->buf, bi->siz, NULL, NULL);
+}
+
+/* the same signatures, one sh_index_pattern() each */
+static void k_pattern_each(struct bench_img *bi) {
+	u32 acc = 0;
+	unsigned id;
+
+	for (id = 0; id < BENCH_NPATS; id++) {
+		u32 *sites;
+		acc += sh_index_pattern(bi->idx, bi->pats[id].len, bi->pats[id].pat, bi->pats[id].mask, &sites);
+		free(sites);
+	}
+	bench_sink = acc;
+}
+
+static unsigned crypt_bytes(const struct bench_img *bi) {
+	(void) bi;
+	return CRYPT_BATCH * 4;
+}
+
+static const struct bench_kernel kernels[] = {
+	{"u8memstr", k_u8memstr, NULL, 0},
+	{"u16memstr", k_u16memstr, NULL, 0},
+	{"u32memstr", k_u32memstr, NULL, 0},
+	{"idchar_run", k_idchar_run, NULL, 0},
+	{"anchors_scan", k_anchors, NULL, 0},
+	{"sum32", k_sum32, NULL, 0},
+	{"checksum_alt2", k_checksum_alt2, NULL, 0},
+	{"enc1", k_enc1, crypt_bytes, CRYPT_BATCH},
+	{"dec1", k_dec1, crypt_bytes, CRYPT_BATCH},
+	{"enc1_buf", k_enc1_buf, NULL, 0},
+	{"dec1_buf", k_dec1_buf, NULL, 0},
+	{"find_keys_brute", k_bruteforce, NULL, 0},
+	{"sh_track_reg", k_track_reg, NULL, 0},
+	{"sh_track_dec", k_track_reg_dec, NULL, 0},
+	{"patset_scan", k_patset_scan, NULL, 0},
+	{"patset_index", k_patset_index, NULL, 0},
+	{"pattern_each", k_pattern_each, NULL, 0},
+};
+
+/** @return best ns per run */
+static double time_kernel(const struct bench_kernel *bk, struct bench_img *bi) {
+	double best = 0;
+	unsigned round;
+
+	bk->run(bi);	//warm up caches and lazy init
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		uint64_t t0 = now_ns();
+		uint64_t elapsed;
+		uint64_t iters = 0;
+		do {
+			bk->run(bi);
+			iters++;
+			elapsed = now_ns() - t0;
+		} while (elapsed < BENCH_MIN_NS);
+		double per = (double) elapsed / (double) iters;
+		if (!round || (per < best)) best = per;
+	}
+	return best;
+}
+
+static void print_row(const char *name, const char *label, double ns_per_byte, double ops_s) {
+	printf("%-16s %-10s %10.3f ns/B %14.0f ops/s\n", name, label, ns_per_byte, ops_s);
+}
+
+static bool img_prepare(struct bench_img *bi, nis_romdb *romdb) {
+	bi->romdb = romdb;
+	bi->idx = sh_index_build(bi->buf, bi->siz);
+	bi->trk = sh_tracker_new(bi->siz);
+	bi->scratch = malloc(bi->siz);
+	if (!bi->idx || !bi->trk || !bi->scratch) return 0;
+
+	bi->nseeds = sh_index_opcode_masked(bi->idx, 0xD000, 0xF000, &bi->seeds);
+	if (bi->nseeds > TRACK_MAXSEEDS) bi->nseeds = TRACK_MAXSEEDS;
+
+	//signatures : opcodes found somewhere in the image, with typical register-field masks
+	static const u16 masks[] = {0xFFFF, 0xF00F, 0xF0FF, 0xFF00};
+	u32 state = BENCH_SEED;
+	unsigned id, i;
+	for (id = 0; id < BENCH_NPATS; id++) {
+		u32 pos = (xorshift32(&state) % ((bi->siz / 2) - BENCH_PATMAX)) * 2;
+		struct sh_pattern *sp = &bi->pats[id];
+		sp->len = 2 + (xorshift32(&state) % (BENCH_PATMAX - 1));
+		for (i = 0; i < sp->len; i++) {
+			bi->patdata[0][id][i] = reconst_16(&bi->buf[pos + i * 2]);
+			bi->patdata[1][id][i] = masks[xorshift32(&state) % ARRAY_SIZE(masks)];
+		}
+		sp->pat = bi->patdata[0][id];
+		sp->mask = bi->patdata[1][id];
+	}
+	bi->ps = sh_patset_compile(bi->pats, BENCH_NPATS);
+	if (!bi->ps) return 0;
+
+	//the three pattern kernels must agree
+	k_pattern_each(bi);
+	u32 each = (u32) bench_sink;
+	u32 lin = sh_patset_scan(bi->ps, bi->buf, bi->siz, NULL, NULL);
+	u32 indexed = sh_patset_scan_index(bi->ps, bi->idx, bi->buf, bi->siz, NULL, NULL);
+	if ((lin != each) || (indexed != each)) {
+		ERR_PRINTF("%s : patset mismatch, %lu / %lu / %lu matches\n", bi->label,
+				(unsigned long) lin, (unsigned long) indexed, (unsigned long) each);
+	}
+	return 1;
+}
+
+static void img_release(struct bench_img *bi) {
+	sh_index_free(bi->idx);
+	sh_tracker_free(bi->trk);
+	free(bi->scratch);
+	free(bi->seeds);
+	sh_patset_free(bi->ps);
+}
+
+static void bench_image(struct bench_img *bi, const char *filter) {
+	unsigned kidx;
+
+	for (kidx = 0; kidx < ARRAY_SIZE(kernels); kidx++) {
+		const struct bench_kernel *bk = &kernels[kidx];
+		if (filter && !strstr(bk->name, filter)) continue;
+		if ((bk->run == k_bruteforce) && !bi->romdb) continue;
+
+		double ns = time_kernel(bk, bi);
+		unsigned bytes = bk->bytes ? bk->bytes(bi) : bi->siz;
+		unsigned ops = bk->ops ? bk->ops : 1;
+		print_row(bk->name, bi->label, ns / bytes, (ops * 1e9) / ns);
+	}
+}
+
+/** run "<nisrom> -c <roms...>" once, output discarded
+ * @return wall time in ns, 0 if failed
+ */
+static uint64_t run_nisrom(const char *nisrom, char **roms, int nroms) {
+	char **args = calloc(nroms + 3, sizeof(*args));
+	if (!args) return 0;
+	args[0] = (char *) nisrom;
+	args[1] = "-c";
+	memcpy(&args[2], roms, nroms * sizeof(*args));
+
+	fflush(stdout);	//else the child flushes our pending output too
+	uint64_t t0 = now_ns();
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (!freopen("/dev/null", "w", stdout)) _exit(127);
+		execv(nisrom, args);
+		_exit(127);
+	}
+	free(args);
+	if (pid < 0) return 0;
+
+	int status;
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) == 127)) {
+		return 0;
+	}
+	return now_ns() - t0;
+}
+
+/** end-to-end : best of BENCH_ROUNDS runs over the whole corpus */
+static void bench_corpus(const char *nisrom, char **roms, int nroms) {
+	uint64_t best = 0;
+	uint64_t bytes = 0;
+	unsigned round;
+	int idx;
+
+	for (idx = 0; idx < nroms; idx++) {
+		struct stat st;
+		if (stat(roms[idx], &st) || !S_ISREG(st.st_mode)) {
+			printf("skipping corpus : %s is not a ROM file\n", roms[idx]);
+			return;
+		}
+		bytes += st.st_size;
+	}
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		uint64_t ns = run_nisrom(nisrom, roms, nroms);
+		if (!ns) {
+			printf("could not run %s\n", nisrom);
+			return;
+		}
+		if (!round || (ns < best)) best = ns;
+	}
+
+	char label[16];
+	snprintf(label, sizeof(label), "%d ROMs", nroms);
+	print_row("nisrom", label, (double) best / bytes, (nroms * 1e9) / best);
+}
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+		"**** benchmark search, checksum, crypto and analysis kernels\n"
+		"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s [OPTIONS] [ROMFILE...]\n"
+		"\tROMFILEs, if any, are used as corpus for an end-to-end nisrom run.\n"
+		"OPTIONS:\n"
+		"\t-f <name>: only run kernels whose name contains <name>\n"
+		"\t-k <file>: keyset db for find_keys_brute (default ../romdb/keysets.csv)\n"
+		"\t-n <file>: nisrom binary for the corpus run (default ./nisrom)\n"
+		"\t-t <file>: seed image (default ../tests/testrom.bin)\n"
+		"\tExample: %s -f memstr\n", progname, progname);
+}
+
+int main(int argc, char *argv[]) {
+	const char *keyset_fname = "../romdb/keysets.csv";
+	const char *nisrom = "./nisrom";
+	const char *testrom = "../tests/testrom.bin";
+	const char *filter = NULL;
+	struct rom_image seed = {0};
+	nis_romdb *romdb = NULL;
+	int opt;
+	int rv = -1;
+	unsigned sidx;
+
+	while ((opt = getopt(argc, argv, "f:hk:n:t:")) != -1) {
+		switch (opt) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'k':
+			keyset_fname = optarg;
+			break;
+		case 'n':
+			nisrom = optarg;
+			break;
+		case 't':
+			testrom = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+
+	//kernels aren't allowed to be chatty
+	dbg_stream = fopen("/dev/null", "w");
+	if (!dbg_stream) {
+		printf("can't open /dev/null\n");
+		return -1;
+	}
+
+	if (romimg_open(&seed, testrom, 0)) {
+		printf("can't open seed image %s\n", testrom);
+		goto exit;
+	}
+
+	romdb = romdb_new();
+	if (romdb && !romdb_keyset_addcsv(romdb, keyset_fname)) {
+		printf("no keysets from %s : skipping find_keys_brute\n", keyset_fname);
+		romdb_close(romdb);
+		romdb = NULL;
+	}
+
+	printf("simd kernels : %s, best of %d rounds\n", nislib_simd_name(), BENCH_ROUNDS);
+
+	struct bench_img bi = {0};
+	bi.label = "testrom";
+	bi.siz = seed.siz;
+	bi.buf = malloc(seed.siz);
+	if (!bi.buf) goto exit;
+	memcpy(bi.buf, seed.buf, seed.siz);
+	if (img_prepare(&bi, romdb)) {
+		bench_image(&bi, filter);
+	}
+	img_release(&bi);
+	free(bi.buf);
+
+	for (sidx = 0; sidx < ARRAY_SIZE(synth_sizes); sidx++) {
+		char label[16];
+		struct bench_img sbi = {0};
+
+		snprintf(label, sizeof(label), "synth%luk", (unsigned long) synth_sizes[sidx] / 1024);
+		sbi.label = label;
+		sbi.siz = synth_sizes[sidx];
+		sbi.buf = malloc(sbi.siz);
+		if (!sbi.buf) goto exit;
+		synth_fill(sbi.buf, sbi.siz, seed.buf, seed.siz);
+		if (img_prepare(&sbi, romdb)) {
+			bench_image(&sbi, filter);
+		} else {
+			printf("trouble preparing %s\n", label);
+		}
+		img_release(&sbi);
+		free(sbi.buf);
+	}
+
+	if (optind < argc) {
+		bench_corpus(nisrom, &argv[optind], argc - optind);
+	}
+	rv = 0;
+
+exit:
+	if (romdb) romdb_close(romdb);
+	romimg_close(&seed);
+	fclose(dbg_stream);
+	return rv;
+}
@@ -13,39 +13,23 @@
 
 #define DEFAULT_OFILE "temp.bin"	//default output filename
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
-void fixck1(FILE *i_file, FILE *o_file,
+void fixck1(struct rom_image *img, FILE *o_file,
 		unsigned long pcs,unsigned long pcx, unsigned long pcorr) {
-	uint8_t *src;
-	u32 file_len;
+	uint8_t *src = img->buf;	//private copy, ok to modify
+	u32 file_len = img->siz;
 
-	file_len = flen(i_file);
-	if ((file_len <= 0) || (file_len > 3*1024*1024UL)) {
+	if (file_len > 3*1024*1024UL) {
 		printf("huge file (length %lu)\n", (unsigned long) file_len);
 	}
 
-	src = malloc(file_len);
-	if (!src) {
-		printf("malloc choke\n");
-		return;
-	}
-
-	/* load whole ROM */
-	if (fread(src,1,file_len,i_file) != file_len) {
-		printf("trouble reading\n");
-		free(src);
-		return;
-	}
-
 	if ((pcs >= file_len) || (pcx >= file_len) || ((pcorr + 8) >= file_len)) {
-		free(src);
 		return;
 	}
 
 	checksum_fix(src, file_len, pcs, pcx, pcorr +0, pcorr +4, pcorr +8);
 	fwrite(src, 1, file_len, o_file);
-	free(src);
 	return;
 }
 
@@ -53,7 +37,8 @@ void fixck1(FILE *i_file, FILE *o_file,
 int main(int argc, char * argv[]) {
 	unsigned long pcs, pcx, pcorr;
 	const char *ofn;	//output file name
-	FILE *i_file, *o_file;
+	FILE *o_file;
+	struct rom_image img;
 
 	dbg_stream = stdout;
 	printf(	"**** %s\n"
@@ -83,13 +68,12 @@ int main(int argc, char * argv[]) {
 		return 0;
 	}
 	//input file
-	if ((i_file=fopen(argv[4],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[4]);
+	if (romimg_open(&img, argv[4], 1)) {
 		return 0;
 	}
 
 	if ((pcs & 3) || (pcx & 3) || (pcorr & 3)) {
-		fclose(i_file);
+		romimg_close(&img);
 		printf("unaligned stuff\n");
 		return 0;
 	}
@@ -103,14 +87,12 @@ int main(int argc, char * argv[]) {
 	//open it
 	if ((o_file=fopen(ofn,"wb"))==NULL) {
 		printf("error opening %s.\n", ofn);
-		fclose(i_file);
+		romimg_close(&img);
 		return 0;
 	}
 
-	rewind(i_file);
-
-	fixck1(i_file,o_file, pcs, pcx, pcorr);
-	fclose(i_file);
+	fixck1(&img, o_file, pcs, pcx, pcorr);
+	romimg_close(&img);
 	fclose(o_file);
 
 	return 0;
@@ -14,49 +14,37 @@
 
 #define DEFAULT_OFILE "temp.bin"	//default output filename
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
-static void fixck2(FILE *i_file, FILE *o_file,
+static void fixck2(struct rom_image *img, FILE *o_file,
 		unsigned long pcs,unsigned long pcx) {
-	uint8_t *src;
-	u32 file_len;
-	u32 ts, tx;		//test sum&xor values
+	uint8_t *src = img->buf;	//private copy, ok to modify
+	u32 file_len = img->siz;
+	struct sum32_state ss;
 
-	file_len = flen(i_file);
-	if ((file_len <= 0) || (file_len > 3*1024*1024UL)) {
+	if (file_len > 3*1024*1024UL) {
 		printf("huge file (length %lu)\n", (unsigned long) file_len);
 	}
 
-	src = malloc(file_len);
-	if (!src) {
-		printf("malloc choke\n");
+	if (((pcs + 4)>= file_len) || ((pcx + 4) >= file_len)) {
 		return;
 	}
-
-	/* load whole ROM */
-	if (fread(src,1,file_len,i_file) != file_len) {
-		printf("trouble reading\n");
-		free(src);
+	if (sum32_init(&ss, src, file_len, SUM32_DEFAULT_BSIZE)) {
 		return;
 	}
 
-	if (((pcs + 4)>= file_len) || ((pcx + 4) >= file_len)) {
-		free(src);
-		return;
-	}
 	//write 0 at the sum & xor locations, so they won't affect the overall calculation
-	
 	write_32b(0, &src[pcs]);
 	write_32b(0, &src[pcx]);
-
-	sum32(src, file_len, &ts, &tx);
+	sum32_update(&ss, pcs, 4);
+	sum32_update(&ss, pcx, 4);
 
 	// and write new ck vals.
-	write_32b(ts, &src[pcs]);
-	write_32b(tx, &src[pcx]);
+	write_32b(ss.sum, &src[pcs]);
+	write_32b(ss.xor, &src[pcx]);
+	sum32_free(&ss);
 
 	fwrite(src, 1, file_len, o_file);
-	free(src);
 	return;
 }
 
@@ -64,7 +52,8 @@ static void fixck2(FILE *i_file, FILE *o_file,
 int main(int argc, char * argv[]) {
 	unsigned long pcs, pcx;
 	const char *ofn;	//output file name
-	FILE *i_file, *o_file;
+	FILE *o_file;
+	struct rom_image img;
 
 	dbg_stream = stdout;
 
@@ -90,14 +79,13 @@ int main(int argc, char * argv[]) {
 	}
 
 	//input file
-	if ((i_file=fopen(argv[3],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[4]);
+	if (romimg_open(&img, argv[3], 1)) {
 		return 0;
 	}
 
 	if ((pcs & 3) || (pcx & 3)) {
 		printf("unaligned stuff\n");
-		fclose(i_file);
+		romimg_close(&img);
 		return 0;
 	}
 
@@ -110,14 +98,12 @@ int main(int argc, char * argv[]) {
 	//open it
 	if ((o_file=fopen(ofn,"wb"))==NULL) {
 		printf("error opening %s.\n", ofn);
-		fclose(i_file);
+		romimg_close(&img);
 		return 0;
 	}
 
-	rewind(i_file);
-
-	fixck2(i_file,o_file, pcs, pcx);
-	fclose(i_file);
+	fixck2(&img, o_file, pcs, pcx);
+	romimg_close(&img);
 	fclose(o_file);
 
 	return 0;
@@ -2,100 +2,75 @@
  * (c) fenugrec 2015-2017
  * GPLv3
  * Needs the 32-bit scode to decrypt.
- * usage : nisdec1 <scode> <in_file> [<out_file>]
+ * usage : nisdec1 [-j <threads>] <scode> <in_file> [<out_file>]
  * if out_file is omitted, output is written to "temp.bin"
+ * in_file and out_file can be "-" for stdin / stdout
  * scode must be in hex, such as 9851EB85 (omit the 0x prefix)
  */
 
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
 
 #include "nislib.h"
+#include "nislib_crypt.h"
 
 #define DEFAULT_OFILE "temp.bin"	//default output filename
 
 
-//decrypt ifh, write to ofh.
-void nis_decrypt1(FILE *ifh, FILE *ofh, uint32_t scode) {
-
-#define DBUFSIZ 256
-	if (!ifh || !ofh) return;
-
-	while (!feof(ifh)) {
-		uint8_t ibuf[DBUFSIZ*4];	//source, encrypted
-		uint8_t obuf[DBUFSIZ*4];	//decrypted
-		uint8_t *icur, *ocur;
-		size_t count;
-		size_t realbs;	//# actually read
-
-		realbs = fread(ibuf, 1, sizeof(ibuf), ifh);	//try to fill buf
-		count = realbs;
-		icur = ibuf;
-		ocur = obuf;
-		for (;count >= 4; count -= 4) {
-			uint32_t block;
-			uint32_t data;	//decrypted
-
-			block = reconst_32(icur);
-			data = dec1(block, scode);
-			write_32b(data, ocur);
-			icur += 4;
-			ocur += 4;
-		}
-		//if the source file didn't have a multiple of 4 bytes, we may have leftovers.
-		if (count) {
-			size_t i;
-			printf("warning : block size is not multiple of 4; ");
-			uint32_t tb=0;
-			for (i=0; i < count; i++) {
-				tb |= *icur;
-				tb <<= 8;
-				icur++;
-			}
-			tb <<= 8 * (4 - count);	//left-justify in dword
-			printf("tb : %#x\n", tb);
-			write_32b(tb, ocur);
-		}
-		// obuf is filled with decrypted data; write that block to output file. Round <count> up to nearest multiple of 4.
-		count = (realbs + 3) & ~(0x03);
-		if (fwrite(obuf, 1, count, ofh) != count) {
-			perror("fwrite error !?: ");
-			return;
-		}
-	}
-}
-
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
 int main(int argc, char * argv[]) {
 	uint32_t scode;
-	const char *ofn;	//output file name
-	FILE *i_file, *o_file;
+	const char *ifn, *ofn;	//input, output file names
+	FILE *o_file;
+	FILE *msg = stdout;	//stderr if output goes to stdout
+	unsigned nthreads = 0;
+	int rv = 0;
+	int c;
+	const char *progname = argv[0];
+
 	dbg_stream = stderr;
 
-	printf(	"**** %s\n"
+	while ((c = getopt(argc, argv, "j:")) != -1) {
+		switch (c) {
+		case 'j':
+			nthreads = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if ((argc >= 4) && (strcmp(argv[3], "-") == 0)) {
+		msg = stderr;
+	}
+
+	fprintf(msg,	"**** %s\n"
 		"**** Decrypt file using Nissan algo\n"
-		"**** (c) 2015-2017 fenugrec\n", argv[0]);
+		"**** (c) 2015-2017 fenugrec\n", progname);
 
 	if (argc < 3) {
-		printf("%s <scode> <in_file> [<out_file>]\n\tscode is uint32. Uses NPT_DDL algo"
+		fprintf(msg, "%s [-j <threads>] <scode> <in_file> [<out_file>]\n\tscode is uint32. Uses NPT_DDL algo"
 			"\n\tIf out_file is omitted, output is written to %s"
-			"\n\tExample: %s 55AA00FF test.bin\n", argv[0], DEFAULT_OFILE, argv[0]);
+			"\n\tin_file and out_file can be \"-\" for stdin / stdout"
+			"\n\t-j : number of threads, 0 (default) for one per CPU"
+			"\n\tExample: %s 55AA00FF test.bin\n", progname, DEFAULT_OFILE, progname);
 		return 0;
 	}
 
 	// arg 1 : scode
 	if (sscanf(argv[1], "%x", &scode) != 1) {
-		printf("did not understand %s\n", argv[1]);
+		fprintf(msg, "did not understand %s\n", argv[1]);
 		return 0;
 	}
 
-	//2 : input file
-	if ((i_file=fopen(argv[2],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[2]);
-		return 0;
-	}
+	//2 : input file, opened by crypt1_file()
+	ifn = argv[2];
 
 	//3 : output file
 	if (argc >= 4) {
@@ -104,18 +79,21 @@ int main(int argc, char * argv[]) {
 		ofn = DEFAULT_OFILE;
 	}
 	//open it
-	if ((o_file=fopen(ofn,"wb"))==NULL) {
-		printf("error opening %s.\n", ofn);
-		fclose(i_file);
+	if (strcmp(ofn, "-") == 0) {
+		o_file = stdout;
+	} else if ((o_file=fopen(ofn,"wb"))==NULL) {
+		fprintf(msg, "error opening %s.\n", ofn);
 		return 0;
 	}
 
-	rewind(i_file);
-
-	nis_decrypt1(i_file,o_file,scode);
-	fclose(i_file);
-	fclose(o_file);
+	if (crypt1_file(ifn, o_file, scode, 0, nthreads, NULL)) {
+		rv = -1;
+	}
+	if (o_file != stdout) {
+		fclose(o_file);
+	} else {
+		fflush(stdout);
+	}
 
-	return 0;
+	return rv;
 }
-
@@ -2,102 +2,76 @@
  * (c) fenugrec 2015-2017
  * GPLv3
  * Specify the 32-bit key/scode to use.
- * usage : nisenc1 <key> <in_file> [<out_file>]
+ * usage : nisenc1 [-j <threads>] <key> <in_file> [<out_file>]
  * if out_file is omitted, output is written to "temp.bin"
+ * in_file and out_file can be "-" for stdin / stdout
  * scode must be in hex, such as 9851EB85 (0x prefix optional)
  */
 
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
 
 #include "nislib.h"
+#include "nislib_crypt.h"
 
 #define DEFAULT_OFILE "temp.bin"	//default output filename
 
 
-//encrypt ifh, write to ofh.
-//Assumes both files are seeked @0
-// Bonus : returns 16bit checksum of output !
-uint16_t nis_encrypt1(FILE *ifh, FILE *ofh, uint32_t scode) {
-	uint16_t cks = 0;
-#define DBUFSIZ 256
-	if (!ifh || !ofh) return 0;
-
-	while (!feof(ifh)) {
-		uint8_t ibuf[DBUFSIZ*4];	//source, plaintext
-		uint8_t obuf[DBUFSIZ*4];	//encrypted
-		uint8_t *icur, *ocur;
-		size_t count;
-		size_t realbs;	//# actually read
-
-		realbs = fread(ibuf, 1, sizeof(ibuf), ifh);	//try to fill buf
-		count = realbs;
-		icur = ibuf;
-		ocur = obuf;
-		for (;count >= 4; count -= 4) {
-			uint32_t plaint;
-			uint32_t data;
-
-			plaint = reconst_32(icur);
-			data = enc1(plaint, scode);
-			write_32b(data, ocur);
-			cks += (plaint >> 24) & 0xff;
-			cks += (plaint >> 16) & 0xff;
-			cks += (plaint >> 8) & 0xff;
-			cks += (plaint >> 0) & 0xff;
-			icur += 4;
-			ocur += 4;
-		}
-		//if the source file didn't have a multiple of 4 bytes, warn & drop leftovers.
-		if (count) {
-			printf("warning : block size is not multiple of 4; dropping extra bytes.\n");
-			realbs &= ~0x03;
-		}
-		if (realbs & 0x1F) {
-			printf("warning : payload not a multiple of 32 bytes; reported cks16 may be wrong.\n");
-		}
-		// obuf is filled with decrypted data; write that block to output file.
-		if (fwrite(obuf, 1, realbs, ofh) != realbs) {
-			perror("fwrite error !?: ");
-			return 0;
-		}
-	}	//while
-	return cks;
-}
-
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
 int main(int argc, char * argv[]) {
 	uint32_t scode;
-	const char *ofn;	//output file name
-	uint16_t cks16;
-	FILE *i_file, *o_file;
+	const char *ifn, *ofn;	//input, output file names
+	FILE *o_file;
+	FILE *msg = stdout;	//stderr if output goes to stdout
+	unsigned nthreads = 0;
+	struct crypt1_result res;
+	int rv = 0;
+	int c;
+	const char *progname = argv[0];
 
 	dbg_stream = stderr;
 
-	printf(	"**** %s\n"
-	"**** Encrypt file using Nissan algo\n"
-	"**** (c) 2015-2017 fenugrec\n", argv[0]);
+	while ((c = getopt(argc, argv, "j:")) != -1) {
+		switch (c) {
+		case 'j':
+			nthreads = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return 0;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if ((argc >= 4) && (strcmp(argv[3], "-") == 0)) {
+		msg = stderr;
+	}
+
+	fprintf(msg,	"**** %s\n"
+		"**** Encrypt file using Nissan algo\n"
+		"**** (c) 2015-2017 fenugrec\n", progname);
 
 	if (argc < 3) {
-		printf("%s <scode> <in_file> [<out_file>]\n\tscode is uint32. Uses Algo 01"
+		fprintf(msg, "%s [-j <threads>] <scode> <in_file> [<out_file>]\n\tscode is uint32. Uses Algo 01"
 			"\n\tIf out_file is omitted, output is written to " DEFAULT_OFILE
-			"\n\tExample: %s 55AA00FF test.bin\n", argv[0], argv[0]);
+			"\n\tin_file and out_file can be \"-\" for stdin / stdout"
+			"\n\t-j : number of threads, 0 (default) for one per CPU"
+			"\n\tExample: %s 55AA00FF test.bin\n", progname, progname);
 		return 0;
 	}
 
 	// arg 1 : scode
 	if (sscanf(argv[1], "%x", &scode) != 1) {
-		printf("did not understand %s\n", argv[1]);
+		fprintf(msg, "did not understand %s\n", argv[1]);
 		return 0;
 	}
 
-	//2 : input file
-	if ((i_file=fopen(argv[2],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[2]);
-		return 0;
-	}
+	//2 : input file, opened by crypt1_file()
+	ifn = argv[2];
 
 	//3 : output file
 	if (argc >= 4) {
@@ -106,19 +80,26 @@ int main(int argc, char * argv[]) {
 		ofn = DEFAULT_OFILE;
 	}
 	//open it
-	if ((o_file=fopen(ofn,"wb"))==NULL) {
-		printf("error opening %s.\n", ofn);
-		fclose(i_file);
+	if (strcmp(ofn, "-") == 0) {
+		o_file = stdout;
+	} else if ((o_file=fopen(ofn,"wb"))==NULL) {
+		fprintf(msg, "error opening %s.\n", ofn);
 		return 0;
 	}
 
-	rewind(i_file);
-
-	cks16 = nis_encrypt1(i_file,o_file,scode);
-	printf("decrypted payload cks16 = 0x%04X\n", (unsigned int) cks16);
-	fclose(i_file);
-	fclose(o_file);
+	if (crypt1_file(ifn, o_file, scode, 1, nthreads, &res)) {
+		rv = -1;
+	} else {
+		if (res.len & 0x1F) {
+			fprintf(msg, "warning : payload not a multiple of 32 bytes; reported cks16 may be wrong.\n");
+		}
+		fprintf(msg, "decrypted payload cks16 = 0x%04X\n", (unsigned int) res.cks16);
+	}
+	if (o_file != stdout) {
+		fclose(o_file);
+	} else {
+		fflush(stdout);
+	}
 
-	return 0;
+	return rv;
 }
-
@@ -0,0 +1,165 @@
+/* nisgraph : find function starts and build the call graph of a ROM,
+ * optionally export it as CSV for ghidra_helpers/nissan_load.py
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_callgraph.h"
+#include "nislib_prof.h"
+#include "nislib_shindex.h"
+#include "stypes.h"
+
+__thread FILE *dbg_stream;
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+		"**** Build ROM call graph\n"
+		"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s [-o <graph.csv>] [-f <func>]... <rom.bin>\n"
+		"\t-o: export graph, \"-\" for stdout\n"
+		"\t-f: list callers and callees of function at <func> (hex)\n"
+		"\tExample: %s -o rom_graph.csv rom.bin\n", progname, progname);
+}
+
+static const char *kindname(enum cg_kind kind) {
+	switch (kind) {
+	case CG_BSR: return "bsr";
+	case CG_JSR: return "jsr";
+	case CG_REF: return "ref";
+	}
+	return "?";
+}
+
+static void print_func(const struct sh_callgraph *cg, FILE *outf, u32 addr) {
+	const struct cg_func *funcs;
+	const struct cg_edge *edges;
+	u32 fi = sh_callgraph_find(cg, addr);
+	u32 n, i;
+
+	(void) sh_callgraph_funcs(cg, &funcs);
+	if (fi == CG_NOFUNC) {
+		fprintf(outf, "0x%06lX : not a known function start\n", (unsigned long) addr);
+		return;
+	}
+	n = sh_callgraph_callers(cg, fi, &edges);
+	fprintf(outf, "0x%06lX : %lu callers\n", (unsigned long) addr, (unsigned long) n);
+	for (i = 0; i < n; i++) {
+		fprintf(outf, "\t%s @ 0x%06lX", kindname(edges[i].kind), (unsigned long) edges[i].site);
+		if (edges[i].caller != CG_NOFUNC) {
+			fprintf(outf, " in 0x%06lX", (unsigned long) funcs[edges[i].caller].addr);
+		}
+		fprintf(outf, "\n");
+	}
+	n = sh_callgraph_callees(cg, fi, &edges);
+	fprintf(outf, "0x%06lX : %lu callees\n", (unsigned long) addr, (unsigned long) n);
+	for (i = 0; i < n; i++) {
+		fprintf(outf, "\t%s @ 0x%06lX to 0x%06lX\n", kindname(edges[i].kind),
+				(unsigned long) edges[i].site, (unsigned long) funcs[edges[i].callee].addr);
+	}
+}
+
+#define MAX_QUERIES 16
+
+int main(int argc, char *argv[]) {
+	const char *ofname = NULL;
+	unsigned long queries[MAX_QUERIES];
+	unsigned nqueries = 0;
+	struct rom_image img;
+	FILE *msg = stdout;	//stderr if the graph goes to stdout
+	int opt;
+	int rv = -1;
+
+	if (!trace_config(getenv(TRACE_ENV))) return -1;
+
+	while ((opt = getopt(argc, argv, "f:ho:")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (nqueries == MAX_QUERIES) {
+				printf("too many -f\n");
+				return -1;
+			}
+			if (sscanf(optarg, "%lx", &queries[nqueries]) != 1) {
+				printf("did not understand %s\n", optarg);
+				return -1;
+			}
+			nqueries++;
+			break;
+		case 'o':
+			ofname = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	if ((argc - optind) != 1) {
+		usage(argv[0]);
+		return 0;
+	}
+	if (ofname && (strcmp(ofname, "-") == 0)) msg = stderr;
+
+	dbg_stream = tmpfile();	//before calling nislib funcs
+	if (!dbg_stream) {
+		printf("problem creating temp file!?\n");
+		return -1;
+	}
+	if (romimg_open(&img, argv[optind], 0)) {
+		fclose(dbg_stream);
+		return -1;
+	}
+
+	uint64_t t0 = prof_now();
+	struct sh_index *idx = sh_index_build(img.buf, img.siz);
+	struct sh_callgraph *cg = idx ? sh_callgraph_build(idx, img.buf, img.siz) : NULL;
+	uint64_t dt = prof_now() - t0;
+	if (!cg) goto exit;
+
+	const struct cg_func *funcs;
+	u32 nfuncs = sh_callgraph_funcs(cg, &funcs);
+	u32 fi, nedges = 0;
+	unsigned long bykind[3] = {0};
+	for (fi = 0; fi < nfuncs; fi++) {
+		const struct cg_edge *edges;
+		u32 n = sh_callgraph_callers(cg, fi, &edges);
+		u32 ei;
+		for (ei = 0; ei < n; ei++) bykind[edges[ei].kind]++;
+		nedges += n;
+	}
+	fprintf(msg, "%s : %lu functions, %lu edges (%lu bsr, %lu jsr, %lu ref) in %.1f ms\n",
+			argv[optind], (unsigned long) nfuncs, (unsigned long) nedges,
+			bykind[CG_BSR], bykind[CG_JSR], bykind[CG_REF], dt / 1e6);
+
+	unsigned q;
+	for (q = 0; q < nqueries; q++) {
+		print_func(cg, msg, (u32) queries[q]);
+	}
+
+	rv = 0;
+	if (ofname) {
+		FILE *outf = (msg == stderr) ? stdout : fopen(ofname, "w");
+		if (!outf) {
+			printf("error opening %s.\n", ofname);
+			rv = -1;
+		} else {
+			if (sh_callgraph_export(cg, outf)) rv = -1;
+			if ((outf != stdout) && fclose(outf)) rv = -1;
+			if (rv) ERR_PRINTF("trouble writing %s\n", ofname);
+		}
+	}
+
+exit:
+	sh_callgraph_free(cg);
+	sh_index_free(idx);
+	romimg_close(&img);
+	fclose(dbg_stream);
+	return rv;
+}
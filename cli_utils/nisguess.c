@@ -2,24 +2,32 @@
  * (c) fenugrec 2015-2017
  * GPLv3
  * Note : because of the algo, there can be many (or no) key possibilities for any given 4-byte-in, 4-byte-out combination.
- * Should be compiled with -O3
  * usage : %0 <enc_u32> <dec_u32>
  * args in hex.
  * example : an encrypted ROM has "4166878b"  as a reset vector; we assume the real address is 0000 0104 so
- * "%0 4166878b 00000104" runs a few seconds and gives 0x1A18 0DC8 and others.
+ * "%0 4166878b 00000104" gives 0x1A18 0DC8 and others.
+ * Each key half is solved separately (see dec1_solve_pair()), so this is instantaneous.
 
  */
 
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include "nislib.h"
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
+
+static bool print_key(uint32_t key, void *data) {
+	(void) data;
+	printf("found key=%#lx\n", (unsigned long) key);
+	return 1;
+}
 
 int main(int argc, char * argv[]) {
-	uint32_t enc,dec,key;
+	uint32_t enc,dec;
+	struct dec1_solver ds;
 	dbg_stream = stdout;
 
 	printf(	"**** %s\n"
@@ -43,16 +51,10 @@ int main(int argc, char * argv[]) {
 		return 0;
 	}
 
-	for (key=0; key != (uint32_t) -1; key++) {
-		if (dec1(enc, key) == dec) {
-			printf("found key=%#lx\n", (unsigned long) key);
-		}
-		if (!(key & 0x3ffffff)) {
-			float status = 100.0 * key / ((uint32_t) -1);
-			printf("%3.f%% complete.\r", status);
-			fflush(stdout);
-		}
-	}
+	dec1_solve_init(&ds);
+	uint64_t nkeys = dec1_solve_pair(&ds, enc, dec);
+	dec1_solve_iterate(&ds, 0, UINT32_MAX, print_key, NULL);
+	printf("%llu keys found.\n", (unsigned long long) nkeys);
 	return 0;
 }
 
@@ -3,7 +3,6 @@
  * GPLv3
  * This version allows to converge on a precise key that works for a given set of u32 vals. (nisguess only gives all possible keys)
  * Note : because of the algo, there can be many (or no) key possibilities for any given 4-byte-in, 4-byte-out combination.
- * Should be compiled with -O3
  * usage : %0 <enc_file> <dec_file>
  * where enc_file contains encrypted data, and dec_file is the expected decrypted data; they have to be the same size of course,
  * and multiples of 4 bytes.
@@ -17,130 +16,591 @@
  * (hint : look for "DATABASE" , "LOADER", "SH7...." strings that may be mangled
  * 5- add values to enc and dec files
  * 6- to confirm the correct key, validate the checksum.
+ * For a whole encrypted ROM, niskeyrec does all of this automatically.
+ *
+ * Weak pair sets can leave billions of candidates to verify. The keyspace can then be split in shards
+ * (-s <i>/<n>), each run anywhere with its own checkpoint file (-c <file>) : chunks of keys
+ * are recorded as they complete, with the keys found in them, and a restarted run skips them.
+ * "-m" merges the checkpoint files of all shards, and reports the keys and any range not covered yet.
  */
 
+#include <getopt.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
 #include "nislib.h"
 
 #define u32 uint32_t
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
 // ret true if key works
 static inline bool testkey_single(u32 enc, u32 dec, u32 key) {
 	return (dec1(enc, key) == dec);
 }
 
-//decode *efh with key, return true if it matches *dfh.
-//Simple version, runs only until fist EOF is reached. But files should really be the same length
-//Does no rewinding on file handles
-bool testkey_file(FILE *efh, FILE *dfh, u32 key) {
-	while (!feof(efh) && !feof(dfh)) {
-		uint8_t fbuf[4];
-		u32 enc, dec;
+/* known pairs, packed for fast candidate verification */
+struct keypair {
+	u32 enc;
+	u32 dec;
+};
+
+/** test key on all pairs
+ * @return true if the key decodes every pair correctly
+ *
+ * pairs should be sorted with the most discriminating first, so bad keys fail early
+ */
+static bool testkey_pairs(const struct keypair *pairs, unsigned npairs, u32 key) {
+	unsigned idx;
+	for (idx = 0; idx < npairs; idx++) {
+		if (!testkey_single(pairs[idx].enc, pairs[idx].dec, key)) return 0;
+	}
+	return 1;
+}
+
+/** load enc + dec files as u32 pairs
+ * Only complete pairs are kept, up to the shortest file. Files should really be the same length
+ * @return number of pairs, 0 if error; caller must free *pairs
+ */
+static unsigned load_pairs(const char *efname, const char *dfname, struct keypair **pairs) {
+	struct rom_image eimg, dimg;
+	unsigned npairs, idx;
+
+	*pairs = NULL;
+	if (romimg_open(&eimg, efname, 0)) {
+		return 0;
+	}
+	if (romimg_open(&dimg, dfname, 0)) {
+		romimg_close(&eimg);
+		return 0;
+	}
+	if (eimg.siz != dimg.siz) {
+		printf("warning : files have different lengths\n");
+	}
+
+	npairs = MIN(eimg.siz, dimg.siz) / 4;
+	if (npairs) {
+		*pairs = malloc(npairs * sizeof(**pairs));
+	}
+	if (!*pairs) {
+		npairs = 0;
+		goto exit;
+	}
+	for (idx = 0; idx < npairs; idx++) {
+		(*pairs)[idx].enc = reconst_32(&eimg.buf[idx * 4]);
+		(*pairs)[idx].dec = reconst_32(&dimg.buf[idx * 4]);
+	}
+
+exit:
+	romimg_close(&dimg);
+	romimg_close(&eimg);
+	return npairs;
+}
+
+#define RANK_PAIRS	32	//rank only the first pairs, at 2 * 65536 evals each
+#define VERIFY_CANDS	4096	//stop solving once this few candidates are left
+
+struct ranked_pair {
+	struct keypair kp;
+	uint64_t ncands;	//keys that decode this pair alone
+};
+
+static int cmp_ranked(const void *a, const void *b) {
+	const struct ranked_pair *ra = a, *rb = b;
+	if (ra->ncands != rb->ncands) return (ra->ncands < rb->ncands) ? -1 : 1;
+	return 0;
+}
+
+/** put the most discriminating pairs first : fewest candidate keys on their own.
+ * Identical pairs end up adjacent, which costs nothing.
+ */
+static void rank_pairs(struct keypair *pairs, unsigned npairs) {
+	struct ranked_pair rp[RANK_PAIRS];
+	struct dec1_solver ds;
+	unsigned nrank = MIN(npairs, RANK_PAIRS);
+	unsigned idx;
+
+	for (idx = 0; idx < nrank; idx++) {
+		dec1_solve_init(&ds);
+		rp[idx].kp = pairs[idx];
+		rp[idx].ncands = dec1_solve_pair(&ds, pairs[idx].enc, pairs[idx].dec);
+	}
+	qsort(rp, nrank, sizeof(rp[0]), cmp_ranked);
+	for (idx = 0; idx < nrank; idx++) {
+		pairs[idx] = rp[idx].kp;
+	}
+}
+
+/** FNV-1a of the pairs, as loaded : checkpoints from another pair set are refused */
+static u32 pairs_hash(const struct keypair *pairs, unsigned npairs) {
+	u32 h = 0x811C9DC5;
+	unsigned idx;
+
+	for (idx = 0; idx < npairs; idx++) {
+		u32 w[2] = {pairs[idx].enc, pairs[idx].dec};
+		unsigned b;
+		for (b = 0; b < 8; b++) {
+			h ^= (w[b / 4] >> (24 - 8 * (b % 4))) & 0xFF;
+			h *= 0x01000193;
+		}
+	}
+	return h;
+}
+
+
+/************* checkpoints
+ * text file, appended to as chunks complete :
+ *	pairs <npairs> <hash>
+ *	range <kmin> <kmax>	(shard)
+ *	key <k>	(for each key found in the next chunk)
+ *	done <start> <end>
+ * keys are only trusted once their chunk is done, and an incomplete last line is ignored,
+ * so a run can be killed at any time.
+ */
+
+#define CKPT_CHUNK	(1UL << 24)	//keys per checkpointed chunk
+#define CKPT_LINELEN	80
+
+struct krange {
+	u32 start;
+	u32 end;	//inclusive
+};
+
+struct ckpt {
+	FILE *f;	//open for appending while searching
+	bool have_hdr;
+	unsigned npairs;
+	u32 hash;
+	u32 kmin, kmax;
+
+	struct krange *done;
+	unsigned ndone;
+	unsigned done_alloc;
+
+	u32 *keys;	//keys in done chunks
+	unsigned nkeys;
+	unsigned keys_alloc;
+};
+
+static bool add_range(struct ckpt *ck, u32 start, u32 end) {
+	if (ck->ndone == ck->done_alloc) {
+		unsigned na = ck->done_alloc ? (2 * ck->done_alloc) : 64;
+		struct krange *nd = realloc(ck->done, na * sizeof(*nd));
+		if (!nd) return 0;
+		ck->done = nd;
+		ck->done_alloc = na;
+	}
+	ck->done[ck->ndone].start = start;
+	ck->done[ck->ndone].end = end;
+	ck->ndone++;
+	return 1;
+}
+
+static bool add_key(struct ckpt *ck, u32 key) {
+	if (ck->nkeys == ck->keys_alloc) {
+		unsigned na = ck->keys_alloc ? (2 * ck->keys_alloc) : 64;
+		u32 *nk = realloc(ck->keys, na * sizeof(*nk));
+		if (!nk) return 0;
+		ck->keys = nk;
+		ck->keys_alloc = na;
+	}
+	ck->keys[ck->nkeys++] = key;
+	return 1;
+}
+
+static void ckpt_free(struct ckpt *ck) {
+	if (ck->f) fclose(ck->f);
+	free(ck->done);
+	free(ck->keys);
+	memset(ck, 0, sizeof(*ck));
+}
+
+static bool in_ranges(const struct ckpt *ck, u32 key) {
+	unsigned idx;
+	for (idx = 0; idx < ck->ndone; idx++) {
+		if ((key >= ck->done[idx].start) && (key <= ck->done[idx].end)) return 1;
+	}
+	return 0;
+}
+
+/** read a checkpoint file.
+ * @param must_exist : else a missing file is just an empty checkpoint
+ * @return 0 if ok; caller must ckpt_free() in any case
+ */
+static int ckpt_load(struct ckpt *ck, const char *fname, bool must_exist) {
+	char line[CKPT_LINELEN];
+	u32 *pending = NULL;	//keys of a chunk not done yet
+	unsigned npending = 0, pending_alloc = 0;
+	unsigned lineno = 0;
+	int rv = -1;
+
+	memset(ck, 0, sizeof(*ck));
+	FILE *f = fopen(fname, "r");
+	if (!f) {
+		if (must_exist) {
+			printf("can't open %s\n", fname);
+			return -1;
+		}
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long a, b;
+		unsigned n;
+
+		lineno++;
+		if (!strchr(line, '\n')) {
+			//interrupted while writing; nothing can follow
+			if (!feof(f)) printf("%s:%u : line too long\n", fname, lineno);
+			break;
+		}
+		if (sscanf(line, "pairs %u %lx", &n, &a) == 2) {
+			ck->have_hdr = 1;
+			ck->npairs = n;
+			ck->hash = (u32) a;
+		} else if (sscanf(line, "range %lx %lx", &a, &b) == 2) {
+			ck->kmin = (u32) a;
+			ck->kmax = (u32) b;
+		} else if (sscanf(line, "key %lx", &a) == 1) {
+			if (npending == pending_alloc) {
+				unsigned na = pending_alloc ? (2 * pending_alloc) : 64;
+				u32 *np = realloc(pending, na * sizeof(*np));
+				if (!np) goto nomem;
+				pending = np;
+				pending_alloc = na;
+			}
+			pending[npending++] = (u32) a;
+		} else if (sscanf(line, "done %lx %lx", &a, &b) == 2) {
+			unsigned idx;
+			if (!add_range(ck, (u32) a, (u32) b)) goto nomem;
+			for (idx = 0; idx < npending; idx++) {
+				if (!add_key(ck, pending[idx])) goto nomem;
+			}
+			npending = 0;
+		} else {
+			printf("%s:%u : bad line, ignored\n", fname, lineno);
+		}
+	}
+	if (!ck->have_hdr) {
+		printf("%s : not a checkpoint file\n", fname);
+		goto exit;
+	}
+	rv = 0;
+	goto exit;
+
+nomem:
+	printf("malloc choke\n");
+exit:
+	free(pending);
+	fclose(f);
+	return rv;
+}
+
+/** open checkpoint for a search over [kmin, kmax] of this pair set : resume it, or start a new one.
+ * @return 0 if ok; caller must ckpt_free()
+ */
+static int ckpt_open(struct ckpt *ck, const char *fname, unsigned npairs, u32 hash, u32 kmin, u32 kmax) {
+	if (ckpt_load(ck, fname, 0)) return -1;
 
-		if (fread(fbuf, 1, 4, efh) != 4) return 1;
-		enc = reconst_32(fbuf);
+	if (ck->have_hdr) {
+		if ((ck->npairs != npairs) || (ck->hash != hash)) {
+			printf("%s : checkpoint is for another pair set\n", fname);
+			return -1;
+		}
+		if ((ck->kmin != kmin) || (ck->kmax != kmax)) {
+			printf("%s : checkpoint is for range %#lx-%#lx\n", fname,
+					(unsigned long) ck->kmin, (unsigned long) ck->kmax);
+			return -1;
+		}
+		printf("resuming %s : %u chunks done, %u keys\n", fname, ck->ndone, ck->nkeys);
+	}
+
+	ck->f = fopen(fname, "a");
+	if (!ck->f) {
+		printf("can't open %s\n", fname);
+		return -1;
+	}
+	if (!ck->have_hdr) {
+		ck->have_hdr = 1;
+		ck->npairs = npairs;
+		ck->hash = hash;
+		ck->kmin = kmin;
+		ck->kmax = kmax;
+		fprintf(ck->f, "pairs %u %08lX\nrange %08lX %08lX\n", npairs, (unsigned long) hash,
+				(unsigned long) kmin, (unsigned long) kmax);
+		fflush(ck->f);
+	}
+	return 0;
+}
 
-		if (fread(fbuf, 1, 4, dfh) != 4) return 1;
-		dec = reconst_32(fbuf);
 
-		if (!testkey_single(enc, dec, key)) return 0;
+struct keytest_ctx {
+	const struct keypair *pairs;	//only pairs not already used by the solver
+	unsigned npairs;
+	unsigned found;
+	struct ckpt *ck;	//optional : keys found are logged there
+	bool nomem;
+};
 
+//candidate from the solver : verify it on the remaining pairs
+static bool test_candidate(u32 key, void *data) {
+	struct keytest_ctx *ktc = data;
+
+	if (testkey_pairs(ktc->pairs, ktc->npairs, key)) {
+		printf("\t Possible key: %#x\n", key);
+		ktc->found += 1;
+		if (ktc->ck && !add_key(ktc->ck, key)) {
+			ktc->nomem = 1;
+			return 0;
+		}
 	}
 	return 1;
 }
 
-//bruteforce keys starting at *key; return true if *key is valid for the given pair.
-//When it returns false, *key==(u32) -1 and there's nothing else to try.
-bool brute_key(u32 enc, u32 dec, u32 *key) {
-	if (!key) return 0;
+/** find keys in [kmin, kmax] for encrypted pairs that produce the decrypted pairs.
+ * just prints the key(s).
+ *
+ * @param ck : optional checkpoint, from ckpt_open() : chunks already done are skipped.
+ * @return 0 if the whole range was searched
+ */
+int find_key(struct keypair *pairs, unsigned npairs, u32 kmin, u32 kmax, struct ckpt *ck) {
+	struct dec1_solver ds;
+	struct keytest_ctx ktc;
+	uint64_t ncands = 0;
+	unsigned used, idx;
+	u32 cstart;
+
+	if (!pairs || !npairs) return -1;
+
+	rank_pairs(pairs, npairs);
 
-	do {
-		(*key)++;
-		if (testkey_single(enc,dec,*key)) return 1;
-		if (!(*key & 0x3ffffff)) {
-			float status = 100.0 * *key / ((uint32_t) -1);
-			printf("Search %3.f%% complete.\r", status);
-			fflush(stdout);
+	//solving the best pairs will generate a small set of possible keys,
+	//which are tested on the rest of the pairs.
+	dec1_solve_init(&ds);
+	for (used = 0; used < npairs; ) {
+		ncands = dec1_solve_pair(&ds, pairs[used].enc, pairs[used].dec);
+		used++;
+		if (ncands <= VERIFY_CANDS) break;
+	}
+	printf("%llu candidates from %u pairs\n", (unsigned long long) ncands, used);
+
+	ktc.pairs = &pairs[used];
+	ktc.npairs = npairs - used;
+	ktc.found = 0;
+	ktc.ck = ck;
+	ktc.nomem = 0;
+
+	if (ck) {
+		for (idx = 0; idx < ck->nkeys; idx++) {
+			printf("\t Possible key: %#x\n", ck->keys[idx]);
 		}
-	} while (*key != (u32) -1);
+		ktc.found = ck->nkeys;
+	}
 
+	uint64_t nchunks = (((uint64_t) kmax - kmin) / CKPT_CHUNK) + 1;
+	uint64_t chunk;
+	for (chunk = 0, cstart = kmin; chunk < nchunks; chunk++, cstart += CKPT_CHUNK) {
+		u32 cend = (chunk == (nchunks - 1)) ? kmax : (cstart + CKPT_CHUNK - 1);
+
+		if (ck && in_ranges(ck, cstart) && in_ranges(ck, cend)) continue;
+
+		unsigned keys_before = ck ? ck->nkeys : 0;
+		dec1_solve_iterate(&ds, cstart, cend, test_candidate, &ktc);
+		if (ktc.nomem) {
+			printf("malloc choke\n");
+			return -1;
+		}
+		if (ck) {
+			for (idx = keys_before; idx < ck->nkeys; idx++) {
+				fprintf(ck->f, "key %08lX\n", (unsigned long) ck->keys[idx]);
+			}
+			fprintf(ck->f, "done %08lX %08lX\n", (unsigned long) cstart, (unsigned long) cend);
+			if (fflush(ck->f) || !add_range(ck, cstart, cend)) {
+				printf("checkpoint write failed\n");
+				return -1;
+			}
+		}
+		if ((nchunks > 1) && (ncands > VERIFY_CANDS)) {
+			fprintf(stderr, "chunk %llu / %llu done, %u keys so far\n",
+					(unsigned long long) chunk + 1, (unsigned long long) nchunks, ktc.found);
+		}
+	}
+	printf("%u keys valid for all %u pairs\n", ktc.found, npairs);
 	return 0;
 }
 
-//brute force encrypted file *efh to find key that produces *dfh.
-//just prints the key(s).
-void find_key(FILE *efh, FILE *dfh) {
-	uint8_t fbuf[4];
-	u32 enc, dec, key;
 
-	if (!efh || !dfh) return;
+/************* merge */
 
-	rewind(efh);
-	rewind(dfh);
+static int cmp_range(const void *a, const void *b) {
+	const struct krange *ra = a, *rb = b;
+	if (ra->start != rb->start) return (ra->start < rb->start) ? -1 : 1;
+	return 0;
+}
 
-	//work on first u32 pair:
-	if (fread(fbuf, 1, 4, efh) != 4) return;
-	enc = reconst_32(fbuf);
+static int cmp_key(const void *a, const void *b) {
+	u32 ka = *(const u32 *) a, kb = *(const u32 *) b;
+	if (ka != kb) return (ka < kb) ? -1 : 1;
+	return 0;
+}
 
-	if (fread(fbuf, 1, 4, dfh) != 4) return;
-	dec = reconst_32(fbuf);
+/** merge checkpoints of several shards : print every key found, and the ranges still missing.
+ * @return 0 if the whole keyspace is covered, 1 if not, -1 on error
+ */
+static int merge_ckpts(char **fnames, unsigned nfiles) {
+	struct ckpt all = {0};
+	unsigned fi, idx, nuniq = 0, ngaps = 0;
+	uint64_t covered = 0;
+	uint64_t next = 0;	//lowest key not covered yet by the sorted ranges
+	int rv = -1;
 
-	//calling brute_key() on the first pair of the file will generate a set of possible keys,
-	//which are tested on the rest of the file.
-	key = 0;
-	while (brute_key(enc, dec, &key)) {
-		//printf("\t testing key=%#x: ", key);
-		//reset to second u32 pair
-		if (fseek(efh, 4, SEEK_SET) || fseek(dfh, 4, SEEK_SET)) {
-			printf("fseek issues, seek counselling\n");
-			return;
+	for (fi = 0; fi < nfiles; fi++) {
+		struct ckpt ck;
+		if (ckpt_load(&ck, fnames[fi], 1)) {
+			ckpt_free(&ck);
+			goto exit;
 		}
-		if (testkey_file(efh, dfh, key)) {
-			printf("\t Possible key: %#x\n", key);
-		} else {
-			//printf("nope\n");
+		if (!fi) {
+			all.npairs = ck.npairs;
+			all.hash = ck.hash;
+		} else if ((ck.npairs != all.npairs) || (ck.hash != all.hash)) {
+			printf("%s : checkpoint is for another pair set than %s\n", fnames[fi], fnames[0]);
+			ckpt_free(&ck);
+			goto exit;
+		}
+		bool ok = 1;
+		for (idx = 0; ok && (idx < ck.ndone); idx++) {
+			ok = add_range(&all, ck.done[idx].start, ck.done[idx].end);
+		}
+		for (idx = 0; ok && (idx < ck.nkeys); idx++) {
+			ok = add_key(&all, ck.keys[idx]);
+		}
+		ckpt_free(&ck);
+		if (!ok) {
+			printf("malloc choke\n");
+			goto exit;
+		}
+	}
+
+	qsort(all.done, all.ndone, sizeof(*all.done), cmp_range);
+	for (idx = 0; idx < all.ndone; idx++) {
+		uint64_t start = all.done[idx].start, end = all.done[idx].end;
+		if (start > next) {
+			printf("missing : %08lX - %08lX\n", (unsigned long) next, (unsigned long) (start - 1));
+			ngaps++;
+		}
+		if ((end + 1) > next) {
+			covered += (end + 1) - MAX(start, next);
+			next = end + 1;
 		}
 	}
-	return;
+	if (next <= UINT32_MAX) {
+		printf("missing : %08lX - %08lX\n", (unsigned long) next, (unsigned long) UINT32_MAX);
+		ngaps++;
+	}
+
+	qsort(all.keys, all.nkeys, sizeof(*all.keys), cmp_key);
+	for (idx = 0; idx < all.nkeys; idx++) {
+		if (nuniq && (all.keys[nuniq - 1] == all.keys[idx])) continue;
+		all.keys[nuniq++] = all.keys[idx];
+		printf("\t Possible key: %#x\n", all.keys[idx]);
+	}
+	printf("%u checkpoints, %llu / %llu keys searched%s\n", nfiles, (unsigned long long) covered,
+			(unsigned long long) UINT32_MAX + 1, ngaps ? " (incomplete)" : "");
+	printf("%u keys valid for all %u pairs\n", nuniq, all.npairs);
+	rv = ngaps ? 1 : 0;
+
+exit:
+	ckpt_free(&all);
+	return rv;
+}
+
+
+static void usage(const char *progname) {
+	printf("%s [-s <i>/<n>] [-c <ckpt_file>] <enc_file> <dec_file>\n"
+		"\t-s <i>/<n>: only search shard i (0 to n - 1) of n equal keyspace ranges\n"
+		"\t-c <file>: checkpoint file, to resume an interrupted search\n"
+		"%s -m <ckpt_file> [<ckpt_file>...]\n"
+		"\tmerge the checkpoints of all shards\n", progname, progname);
 }
 
 
 int main(int argc, char * argv[]) {
-	FILE *efh, *dfh;
+	struct keypair *pairs;
+	struct ckpt ck = {0};
+	const char *ckname = NULL;
+	unsigned npairs;
+	unsigned long shard = 0, nshards = 1;
+	bool merge = 0;
+	int c, rv;
 	dbg_stream = stdout;
 
 	printf(	"**** %s\n"
 		"**** Attemp to guess Nissan key based on decrypted + encrypted data\n"
 		"**** (c) 2015-2017 fenugrec\n", argv[0]);
 
-	if (argc < 3) {
-		printf("%s <enc_file> <dec_file>\n", argv[0]);
+	while ((c = getopt(argc, argv, "c:hms:")) != -1) {
+		switch (c) {
+		case 'c':
+			ckname = optarg;
+			break;
+		case 'm':
+			merge = 1;
+			break;
+		case 's':
+			if ((sscanf(optarg, "%lu/%lu", &shard, &nshards) != 2) ||
+					!nshards || (shard >= nshards) || (nshards > UINT32_MAX)) {
+				printf("bad shard \"%s\"\n", optarg);
+				return -1;
+			}
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+
+	if (merge) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			return 0;
+		}
+		return merge_ckpts(&argv[optind], (unsigned) (argc - optind));
+	}
+
+	if ((argc - optind) < 2) {
+		usage(argv[0]);
 		return 0;
 	}
 
-	// arg 1 : enc'd file
-	if ((efh=fopen(argv[1],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[1]);
+	// enc'd and dec'd files
+	npairs = load_pairs(argv[optind], argv[optind + 1], &pairs);
+	if (!npairs) {
+		printf("no u32 pairs to work with.\n");
 		return -1;
 	}
 
-	// arg 2 : dec'd file
-	if ((dfh=fopen(argv[2],"rb"))==NULL) {
-		printf("error opening %s.\n", argv[2]);
-		fclose(efh);
-		return -1;
+	const uint64_t kspace = (uint64_t) UINT32_MAX + 1;
+	u32 kmin = (u32) (kspace * shard / nshards);
+	u32 kmax = (u32) ((kspace * (shard + 1) / nshards) - 1);
+	if (nshards > 1) {
+		printf("shard %lu / %lu : keys %08lX - %08lX\n", shard, nshards,
+				(unsigned long) kmin, (unsigned long) kmax);
 	}
 
-	find_key(efh, dfh);
+	if (ckname && ckpt_open(&ck, ckname, npairs, pairs_hash(pairs, npairs), kmin, kmax)) {
+		rv = -1;
+		goto exit;
+	}
 
-	fclose(efh);
-	fclose(dfh);
-	return 0;
-}
+	rv = find_key(pairs, npairs, kmin, kmax, ckname ? &ck : NULL);
 
+exit:
+	ckpt_free(&ck);
+	free(pairs);
+	return rv;
+}
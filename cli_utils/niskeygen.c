@@ -0,0 +1,454 @@
+/* niskeygen : SID27 / SID36 key server. Computes keys for a stream of requests, in batches.
+ * Replaces running nis_algo1 once per key.
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * Line protocol, one response line per request line, in order :
+ *	27 <ECUID | key> <seed>	=> enc1(seed, s27k) : SID27 key
+ *	36 <ECUID | key> <value>	=> dec1(value, s36k1) : SID36 "inverse operation" (see nis_algo1)
+ * The key is 8 hex digits; an ECUID (5 chars) is resolved through the romdb.
+ * Responses are 8 hex digits, or "ERR <reason>". Empty lines are ignored.
+ *
+ * Everything already received is parsed before answering, so a client that pipelines many
+ * requests gets them computed together with enc1_batch() / dec1_batch().
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "nislib.h"
+#include "nislib_keycache.h"
+#include "nis_romdb.h"
+#include "nis_romdb_live.h"
+#include "stypes.h"
+
+#include "uthash/utstring.h"
+
+__thread FILE *dbg_stream;
+
+#define KEYSET_CSV "../romdb/keysets.csv"	//default keyset db file, relative to this executable
+
+#define KG_INBUF	(64 * 1024)
+#define KG_BATCH	4096	//requests computed together
+#define KG_RESPLEN	32	//max length of one response line
+
+enum kg_op {
+	KG_SID27,
+	KG_SID36,
+	KG_ERR,	//err is set
+};
+
+struct kg_batch {
+	unsigned n;
+	u32 val[KG_BATCH];
+	u32 scode[KG_BATCH];
+	u8 op[KG_BATCH];
+	const char *err[KG_BATCH];
+
+	//per op, for the batch calls
+	u32 bval[KG_BATCH];
+	u32 bscode[KG_BATCH];
+	unsigned bidx[KG_BATCH];
+	char out[KG_BATCH * KG_RESPLEN];
+};
+
+/* one client : stdin / stdout, or a socket */
+struct kg_conn {
+	int ifd;
+	int ofd;
+	struct romdb_live *live;
+	struct romdb_reader *rd;
+	struct keycache kc;
+	struct kg_batch b;
+	char inbuf[KG_INBUF];
+};
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+			"**** SID27 / SID36 key server\n"
+			"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s [OPTIONS] [<27|36> <ECUID|key> <seed>]\n"
+			"\tWith a request on the command line, answer it and exit; else serve requests from stdin,\n"
+			"\tone per line, e.g. \"27 8U92A 55AA00FF\" or \"27 9851EB85 55AA00FF\".\n"
+			"OPTIONS:\n"
+			"\t-D <file>: compiled romdb (see nisromdb)\n"
+			"\t-e <file>: ECUID csv\n"
+			"\t-k <file>: keyset csv, default " KEYSET_CSV "\n"
+			"\t-l <port>: serve TCP connections on 127.0.0.1:<port> instead of stdin\n"
+			"\t-w <ms>: reload the db files when they change, checking every <ms>\n"
+			"\t-h: show this help\n", progname);
+}
+
+static bool parse_hex32(const char *s, u32 *val) {
+	char *endp;
+	unsigned long v;
+
+	if (!isxdigit((unsigned char) *s) && strncmp(s, "0x", 2) && strncmp(s, "0X", 2)) return 0;
+	errno = 0;
+	v = strtoul(s, &endp, 16);
+	if (*endp || errno || (v > UINT32_MAX)) return 0;
+	*val = (u32) v;
+	return 1;
+}
+
+/** parse one request and resolve its key; must be called between romdb_live_enter / exit */
+static void add_request(struct kg_conn *c, nis_romdb *db, unsigned long version, char *line) {
+	struct kg_batch *b = &c->b;
+	unsigned idx = b->n++;
+	char *tok[3];
+	char *save = NULL;
+	unsigned nt;
+
+	b->op[idx] = KG_ERR;
+	for (nt = 0; nt < ARRAY_SIZE(tok); nt++) {
+		tok[nt] = strtok_r(nt ? NULL : line, " \t\r", &save);
+		if (!tok[nt]) break;
+	}
+	if ((nt < 3) || strtok_r(NULL, " \t\r", &save)) {
+		b->err[idx] = "expected 3 fields";
+		return;
+	}
+
+	enum kg_op op;
+	if (!strcmp(tok[0], "27")) {
+		op = KG_SID27;
+	} else if (!strcmp(tok[0], "36")) {
+		op = KG_SID36;
+	} else {
+		b->err[idx] = "unknown request";
+		return;
+	}
+	if (!parse_hex32(tok[2], &b->val[idx])) {
+		b->err[idx] = "bad seed";
+		return;
+	}
+
+	if (strlen(tok[1]) == ECUID_LEN) {
+		struct keyset_t ks;
+		if (!keycache_get(&c->kc, db, version, tok[1], &ks)) {
+			b->err[idx] = "unknown ECUID";
+			return;
+		}
+		b->scode[idx] = (op == KG_SID27) ? ks.s27k : ks.s36k1;
+		if (!b->scode[idx]) {
+			b->err[idx] = (op == KG_SID27) ? "no s27k for ECUID" : "no s36k1 for ECUID";
+			return;
+		}
+	} else if (!parse_hex32(tok[1], &b->scode[idx])) {
+		b->err[idx] = "bad ECUID or key";
+		return;
+	}
+	b->op[idx] = op;
+}
+
+static void add_error(struct kg_batch *b, const char *err) {
+	b->op[b->n] = KG_ERR;
+	b->err[b->n] = err;
+	b->n++;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t rv = write(fd, buf, len);
+		if (rv < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+/** compute the batch, one enc1_batch / dec1_batch per op, and send the responses
+ * @return 0 if ok
+ */
+static int flush_batch(struct kg_conn *c) {
+	struct kg_batch *b = &c->b;
+	static const enum kg_op ops[] = {KG_SID27, KG_SID36};
+	unsigned oi, idx;
+	size_t olen = 0;
+
+	if (!b->n) return 0;
+	for (oi = 0; oi < ARRAY_SIZE(ops); oi++) {
+		unsigned m = 0;
+		for (idx = 0; idx < b->n; idx++) {
+			if (b->op[idx] != ops[oi]) continue;
+			b->bval[m] = b->val[idx];
+			b->bscode[m] = b->scode[idx];
+			b->bidx[m] = idx;
+			m++;
+		}
+		if (!m) continue;
+		if (ops[oi] == KG_SID27) {
+			enc1_batch(b->bval, b->bscode, b->bval, m);
+		} else {
+			dec1_batch(b->bval, b->bscode, b->bval, m);
+		}
+		for (idx = 0; idx < m; idx++) {
+			b->val[b->bidx[idx]] = b->bval[idx];
+		}
+	}
+
+	for (idx = 0; idx < b->n; idx++) {
+		if (b->op[idx] == KG_ERR) {
+			olen += snprintf(&b->out[olen], KG_RESPLEN, "ERR %.*s\n", KG_RESPLEN - 6, b->err[idx]);
+		} else {
+			olen += snprintf(&b->out[olen], KG_RESPLEN, "%08lX\n", (unsigned long) b->val[idx]);
+		}
+	}
+	b->n = 0;
+	return write_all(c->ofd, b->out, olen);
+}
+
+/** parse complete lines in p[0, avail[ until the batch is full; on eof, a last unterminated line too.
+ * @return bytes consumed
+ */
+static size_t parse_lines(struct kg_conn *c, char *p, size_t avail, bool eof, bool *skipping) {
+	unsigned long version = romdb_live_version(c->live);	//before enter : a reload in between only flushes the cache
+	nis_romdb *db = romdb_live_enter(c->rd);
+	size_t used = 0;
+
+	while ((used < avail) && (c->b.n < KG_BATCH)) {
+		char *line = &p[used];
+		char *nl = memchr(line, '\n', avail - used);
+		if (!nl) {
+			if (!eof) break;
+			nl = &p[avail];	//inbuf always has a spare byte
+		}
+		*nl = 0;
+		used = (nl - p) + 1;
+		if (*skipping) {
+			//remainder of a line too long
+			*skipping = 0;
+			continue;
+		}
+		if (!line[strspn(line, " \t\r")]) continue;
+		if (!db) {
+			add_error(&c->b, "no db loaded");
+			continue;
+		}
+		add_request(c, db, version, line);
+	}
+	romdb_live_exit(c->rd);
+	return MIN(used, avail);
+}
+
+/** answer requests until EOF
+ * @return 0 if ok
+ */
+static int serve(struct kg_conn *c) {
+	size_t len = 0;
+	bool eof = 0, skipping = 0;
+
+	while (!eof) {
+		ssize_t rv = read(c->ifd, &c->inbuf[len], KG_INBUF - 1 - len);
+		if (rv < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		eof = !rv;
+		len += rv;
+
+		size_t start = 0;
+		while (1) {
+			size_t used = parse_lines(c, &c->inbuf[start], len - start, eof, &skipping);
+			start += used;
+			if (flush_batch(c)) return -1;
+			if (!used || (start == len)) break;
+		}
+		len -= start;
+		if (len == (KG_INBUF - 1)) {
+			add_error(&c->b, "line too long");
+			if (flush_batch(c)) return -1;
+			skipping = 1;
+			len = 0;
+		}
+		memmove(c->inbuf, &c->inbuf[start], len);
+	}
+	return 0;
+}
+
+static struct kg_conn *conn_new(struct romdb_live *live, int ifd, int ofd) {
+	struct kg_conn *c = malloc(sizeof(*c));
+	if (!c) return NULL;
+	c->rd = romdb_live_reader(live);
+	if (!c->rd) {
+		free(c);
+		return NULL;
+	}
+	c->ifd = ifd;
+	c->ofd = ofd;
+	c->live = live;
+	c->b.n = 0;
+	keycache_init(&c->kc, romdb_live_version(live));
+	return c;
+}
+
+static void conn_free(struct kg_conn *c) {
+	romdb_reader_free(c->rd);
+	free(c);
+}
+
+static void *conn_thread(void *arg) {
+	struct kg_conn *c = arg;
+	(void) serve(c);
+	close(c->ifd);
+	conn_free(c);
+	return NULL;
+}
+
+/** accept connections forever, one thread each */
+static int serve_tcp(struct romdb_live *live, unsigned port) {
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int one = 1;
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (lfd < 0) {
+		perror("socket");
+		return -1;
+	}
+	(void) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) || listen(lfd, 16)) {
+		perror("bind / listen");
+		close(lfd);
+		return -1;
+	}
+	ERR_PRINTF("listening on 127.0.0.1:%u\n", port);
+
+	while (1) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			perror("accept");
+			break;
+		}
+		struct kg_conn *c = conn_new(live, fd, fd);
+		pthread_t th;
+		if (!c) {
+			static const char busy[] = "ERR busy\n";
+			(void) write_all(fd, busy, sizeof(busy) - 1);
+			close(fd);
+			continue;
+		}
+		if (pthread_create(&th, NULL, conn_thread, c)) {
+			close(fd);
+			conn_free(c);
+			continue;
+		}
+		pthread_detach(th);
+	}
+	close(lfd);
+	return -1;
+}
+
+int main(int argc, char *argv[]) {
+	struct romdb_live *live;
+	const char *ks_fname = NULL;
+	unsigned long port = 0, watch_ms = 0;
+	UT_string csvpath;
+	int c, rv = -1;
+
+	if (!trace_config(getenv(TRACE_ENV))) return -1;
+	dbg_stream = stderr;
+
+	live = romdb_live_new();
+	if (!live) {
+		ERR_PRINTF("trouble in romdb_live_new\n");
+		return -1;
+	}
+	utstring_init(&csvpath);
+
+	while ((c = getopt(argc, argv, "D:e:hk:l:w:")) != -1) {
+		bool ok = 1;
+		switch (c) {
+		case 'D':
+			ok = romdb_live_addsrc(live, ROMDB_SRC_COMPILED, optarg);
+			break;
+		case 'e':
+			ok = romdb_live_addsrc(live, ROMDB_SRC_ECUID, optarg);
+			break;
+		case 'k':
+			ks_fname = optarg;
+			break;
+		case 'l':
+			port = strtoul(optarg, NULL, 0);
+			if (!port || (port > 65535)) {
+				ERR_PRINTF("bad port %s\n", optarg);
+				goto exit;
+			}
+			break;
+		case 'w':
+			watch_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			rv = 0;
+			goto exit;
+		}
+		if (!ok) goto exit;
+	}
+	if ((optind != argc) && ((argc - optind) != 3)) {
+		usage(argv[0]);
+		goto exit;
+	}
+
+	if (!ks_fname) {
+		//keyset csv is relative to the executable, same as nisrom
+		const char *slash = strrchr(argv[0], '/');
+		if (slash) utstring_bincpy(&csvpath, argv[0], (size_t) (slash + 1 - argv[0]));
+		utstring_printf(&csvpath, "%s", KEYSET_CSV);
+		ks_fname = utstring_body(&csvpath);
+	}
+	if (!romdb_live_addsrc(live, ROMDB_SRC_KEYSET, ks_fname)) goto exit;
+	if (!romdb_live_reload(live)) {
+		ERR_PRINTF("could not load the db\n");
+		goto exit;
+	}
+	if (watch_ms && romdb_live_watch(live, (unsigned) watch_ms)) goto exit;
+	signal(SIGPIPE, SIG_IGN);	//clients may leave without reading every response
+
+	if (port) {
+		rv = serve_tcp(live, (unsigned) port);
+		goto exit;
+	}
+
+	struct kg_conn *conn = conn_new(live, STDIN_FILENO, STDOUT_FILENO);
+	if (!conn) goto exit;
+	if (optind == argc) {
+		rv = serve(conn);
+	} else {
+		//request from the command line
+		char line[KG_RESPLEN * 4];
+		snprintf(line, sizeof(line), "%s %s %s", argv[optind], argv[optind + 1], argv[optind + 2]);
+		unsigned long version = romdb_live_version(live);
+		nis_romdb *db = romdb_live_enter(conn->rd);
+		add_request(conn, db, version, line);
+		romdb_live_exit(conn->rd);
+		rv = flush_batch(conn);
+		if (!rv && (conn->b.op[0] == KG_ERR)) rv = -1;
+	}
+	conn_free(conn);
+
+exit:
+	utstring_done(&csvpath);
+	romdb_live_close(live);
+	return rv;
+}
@@ -0,0 +1,182 @@
+/* niskeyrec : find the algo 1 key of an encrypted ROM, without any guessed plaintext.
+ * Replaces the manual nisguess2 loop (guess enc / dec words, try a key, repeat).
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nislib.h"
+#include "nislib_keyrec.h"
+#include "nis_romdb.h"
+#include "stypes.h"
+
+#include "uthash/utstring.h"
+
+__thread FILE *dbg_stream;
+
+#define KEYSET_CSV "../romdb/keysets.csv"	//default keyset db file, relative to this executable
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+			"**** Recover the key of an encrypted ROM\n"
+			"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s [OPTIONS] <encrypted_rom.bin>\n"
+			"OPTIONS:\n"
+			"\t-D <file>: use compiled romdb (see nisromdb) instead of " KEYSET_CSV "\n"
+			"\t-n: no known keysets, only search\n"
+			"\t-k: only try known keysets, no search\n"
+			"\t-o <file>: write the decrypted ROM\n"
+			"\t-t <n>: search threads, default is one per CPU\n"
+			"\t-h: show this help\n", progname);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static nis_romdb *load_romdb(const char *progname, const char *db_fname) {
+	nis_romdb *romdb = romdb_new();
+	bool ok;
+
+	if (!romdb) {
+		ERR_PRINTF("trouble in romdb_new\n");
+		return NULL;
+	}
+	if (db_fname) {
+		ok = romdb_load_compiled(romdb, db_fname);
+	} else {
+		//keyset csv is relative to the executable, same as nisrom
+		const char *slash = strrchr(progname, '/');
+		UT_string csvpath;
+		utstring_init(&csvpath);
+		if (slash) utstring_bincpy(&csvpath, progname, (size_t) (slash + 1 - progname));
+		utstring_printf(&csvpath, "%s", KEYSET_CSV);
+		ok = romdb_keyset_addcsv(romdb, utstring_body(&csvpath));
+		db_fname = "keyset csv";
+		utstring_done(&csvpath);
+	}
+	if (!ok) {
+		ERR_PRINTF("trouble loading %s\n", db_fname);
+		romdb_close(romdb);
+		return NULL;
+	}
+	return romdb;
+}
+
+static const char *ktype_name(enum key_type kt) {
+	switch (kt) {
+	case KEY_S27: return "s27k";
+	case KEY_S36K1: return "s36k1";
+	case KEY_S36K2: return "s36k2";
+	default: return "?";
+	}
+}
+
+int main(int argc, char *argv[]) {
+	struct keyrec_opts opts = {0};
+	struct keyrec_result res;
+	struct rom_image img = {0};
+	const char *db_fname = NULL, *ofname = NULL;
+	bool use_db = 1;
+	int c, rv = -1;
+
+	while ((c = getopt(argc, argv, "D:hkno:t:")) != -1) {
+		switch (c) {
+		case 'D':
+			db_fname = optarg;
+			break;
+		case 'k':
+			opts.no_search = 1;
+			break;
+		case 'n':
+			use_db = 0;
+			break;
+		case 'o':
+			ofname = optarg;
+			break;
+		case 't':
+			opts.nthreads = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	if ((argc - optind) != 1) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (!trace_config(getenv(TRACE_ENV))) return -1;
+
+	dbg_stream = tmpfile();	//before calling nislib funcs
+	if (!dbg_stream) {
+		ERR_PRINTF("tmpfile() trouble\n");
+		return -1;
+	}
+
+	if (use_db) {
+		opts.romdb = load_romdb(argv[0], db_fname);
+		if (!opts.romdb) goto exit;
+	}
+	if (romimg_open(&img, argv[optind], 0)) goto exit;
+
+	uint64_t t0 = now_ns();
+	int found = keyrec_run(img.buf, img.siz, &opts, &res);
+	double secs = (now_ns() - t0) / 1e9;
+
+	printf("%s : %u keysets tried, %u keys with a plausible IVT, %u verified, %.2f s\n",
+		argv[optind], res.keysets_tried, res.ivt_cands, res.verified, secs);
+	if (found) {
+		printf("no key found\n");
+		goto exit;
+	}
+	printf("key %08lX", (unsigned long) res.key);
+	if (res.src == KR_KEYSET) {
+		printf(" : %s of keyset %08lX %08lX %08lX", ktype_name(res.ktype), (unsigned long) res.keyset->s27k,
+			(unsigned long) res.keyset->s36k1, (unsigned long) res.keyset->s36k2);
+	} else {
+		printf(" : found by search");
+	}
+	printf(", %s valid\n", res.confirm);
+
+	if (ofname) {
+		u32 alen = img.siz & ~3U;
+		u8 *dec = malloc(img.siz);
+		FILE *outf;
+
+		if (!dec) goto exit;
+		dec1_buf(img.buf, dec, alen, res.key);
+		memcpy(&dec[alen], &img.buf[alen], img.siz - alen);	//partial u32 : copied as-is
+		outf = fopen(ofname, "wb");
+		if (!outf) {
+			ERR_PRINTF("error opening %s.\n", ofname);
+			free(dec);
+			goto exit;
+		}
+		if ((fwrite(dec, 1, img.siz, outf) != img.siz) | fclose(outf)) {
+			ERR_PRINTF("trouble writing %s\n", ofname);
+			free(dec);
+			goto exit;
+		}
+		free(dec);
+		printf("wrote %s\n", ofname);
+	}
+	rv = 0;
+
+exit:
+	romimg_close(&img);
+	if (opts.romdb) romdb_close(opts.romdb);
+	trace_flush();
+	fclose(dbg_stream);
+	return rv;
+}
@@ -8,6 +8,14 @@
 #include <stdio.h>	//for printf(); probably can go away someday
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "nislib.h"
 #include "nislib_shtools.h"
@@ -73,8 +81,8 @@ static inline uint16_t mess2(const uint16_t a, const uint16_t b, const uint16_t
 
 }
 
-// "encode" u32 data with key 'scode'
-uint32_t enc1(uint32_t data, uint32_t scode) {
+/* enc1 / dec1 bodies, inlined in the buffer and batch loops so they can be vectorized */
+static inline uint32_t enc1_core(uint32_t data, uint32_t scode) {
 	//m: scrambling code (hardcoded in ECU firmware)
 	uint16_t mH,mL, sH, sL;
 	uint16_t kL, kH;	//temp words
@@ -89,11 +97,10 @@ uint32_t enc1(uint32_t data, uint32_t scode) {
 
 	kH = mess2(sL, kL, mL);
 
-	return (kH << 16) | kL;
+	return ((uint32_t) kH << 16) | kL;
 }
 
-//decrypt 4 bytes in <data> with firmware's key <scode>
-uint32_t dec1(uint32_t data, uint32_t scode) {
+static inline uint32_t dec1_core(uint32_t data, uint32_t scode) {
 	//based on sub 15F18, ugly rewrite
 	uint16_t scH, scL;
 	uint16_t dH, dL;
@@ -116,25 +123,592 @@ uint32_t dec1(uint32_t data, uint32_t scode) {
 	t0 = mess1(t0, t1, scH);
 	//printf("mess2 returns %0#x\n", t0);
 	//printf("local_0: %0#X\tlocal_1: %0#X\n", t0, t1);
-	return (t0 << 16) | t1;
+	return ((uint32_t) t0 << 16) | t1;
 }
 
+// "encode" u32 data with key 'scode'
+uint32_t enc1(uint32_t data, uint32_t scode) {
+	return enc1_core(data, scode);
+}
 
-//Painfully unoptimized, because it's easy to get it wrong
-const uint8_t *u8memstr(const uint8_t *buf, uint32_t buflen, const uint8_t *needle, unsigned nlen) {
-	uint32_t hcur;
-	assert(buf && needle && buflen && nlen && (nlen <= buflen));
+//decrypt 4 bytes in <data> with firmware's key <scode>
+uint32_t dec1(uint32_t data, uint32_t scode) {
+	return dec1_core(data, scode);
+}
+
+
+void enc1_buf(const uint8_t *src, uint8_t *dst, uint32_t len, uint32_t scode) {
+	assert(src && dst && !(len & 3));
+	uint32_t cur;
+	for (cur = 0; cur < len; cur += 4) {
+		write_32b(enc1_core(reconst_32(&src[cur]), scode), &dst[cur]);
+	}
+}
+
+void dec1_buf(const uint8_t *src, uint8_t *dst, uint32_t len, uint32_t scode) {
+	assert(src && dst && !(len & 3));
+	uint32_t cur;
+	for (cur = 0; cur < len; cur += 4) {
+		write_32b(dec1_core(reconst_32(&src[cur]), scode), &dst[cur]);
+	}
+}
+
+void enc1_batch(const uint32_t *data, const uint32_t *scodes, uint32_t *out, unsigned n) {
+	assert(data && scodes && out);
+	unsigned idx;
+	for (idx = 0; idx < n; idx++) {
+		out[idx] = enc1_core(data[idx], scodes[idx]);
+	}
+}
+
+void dec1_batch(const uint32_t *data, const uint32_t *scodes, uint32_t *out, unsigned n) {
+	assert(data && scodes && out);
+	unsigned idx;
+	for (idx = 0; idx < n; idx++) {
+		out[idx] = dec1_core(data[idx], scodes[idx]);
+	}
+}
+
+/********** dec1 key solver
+ *
+ * In dec1(), the low half of the output is mess2(dH, dL, scL) : it only depends on the low half of the key.
+ * The high half is then mess1(dL, <low output>, scH). So for a known (enc, dec) pair, the possible scL
+ * and scH values can be found independently, with 2 * 65536 evaluations instead of 2^32.
+ * Every key made of a valid scH and a valid scL decodes the pair correctly.
+ */
+
+void dec1_solve_init(struct dec1_solver *ds) {
+	assert(ds);
+	memset(ds->lmask, 0xFF, sizeof(ds->lmask));
+	memset(ds->hmask, 0xFF, sizeof(ds->hmask));
+}
+
+static unsigned popcount_mask(const u32 *mask) {
+	unsigned idx, cnt = 0;
+	for (idx = 0; idx < DEC1_MASKLEN; idx++) {
+		cnt += (unsigned) __builtin_popcount(mask[idx]);
+	}
+	return cnt;
+}
+
+uint64_t dec1_solve_count(const struct dec1_solver *ds) {
+	assert(ds);
+	return (uint64_t) popcount_mask(ds->lmask) * popcount_mask(ds->hmask);
+}
+
+uint64_t dec1_solve_pair(struct dec1_solver *ds, uint32_t enc, uint32_t dec) {
+	assert(ds);
+	const uint16_t eH = enc >> 16, eL = enc;
+	const uint16_t dH = dec >> 16, dL = dec;
+	unsigned widx;
+
+	for (widx = 0; widx < DEC1_MASKLEN; widx++) {
+		u32 lm = ds->lmask[widx];
+		u32 hm = ds->hmask[widx];
+		if (!(lm | hm)) continue;
+
+		//fixed trip count, no branches : lets the compiler vectorize both tests
+		u32 newl = 0, newh = 0;
+		unsigned bit;
+		for (bit = 0; bit < 32; bit++) {
+			uint16_t khalf = (uint16_t) (widx * 32 + bit);
+			newl |= (u32) (mess2(eH, eL, khalf) == dL) << bit;
+			newh |= (u32) (mess1(eL, dL, khalf) == dH) << bit;
+		}
+		ds->lmask[widx] = lm & newl;
+		ds->hmask[widx] = hm & newh;
+	}
+	return dec1_solve_count(ds);
+}
+
+void dec1_solve_iterate(const struct dec1_solver *ds, uint32_t kmin, uint32_t kmax,
+			bool (*cb)(uint32_t key, void *data), void *data) {
+	assert(ds && cb && (kmin <= kmax));
+	uint32_t kh;
+
+	for (kh = kmin >> 16; kh <= (kmax >> 16); kh++) {
+		if (!(ds->hmask[kh / 32] & (1UL << (kh % 32)))) continue;
+
+		uint32_t kl_start = (kh == (kmin >> 16)) ? (kmin & 0xFFFF) : 0;
+		uint32_t kl_end = (kh == (kmax >> 16)) ? (kmax & 0xFFFF) : 0xFFFF;
+		uint32_t kl;
+		for (kl = kl_start; kl <= kl_end; kl++) {
+			if (!(ds->lmask[kl / 32] & (1UL << (kl % 32)))) continue;
+			if (!cb((kh << 16) | kl, data)) return;
+		}
+	}
+}
+
+/* dec1_search() : mess1(a, b, x) only depends on a and (x + b). So for a given constraint, the high
+ * halves that pass are a fixed set of (scH + <low output>) values, computed once : for each scL that
+ * passes, the set of valid scH is that bitmap rotated by the low output.
+ */
+
+/** bit k of the result word w is bit (k + rot) of bm, modulo 65536 */
+static inline u32 rot_word(const u32 *bm, unsigned w, unsigned rot) {
+	unsigned q = (w + rot / 32) % DEC1_MASKLEN;
+	unsigned r = rot % 32;
+	if (!r) return bm[q];
+	return (bm[q] >> r) | (bm[(q + 1) % DEC1_MASKLEN] << (32 - r));
+}
+
+bool dec1_search(const struct dec1_cons *cons, unsigned ncons, uint16_t klmin, uint16_t klmax,
+			bool (*cb)(uint32_t key, void *data), void *data) {
+	assert(cons && cb && ncons && (ncons <= DEC1_MAXCONS) && (klmin <= klmax));
+	u32 hbm[DEC1_MAXCONS][DEC1_MASKLEN];
+	uint16_t lo[DEC1_MAXCONS];
+	uint32_t kl;
+	unsigned ci, widx;
+
+	for (ci = 0; ci < ncons; ci++) {
+		const uint16_t eL = cons[ci].enc;
+		for (widx = 0; widx < DEC1_MASKLEN; widx++) {
+			u32 m = 0;
+			unsigned bit;
+			for (bit = 0; bit < 32; bit++) {
+				uint16_t hi = mess1(eL, 0, (uint16_t) (widx * 32 + bit));
+				m |= (u32) ((hi >= cons[ci].hmin) & (hi <= cons[ci].hmax)) << bit;
+			}
+			hbm[ci][widx] = m;
+		}
+	}
+
+	for (kl = klmin; kl <= klmax; kl++) {
+		for (ci = 0; ci < ncons; ci++) {
+			lo[ci] = mess2(cons[ci].enc >> 16, cons[ci].enc, (uint16_t) kl);
+			if ((lo[ci] & cons[ci].lmask) != cons[ci].lval) break;
+		}
+		if (ci < ncons) continue;
+
+		for (widx = 0; widx < DEC1_MASKLEN; widx++) {
+			u32 hm = rot_word(hbm[0], widx, lo[0]);
+			for (ci = 1; hm && (ci < ncons); ci++) {
+				hm &= rot_word(hbm[ci], widx, lo[ci]);
+			}
+			while (hm) {
+				unsigned bit = (unsigned) __builtin_ctz(hm);
+				hm &= hm - 1;
+				if (!cb(((widx * 32 + bit) << 16) | kl, data)) return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+
+/********** search kernels
+ *
+ * The scalar versions are the reference; every SIMD variant must return exactly the same
+ * result, including the odd bounds (e.g. u8memstr never tests the very last position).
+ * Variants are picked at runtime (see get_simd_level()); all of them rely on unaligned loads only,
+ * so alignment is always relative to buf, same as the scalar loops.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	#include <immintrin.h>
+	#define NISLIB_SIMD_X86
+#elif defined(NISLIB_NEON) && defined(__aarch64__) && defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	/* opt-in (CPPFLAGS=-DNISLIB_NEON) until these have been run through test_memstr on real hardware */
+	#include <arm_neon.h>
+	#define NISLIB_SIMD_NEON
+#endif
+
+enum simd_level {
+	SIMD_NONE = 0,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_NEON,
+};
+
+static const char *simd_names[] = {
+	[SIMD_NONE] = "scalar",
+	[SIMD_SSE2] = "sse2",
+	[SIMD_AVX2] = "avx2",
+	[SIMD_NEON] = "neon",
+};
+
+static int simd_level = -1;	//not detected yet
+
+/* best kernels this CPU can run */
+static enum simd_level detect_simd_hw(void) {
+	enum simd_level lvl = SIMD_NONE;
+#if defined(NISLIB_SIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) lvl = SIMD_SSE2;
+	if (__builtin_cpu_supports("avx2")) lvl = SIMD_AVX2;
+#elif defined(NISLIB_SIMD_NEON)
+	lvl = SIMD_NEON;
+#endif
+	return lvl;
+}
+
+/** @return 1 if <lvl> kernels are built and can run, given the best level <hw> */
+static bool simd_available(enum simd_level lvl, enum simd_level hw) {
+	if ((lvl == SIMD_NONE) || (lvl == hw)) return 1;
+	return (hw == SIMD_AVX2) && (lvl == SIMD_SSE2);
+}
+
+/** @return level named <name>, if available; -1 if not */
+static int simd_lookup(const char *name) {
+	enum simd_level hw = detect_simd_hw();
+	unsigned idx;
+	for (idx = 0; idx < ARRAY_SIZE(simd_names); idx++) {
+		if (strcmp(name, simd_names[idx]) != 0) continue;
+		if (!simd_available((enum simd_level) idx, hw)) return -1;
+		return (int) idx;
+	}
+	return -1;
+}
 
-	for (hcur=0; hcur < (buflen - nlen); hcur++) {
+/* detect best available kernels. The NISLIB_SIMD environment variable
+ * can force a lower level, e.g. NISLIB_SIMD=scalar to compare results. */
+static enum simd_level detect_simd_level(void) {
+	const char *force = getenv("NISLIB_SIMD");
+	if (force) {
+		int lvl = simd_lookup(force);
+		if (lvl >= 0) return (enum simd_level) lvl;
+	}
+	return detect_simd_hw();
+}
+
+static enum simd_level get_simd_level(void) {
+	int lvl = __atomic_load_n(&simd_level, __ATOMIC_RELAXED);
+	if (lvl < 0) {
+		//harmless if this races : every thread gets the same answer
+		lvl = (int) detect_simd_level();
+		__atomic_store_n(&simd_level, lvl, __ATOMIC_RELAXED);
+	}
+	return (enum simd_level) lvl;
+}
+
+const char *nislib_simd_name(void) {
+	return simd_names[get_simd_level()];
+}
+
+int nislib_simd_force(const char *name) {
+	assert(name);
+	int lvl = simd_lookup(name);
+	if (lvl < 0) return -1;
+	__atomic_store_n(&simd_level, lvl, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+/* positions [start, buflen - nlen[ */
+static const uint8_t *u8memstr_scalar(const uint8_t *buf, uint32_t start, uint32_t buflen,
+						const uint8_t *needle, unsigned nlen) {
+	uint32_t hcur;
+	for (hcur = start; hcur < (buflen - nlen); hcur++) {
 		if (memcmp(buf + hcur, needle, nlen)==0) {
 			return &buf[hcur];
 		}
 	}
+	return NULL;
+}
 
+/* even positions [start, buflen - 2]; testval is the needle in memory order */
+static const uint8_t *u16memstr_scalar(const uint8_t *buf, uint32_t start, uint32_t buflen, u16 testval) {
+	uint32_t cur;
+	for (cur = start; cur <= (buflen - 2); cur += 2) {
+		u16 tmp;
+		memcpy(&tmp, &buf[cur], 2);	//gets optimized out
+		if (tmp == testval) return &buf[cur];
+	}
 	return NULL;
 }
 
-/* manual, aligned search for u16 val */
+/* positions multiple of 4, [start, buflen - 4]; testval is the needle in memory order */
+static const uint8_t *u32memstr_scalar(const uint8_t *buf, uint32_t start, uint32_t buflen, u32 testval) {
+	uint32_t cur;
+	for (cur = start; cur <= (buflen - 4); cur += 4) {
+		u32 tmp;
+		memcpy(&tmp, &buf[cur], 4);
+		if (tmp == testval) return &buf[cur];
+	}
+	return NULL;
+}
+
+static inline bool is_idchar(u8 c) {
+	return ((u8) (c - '0') <= 9) || ((u8) (c - 'A') <= 25);
+}
+
+/* idchar runs starting in [start, siz[ */
+static uint32_t idchar_run_scalar(const uint8_t *buf, uint32_t start, uint32_t siz, unsigned minlen, uint32_t *len) {
+	uint32_t cur = start;
+	while (cur < siz) {
+		if (!is_idchar(buf[cur])) {
+			cur++;
+			continue;
+		}
+		uint32_t end = cur + 1;
+		while ((end < siz) && is_idchar(buf[end])) end++;
+		if ((end - cur) >= minlen) {
+			*len = end - cur;
+			return cur;
+		}
+		cur = end;
+	}
+	return UINT32_MAX;
+}
+
+#ifdef NISLIB_SIMD_X86
+/* u8memstr : compare first and last needle bytes at 16 (or 32) positions at once,
+ * only memcmp() the middle part for candidates. */
+__attribute__((target("sse2")))
+static const uint8_t *u8memstr_sse2(const uint8_t *buf, uint32_t buflen, const uint8_t *needle, unsigned nlen) {
+	const uint32_t limit = buflen - nlen;
+	const __m128i vfirst = _mm_set1_epi8((char) needle[0]);
+	const __m128i vlast = _mm_set1_epi8((char) needle[nlen - 1]);
+	uint32_t hcur;
+
+	for (hcur = 0; (hcur + 16) <= limit; hcur += 16) {
+		__m128i bf = _mm_loadu_si128((const __m128i *) (buf + hcur));
+		__m128i bl = _mm_loadu_si128((const __m128i *) (buf + hcur + nlen - 1));
+		unsigned mask = (unsigned) _mm_movemask_epi8(
+					_mm_and_si128(_mm_cmpeq_epi8(bf, vfirst), _mm_cmpeq_epi8(bl, vlast)));
+		while (mask) {
+			unsigned bit = (unsigned) __builtin_ctz(mask);
+			if ((nlen <= 2) || (memcmp(buf + hcur + bit + 1, needle + 1, nlen - 2) == 0)) {
+				return &buf[hcur + bit];
+			}
+			mask &= mask - 1;
+		}
+	}
+	return u8memstr_scalar(buf, hcur, buflen, needle, nlen);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *u8memstr_avx2(const uint8_t *buf, uint32_t buflen, const uint8_t *needle, unsigned nlen) {
+	const uint32_t limit = buflen - nlen;
+	const __m256i vfirst = _mm256_set1_epi8((char) needle[0]);
+	const __m256i vlast = _mm256_set1_epi8((char) needle[nlen - 1]);
+	uint32_t hcur;
+
+	for (hcur = 0; (hcur + 32) <= limit; hcur += 32) {
+		__m256i bf = _mm256_loadu_si256((const __m256i *) (buf + hcur));
+		__m256i bl = _mm256_loadu_si256((const __m256i *) (buf + hcur + nlen - 1));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(
+					_mm256_and_si256(_mm256_cmpeq_epi8(bf, vfirst), _mm256_cmpeq_epi8(bl, vlast)));
+		while (mask) {
+			unsigned bit = (unsigned) __builtin_ctz(mask);
+			if ((nlen <= 2) || (memcmp(buf + hcur + bit + 1, needle + 1, nlen - 2) == 0)) {
+				return &buf[hcur + bit];
+			}
+			mask &= mask - 1;
+		}
+	}
+	return u8memstr_scalar(buf, hcur, buflen, needle, nlen);
+}
+
+/* u16 / u32 : a matching lane sets 2 (or 4) consecutive mask bits; the lowest one is the byte offset */
+__attribute__((target("sse2")))
+static const uint8_t *u16memstr_sse2(const uint8_t *buf, uint32_t buflen, u16 testval) {
+	const __m128i vn = _mm_set1_epi16((short) testval);
+	uint32_t cur;
+	for (cur = 0; (cur + 16) <= buflen; cur += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + cur));
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi16(v, vn));
+		if (mask) return &buf[cur + __builtin_ctz(mask)];
+	}
+	return u16memstr_scalar(buf, cur, buflen, testval);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *u16memstr_avx2(const uint8_t *buf, uint32_t buflen, u16 testval) {
+	const __m256i vn = _mm256_set1_epi16((short) testval);
+	uint32_t cur;
+	for (cur = 0; (cur + 32) <= buflen; cur += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (buf + cur));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, vn));
+		if (mask) return &buf[cur + __builtin_ctz(mask)];
+	}
+	return u16memstr_scalar(buf, cur, buflen, testval);
+}
+
+__attribute__((target("sse2")))
+static const uint8_t *u32memstr_sse2(const uint8_t *buf, uint32_t buflen, u32 testval) {
+	const __m128i vn = _mm_set1_epi32((int) testval);
+	uint32_t cur;
+	for (cur = 0; (cur + 16) <= buflen; cur += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + cur));
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi32(v, vn));
+		if (mask) return &buf[cur + __builtin_ctz(mask)];
+	}
+	return u32memstr_scalar(buf, cur, buflen, testval);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *u32memstr_avx2(const uint8_t *buf, uint32_t buflen, u32 testval) {
+	const __m256i vn = _mm256_set1_epi32((int) testval);
+	uint32_t cur;
+	for (cur = 0; (cur + 32) <= buflen; cur += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (buf + cur));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, vn));
+		if (mask) return &buf[cur + __builtin_ctz(mask)];
+	}
+	return u32memstr_scalar(buf, cur, buflen, testval);
+}
+
+/* idchar_run : one class bit per byte, for 32 bytes. A byte is in [lo, lo + n] if
+ * min(c - lo, n) == c - lo, unsigned : that saves the signed compare tricks. */
+__attribute__((target("sse2")))
+static inline u32 idclass32_sse2(const uint8_t *p) {
+	const __m128i v0 = _mm_set1_epi8('0'), n0 = _mm_set1_epi8(9);
+	const __m128i va = _mm_set1_epi8('A'), na = _mm_set1_epi8(25);
+	u32 mask = 0;
+	unsigned half;
+	for (half = 0; half < 2; half++) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + half * 16));
+		__m128i d = _mm_sub_epi8(v, v0), a = _mm_sub_epi8(v, va);
+		__m128i in = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(d, n0), d), _mm_cmpeq_epi8(_mm_min_epu8(a, na), a));
+		mask |= (u32) _mm_movemask_epi8(in) << (half * 16);
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static inline u32 idclass32_avx2(const uint8_t *p) {
+	const __m256i v0 = _mm256_set1_epi8('0'), n0 = _mm256_set1_epi8(9);
+	const __m256i va = _mm256_set1_epi8('A'), na = _mm256_set1_epi8(25);
+	__m256i v = _mm256_loadu_si256((const __m256i *) p);
+	__m256i d = _mm256_sub_epi8(v, v0), a = _mm256_sub_epi8(v, va);
+	__m256i in = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(d, n0), d),
+				_mm256_cmpeq_epi8(_mm256_min_epu8(a, na), a));
+	return (u32) _mm256_movemask_epi8(in);
+}
+
+/* bits of m that start <minlen> consecutive set bits */
+static inline uint64_t idrun_starts(uint64_t m, unsigned minlen) {
+	uint64_t y = m;
+	unsigned k;
+	for (k = 1; k < minlen; k++) y &= m >> k;
+	return y;
+}
+
+/* Skip 32-byte blocks where no run of minlen starts, looking 32 bytes ahead; the scalar loop takes
+ * over at the first block that has one. A run that crosses into that block started in a block
+ * already skipped, so it is shorter than minlen and the scalar loop skips its tail too. */
+__attribute__((target("sse2")))
+static uint32_t idchar_run_sse2(const uint8_t *buf, uint32_t from, uint32_t siz, unsigned minlen, uint32_t *len) {
+	uint32_t cur = from;
+	if ((siz - cur) >= 64) {
+		u32 lo = idclass32_sse2(buf + cur), hi;
+		for (; (cur + 64) <= siz; cur += 32, lo = hi) {
+			hi = idclass32_sse2(buf + cur + 32);
+			if ((u32) idrun_starts(lo | ((uint64_t) hi << 32), minlen)) break;
+		}
+	}
+	return idchar_run_scalar(buf, cur, siz, minlen, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t idchar_run_avx2(const uint8_t *buf, uint32_t from, uint32_t siz, unsigned minlen, uint32_t *len) {
+	uint32_t cur = from;
+	if ((siz - cur) >= 64) {
+		u32 lo = idclass32_avx2(buf + cur), hi;
+		for (; (cur + 64) <= siz; cur += 32, lo = hi) {
+			hi = idclass32_avx2(buf + cur + 32);
+			if ((u32) idrun_starts(lo | ((uint64_t) hi << 32), minlen)) break;
+		}
+	}
+	return idchar_run_scalar(buf, cur, siz, minlen, len);
+}
+#endif	//NISLIB_SIMD_X86
+
+#ifdef NISLIB_SIMD_NEON
+/* no movemask on NEON : narrow the compare results to a 64-bit scalar instead */
+static const uint8_t *u8memstr_neon(const uint8_t *buf, uint32_t buflen, const uint8_t *needle, unsigned nlen) {
+	const uint32_t limit = buflen - nlen;
+	const uint8x16_t vfirst = vdupq_n_u8(needle[0]);
+	const uint8x16_t vlast = vdupq_n_u8(needle[nlen - 1]);
+	uint32_t hcur;
+
+	for (hcur = 0; (hcur + 16) <= limit; hcur += 16) {
+		uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(buf + hcur), vfirst),
+							vceqq_u8(vld1q_u8(buf + hcur + nlen - 1), vlast));
+		//4 mask bits per byte
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		while (mask) {
+			unsigned bit = (unsigned) __builtin_ctzll(mask) / 4;
+			if ((nlen <= 2) || (memcmp(buf + hcur + bit + 1, needle + 1, nlen - 2) == 0)) {
+				return &buf[hcur + bit];
+			}
+			mask &= ~(0xFULL << (bit * 4));
+		}
+	}
+	return u8memstr_scalar(buf, hcur, buflen, needle, nlen);
+}
+
+static const uint8_t *u16memstr_neon(const uint8_t *buf, uint32_t buflen, u16 testval) {
+	const uint16x8_t vn = vdupq_n_u16(testval);
+	uint32_t cur;
+	for (cur = 0; (cur + 16) <= buflen; cur += 16) {
+		uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(buf + cur));
+		//one byte per lane
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(vceqq_u16(v, vn))), 0);
+		if (mask) return &buf[cur + 2 * ((unsigned) __builtin_ctzll(mask) / 8)];
+	}
+	return u16memstr_scalar(buf, cur, buflen, testval);
+}
+
+static const uint8_t *u32memstr_neon(const uint8_t *buf, uint32_t buflen, u32 testval) {
+	const uint32x4_t vn = vdupq_n_u32(testval);
+	uint32_t cur;
+	for (cur = 0; (cur + 16) <= buflen; cur += 16) {
+		uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(buf + cur));
+		//two bytes per lane
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(vceqq_u32(v, vn))), 0);
+		if (mask) return &buf[cur + 4 * ((unsigned) __builtin_ctzll(mask) / 16)];
+	}
+	return u32memstr_scalar(buf, cur, buflen, testval);
+}
+
+/* 4 class bits per byte, for 16 bytes */
+static inline uint64_t idclass16_neon(const uint8_t *p) {
+	uint8x16_t v = vld1q_u8(p);
+	uint8x16_t in = vorrq_u8(vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(9)),
+				vcleq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(25)));
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(in), 4)), 0);
+}
+
+/* same block skipping as idchar_run_sse2(), with 16-byte blocks */
+static uint32_t idchar_run_neon(const uint8_t *buf, uint32_t from, uint32_t siz, unsigned minlen, uint32_t *len) {
+	uint32_t cur = from;
+	if ((siz - cur) >= 32) {
+		uint64_t lo = idclass16_neon(buf + cur), hi;
+		for (; (cur + 32) <= siz; cur += 16, lo = hi) {
+			uint64_t y = lo;
+			unsigned k;
+			hi = idclass16_neon(buf + cur + 16);
+			for (k = 1; k < minlen; k++) y &= (lo >> (4 * k)) | (hi << (64 - 4 * k));
+			if (y) break;
+		}
+	}
+	return idchar_run_scalar(buf, cur, siz, minlen, len);
+}
+#endif	//NISLIB_SIMD_NEON
+
+
+const uint8_t *u8memstr(const uint8_t *buf, uint32_t buflen, const uint8_t *needle, unsigned nlen) {
+	assert(buf && needle && buflen && nlen && (nlen <= buflen));
+
+	switch (get_simd_level()) {
+#ifdef NISLIB_SIMD_X86
+	case SIMD_AVX2:
+		return u8memstr_avx2(buf, buflen, needle, nlen);
+	case SIMD_SSE2:
+		return u8memstr_sse2(buf, buflen, needle, nlen);
+#endif
+#ifdef NISLIB_SIMD_NEON
+	case SIMD_NEON:
+		return u8memstr_neon(buf, buflen, needle, nlen);
+#endif
+	default:
+		return u8memstr_scalar(buf, 0, buflen, needle, nlen);
+	}
+}
+
+/* aligned search for u16 val */
 const uint8_t *u16memstr(const uint8_t *buf, uint32_t buflen, const uint16_t needle) {
 	assert(buf && (buflen >= 2));
 
@@ -145,14 +719,21 @@ const uint8_t *u16memstr(const uint8_t *buf, uint32_t buflen, const uint16_t nee
 	u16 testval;
 	*((u8 *) &testval + 0) = (u8) (needle >> 8);
 	*((u8 *) &testval + 1) = (u8) (needle & 0xFF);
-	uint32_t cur;
-	for (cur = 0; cur <= (buflen - 2); cur += 2) {
-		u16 tmp;
-		memcpy(&tmp, &buf[cur], 2);	//gets optimized out
-		if (tmp == testval) return &buf[cur];
-		//if (reconst_16(&buf[cur]) == needle) return &buf[cur];
+
+	switch (get_simd_level()) {
+#ifdef NISLIB_SIMD_X86
+	case SIMD_AVX2:
+		return u16memstr_avx2(buf, buflen, testval);
+	case SIMD_SSE2:
+		return u16memstr_sse2(buf, buflen, testval);
+#endif
+#ifdef NISLIB_SIMD_NEON
+	case SIMD_NEON:
+		return u16memstr_neon(buf, buflen, testval);
+#endif
+	default:
+		return u16memstr_scalar(buf, 0, buflen, testval);
 	}
-	return NULL;
 }
 
 /* reversed, aligned search for u16 val */
@@ -167,15 +748,49 @@ const uint8_t *u16memstr_rev(const uint8_t *buf, uint32_t start_pos, const uint1
 	return NULL;
 }
 
-/* manual, aligned search instead of calling u8memstr; should be faster */
+/* aligned search instead of calling u8memstr; same host-endian trick as u16memstr */
 const uint8_t *u32memstr(const uint8_t *buf, uint32_t buflen, const uint32_t needle) {
 	assert(buf && (buflen >= 4));
 
-	uint32_t cur;
-	for (cur = 0; cur <= (buflen - 4); cur += 4) {
-		if (reconst_32(&buf[cur]) == needle) return &buf[cur];
+	u32 testval;
+	u8 nbytes[4];
+	write_32b(needle, nbytes);
+	memcpy(&testval, nbytes, 4);
+
+	switch (get_simd_level()) {
+#ifdef NISLIB_SIMD_X86
+	case SIMD_AVX2:
+		return u32memstr_avx2(buf, buflen, testval);
+	case SIMD_SSE2:
+		return u32memstr_sse2(buf, buflen, testval);
+#endif
+#ifdef NISLIB_SIMD_NEON
+	case SIMD_NEON:
+		return u32memstr_neon(buf, buflen, testval);
+#endif
+	default:
+		return u32memstr_scalar(buf, 0, buflen, testval);
+	}
+}
+
+uint32_t idchar_run(const uint8_t *buf, uint32_t siz, uint32_t from, unsigned minlen, uint32_t *len) {
+	assert(buf && len && minlen && (minlen <= IDRUN_MAXMIN));
+	if (from >= siz) return UINT32_MAX;
+
+	switch (get_simd_level()) {
+#ifdef NISLIB_SIMD_X86
+	case SIMD_AVX2:
+		return idchar_run_avx2(buf, from, siz, minlen, len);
+	case SIMD_SSE2:
+		return idchar_run_sse2(buf, from, siz, minlen, len);
+#endif
+#ifdef NISLIB_SIMD_NEON
+	case SIMD_NEON:
+		return idchar_run_neon(buf, from, siz, minlen, len);
+#endif
+	default:
+		return idchar_run_scalar(buf, from, siz, minlen, len);
 	}
-	return NULL;
 }
 
 
@@ -203,16 +818,171 @@ u32 flen(FILE *hf) {
 }
 
 
-/* sum and xor all u32 values in *buf, read with SH endianness */
-void sum32(const uint8_t *buf, u32 siz, uint32_t *sum, uint32_t *xor) {
-	u32 bufcur;
-	uint32_t sumt, xort;
+#define ROMIMG_READBLK (256 * 1024UL)	//growth step when reading a stream
 
-	assert(buf && siz && sum && xor && (siz <= MAX_ROMSIZE));
+/** read until EOF into a growing buffer, for pipes and such that can't tell their length.
+ * @return 0 if ok
+ */
+static int romimg_readstream(struct rom_image *img, FILE *fbin, const char *fname) {
+	u8 *buf = NULL;
+	size_t alloc = 0;
+	size_t len = 0;
+
+	while (1) {
+		if (len == alloc) {
+			size_t newalloc = alloc ? (2 * alloc) : ROMIMG_READBLK;
+			if (newalloc >= UINT32_MAX) newalloc = UINT32_MAX - 1;
+			if (newalloc == alloc) {
+				ERR_PRINTF("%s is too large\n", fname);
+				goto badexit;
+			}
+			u8 *newbuf = realloc(buf, newalloc);
+			if (!newbuf) {
+				ERR_PRINTF("malloc choke\n");
+				goto badexit;
+			}
+			buf = newbuf;
+			alloc = newalloc;
+		}
+		size_t got = fread(&buf[len], 1, alloc - len, fbin);
+		len += got;
+		if (got) continue;
+		if (ferror(fbin)) {
+			ERR_PRINTF("trouble reading %s\n", fname);
+			goto badexit;
+		}
+		break;
+	}
+	if (!len) {
+		ERR_PRINTF("empty or unreadable file %s\n", fname);
+		goto badexit;
+	}
+
+	img->buf = buf;
+	img->siz = (u32) len;
+	img->mapped = 0;
+	return 0;
+
+badexit:
+	free(buf);
+	return -1;
+}
+
+/* copy whole file to a new buffer */
+static int romimg_copy(struct rom_image *img, const char *fname) {
+	FILE *fbin;
+	u32 file_len;
+
+	if ((fbin = fopen(fname, "rb")) == NULL) {
+		ERR_PRINTF("error opening %s.\n", fname);
+		return -1;
+	}
+
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(fileno(fbin), &st) || !S_ISREG(st.st_mode)) {
+		//pipe, FIFO, process substitution etc : length unknown until EOF
+		int rv = romimg_readstream(img, fbin, fname);
+		fclose(fbin);
+		return rv;
+	}
+#endif
+
+	file_len = flen(fbin);
+	if (!file_len) {
+		ERR_PRINTF("empty or unreadable file %s\n", fname);
+		fclose(fbin);
+		return -1;
+	}
+
+	img->buf = malloc(file_len);
+	if (!img->buf) {
+		ERR_PRINTF("malloc choke\n");
+		fclose(fbin);
+		return -1;
+	}
 
-	sumt=0;
-	xort=0;
-	for (bufcur=0; bufcur < siz; bufcur += 4) {
+	if (fread(img->buf, 1, file_len, fbin) != file_len) {
+		ERR_PRINTF("trouble reading %s\n", fname);
+		free(img->buf);
+		img->buf = NULL;
+		fclose(fbin);
+		return -1;
+	}
+	fclose(fbin);
+
+	img->siz = file_len;
+	img->mapped = 0;
+	return 0;
+}
+
+int romimg_open(struct rom_image *img, const char *fname, bool writable) {
+	assert(img && fname);
+
+	img->buf = NULL;
+	img->siz = 0;
+	img->mapped = 0;
+
+#ifndef _WIN32
+	if (!writable) {
+		struct stat st;
+		int fd = open(fname, O_RDONLY);
+		if (fd < 0) {
+			ERR_PRINTF("error opening %s.\n", fname);
+			return -1;
+		}
+		if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+			(st.st_size <= 0) || ((unsigned long long) st.st_size >= UINT32_MAX)) {
+			// not something we can map : pipe, empty, huge etc.
+			close(fd);
+			return romimg_copy(img, fname);
+		}
+
+		void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);	//mapping stays valid
+		if (map == MAP_FAILED) {
+			return romimg_copy(img, fname);
+		}
+		img->buf = map;
+		img->siz = (u32) st.st_size;
+		img->mapped = 1;
+		return 0;
+	}
+#else
+	(void) writable;
+#endif
+	return romimg_copy(img, fname);
+}
+
+void romimg_close(struct rom_image *img) {
+	if (!img || !img->buf) return;
+#ifndef _WIN32
+	if (img->mapped) {
+		munmap(img->buf, img->siz);
+	} else
+#endif
+	{
+		free(img->buf);
+	}
+	img->buf = NULL;
+	img->siz = 0;
+	img->mapped = 0;
+}
+
+
+/********** sum32 kernels
+ *
+ * The sum and xor are computed on byteswapped (SH/BE) u32 words; SIMD variants swap whole
+ * vectors then accumulate per lane, which gives the same result since both operations are
+ * associative and commutative. Like the search kernels, the scalar loop finishes the tail.
+ */
+
+/* add words [start, siz[ to *sum and *xor */
+static void sum32_scalar(const uint8_t *buf, uint32_t start, uint32_t siz, uint32_t *sum, uint32_t *xor) {
+	u32 bufcur;
+	uint32_t sumt = *sum, xort = *xor;
+
+	for (bufcur = start; bufcur < siz; bufcur += 4) {
 		//loop each uint32, but with good endianness (need to reconstruct)
 		uint32_t lw;
 		lw = reconst_32(&buf[bufcur]);
@@ -221,7 +991,156 @@ void sum32(const uint8_t *buf, u32 siz, uint32_t *sum, uint32_t *xor) {
 	}
 	*sum = sumt;
 	*xor = xort;
-	return;
+}
+
+#ifdef NISLIB_SIMD_X86
+/* SSE2 has no byte shuffle : swap bytes in each u16, then swap the u16 halves */
+__attribute__((target("sse2")))
+static void sum32_sse2(const uint8_t *buf, uint32_t siz, uint32_t *sum, uint32_t *xor) {
+	__m128i vs = _mm_setzero_si128();
+	__m128i vx = _mm_setzero_si128();
+	uint32_t cur;
+
+	for (cur = 0; (cur + 16) <= siz; cur += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + cur));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		vs = _mm_add_epi32(vs, v);
+		vx = _mm_xor_si128(vx, v);
+	}
+	uint32_t ls[4], lx[4];
+	_mm_storeu_si128((__m128i *) ls, vs);
+	_mm_storeu_si128((__m128i *) lx, vx);
+	*sum = ls[0] + ls[1] + ls[2] + ls[3];
+	*xor = lx[0] ^ lx[1] ^ lx[2] ^ lx[3];
+	sum32_scalar(buf, cur, siz, sum, xor);
+}
+
+__attribute__((target("avx2")))
+static void sum32_avx2(const uint8_t *buf, uint32_t siz, uint32_t *sum, uint32_t *xor) {
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+						3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i vs = _mm256_setzero_si256();
+	__m256i vx = _mm256_setzero_si256();
+	uint32_t cur;
+
+	for (cur = 0; (cur + 32) <= siz; cur += 32) {
+		__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (buf + cur)), bswap);
+		vs = _mm256_add_epi32(vs, v);
+		vx = _mm256_xor_si256(vx, v);
+	}
+	uint32_t ls[8], lx[8];
+	_mm256_storeu_si256((__m256i *) ls, vs);
+	_mm256_storeu_si256((__m256i *) lx, vx);
+	unsigned idx;
+	*sum = 0;
+	*xor = 0;
+	for (idx = 0; idx < 8; idx++) {
+		*sum += ls[idx];
+		*xor ^= lx[idx];
+	}
+	sum32_scalar(buf, cur, siz, sum, xor);
+}
+#endif	//NISLIB_SIMD_X86
+
+#ifdef NISLIB_SIMD_NEON
+static void sum32_neon(const uint8_t *buf, uint32_t siz, uint32_t *sum, uint32_t *xor) {
+	uint32x4_t vs = vdupq_n_u32(0);
+	uint32x4_t vx = vdupq_n_u32(0);
+	uint32_t cur;
+
+	for (cur = 0; (cur + 16) <= siz; cur += 16) {
+		uint32x4_t v = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + cur)));
+		vs = vaddq_u32(vs, v);
+		vx = veorq_u32(vx, v);
+	}
+	*sum = vaddvq_u32(vs);
+	*xor = vgetq_lane_u32(vx, 0) ^ vgetq_lane_u32(vx, 1) ^ vgetq_lane_u32(vx, 2) ^ vgetq_lane_u32(vx, 3);
+	sum32_scalar(buf, cur, siz, sum, xor);
+}
+#endif	//NISLIB_SIMD_NEON
+
+/* sum and xor all u32 values in *buf, read with SH endianness */
+void sum32(const uint8_t *buf, u32 siz, uint32_t *sum, uint32_t *xor) {
+	assert(buf && siz && sum && xor && (siz <= MAX_ROMSIZE));
+
+	switch (get_simd_level()) {
+#ifdef NISLIB_SIMD_X86
+	case SIMD_AVX2:
+		sum32_avx2(buf, siz, sum, xor);
+		return;
+	case SIMD_SSE2:
+		sum32_sse2(buf, siz, sum, xor);
+		return;
+#endif
+#ifdef NISLIB_SIMD_NEON
+	case SIMD_NEON:
+		sum32_neon(buf, siz, sum, xor);
+		return;
+#endif
+	default:
+		*sum = 0;
+		*xor = 0;
+		sum32_scalar(buf, 0, siz, sum, xor);
+		return;
+	}
+}
+
+
+int sum32_init(struct sum32_state *ss, const uint8_t *buf, uint32_t siz, uint32_t bsize) {
+	assert(ss && buf && siz && (siz <= MAX_ROMSIZE));
+	assert(bsize && !(bsize & 3));
+
+	ss->buf = buf;
+	ss->siz = siz & ~0x03;
+	ss->bsize = bsize;
+	ss->nblocks = (ss->siz + bsize - 1) / bsize;
+	ss->sum = 0;
+	ss->xor = 0;
+	ss->bsum = malloc(ss->nblocks * sizeof(*ss->bsum));
+	ss->bxor = malloc(ss->nblocks * sizeof(*ss->bxor));
+	if (!ss->bsum || !ss->bxor) {
+		ERR_PRINTF("malloc failed\n");
+		sum32_free(ss);
+		return -1;
+	}
+
+	u32 blk;
+	for (blk = 0; blk < ss->nblocks; blk++) {
+		u32 bstart = blk * bsize;
+		sum32(&buf[bstart], MIN(bsize, ss->siz - bstart), &ss->bsum[blk], &ss->bxor[blk]);
+		ss->sum += ss->bsum[blk];
+		ss->xor ^= ss->bxor[blk];
+	}
+	return 0;
+}
+
+void sum32_update(struct sum32_state *ss, uint32_t offs, uint32_t len) {
+	assert(ss && ss->bsum);
+
+	if (!len || (offs >= ss->siz)) return;
+	len = MIN(len, ss->siz - offs);
+
+	u32 blk, lastblk = (offs + len - 1) / ss->bsize;
+	for (blk = offs / ss->bsize; blk <= lastblk; blk++) {
+		u32 bstart = blk * ss->bsize;
+		uint32_t bs, bx;
+		sum32(&ss->buf[bstart], MIN(ss->bsize, ss->siz - bstart), &bs, &bx);
+		ss->sum += bs - ss->bsum[blk];
+		ss->xor ^= bx ^ ss->bxor[blk];
+		ss->bsum[blk] = bs;
+		ss->bxor[blk] = bx;
+	}
+}
+
+void sum32_free(struct sum32_state *ss) {
+	assert(ss);
+	free(ss->bsum);
+	free(ss->bxor);
+	ss->bsum = NULL;
+	ss->bxor = NULL;
+	ss->nblocks = 0;
 }
 
 //calculate checksum & locations
@@ -261,7 +1180,7 @@ int checksum_alt2(const uint8_t *buf, uint32_t siz, uint32_t *p_ack_s, uint32_t
 
 	cks=xort;
 	ckx= sumt - 2*xort;	//cheat !
-	DBG_PRINTF("alt2 sum=0x%0X; xor=0x%0X\n", cks, ckx);
+	TRACE(TC_CKS, TL_INFO, "alt2 sum=0x%0X; xor=0x%0X\n", cks, ckx);
 	//try to find cks et ckx in there
 	*p_ack_s = 0;
 	*p_ack_x = 0;
@@ -290,47 +1209,50 @@ int checksum_std(const uint8_t *buf, uint32_t siz, uint32_t *p_cks, uint32_t *p_
 // 1) set a,b,c to 0
 // 2) calculate actual sum and xor (skipping locs p_cks and p_ckx)
 // 3) determine correction values to bring actual sum and xor to the desired cks and ckx
-void checksum_fix(uint8_t *buf, uint32_t siz, uint32_t p_cks, uint32_t p_ckx,
+void checksum_fix_incr(struct sum32_state *ss, uint8_t *buf, uint32_t p_cks, uint32_t p_ckx,
 				uint32_t p_a, uint32_t p_b, uint32_t p_c) {
 	uint32_t cks, ckx;	//desired sum and xor
 	uint32_t ds, dx;	//actual/delta vals
 	uint32_t a, b, c;	//correction vals
-
-	siz &= ~0x03;
+	uint32_t siz;
 
 	//abort if siz not a multiple of 4, and other problems
-	assert(buf && siz &&
+	assert(ss && buf && (buf == ss->buf));
+	siz = ss->siz;
+	assert(siz &&
 		(siz <= MAX_ROMSIZE) &&
 		(p_cks <= (siz - 4)) && (p_ckx <= (siz - 4)) &&
 		(p_a < siz) && (p_b < siz));
 
 	cks = reconst_32(&buf[p_cks]);
 	ckx = reconst_32(&buf[p_ckx]);
-	DBG_PRINTF("desired cks=%X, ckx=%X\n", cks, ckx);
+	TRACE(TC_CKS, TL_INFO, "desired cks=%X, ckx=%X\n", cks, ckx);
 	if ((cks & 1) != (ckx &1)) {
 		//Major problem, since both those bits should *always* match
 		// (bit 0 of an addition is the XOR of all "bit 0"s !! )
-		DBG_PRINTF("Warning : unlikely original checksums; unmatched LSBs\n");
+		TRACE(TC_CKS, TL_WARN, "Warning : unlikely original checksums; unmatched LSBs\n");
 	}
 
 	// 1) set correction vals to 0
 	write_32b(0, &buf[p_a]);
 	write_32b(0, &buf[p_b]);
 	write_32b(0, &buf[p_c]);
+	sum32_update(ss, p_a, 4);
+	sum32_update(ss, p_b, 4);
+	sum32_update(ss, p_c, 4);
 
-	// 2) calc actual sum & xor
-	ds=0;
-	dx=0;
-	sum32(buf, siz, &ds, &dx);
+	// 2) actual sum & xor; only the touched blocks were recalculated
+	ds = ss->sum;
+	dx = ss->xor;
 	// do not count orig cks and ckx
 	ds = ds - (cks + ckx);
 	dx = dx ^ cks ^ ckx;
-	DBG_PRINTF("actual s=%X, x=%X\n", ds, dx);
+	TRACE(TC_CKS, TL_INFO, "actual s=%X, x=%X\n", ds, dx);
 
 	//required corrections :
 	ds = cks - ds;
 	dx = ckx ^ dx;
-	DBG_PRINTF("corrections ds=%X, dx=%X\n", ds, dx);
+	TRACE(TC_CKS, TL_INFO, "corrections ds=%X, dx=%X\n", ds, dx);
 	// 3) solve thus :
 	//	- find 'c' such that c ^ dx == 0; easy : c = dx.
 	//	- the new sum correction is now (ds - c)
@@ -343,22 +1265,39 @@ void checksum_fix(uint8_t *buf, uint32_t siz, uint32_t p_cks, uint32_t p_ckx,
 	a = b = ds / 2;
 	//aaaand... that's it !?
 
-	DBG_PRINTF("Correction vals a=%X, b=%X, c=%X\n", a,b,c);
+	TRACE(TC_CKS, TL_INFO, "Correction vals a=%X, b=%X, c=%X\n", a,b,c);
 	//write correction vals
 	write_32b(a, &buf[p_a]);
 	write_32b(b, &buf[p_b]);
 	write_32b(c, &buf[p_c]);
+	sum32_update(ss, p_a, 4);
+	sum32_update(ss, p_b, 4);
+	sum32_update(ss, p_c, 4);
 	//and verify, just for shits
-	sum32(buf, siz, &ds, &dx);
+	ds = ss->sum;
+	dx = ss->xor;
 	// do not count orig cks and ckx
 	ds = ds - (cks + ckx);
 	dx = dx ^ cks ^ ckx;
 	if ((ds == cks) && (dx == ckx)) {
-		DBG_PRINTF("checksum fixed !\n");
+		TRACE(TC_CKS, TL_INFO, "checksum fixed !\n");
 	} else {
-		DBG_PRINTF("could not fix checksum !!\n");
+		TRACE(TC_CKS, TL_WARN, "could not fix checksum !!\n");
 	}
 
 	return;
 }
 
+void checksum_fix(uint8_t *buf, uint32_t siz, uint32_t p_cks, uint32_t p_ckx,
+				uint32_t p_a, uint32_t p_b, uint32_t p_c) {
+	struct sum32_state ss;
+
+	assert(buf && (siz & ~0x03));
+	if (sum32_init(&ss, buf, siz, SUM32_DEFAULT_BSIZE)) {
+		return;
+	}
+	checksum_fix_incr(&ss, buf, p_cks, p_ckx, p_a, p_b, p_c);
+	sum32_free(&ss);
+	return;
+}
+
@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "nislib_trace.h"
 #include "stypes.h"
 
 
@@ -20,15 +21,38 @@
 #define	MIN_ROMSIZE (128*1024UL)	//smallest known ROM is SH7050, 128kB
 #define MAX_ROMSIZE (2048*1024UL)
 
-/* this needs to be valid; debugging output is written to this.*/
-extern FILE *dbg_stream;	//such as as stdout or stderr
+/* this needs to be valid; debugging output is written to this.
+ * It is per-thread : worker threads must set their own before calling nislib funcs,
+ * and call trace_flush() before closing it. */
+extern __thread FILE *dbg_stream;	//such as as stdout or stderr
 
-#define DBG_PRINTF(fmt, ...) fprintf(dbg_stream, fmt, ##__VA_ARGS__)
+#define DBG_PRINTF(fmt, ...) TRACE(TC_GEN, TL_INFO, fmt, ##__VA_ARGS__)
 #define ERR_PRINTF(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
 
 /** get file length but restore position */
 uint32_t flen(FILE *hf);
 
+/** whole-file image, either mapped read-only or copied to a private buffer */
+struct rom_image {
+	uint8_t *buf;	//file contents. Must not be modified unless opened as writable
+	uint32_t siz;	//in bytes
+	bool mapped;	//buf is a read-only mmap view, else a malloc'd copy
+};
+
+/** load a whole file.
+ *
+ * @param writable : if 1, contents are always copied to a private buffer that the caller may modify.
+ *	Otherwise the file is mmap'ed read-only if possible, falling back to a copy.
+ *	Non-regular files (pipes, FIFOs, /dev/fd/N) are read until EOF.
+ *
+ * Size limits are left to the caller; only empty files are rejected.
+ * @return 0 if ok; caller must call romimg_close() after
+ */
+int romimg_open(struct rom_image *img, const char *fname, bool writable);
+
+/** unmap / free image. Safe to call multiple times or on a zeroed struct */
+void romimg_close(struct rom_image *img);
+
 /** Read uint32 at *buf with SH endianness
 */
 uint32_t reconst_32(const uint8_t *buf);
@@ -48,7 +72,7 @@ void write_32b(uint32_t val, uint8_t *buf);
  * @param nlen size of "needle" pattern
  * @return NULL if not found
  *
- * Painfully unoptimized, because it's easy to get it wrong
+ * Note : the last position (buf + buflen - nlen) is never tested.
  */
 const uint8_t *u8memstr(const uint8_t *buf, uint32_t buflen, const uint8_t *needle, unsigned nlen);
 
@@ -63,6 +87,30 @@ const uint8_t *u16memstr_rev(const uint8_t *buf, uint32_t start_pos, const uint1
  */
 const uint8_t *u32memstr(const uint8_t *buf, uint32_t buflen, const uint32_t needle);
 
+#define IDRUN_MAXMIN	16	//max minlen for idchar_run()
+
+/** find the next run of at least <minlen> ECUID chars ([0-9A-Z], uppercase only) in [from, siz[
+ *
+ * Runs are maximal, except one that starts before <from> is cut there.
+ * Resume with from = start + *len to get the next one.
+ * @param minlen : 1 to IDRUN_MAXMIN
+ * @param len : length of the run, if found
+ * @return start of the run, UINT32_MAX if none
+ */
+uint32_t idchar_run(const uint8_t *buf, uint32_t siz, uint32_t from, unsigned minlen, uint32_t *len);
+
+/** name of the search / checksum kernels in use : "scalar", "sse2", "avx2" or "neon".
+ * The NISLIB_SIMD environment variable can force a lower level, e.g. NISLIB_SIMD=scalar.
+ * The neon kernels are only built with -DNISLIB_NEON.
+ */
+const char *nislib_simd_name(void);
+
+/** use the "scalar", "sse2", "avx2" or "neon" kernels from now on, e.g. to compare them in tests.
+ * Not meant to be called while other threads use the kernels.
+ * @return 0 if ok, -1 if unknown or not available on this build / CPU
+ */
+int nislib_simd_force(const char *name);
+
 
 
 /* "security" algorithms */
@@ -79,12 +127,109 @@ uint32_t enc1(uint32_t data, uint32_t scode);
  */
 uint32_t dec1(uint32_t data, uint32_t scode);
 
+/** encrypt / decrypt buffer with algo 1.
+ * @param len : multiple of 4
+ * src and dst may be the same buffer.
+ */
+void enc1_buf(const uint8_t *src, uint8_t *dst, uint32_t len, uint32_t scode);
+void dec1_buf(const uint8_t *src, uint8_t *dst, uint32_t len, uint32_t scode);
+
+/** enc1 / dec1 of n independent (data, key) pairs : out[i] = enc1(data[i], scodes[i]).
+ * Plain loops over the inlined algo, that the compiler vectorizes.
+ * out may be the same array as data.
+ * e.g. SID27 : keys for many seeds at once is enc1_batch(seeds, s27keys, keys, n)
+ */
+void enc1_batch(const uint32_t *data, const uint32_t *scodes, uint32_t *out, unsigned n);
+void dec1_batch(const uint32_t *data, const uint32_t *scodes, uint32_t *out, unsigned n);
+
+/** dec1 key solver : set of keys that decode all the (enc, dec) pairs seen so far.
+ *
+ * Since each half of a key can be solved separately, the set is stored as two bitmaps :
+ * key K is a candidate iff its high half is set in hmask and its low half in lmask.
+ */
+#define DEC1_MASKLEN	(65536 / 32)
+struct dec1_solver {
+	uint32_t lmask[DEC1_MASKLEN];
+	uint32_t hmask[DEC1_MASKLEN];
+};
+
+/** start with every possible key */
+void dec1_solve_init(struct dec1_solver *ds);
+
+/** remove candidates that don't give dec1(enc, key) == dec
+ * @return number of remaining candidate keys
+ */
+uint64_t dec1_solve_pair(struct dec1_solver *ds, uint32_t enc, uint32_t dec);
+
+/** @return number of candidate keys */
+uint64_t dec1_solve_count(const struct dec1_solver *ds);
+
+/** call cb for each candidate key in [kmin, kmax], in ascending order.
+ * cb returns 0 to stop iteration.
+ */
+void dec1_solve_iterate(const struct dec1_solver *ds, uint32_t kmin, uint32_t kmax,
+			bool (*cb)(uint32_t key, void *data), void *data);
+
+/** partial known plaintext for dec1_search() : bounds on one decrypted u32.
+ * The low half must give (low & lmask) == lval, the high half must be in [hmin, hmax].
+ * e.g. a reset PC (<= 0x00FFFFFF, even) is {enc, 1, 0, 0, 0x00FF}.
+ */
+struct dec1_cons {
+	uint32_t enc;
+	uint16_t lmask;
+	uint16_t lval;
+	uint16_t hmin;
+	uint16_t hmax;
+};
+
+#define DEC1_MAXCONS	4
+
+/** exhaustive search for keys that decrypt every cons[] word within its bounds,
+ * over the keys whose low half is in [klmin, klmax]; the high half always covers 0-0xFFFF.
+ * Like the solver, the low half of the key is tested once per constraint; the high half is
+ * only scanned for the low halves that pass, which makes it much faster than 2^32 dec1() calls.
+ *
+ * @param ncons : 1 to DEC1_MAXCONS
+ * cb is called for each matching key, by increasing low half then high half; it returns 0 to stop.
+ * @return 0 if cb stopped the search
+ */
+bool dec1_search(const struct dec1_cons *cons, unsigned ncons, uint16_t klmin, uint16_t klmax,
+			bool (*cb)(uint32_t key, void *data), void *data);
+
 /** Sum and xor all uint32_t values in *buf, read with SH endianness
  * @param [out] *xor
  * @param [out] *sum
  */
 void sum32(const uint8_t *buf, uint32_t siz, uint32_t *sum, uint32_t *xor);
 
+/** incremental sum32 : keep partial sums per block, so that after a small edit only the
+ * modified blocks need to be recalculated.
+ */
+struct sum32_state {
+	const uint8_t *buf;
+	uint32_t siz;	//rounded down to a multiple of 4
+	uint32_t bsize;	//block size, multiple of 4
+	uint32_t nblocks;
+	uint32_t *bsum;	//per-block partial sums
+	uint32_t *bxor;
+	uint32_t sum;	//totals over the whole buffer
+	uint32_t xor;
+};
+
+#define SUM32_DEFAULT_BSIZE	4096
+
+/** calculate all block sums of *buf
+ *
+ * @param bsize : block size in bytes, multiple of 4
+ * @return 0 if ok; must be followed by sum32_free()
+ */
+int sum32_init(struct sum32_state *ss, const uint8_t *buf, uint32_t siz, uint32_t bsize);
+
+/** update sums after bytes [offs, offs + len[ of ss->buf were modified */
+void sum32_update(struct sum32_state *ss, uint32_t offs, uint32_t len);
+
+void sum32_free(struct sum32_state *ss);
+
 /** calculate checksums and find their location
  *
  * @param siz : size of *buf in bytes
@@ -126,5 +271,15 @@ int checksum_alt2(const uint8_t *buf, uint32_t siz, uint32_t *p_ack_s, uint32_t
 void checksum_fix(uint8_t *buf, uint32_t siz, uint32_t p_cks, uint32_t p_ckx,
 		uint32_t p_a, uint32_t p_b, uint32_t p_c);
 
+/** same as checksum_fix(), using and updating existing sum32 state
+ *
+ * @param buf : writable view of ss->buf
+ *
+ * Only the blocks holding the correction values are recalculated, so this can be called
+ * repeatedly while patching a ROM.
+ */
+void checksum_fix_incr(struct sum32_state *ss, uint8_t *buf, uint32_t p_cks, uint32_t p_ckx,
+		uint32_t p_a, uint32_t p_b, uint32_t p_c);
+
 
 #endif // NISLIB_H
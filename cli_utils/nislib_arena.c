@@ -0,0 +1,212 @@
+/* arena and slab allocators
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib_arena.h"
+
+/* strictest alignment of the usual types */
+typedef union {
+	long double ld;
+	long long ll;
+	void *p;
+	void (*fp)(void);
+} arena_align_t;
+
+#define ARENA_ALIGN	((size_t) __alignof__(arena_align_t))
+#define ALIGN_UP(x)	(((x) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;	//usable bytes in data[]
+	size_t used;
+	size_t last;	//offset of the most recent allocation, for arena_grow()
+	arena_align_t data[];
+};
+
+
+void arena_init(struct arena *a, size_t chunk_size) {
+	assert(a);
+	a->head = NULL;
+	a->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+	a->total = 0;
+}
+
+static void free_chunks(struct arena_chunk *ch) {
+	while (ch) {
+		struct arena_chunk *next = ch->next;
+		free(ch);
+		ch = next;
+	}
+}
+
+void arena_done(struct arena *a) {
+	assert(a);
+	free_chunks(a->head);
+	a->head = NULL;
+	a->total = 0;
+}
+
+static struct arena_chunk *new_chunk(struct arena *a, size_t minsize) {
+	size_t size = (minsize > a->chunk_size) ? minsize : a->chunk_size;
+	struct arena_chunk *ch = malloc(sizeof(*ch) + size);
+	if (!ch) return NULL;
+	ch->size = size;
+	ch->used = 0;
+	ch->last = 0;
+	ch->next = a->head;
+	a->head = ch;
+	a->total += size;
+	return ch;
+}
+
+void arena_reset(struct arena *a) {
+	assert(a);
+	struct arena_chunk *ch = a->head;
+
+	if (!ch) return;
+	if (ch->next) {
+		//grew past one chunk : replace them all with one big enough for the whole run
+		size_t total = a->total;
+		free_chunks(ch);
+		a->head = NULL;
+		a->total = 0;
+		ch = new_chunk(a, total);
+		if (!ch) return;
+	}
+	ch->used = 0;
+	ch->last = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+	assert(a);
+	struct arena_chunk *ch = a->head;
+
+	size = ALIGN_UP(size ? size : 1);
+	if (!ch || ((ch->size - ch->used) < size)) {
+		ch = new_chunk(a, size);
+		if (!ch) return NULL;
+	}
+	ch->last = ch->used;
+	ch->used += size;
+	return (char *) ch->data + ch->last;
+}
+
+void *arena_calloc(struct arena *a, size_t nmemb, size_t size) {
+	if (size && (nmemb > (SIZE_MAX / size))) return NULL;
+	void *p = arena_alloc(a, nmemb * size);
+	if (p) memset(p, 0, nmemb * size);
+	return p;
+}
+
+void *arena_grow(struct arena *a, void *ptr, size_t oldsize, size_t newsize) {
+	assert(a);
+	struct arena_chunk *ch = a->head;
+
+	if (!ptr) return arena_alloc(a, newsize);
+	if (newsize <= oldsize) return ptr;
+	if (ch && (ptr == (char *) ch->data + ch->last)) {
+		size_t need = ALIGN_UP(newsize);
+		if ((ch->size - ch->last) >= need) {
+			ch->used = ch->last + need;
+			return ptr;
+		}
+	}
+	void *np = arena_alloc(a, newsize);
+	if (np) memcpy(np, ptr, oldsize);
+	return np;
+}
+
+char *arena_vprintf(struct arena *a, const char *fmt, va_list ap) {
+	assert(a && fmt);
+	struct arena_chunk *ch = a->head;
+	va_list ap2;
+	char *dst = NULL;
+	size_t avail = 0;
+	int len;
+
+	//try in place first; most strings are short and fit in the current chunk
+	if (ch) {
+		dst = (char *) ch->data + ch->used;
+		avail = ch->size - ch->used;
+	}
+	va_copy(ap2, ap);
+	len = vsnprintf(dst, avail, fmt, ap2);
+	va_end(ap2);
+	if (len < 0) return NULL;
+
+	if ((size_t) len < avail) {
+		ch->last = ch->used;
+		ch->used += ALIGN_UP((size_t) len + 1);
+		if (ch->used > ch->size) ch->used = ch->size;
+		return dst;
+	}
+
+	dst = arena_alloc(a, (size_t) len + 1);
+	if (!dst) return NULL;
+	vsnprintf(dst, (size_t) len + 1, fmt, ap);
+	return dst;
+}
+
+char *arena_printf(struct arena *a, const char *fmt, ...) {
+	va_list ap;
+	char *s;
+
+	va_start(ap, fmt);
+	s = arena_vprintf(a, fmt, ap);
+	va_end(ap);
+	return s;
+}
+
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread struct arena thread_arena;
+static __thread bool thread_arena_init;
+
+static void thread_arena_free(void *arg) {
+	arena_done(arg);
+}
+
+static void thread_key_init(void) {
+	(void) pthread_key_create(&thread_key, thread_arena_free);
+}
+
+struct arena *arena_thread(void) {
+	if (!thread_arena_init) {
+		pthread_once(&thread_once, thread_key_init);
+		arena_init(&thread_arena, 0);
+		(void) pthread_setspecific(thread_key, &thread_arena);
+		thread_arena_init = 1;
+	}
+	return &thread_arena;
+}
+
+
+void slab_init(struct slab *s, size_t objsize, size_t per_chunk) {
+	assert(s && objsize);
+	s->objsize = ALIGN_UP(objsize);
+	arena_init(&s->mem, s->objsize * (per_chunk ? per_chunk : 1));
+}
+
+void *slab_alloc(struct slab *s) {
+	assert(s);
+	void *p = arena_alloc(&s->mem, s->objsize);
+	if (p) memset(p, 0, s->objsize);
+	return p;
+}
+
+void slab_done(struct slab *s) {
+	assert(s);
+	arena_done(&s->mem);
+}
@@ -0,0 +1,75 @@
+/* arena and slab allocators, for data with a common lifetime
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * An arena hands out memory from large chunks, and everything is released at once by arena_reset().
+ * After a reset the memory is kept (merged in a single chunk if it had grown), so
+ * a loop that resets the arena every iteration stops calling malloc once it has seen its largest input.
+ *
+ * A slab is the same idea for many records of one size that are only released together.
+ */
+
+#ifndef NISLIB_ARENA_H
+#define NISLIB_ARENA_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *head;	//current chunk; older ones follow
+	size_t chunk_size;	//minimum size of new chunks
+	size_t total;	//sum of chunk sizes
+};
+
+#define ARENA_DEFAULT_CHUNK	(256 * 1024UL)
+
+/** @param chunk_size : 0 for ARENA_DEFAULT_CHUNK */
+void arena_init(struct arena *a, size_t chunk_size);
+
+/** free all chunks. The arena can be reused after arena_init() */
+void arena_done(struct arena *a);
+
+/** release everything allocated so far, keeping the memory for later allocations. */
+void arena_reset(struct arena *a);
+
+/** @return <size> bytes aligned for any type, NULL if out of memory */
+void *arena_alloc(struct arena *a, size_t size);
+
+/** same, zeroed */
+void *arena_calloc(struct arena *a, size_t nmemb, size_t size);
+
+/** resize an allocation (NULL : new one), like realloc(). Grows in place when ptr is the
+ * most recent allocation, else copies; the old block is only reclaimed by arena_reset().
+ */
+void *arena_grow(struct arena *a, void *ptr, size_t oldsize, size_t newsize);
+
+/** printf into a new 0-terminated string
+ * @return NULL if out of memory
+ */
+char *arena_printf(struct arena *a, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+char *arena_vprintf(struct arena *a, const char *fmt, va_list ap);
+
+/** per-thread arena, created on first use and freed when the thread exits.
+ * Never NULL, but allocations from it can still fail.
+ */
+struct arena *arena_thread(void);
+
+
+struct slab {
+	struct arena mem;
+	size_t objsize;
+};
+
+/** @param per_chunk : records per chunk */
+void slab_init(struct slab *s, size_t objsize, size_t per_chunk);
+
+/** @return zeroed record, NULL if out of memory */
+void *slab_alloc(struct slab *s);
+
+/** free all records */
+void slab_done(struct slab *s);
+
+#endif
@@ -0,0 +1,374 @@
+/* whole-ROM function starts and call graph for SH ROMs
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_callgraph.h"
+#include "nislib_shindex.h"
+#include "nislib_shtools.h"
+#include "nisrom_finders.h"
+#include "sh_opcodes.h"
+#include "stypes.h"
+
+#define CG_IVT_STRIDE	0x400	//IVTs are at least this long; skip that much after one is found
+#define CG_IVT_MAXVECT	0x200	//vectors to read per IVT, max
+#define CG_JSR_WINDOW	16	//opcodes to look at after a literal load, to find its jsr
+#define OPC_RTS	0x000B
+
+struct sh_callgraph {
+	struct cg_func *funcs;	//sorted by addr, unique
+	u32 nfuncs;
+
+	/* CSR : edges of caller X are out[out_start[X] .. out_start[X + 1][.
+	 * Edges with caller CG_NOFUNC are at the end, after out_start[nfuncs].
+	 */
+	struct cg_edge *out;
+	u32 *out_start;
+	struct cg_edge *in;	//same edges, by callee
+	u32 *in_start;
+	u32 nedges;
+};
+
+/* growable arrays for the build */
+struct funcvec {
+	struct cg_func *v;
+	u32 n, alloc;
+};
+
+struct edgevec {
+	struct cg_edge *v;
+	u32 n, alloc;
+};
+
+static bool add_func(struct funcvec *fv, u32 addr, unsigned flags) {
+	if (fv->n == fv->alloc) {
+		u32 newalloc = fv->alloc ? (2 * fv->alloc) : 1024;
+		struct cg_func *newv = realloc(fv->v, newalloc * sizeof(*newv));
+		if (!newv) return 0;
+		fv->v = newv;
+		fv->alloc = newalloc;
+	}
+	fv->v[fv->n].addr = addr;
+	fv->v[fv->n].flags = flags;
+	fv->n++;
+	return 1;
+}
+
+static bool add_edge(struct edgevec *ev, u32 site, u32 load, u32 tgt, enum cg_kind kind) {
+	if (ev->n == ev->alloc) {
+		u32 newalloc = ev->alloc ? (2 * ev->alloc) : 1024;
+		struct cg_edge *newv = realloc(ev->v, newalloc * sizeof(*newv));
+		if (!newv) return 0;
+		ev->v = newv;
+		ev->alloc = newalloc;
+	}
+	//callee is the target address until the functions are sorted
+	ev->v[ev->n] = (struct cg_edge) {.site = site, .load = load, .caller = CG_NOFUNC, .callee = tgt, .kind = kind};
+	ev->n++;
+	return 1;
+}
+
+static int cmp_func(const void *a, const void *b) {
+	const struct cg_func *fa = a, *fb = b;
+	if (fa->addr != fb->addr) return (fa->addr < fb->addr) ? -1 : 1;
+	return 0;
+}
+
+static int cmp_edge_out(const void *a, const void *b) {
+	const struct cg_edge *ea = a, *eb = b;
+	if (ea->caller != eb->caller) return (ea->caller < eb->caller) ? -1 : 1;
+	if (ea->site != eb->site) return (ea->site < eb->site) ? -1 : 1;
+	if (ea->callee != eb->callee) return (ea->callee < eb->callee) ? -1 : 1;
+	return 0;
+}
+
+static int cmp_edge_in(const void *a, const void *b) {
+	const struct cg_edge *ea = a, *eb = b;
+	if (ea->callee != eb->callee) return (ea->callee < eb->callee) ? -1 : 1;
+	if (ea->site != eb->site) return (ea->site < eb->site) ? -1 : 1;
+	if (ea->caller != eb->caller) return (ea->caller < eb->caller) ? -1 : 1;
+	return 0;
+}
+
+static bool is_codeaddr(u32 addr, u32 siz) {
+	return !(addr & 1) && ((addr + 2) <= siz);
+}
+
+/** vectors of every IVT. The SP entries point in RAM and are skipped like any out-of-ROM value. */
+static bool add_ivts(struct funcvec *fv, const u8 *buf, u32 siz) {
+	u32 pos;
+
+	for (pos = 0; (pos + IVT_MINSIZE) <= siz; pos += 4) {
+		if (!check_ivt(&buf[pos], siz - pos)) continue;
+
+		u32 vect;
+		for (vect = 0; (vect < CG_IVT_MAXVECT) && ((pos + vect * 4 + 4) <= siz); vect++) {
+			u32 tgt = reconst_32(&buf[pos + vect * 4]);
+			if (is_codeaddr(tgt, siz)) {
+				if (!add_func(fv, tgt, CGF_IVT)) return 0;
+			} else if (vect >= 4) {
+				break;	//past the end of the table
+			}
+		}
+		pos += CG_IVT_STRIDE - 4;
+	}
+	return 1;
+}
+
+static bool add_calltables(struct funcvec *fv, const u8 *buf, u32 siz) {
+	u32 skip = 0;
+
+	while (skip < (siz & ~3)) {
+		unsigned ctlen, i;
+		u32 ct = find_calltable(buf, skip, siz, &ctlen);
+		if (ct == UINT32_MAX) break;
+		for (i = 0; i < ctlen; i++) {
+			u32 tgt = reconst_32(&buf[ct + i * 4]);
+			if (is_codeaddr(tgt, siz) && !add_func(fv, tgt, CGF_CALLTABLE)) return 0;
+		}
+		skip = ct + (ctlen * 4);
+	}
+	return 1;
+}
+
+/** literal loads : find the jsr @Rn that uses it, before Rn is clobbered */
+static bool add_literal_calls(struct funcvec *fv, struct edgevec *ev, const struct sh_index *idx,
+				const u8 *buf, u32 siz) {
+	const struct sh_xref *lits;
+	u32 nlits = sh_index_allpcimm(idx, &lits);
+	u32 li;
+
+	for (li = 0; li < nlits; li++) {
+		u32 tgt = lits[li].val;
+		u32 load = lits[li].pos;
+		u16 lop = reconst_16(&buf[load]);
+		unsigned regno = (lop >> 8) & 0x0F;
+		u32 pos, end;
+		bool found = 0;
+
+		if (!is_codeaddr(tgt, siz)) continue;
+
+		//a register can be reused for several calls, until it's clobbered
+		end = load + 2 + (CG_JSR_WINDOW * 2);
+		if (end > siz) end = siz & ~1;
+		for (pos = load + 2; pos < end; pos += 2) {
+			u16 op = reconst_16(&buf[pos]);
+			if (IS_JSR(op) && (GET_TARGET_REG(op) == regno)) {
+				if (!found && !add_func(fv, tgt, CGF_JSR)) return 0;
+				if (!add_edge(ev, pos, load, tgt, CG_JSR)) return 0;
+				found = 1;
+				continue;
+			}
+			if ((op == OPC_RTS) || (sh_getopcode_dest(op) == regno)) break;
+		}
+		if (found) continue;
+		//mov.w can't reach most code; only accept function pointers loaded with mov.l
+		if (!(lop & 0x4000) || !sh_isprologue(&buf[tgt])) continue;
+		if (!add_func(fv, tgt, CGF_REF) || !add_edge(ev, load, load, tgt, CG_REF)) return 0;
+	}
+	return 1;
+}
+
+static bool add_bsr_calls(struct funcvec *fv, struct edgevec *ev, const struct sh_index *idx, u32 siz) {
+	const struct sh_xref *bsrs;
+	u32 nbsr = sh_index_allbsr(idx, &bsrs);
+	u32 bi;
+
+	for (bi = 0; bi < nbsr; bi++) {
+		u32 tgt = bsrs[bi].val;
+		if (!is_codeaddr(tgt, siz)) continue;
+		//sorted by target : one function entry per target is enough
+		if (!bi || (bsrs[bi - 1].val != tgt)) {
+			if (!add_func(fv, tgt, CGF_BSR)) return 0;
+		}
+		if (!add_edge(ev, bsrs[bi].pos, bsrs[bi].pos, tgt, CG_BSR)) return 0;
+	}
+	return 1;
+}
+
+static bool add_prologues(struct funcvec *fv, const struct sh_index *idx, const u8 *buf, u32 siz) {
+	const u32 *rts;
+	u32 nrts = sh_index_opcode(idx, OPC_RTS, &rts);
+	u32 ri;
+
+	for (ri = 0; ri < nrts; ri++) {
+		u32 pos = rts[ri] + 4;	//after delay slot
+		if (!is_codeaddr(pos, siz) || !sh_isprologue(&buf[pos])) continue;
+		if (!add_func(fv, pos, CGF_PROLOGUE)) return 0;
+	}
+	return 1;
+}
+
+/* sort, merge flags of duplicates */
+static void merge_funcs(struct funcvec *fv) {
+	u32 cur, uniq = 0;
+
+	qsort(fv->v, fv->n, sizeof(*fv->v), cmp_func);
+	for (cur = 0; cur < fv->n; cur++) {
+		if (uniq && (fv->v[uniq - 1].addr == fv->v[cur].addr)) {
+			fv->v[uniq - 1].flags |= fv->v[cur].flags;
+			continue;
+		}
+		fv->v[uniq++] = fv->v[cur];
+	}
+	fv->n = uniq;
+}
+
+/* @return number of funcs with addr <= pos */
+static u32 funcs_upper(const struct cg_func *funcs, u32 nfuncs, u32 pos) {
+	u32 lo = 0, hi = nfuncs;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (funcs[mid].addr <= pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/** fill CSR row starts; edges already sorted by the row key */
+static void fill_rows(u32 *start, u32 nrows, const struct cg_edge *e, u32 nedges, bool by_caller) {
+	u32 row, ei = 0;
+	for (row = 0; row < nrows; row++) {
+		start[row] = ei;
+		while ((ei < nedges) && ((by_caller ? e[ei].caller : e[ei].callee) == row)) ei++;
+	}
+	start[nrows] = ei;
+}
+
+struct sh_callgraph *sh_callgraph_build(const struct sh_index *idx, const uint8_t *buf, uint32_t siz) {
+	assert(idx && buf && siz && (siz <= MAX_ROMSIZE));
+	struct funcvec fv = {0};
+	struct edgevec ev = {0};
+	struct sh_callgraph *cg = calloc(1, sizeof(*cg));
+	u32 ei;
+
+	if (!cg) goto bad;
+	siz &= ~1;
+
+	if (!add_ivts(&fv, buf, siz) ||
+		!add_calltables(&fv, buf, siz) ||
+		!add_bsr_calls(&fv, &ev, idx, siz) ||
+		!add_literal_calls(&fv, &ev, idx, buf, siz) ||
+		!add_prologues(&fv, idx, buf, siz)) {
+		goto bad;
+	}
+	merge_funcs(&fv);
+
+	//every edge target was added as a function
+	for (ei = 0; ei < ev.n; ei++) {
+		struct cg_edge *e = &ev.v[ei];
+		u32 up = funcs_upper(fv.v, fv.n, e->callee);
+		assert(up && (fv.v[up - 1].addr == e->callee));
+		e->callee = up - 1;
+		up = funcs_upper(fv.v, fv.n, e->site);
+		e->caller = up ? (up - 1) : CG_NOFUNC;
+	}
+
+	cg->funcs = fv.v;
+	cg->nfuncs = fv.n;
+	cg->nedges = ev.n;
+	cg->out = ev.v;
+	fv.v = NULL;
+	ev.v = NULL;
+
+	cg->in = malloc((cg->nedges + 1) * sizeof(*cg->in));
+	cg->out_start = malloc((cg->nfuncs + 1) * sizeof(*cg->out_start));
+	cg->in_start = malloc((cg->nfuncs + 1) * sizeof(*cg->in_start));
+	if (!cg->in || !cg->out_start || !cg->in_start) goto bad;
+
+	if (cg->nedges) memcpy(cg->in, cg->out, cg->nedges * sizeof(*cg->in));
+	qsort(cg->out, cg->nedges, sizeof(*cg->out), cmp_edge_out);
+	qsort(cg->in, cg->nedges, sizeof(*cg->in), cmp_edge_in);
+	fill_rows(cg->out_start, cg->nfuncs, cg->out, cg->nedges, 1);
+	fill_rows(cg->in_start, cg->nfuncs, cg->in, cg->nedges, 0);
+	return cg;
+
+bad:
+	ERR_PRINTF("sh_callgraph : malloc failed\n");
+	free(fv.v);
+	free(ev.v);
+	sh_callgraph_free(cg);
+	return NULL;
+}
+
+void sh_callgraph_free(struct sh_callgraph *cg) {
+	if (!cg) return;
+	free(cg->funcs);
+	free(cg->out);
+	free(cg->out_start);
+	free(cg->in);
+	free(cg->in_start);
+	free(cg);
+}
+
+u32 sh_callgraph_funcs(const struct sh_callgraph *cg, const struct cg_func **funcs) {
+	assert(cg && funcs);
+	*funcs = cg->funcs;
+	return cg->nfuncs;
+}
+
+u32 sh_callgraph_find(const struct sh_callgraph *cg, u32 addr) {
+	assert(cg);
+	u32 up = funcs_upper(cg->funcs, cg->nfuncs, addr);
+	if (up && (cg->funcs[up - 1].addr == addr)) return up - 1;
+	return CG_NOFUNC;
+}
+
+u32 sh_callgraph_containing(const struct sh_callgraph *cg, u32 pos) {
+	assert(cg);
+	u32 up = funcs_upper(cg->funcs, cg->nfuncs, pos);
+	return up ? (up - 1) : CG_NOFUNC;
+}
+
+u32 sh_callgraph_callees(const struct sh_callgraph *cg, u32 fi, const struct cg_edge **edges) {
+	assert(cg && edges && (fi < cg->nfuncs));
+	*edges = &cg->out[cg->out_start[fi]];
+	return cg->out_start[fi + 1] - cg->out_start[fi];
+}
+
+u32 sh_callgraph_callers(const struct sh_callgraph *cg, u32 fi, const struct cg_edge **edges) {
+	assert(cg && edges && (fi < cg->nfuncs));
+	*edges = &cg->in[cg->in_start[fi]];
+	return cg->in_start[fi + 1] - cg->in_start[fi];
+}
+
+int sh_callgraph_export(const struct sh_callgraph *cg, FILE *outf) {
+	static const char *flagnames[] = {"ivt", "calltable", "bsr", "jsr", "ref", "prologue"};
+	static const char *kindnames[] = {[CG_BSR] = "bsr", [CG_JSR] = "jsr", [CG_REF] = "ref"};
+	u32 i;
+
+	assert(cg && outf);
+	fprintf(outf, "type,addr,target,info\n");
+	for (i = 0; i < cg->nfuncs; i++) {
+		unsigned fl;
+		bool first = 1;
+		fprintf(outf, "func,0x%08lX,,", (unsigned long) cg->funcs[i].addr);
+		for (fl = 0; fl < ARRAY_SIZE(flagnames); fl++) {
+			if (!(cg->funcs[i].flags & (1U << fl))) continue;
+			fprintf(outf, "%s%s", first ? "" : "|", flagnames[fl]);
+			first = 0;
+		}
+		fprintf(outf, "\n");
+	}
+	for (i = 0; i < cg->nedges; i++) {
+		const struct cg_edge *e = &cg->out[i];
+		fprintf(outf, "%s,0x%08lX,0x%08lX,", kindnames[e->kind],
+				(unsigned long) e->site, (unsigned long) cg->funcs[e->callee].addr);
+		if (e->caller != CG_NOFUNC) {
+			fprintf(outf, "0x%08lX", (unsigned long) cg->funcs[e->caller].addr);
+		}
+		fprintf(outf, "\n");
+	}
+	return ferror(outf) ? -1 : 0;
+}
@@ -0,0 +1,86 @@
+/* whole-ROM function starts and call graph for SH ROMs, built once from the code index
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_CALLGRAPH_H
+#define NISLIB_CALLGRAPH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nislib_shindex.h"
+#include "stypes.h"
+
+/* why an address is considered a function start; several can apply */
+#define CGF_IVT		(1 << 0)	//vector in an IVT
+#define CGF_CALLTABLE	(1 << 1)	//entry of a find_calltable() table
+#define CGF_BSR		(1 << 2)	//bsr target
+#define CGF_JSR		(1 << 3)	//jsr target, through a PC-relative literal
+#define CGF_REF		(1 << 4)	//PC-relative literal pointing to a prologue
+#define CGF_PROLOGUE	(1 << 5)	//prologue right after "rts" + delay slot
+
+#define CG_NOFUNC	UINT32_MAX
+
+struct cg_func {
+	u32 addr;
+	unsigned flags;	//CGF_*
+};
+
+enum cg_kind {
+	CG_BSR,	//bsr <callee>
+	CG_JSR,	//mov.x @(disp, PC), Rn ... jsr @Rn
+	CG_REF,	//mov.x @(disp, PC), Rn loading <callee>, without a jsr found : function pointer
+};
+
+struct cg_edge {
+	u32 site;	//bsr / jsr opcode; for CG_REF, the literal load
+	u32 load;	//literal load for CG_JSR and CG_REF, == site for CG_BSR
+	u32 caller;	//function containing site (index), CG_NOFUNC if before the first function
+	u32 callee;	//function index
+	enum cg_kind kind;
+};
+
+/** opaque graph. Read-only once built, can be shared between threads. */
+struct sh_callgraph;
+
+/** find function starts (IVT entries, call tables, call targets, prologues after rts)
+ * and call edges from bsr, jsr through literals, and other literal references to functions.
+ *
+ * Functions are sorted by address. Edges are kept twice in compressed rows : by caller, then by callee.
+ * @return NULL if failed
+ */
+struct sh_callgraph *sh_callgraph_build(const struct sh_index *idx, const uint8_t *buf, uint32_t siz);
+
+void sh_callgraph_free(struct sh_callgraph *cg);
+
+/** @return number of functions; *funcs points inside the graph, sorted by address */
+u32 sh_callgraph_funcs(const struct sh_callgraph *cg, const struct cg_func **funcs);
+
+/** @return index of the function starting at addr, or CG_NOFUNC */
+u32 sh_callgraph_find(const struct sh_callgraph *cg, u32 addr);
+
+/** @return index of the last function starting at or before pos, or CG_NOFUNC */
+u32 sh_callgraph_containing(const struct sh_callgraph *cg, u32 pos);
+
+/** outgoing edges of function <fi>, sorted by site
+ * @return number of edges; *edges points inside the graph
+ */
+u32 sh_callgraph_callees(const struct sh_callgraph *cg, u32 fi, const struct cg_edge **edges);
+
+/** incoming edges of function <fi>, sorted by site
+ * @return number of edges; *edges points inside the graph
+ */
+u32 sh_callgraph_callers(const struct sh_callgraph *cg, u32 fi, const struct cg_edge **edges);
+
+/** write graph as CSV, header "type,addr,target,info" :
+ * - "func,<addr>,,<flags>" with flags like "ivt|bsr"
+ * - "bsr|jsr|ref,<site>,<callee addr>,<caller addr>"
+ * Addresses are hex "0x%08X". Read by ghidra_helpers/nissan_load.py.
+ *
+ * @return 0 if ok
+ */
+int sh_callgraph_export(const struct sh_callgraph *cg, FILE *outf);
+
+#endif
@@ -0,0 +1,333 @@
+/* apply byte patches to a ROM image and fix every checksum region in one go
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_ckpatch.h"
+#include "stypes.h"
+
+
+int ckpatch_init(struct ckpatch *cp, u8 *buf, u32 siz) {
+	assert(cp && buf && siz && (siz <= MAX_ROMSIZE));
+
+	memset(cp, 0, sizeof(*cp));
+	cp->dirty = calloc((siz + 7) / 8, 1);
+	if (!cp->dirty) return -1;
+	cp->buf = buf;
+	cp->siz = siz;
+	return 0;
+}
+
+void ckpatch_done(struct ckpatch *cp) {
+	assert(cp);
+	free(cp->dirty);
+	cp->dirty = NULL;
+}
+
+static u32 reg_end(const struct ck_region *r) {
+	return r->start + r->len;
+}
+
+static bool overlaps(u32 a, u32 alen, u32 b, u32 blen) {
+	return (a < (b + blen)) && (b < (a + alen));
+}
+
+/* word at <pos> is one of the region's own u32s */
+static bool on_grid(const struct ck_region *r, u32 pos) {
+	return (pos >= r->start) && ((pos + 4) <= reg_end(r)) && !((pos - r->start) & 3);
+}
+
+/* a check word is either one of the region's u32s, and then it doesn't count, or outside the region */
+static bool word_ok(const struct ck_region *r, u32 pos, u32 siz) {
+	if ((pos > siz) || ((siz - pos) < 4)) return 0;
+	return on_grid(r, pos) || !overlaps(pos, 4, r->start, r->len);
+}
+
+/* the words a region writes when fixed
+ * @return how many */
+static unsigned fixed_words(const struct ck_region *r, u32 words[3]) {
+	if (r->fix == CKFIX_CORRECT) {
+		words[0] = r->p_corr;
+		words[1] = r->p_corr + 4;
+		words[2] = r->p_corr + 8;
+		return 3;
+	}
+	words[0] = r->p_sum;
+	words[1] = r->p_xor;
+	return 2;
+}
+
+int ckpatch_addregion(struct ckpatch *cp, const struct ck_region *reg) {
+	assert(cp && reg);
+	struct ck_region r = *reg;
+
+	if (cp->nregions == CKP_MAXREGIONS) return -1;
+	r.len &= ~3;
+	if (!r.len || (r.start > cp->siz) || (r.len > (cp->siz - r.start))) {
+		ERR_PRINTF("%s : bad region 0x%lX + 0x%lX\n", r.name, (unsigned long) r.start, (unsigned long) r.len);
+		return -1;
+	}
+	if (!word_ok(&r, r.p_sum, cp->siz) || !word_ok(&r, r.p_xor, cp->siz) || overlaps(r.p_sum, 4, r.p_xor, 4)) {
+		ERR_PRINTF("%s : sum / xor at 0x%lX, 0x%lX are not aligned u32s of the region\n", r.name,
+					(unsigned long) r.p_sum, (unsigned long) r.p_xor);
+		return -1;
+	}
+	if ((r.p_skip != UINT32_MAX) && !on_grid(&r, r.p_skip)) {
+		ERR_PRINTF("%s : bad skipped u32 0x%lX\n", r.name, (unsigned long) r.p_skip);
+		return -1;
+	}
+	if (r.fix == CKFIX_CORRECT) {
+		if (!on_grid(&r, r.p_corr) || !on_grid(&r, r.p_corr + 8) ||
+			overlaps(r.p_corr, 12, r.p_sum, 4) || overlaps(r.p_corr, 12, r.p_xor, 4) ||
+			((r.p_skip != UINT32_MAX) && overlaps(r.p_corr, 12, r.p_skip, 4))) {
+			ERR_PRINTF("%s : bad correction words @ 0x%lX\n", r.name, (unsigned long) r.p_corr);
+			return -1;
+		}
+	}
+	r.done = 0;
+	cp->regions[cp->nregions++] = r;
+	return 0;
+}
+
+static void mark_dirty(struct ckpatch *cp, u32 pos, u32 len) {
+	u32 idx;
+	for (idx = pos; idx < (pos + len); idx++) {
+		cp->dirty[idx / 8] |= 1 << (idx % 8);
+	}
+}
+
+int ckpatch_write(struct ckpatch *cp, u32 offs, const u8 *data, u32 len) {
+	assert(cp && data);
+	unsigned ri;
+
+	if ((offs > cp->siz) || (len > (cp->siz - offs))) {
+		ERR_PRINTF("patch 0x%lX + 0x%lX is outside the ROM\n", (unsigned long) offs, (unsigned long) len);
+		return -1;
+	}
+	for (ri = 0; ri < cp->nregions; ri++) {
+		const struct ck_region *r = &cp->regions[ri];
+		u32 words[5] = {r->p_sum, r->p_xor, r->p_corr, r->p_corr + 4, r->p_corr + 8};
+		unsigned nw = (r->fix == CKFIX_CORRECT) ? 5 : 2;
+		unsigned wi;
+
+		for (wi = 0; wi < nw; wi++) {
+			if (overlaps(offs, len, words[wi], 4)) {
+				ERR_PRINTF("patch 0x%lX + 0x%lX overwrites %s checksum word @ 0x%lX\n",
+					(unsigned long) offs, (unsigned long) len, r->name, (unsigned long) words[wi]);
+				return -1;
+			}
+		}
+	}
+
+	u32 idx;
+	for (idx = 0; idx < len; idx++) {
+		if (cp->buf[offs + idx] == data[idx]) continue;
+		cp->buf[offs + idx] = data[idx];
+		mark_dirty(cp, offs + idx, 1);
+	}
+	return 0;
+}
+
+/* add (or remove) the contribution of bytes [lo, hi[ to the sums of region r.
+ * Used around every write done while fixing, so the sums of other regions stay current.
+ */
+static void reg_contrib(struct ck_region *r, const u8 *buf, u32 lo, u32 hi, bool add) {
+	u32 end = reg_end(r);
+	u32 excl[3] = {r->p_sum, r->p_xor, r->p_skip};
+	u32 k, kmax;
+	unsigned ei;
+
+	if ((hi <= r->start) || (lo >= end)) return;
+	k = (lo > r->start) ? (lo - r->start) / 4 : 0;
+	kmax = (((hi < end) ? hi : end) - r->start + 3) / 4;
+	for (; k < kmax; k++) {
+		u32 w = reconst_32(&buf[r->start + 4 * k]);
+		r->sum += add ? w : -w;
+		r->xor ^= w;
+	}
+	for (ei = 0; ei < ARRAY_SIZE(excl); ei++) {
+		if ((excl[ei] == UINT32_MAX) || !on_grid(r, excl[ei]) || !overlaps(lo, hi - lo, excl[ei], 4)) continue;
+		u32 w = reconst_32(&buf[excl[ei]]);
+		r->sum += add ? -w : w;
+		r->xor ^= w;
+	}
+}
+
+static void put32(struct ckpatch *cp, u32 pos, u32 val) {
+	unsigned ri;
+
+	if (reconst_32(&cp->buf[pos]) == val) return;
+	for (ri = 0; ri < cp->nregions; ri++) reg_contrib(&cp->regions[ri], cp->buf, pos, pos + 4, 0);
+	write_32b(val, &cp->buf[pos]);
+	for (ri = 0; ri < cp->nregions; ri++) reg_contrib(&cp->regions[ri], cp->buf, pos, pos + 4, 1);
+	mark_dirty(cp, pos, 4);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	u32 ua = *(const u32 *) a, ub = *(const u32 *) b;
+	return (ua > ub) - (ua < ub);
+}
+
+/* sums of every region, from the current image. Regions are made of disjoint segments between
+ * region boundaries; each segment is summed once and added to every region that covers it.
+ * Regions whose start is not 4-aligned with the others get their own pass.
+ */
+static void sum_regions(struct ckpatch *cp) {
+	u32 bounds[2 * CKP_MAXREGIONS];
+	unsigned phase, ri;
+
+	for (ri = 0; ri < cp->nregions; ri++) {
+		cp->regions[ri].sum = 0;
+		cp->regions[ri].xor = 0;
+	}
+	for (phase = 0; phase < 4; phase++) {
+		unsigned nb = 0, bi;
+		for (ri = 0; ri < cp->nregions; ri++) {
+			const struct ck_region *r = &cp->regions[ri];
+			if ((r->start & 3) != phase) continue;
+			bounds[nb++] = r->start;
+			bounds[nb++] = reg_end(r);
+		}
+		if (!nb) continue;
+		qsort(bounds, nb, sizeof(bounds[0]), cmp_u32);
+		for (bi = 0; (bi + 1) < nb; bi++) {
+			u32 lo = bounds[bi], hi = bounds[bi + 1];
+			u32 ss, sx;
+			bool summed = 0;
+
+			if (lo == hi) continue;
+			for (ri = 0; ri < cp->nregions; ri++) {
+				struct ck_region *r = &cp->regions[ri];
+				if (((r->start & 3) != phase) || (lo < r->start) || (hi > reg_end(r))) continue;
+				if (!summed) {
+					sum32(&cp->buf[lo], hi - lo, &ss, &sx);
+					summed = 1;
+				}
+				r->sum += ss;
+				r->xor ^= sx;
+			}
+		}
+	}
+	for (ri = 0; ri < cp->nregions; ri++) {
+		struct ck_region *r = &cp->regions[ri];
+		u32 excl[3] = {r->p_sum, r->p_xor, r->p_skip};
+		unsigned ei;
+		for (ei = 0; ei < ARRAY_SIZE(excl); ei++) {
+			if ((excl[ei] == UINT32_MAX) || !on_grid(r, excl[ei])) continue;
+			u32 w = reconst_32(&cp->buf[excl[ei]]);
+			r->sum -= w;
+			r->xor ^= w;
+		}
+	}
+}
+
+/* fixing q changes words inside r */
+static bool writes_into(const struct ck_region *q, const struct ck_region *r) {
+	u32 words[3];
+	unsigned nw = fixed_words(q, words);
+	unsigned wi;
+
+	for (wi = 0; wi < nw; wi++) {
+		if (overlaps(words[wi], 4, r->start, r->len)) return 1;
+	}
+	return 0;
+}
+
+/* @return 0 if ok */
+static int fix_region(struct ckpatch *cp, struct ck_region *r) {
+	if (r->fix == CKFIX_REWRITE) {
+		//own words don't count in r->sum, so this doesn't change it
+		u32 s = r->sum, x = r->xor;
+		put32(cp, r->p_sum, s);
+		put32(cp, r->p_xor, x);
+		return 0;
+	}
+
+	u32 cks = reconst_32(&cp->buf[r->p_sum]);
+	u32 ckx = reconst_32(&cp->buf[r->p_xor]);
+	put32(cp, r->p_corr, 0);
+	put32(cp, r->p_corr + 4, 0);
+	put32(cp, r->p_corr + 8, 0);
+
+	// same solution as checksum_fix() : c cancels the xor difference, a == b share the rest of the sum
+	u32 c = ckx ^ r->xor;
+	u32 ds = cks - r->sum - c;
+	if (ds & 1) {
+		ERR_PRINTF("%s : sum 0x%08lX and xor 0x%08lX have different LSBs, cannot correct\n",
+					r->name, (unsigned long) cks, (unsigned long) ckx);
+		return -1;
+	}
+	put32(cp, r->p_corr, ds / 2);
+	put32(cp, r->p_corr + 4, ds / 2);
+	put32(cp, r->p_corr + 8, c);
+	return 0;
+}
+
+int ckpatch_fix(struct ckpatch *cp) {
+	assert(cp);
+	unsigned ri, qi, nfixed;
+	int rv = 0;
+
+	sum_regions(cp);
+	for (ri = 0; ri < cp->nregions; ri++) cp->regions[ri].done = 0;
+
+	for (nfixed = 0; nfixed < cp->nregions; nfixed++) {
+		struct ck_region *next = NULL;
+		for (ri = 0; (ri < cp->nregions) && !next; ri++) {
+			struct ck_region *r = &cp->regions[ri];
+			bool ready = !r->done;
+			for (qi = 0; (qi < cp->nregions) && ready; qi++) {
+				const struct ck_region *q = &cp->regions[qi];
+				if ((qi != ri) && !q->done && writes_into(q, r)) ready = 0;
+			}
+			if (ready) next = r;
+		}
+		if (!next) {
+			ERR_PRINTF("checksum regions depend on each other, cannot fix\n");
+			return -1;
+		}
+		if (fix_region(cp, next)) rv = -1;
+		next->done = 1;
+	}
+	if (rv) return rv;
+
+	//verify from scratch
+	sum_regions(cp);
+	for (ri = 0; ri < cp->nregions; ri++) {
+		const struct ck_region *r = &cp->regions[ri];
+		if ((r->sum == reconst_32(&cp->buf[r->p_sum])) && (r->xor == reconst_32(&cp->buf[r->p_xor]))) {
+			TRACE(TC_CKS, TL_INFO, "%s checksum fixed : sum 0x%08lX @ 0x%lX, xor 0x%08lX @ 0x%lX\n", r->name,
+				(unsigned long) r->sum, (unsigned long) r->p_sum, (unsigned long) r->xor, (unsigned long) r->p_xor);
+		} else {
+			ERR_PRINTF("%s checksum still bad after fixing !?\n", r->name);
+			rv = -1;
+		}
+	}
+	return rv;
+}
+
+bool ckpatch_dirty(const struct ckpatch *cp, u32 from, u32 *pos, u32 *len) {
+	assert(cp && pos && len);
+	u32 idx = from;
+
+	while (idx < cp->siz) {
+		if (!(idx & 7) && !cp->dirty[idx / 8]) {
+			idx += 8;
+			continue;
+		}
+		if (cp->dirty[idx / 8] & (1 << (idx % 8))) break;
+		idx++;
+	}
+	if (idx >= cp->siz) return 0;
+	*pos = idx;
+	while ((idx < cp->siz) && (cp->dirty[idx / 8] & (1 << (idx % 8)))) idx++;
+	*len = idx - *pos;
+	return 1;
+}
@@ -0,0 +1,82 @@
+/* apply byte patches to a ROM image and fix every checksum region in one go
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * A region is summed like the std checksum : sum and xor of the u32s in [start, start + len[,
+ * not counting the words at p_sum and p_xor (and p_skip, if any) when they are inside the region;
+ * the alt cks values for instance are stored outside their block.
+ * Regions can be nested (alt and alt2 blocks are inside the std one). Each region is fixed after the
+ * regions whose check words it contains, so that the outer sums include the new inner values.
+ *
+ * Typical use : ckpatch_init(), ckpatch_addregion() for each region, ckpatch_write() for each
+ * patch, ckpatch_fix(), then write out the ranges given by ckpatch_dirty().
+ */
+
+#ifndef NISLIB_CKPATCH_H
+#define NISLIB_CKPATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stypes.h"
+
+enum ckfix {
+	CKFIX_REWRITE = 0,	//store the new sum and xor at p_sum, p_xor (like nisckfix2)
+	CKFIX_CORRECT,	//keep them; set 3 u32 correction words at p_corr (like checksum_fix())
+};
+
+struct ck_region {
+	const char *name;	//for messages
+	u32 start;
+	u32 len;	//in bytes, rounded down to a multiple of 4
+	u32 p_sum;
+	u32 p_xor;
+	u32 p_skip;	//another u32 not counted, UINT32_MAX if none
+	enum ckfix fix;
+	u32 p_corr;	//CKFIX_CORRECT only
+
+	/* private */
+	u32 sum;
+	u32 xor;
+	bool done;
+};
+
+#define CKP_MAXREGIONS	8
+
+struct ckpatch {
+	u8 *buf;
+	u32 siz;
+	u8 *dirty;	//bitmap, one bit per byte of buf
+	struct ck_region regions[CKP_MAXREGIONS];
+	unsigned nregions;
+};
+
+/** @param buf : writable image; kept by reference
+ * @return 0 if ok; must be followed by ckpatch_done()
+ */
+int ckpatch_init(struct ckpatch *cp, u8 *buf, u32 siz);
+
+void ckpatch_done(struct ckpatch *cp);
+
+/** add a checksum region; everything must be inside the image
+ * @return 0 if ok
+ */
+int ckpatch_addregion(struct ckpatch *cp, const struct ck_region *reg);
+
+/** copy <len> bytes to <offs>. Refused if that touches the check or correction words of a region
+ * @return 0 if ok
+ */
+int ckpatch_write(struct ckpatch *cp, u32 offs, const u8 *data, u32 len);
+
+/** sum every region in one pass over the image, then set their check or correction words,
+ * inner regions first, and verify.
+ * @return 0 if every region is now valid
+ */
+int ckpatch_fix(struct ckpatch *cp);
+
+/** find the next run of modified bytes at or after <from>
+ * @return 0 if there is none
+ */
+bool ckpatch_dirty(const struct ckpatch *cp, u32 from, u32 *pos, u32 *len);
+
+#endif
@@ -0,0 +1,233 @@
+/* ROM lists, and running a search over many ROMs on a worker pool
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <limits.h>	//PATH_MAX
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "uthash/utstring.h"
+
+#include "nislib.h"
+#include "nislib_corpus.h"
+#include "nislib_pool.h"
+#include "nislib_shindex.h"
+#include "nislib_shtools.h"
+#include "stypes.h"
+
+
+/** append a copy of fname to the list
+ * ret 1 if ok
+ */
+bool filelist_add(struct filelist *fl, const char *fname) {
+	assert(fl && fname);
+	if (fl->num == fl->alloc) {
+		unsigned newalloc = fl->alloc ? (2 * fl->alloc) : 64;
+		char **newnames = realloc(fl->names, newalloc * sizeof(*newnames));
+		if (!newnames) return 0;
+		fl->names = newnames;
+		fl->alloc = newalloc;
+	}
+	fl->names[fl->num] = strdup(fname);
+	if (!fl->names[fl->num]) return 0;
+	fl->num++;
+	return 1;
+}
+
+void filelist_free(struct filelist *fl) {
+	unsigned idx;
+	for (idx = 0; idx < fl->num; idx++) {
+		free(fl->names[idx]);
+	}
+	free(fl->names);
+	fl->names = NULL;
+	fl->num = fl->alloc = 0;
+}
+
+static int cmp_strp(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/** add every regular file in a directory, recursing into subdirs.
+ * Entries are sorted so the output order doesn't depend on the filesystem.
+ * Hidden entries (".*") are skipped.
+ *
+ * ret 1 if ok
+ */
+static bool filelist_adddir(struct filelist *fl, const char *dirname) {
+	struct filelist entries = {0};
+	struct dirent *de;
+	DIR *dir;
+	bool rv = 1;
+	unsigned idx;
+
+	dir = opendir(dirname);
+	if (!dir) {
+		ERR_PRINTF("can't open dir %s\n", dirname);
+		return 0;
+	}
+
+	UT_string path;
+	utstring_init(&path);
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.') continue;
+		utstring_clear(&path);
+		utstring_printf(&path, "%s/%s", dirname, de->d_name);
+		if (!filelist_add(&entries, utstring_body(&path))) {
+			rv = 0;
+			break;
+		}
+	}
+	closedir(dir);
+	utstring_done(&path);
+
+	if (entries.num) {
+		qsort(entries.names, entries.num, sizeof(*entries.names), cmp_strp);
+	}
+
+	for (idx = 0; rv && (idx < entries.num); idx++) {
+		struct stat st;
+		const char *ename = entries.names[idx];
+		if (stat(ename, &st)) {
+			ERR_PRINTF("can't stat %s\n", ename);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			rv = filelist_adddir(fl, ename);
+		} else if (S_ISREG(st.st_mode)) {
+			rv = filelist_add(fl, ename);
+		}
+	}
+	filelist_free(&entries);
+	return rv;
+}
+
+/** add filenames read from a stream, one per line. Empty lines are ignored
+ * ret 1 if ok
+ */
+bool filelist_addlist(struct filelist *fl, FILE *fh) {
+	char line[PATH_MAX + 2];
+
+	while (fgets(line, sizeof(line), fh)) {
+		size_t len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if (!len) continue;
+		if (!filelist_add(fl, line)) return 0;
+	}
+	return 1;
+}
+
+/** add a command-line argument : filename, directory, or "-" for a list on stdin
+ * ret 1 if ok
+ */
+bool filelist_addarg(struct filelist *fl, const char *arg) {
+	struct stat st;
+
+	if (strcmp(arg, "-") == 0) {
+		return filelist_addlist(fl, stdin);
+	}
+	if (!stat(arg, &st) && S_ISDIR(st.st_mode)) {
+		return filelist_adddir(fl, arg);
+	}
+	// nonexistent files are reported when opening them
+	return filelist_add(fl, arg);
+}
+
+
+struct corpus_ctx {
+	const struct filelist *fl;
+	corpus_work_cb work;
+	void *ctx;
+	FILE *out;
+	FILE *dbg_out;	//caller's dbg_stream
+	unsigned failed;
+};
+
+struct corpus_result {
+	int rc;
+	char *out;
+	size_t outlen;
+};
+
+static void *corpus_work(unsigned jobidx, void *ctx) {
+	struct corpus_ctx *cc = ctx;
+	struct corpus_result *res;
+	struct rom_image img = {0};
+	struct corpus_rom cr = {0};
+	struct sh_index *idx;
+	const char *fname = cc->fl->names[jobidx];
+	FILE *prev_dbg = dbg_stream;	//not NULL if run by the caller of pool_run()
+
+	res = calloc(1, sizeof(*res));
+	if (!res) return NULL;
+	res->rc = -1;
+
+	cr.out = open_memstream(&res->out, &res->outlen);
+	if (!cr.out) return res;
+	dbg_stream = cc->dbg_out;
+
+	if (romimg_open(&img, fname, 0)) goto exit;
+	cr.fname = fname;
+	cr.buf = img.buf;
+	cr.siz = img.siz;
+	idx = sh_index_build(img.buf, img.siz);
+	cr.idx = idx;
+	cr.trk = sh_tracker_new(img.siz);
+	if (!idx || !cr.trk) {
+		ERR_PRINTF("malloc choke on %s\n", fname);
+	} else {
+		sh_tracker_setdecoded(cr.trk, sh_index_decoded(idx));
+		res->rc = cc->work(&cr, cc->ctx);
+	}
+	sh_tracker_free(cr.trk);
+	sh_index_free(idx);
+	romimg_close(&img);
+
+exit:
+	fclose(cr.out);
+	trace_flush();
+	dbg_stream = prev_dbg;
+	return res;
+}
+
+static void corpus_emit(unsigned jobidx, void *result, void *ctx) {
+	struct corpus_ctx *cc = ctx;
+	struct corpus_result *res = result;
+	(void) jobidx;
+
+	if (!res) {
+		cc->failed++;
+		return;
+	}
+	if (res->rc) cc->failed++;
+	if (res->out) {
+		fwrite(res->out, 1, res->outlen, cc->out);
+		free(res->out);
+	}
+	free(res);
+}
+
+unsigned corpus_run(const struct filelist *fl, unsigned nthreads, corpus_work_cb work, void *ctx, FILE *out) {
+	assert(fl && work && out);
+	struct corpus_ctx cc = {
+		.fl = fl,
+		.work = work,
+		.ctx = ctx,
+		.out = out,
+		.dbg_out = dbg_stream ? dbg_stream : stderr,
+	};
+
+	if (pool_run(fl->num, nthreads, corpus_work, corpus_emit, &cc)) {
+		ERR_PRINTF("trouble in pool_run\n");
+		return fl->num;
+	}
+	return cc.failed;
+}
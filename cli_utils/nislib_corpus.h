@@ -0,0 +1,67 @@
+/* ROM lists, and running a search over many ROMs on a worker pool
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_CORPUS_H
+#define NISLIB_CORPUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nislib_shindex.h"
+#include "nislib_shtools.h"
+#include "stypes.h"
+
+/** list of ROM files, in the order given */
+struct filelist {
+	char **names;
+	unsigned num;
+	unsigned alloc;
+};
+
+/** append a copy of fname to the list
+ * ret 1 if ok
+ */
+bool filelist_add(struct filelist *fl, const char *fname);
+
+void filelist_free(struct filelist *fl);
+
+/** add filenames read from a stream, one per line. Empty lines are ignored
+ * ret 1 if ok
+ */
+bool filelist_addlist(struct filelist *fl, FILE *fh);
+
+/** add a command-line argument : filename, directory (scanned recursively, sorted),
+ * or "-" for a list on stdin
+ * ret 1 if ok
+ */
+bool filelist_addarg(struct filelist *fl, const char *arg);
+
+
+/** one ROM of a corpus run. Everything here belongs to the job. */
+struct corpus_rom {
+	const char *fname;
+	const u8 *buf;
+	u32 siz;
+	const struct sh_index *idx;
+	struct sh_tracker *trk;	//sized for this ROM
+	FILE *out;	//results for this ROM, merged in list order
+};
+
+/** search one ROM; called from a worker thread, with its own dbg_stream.
+ * Anything shared through ctx must be read-only.
+ * @return 0 if ok
+ */
+typedef int (*corpus_work_cb)(struct corpus_rom *cr, void *ctx);
+
+/** open, index and search every ROM of <fl>, <nthreads> at a time (0 = one per CPU).
+ * Each ROM's output is written to <out> as a block, in list order.
+ * Debug output goes to the caller's dbg_stream.
+ *
+ * @return number of ROMs that could not be opened or searched
+ */
+unsigned corpus_run(const struct filelist *fl, unsigned nthreads, corpus_work_cb work, void *ctx, FILE *out);
+
+#endif
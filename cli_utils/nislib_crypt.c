@@ -0,0 +1,278 @@
+/* bulk algo 1 encryption / decryption
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_crypt.h"
+#include "nislib_pool.h"
+#include "stypes.h"
+
+#define CRYPT1_CHUNK	(4 * 1024 * 1024UL)	//stdin read size, multiple of CRYPT1_SLICE
+#define CRYPT1_SLICE	(256 * 1024UL)	//work unit for one thread, multiple of 4
+#define CRYPT1_NBUF	3	//stdin : one chunk being crypted, one being read, one spare
+
+struct crypt1_ctx {
+	const u8 *src;	//current chunk
+	u32 len;	//multiple of 4
+
+	u32 scode;
+	bool encrypt;
+
+	FILE *ofh;
+	bool error;
+	struct crypt1_result *res;
+};
+
+struct crypt1_slice {
+	u32 len;
+	u16 cks16;
+	u8 buf[];
+};
+
+static void *crypt1_work(unsigned jobidx, void *ctx) {
+	const struct crypt1_ctx *cc = ctx;
+	u32 offs = jobidx * CRYPT1_SLICE;
+	u32 len = MIN(CRYPT1_SLICE, cc->len - offs);
+	const u8 *plain;
+	u32 cur;
+
+	struct crypt1_slice *cs = malloc(sizeof(*cs) + len);
+	if (!cs) return NULL;
+	cs->len = len;
+
+	if (cc->encrypt) {
+		enc1_buf(&cc->src[offs], cs->buf, len, cc->scode);
+		plain = &cc->src[offs];
+	} else {
+		dec1_buf(&cc->src[offs], cs->buf, len, cc->scode);
+		plain = cs->buf;
+	}
+
+	u16 cks = 0;
+	for (cur = 0; cur < len; cur++) {
+		cks += plain[cur];
+	}
+	cs->cks16 = cks;
+	return cs;
+}
+
+static void crypt1_emit(unsigned jobidx, void *result, void *ctx) {
+	struct crypt1_ctx *cc = ctx;
+	struct crypt1_slice *cs = result;
+	(void) jobidx;
+
+	if (!cs) {
+		if (!cc->error) ERR_PRINTF("malloc failed\n");
+		cc->error = 1;
+		return;
+	}
+	if (!cc->error) {
+		if (fwrite(cs->buf, 1, cs->len, cc->ofh) != cs->len) {
+			perror("fwrite error !?: ");
+			cc->error = 1;
+		} else {
+			cc->res->len += cs->len;
+			cc->res->cks16 += cs->cks16;
+		}
+	}
+	free(cs);
+}
+
+/* process one chunk; *src may have trailing bytes that don't make a u32 */
+static int crypt1_chunk(struct crypt1_ctx *cc, const u8 *src, u32 len, struct pool *pool) {
+	u32 tail = len & 3;
+
+	cc->src = src;
+	cc->len = len - tail;
+	if (cc->len) {
+		unsigned nslices = (cc->len + CRYPT1_SLICE - 1) / CRYPT1_SLICE;
+		if (pool_exec(pool, nslices, crypt1_work, crypt1_emit, cc) || cc->error) {
+			return -1;
+		}
+	}
+	if (!tail) return 0;
+
+	cc->res->partial = 1;
+	if (cc->encrypt) {
+		ERR_PRINTF("warning : block size is not multiple of 4; dropping extra bytes.\n");
+		return 0;
+	}
+	u8 tb[4] = {0};
+	memcpy(tb, &src[cc->len], tail);	//left-justify in dword
+	ERR_PRINTF("warning : block size is not multiple of 4; tb : %#x\n", reconst_32(tb));
+	if (fwrite(tb, 1, 4, cc->ofh) != 4) {
+		perror("fwrite error !?: ");
+		return -1;
+	}
+	cc->res->len += 4;
+	return 0;
+}
+
+/********** stdin : chunks are read ahead by a separate thread */
+
+struct crypt1_reader {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	//a chunk was filled, or released
+
+	u8 *bufs[CRYPT1_NBUF];
+	u32 len[CRYPT1_NBUF];
+	unsigned fill;	//next buffer to fill
+	unsigned take;	//next buffer to crypt
+	unsigned nfull;
+	bool eof;	//no more chunks after the full ones
+	bool error;
+	bool stop;	//consumer gave up
+};
+
+/** read the next chunk into bufs[fill], which the consumer isn't using. Called without the lock.
+ * @return 0 if there may be more chunks
+ */
+static bool reader_fill(struct crypt1_reader *rd, unsigned idx) {
+	size_t realbs = fread(rd->bufs[idx], 1, CRYPT1_CHUNK, stdin);	//try to fill buf
+	bool error = ferror(stdin);
+	if (error) perror("fread error : ");
+
+	pthread_mutex_lock(&rd->lock);
+	if (error) {
+		rd->error = 1;
+	} else if (realbs) {
+		rd->len[idx] = (u32) realbs;
+		rd->fill = (idx + 1) % CRYPT1_NBUF;
+		rd->nfull++;
+	}
+	//fread only comes back short at the end
+	if (error || (realbs < CRYPT1_CHUNK)) rd->eof = 1;
+	bool end = rd->eof;
+	pthread_cond_signal(&rd->cond);
+	pthread_mutex_unlock(&rd->lock);
+	return end;
+}
+
+static void *reader_thread(void *arg) {
+	struct crypt1_reader *rd = arg;
+
+	while (1) {
+		pthread_mutex_lock(&rd->lock);
+		while (!rd->stop && (rd->nfull == CRYPT1_NBUF)) {
+			pthread_cond_wait(&rd->cond, &rd->lock);
+		}
+		unsigned idx = rd->fill;
+		bool stop = rd->stop;
+		pthread_mutex_unlock(&rd->lock);
+		if (stop || reader_fill(rd, idx)) break;
+	}
+	return NULL;
+}
+
+static int crypt1_stream(struct crypt1_ctx *cc, struct pool *pool) {
+	struct crypt1_reader rd = {0};
+	pthread_t thr;
+	bool threaded;
+	unsigned idx;
+	int rv = 0;
+
+	for (idx = 0; idx < CRYPT1_NBUF; idx++) {
+		rd.bufs[idx] = malloc(CRYPT1_CHUNK);
+		if (!rd.bufs[idx]) {
+			ERR_PRINTF("malloc failed\n");
+			rv = -1;
+			goto cleanup;
+		}
+	}
+	pthread_mutex_init(&rd.lock, NULL);
+	pthread_cond_init(&rd.cond, NULL);
+	threaded = !pthread_create(&thr, NULL, reader_thread, &rd);
+
+	while (!rv) {
+		if (!threaded) {
+			//no reader thread : read each chunk just before crypting it
+			pthread_mutex_lock(&rd.lock);
+			bool more = !rd.eof && !rd.nfull;
+			pthread_mutex_unlock(&rd.lock);
+			if (more) (void) reader_fill(&rd, rd.fill);
+		}
+		pthread_mutex_lock(&rd.lock);
+		while (!rd.nfull && !rd.eof) {
+			pthread_cond_wait(&rd.cond, &rd.lock);
+		}
+		if (rd.error) rv = -1;
+		bool have = rd.nfull && !rv;
+		idx = rd.take;
+		pthread_mutex_unlock(&rd.lock);
+		if (!have) break;
+
+		//the reader keeps filling the other buffers meanwhile
+		rv = crypt1_chunk(cc, rd.bufs[idx], rd.len[idx], pool);
+
+		pthread_mutex_lock(&rd.lock);
+		rd.take = (idx + 1) % CRYPT1_NBUF;
+		rd.nfull--;
+		pthread_cond_signal(&rd.cond);
+		pthread_mutex_unlock(&rd.lock);
+	}
+
+	if (threaded) {
+		pthread_mutex_lock(&rd.lock);
+		rd.stop = 1;
+		pthread_cond_signal(&rd.cond);
+		pthread_mutex_unlock(&rd.lock);
+		pthread_join(thr, NULL);
+	}
+	pthread_cond_destroy(&rd.cond);
+	pthread_mutex_destroy(&rd.lock);
+
+cleanup:
+	for (idx = 0; idx < CRYPT1_NBUF; idx++) {
+		free(rd.bufs[idx]);
+	}
+	return rv;
+}
+
+int crypt1_file(const char *ifname, FILE *ofh, uint32_t scode, bool encrypt,
+			unsigned nthreads, struct crypt1_result *res) {
+	struct crypt1_result dummy;
+	struct crypt1_ctx cc = {
+		.scode = scode,
+		.encrypt = encrypt,
+		.ofh = ofh,
+		.error = 0,
+	};
+	int rv = 0;
+
+	assert(ifname && ofh);
+	if (!res) res = &dummy;
+	memset(res, 0, sizeof(*res));
+	cc.res = res;
+
+	//one pool for the whole file
+	struct pool *pool = pool_new(nthreads);
+	if (!pool) {
+		ERR_PRINTF("malloc failed\n");
+		return -1;
+	}
+
+	if (strcmp(ifname, "-") != 0) {
+		//whole file at once
+		struct rom_image img;
+		if (romimg_open(&img, ifname, 0)) {
+			rv = -1;
+		} else {
+			rv = crypt1_chunk(&cc, img.buf, img.siz, pool);
+			romimg_close(&img);
+		}
+	} else {
+		rv = crypt1_stream(&cc, pool);
+	}
+	pool_free(pool);
+	return rv;
+}
+
@@ -0,0 +1,38 @@
+/* bulk algo 1 encryption / decryption : large buffers, threaded
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_CRYPT_H
+#define NISLIB_CRYPT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct crypt1_result {
+	uint64_t len;	//bytes written
+	uint16_t cks16;	//16-bit sum of all plaintext bytes
+	bool partial;	//input was not a multiple of 4 bytes
+};
+
+/** encrypt or decrypt a whole file with algo 1, and write the result to ofh.
+ *
+ * @param ifname : input file; "-" reads stdin in large chunks. Regular files are mmapped.
+ * @param encrypt : 1 to encrypt, 0 to decrypt
+ * @param nthreads : 0 for one per CPU
+ * @param res : optional, filled if not NULL
+ *
+ * Every u32 is independent, so each chunk is split in slices processed by a worker pool.
+ * Output stays in order, and the slices already crypted are written while the next are being crypted.
+ * From stdin, the next chunks are read on a separate thread while the current one is crypted;
+ * the workers are started once for the whole file.
+ * Trailing bytes that don't make a u32 are dropped when encrypting, and copied as-is
+ * (zero-padded to 4 bytes) when decrypting.
+ *
+ * @return 0 if ok
+ */
+int crypt1_file(const char *ifname, FILE *ofh, uint32_t scode, bool encrypt,
+			unsigned nthreads, struct crypt1_result *res);
+
+#endif
@@ -0,0 +1,456 @@
+/* streaming parser for Nissan .dat repro files
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_dat.h"
+#include "stypes.h"
+
+#define DAT_SID0 0x34
+#define DAT_SID1 0x82
+#define DAT_PLHDR 6	//"34 82 AH AM AL CL"
+#define DAT_CRCLEN 2
+#define DAT_CRC_LEARN 4	//frames used to pick the CRC
+#define DAT_READSIZ (256 * 1024UL)	//block size for non-mappable input
+
+
+/********** table-driven CRC-16
+ * One table per polynomial and bit order; the variants only differ in init / xorout.
+ */
+
+enum crc_tbl {
+	CT_1021 = 0,
+	CT_1021R,	//reflected
+	CT_8005,
+	CT_8005R,
+	CT_MAX
+};
+
+static u16 crc_tables[CT_MAX][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_build(void) {
+	static const u16 polys[CT_MAX] = {
+		[CT_1021] = 0x1021, [CT_1021R] = 0x8408,
+		[CT_8005] = 0x8005, [CT_8005R] = 0xA001,
+	};
+	unsigned t, i, bit;
+
+	for (t = 0; t < CT_MAX; t++) {
+		bool refl = (t == CT_1021R) || (t == CT_8005R);
+		for (i = 0; i < 256; i++) {
+			u16 crc = refl ? i : (u16) (i << 8);
+			for (bit = 0; bit < 8; bit++) {
+				if (refl) {
+					crc = (crc & 1) ? ((crc >> 1) ^ polys[t]) : (crc >> 1);
+				} else {
+					crc = (crc & 0x8000) ? ((u16) (crc << 1) ^ polys[t]) : (u16) (crc << 1);
+				}
+			}
+			crc_tables[t][i] = crc;
+		}
+	}
+}
+
+struct crc_alg {
+	const char *name;
+	enum crc_tbl tbl;
+	u16 init;
+	u16 xorout;
+};
+
+static const struct crc_alg crc_algs[] = {
+	{"CRC-16/CCITT-FALSE", CT_1021, 0xFFFF, 0},
+	{"CRC-16/XMODEM", CT_1021, 0, 0},
+	{"CRC-16/GENIBUS", CT_1021, 0xFFFF, 0xFFFF},
+	{"CRC-16/KERMIT", CT_1021R, 0, 0},
+	{"CRC-16/X-25", CT_1021R, 0xFFFF, 0xFFFF},
+	{"CRC-16/MCRF4XX", CT_1021R, 0xFFFF, 0},
+	{"CRC-16/UMTS", CT_8005, 0, 0},
+	{"CRC-16/ARC", CT_8005R, 0, 0},
+	{"CRC-16/MODBUS", CT_8005R, 0xFFFF, 0},
+};
+
+static u16 crc16(const struct crc_alg *ca, const u8 *buf, unsigned len) {
+	const u16 *t = crc_tables[ca->tbl];
+	u16 crc = ca->init;
+	unsigned i;
+
+	if ((ca->tbl == CT_1021R) || (ca->tbl == CT_8005R)) {
+		for (i = 0; i < len; i++) {
+			crc = (crc >> 8) ^ t[(crc ^ buf[i]) & 0xFF];
+		}
+	} else {
+		for (i = 0; i < len; i++) {
+			crc = (u16) (crc << 8) ^ t[((crc >> 8) ^ buf[i]) & 0xFF];
+		}
+	}
+	return crc ^ ca->xorout;
+}
+
+/* bytes covered by the CRC */
+enum crc_range {
+	CR_PAYLOAD = 0,	//payload only
+	CR_ADDR,	//AH AM AL CL payload
+	CR_DATA,	//34 82 AH ... payload
+	CR_FRAME,	//FMT ... payload
+	CR_MAX
+};
+
+static const char *crc_range_names[CR_MAX] = {
+	[CR_PAYLOAD] = "payload", [CR_ADDR] = "addr+payload",
+	[CR_DATA] = "data", [CR_FRAME] = "frame",
+};
+
+#define CRC_NCAND (ARRAY_SIZE(crc_algs) * CR_MAX * 2)	//x2 : CRC1 is MSB or LSB
+#define CAND(alg, range, le) ((((alg) * CR_MAX) + (range)) * 2 + (le))
+
+static void crc_range(const u8 *frame, unsigned hl, unsigned cl, enum crc_range cr,
+			const u8 **start, unsigned *len) {
+	switch (cr) {
+	case CR_PAYLOAD:
+		*start = &frame[hl + DAT_PLHDR];
+		*len = cl;
+		break;
+	case CR_ADDR:
+		*start = &frame[hl + 2];
+		*len = cl + 4;
+		break;
+	case CR_DATA:
+		*start = &frame[hl];
+		*len = cl + DAT_PLHDR;
+		break;
+	default:
+		*start = frame;
+		*len = hl + cl + DAT_PLHDR;
+		break;
+	}
+}
+
+/** narrow down the candidates, or verify with the detected CRC.
+ *
+ * While learning, a frame that matches none of the remaining candidates is assumed corrupt :
+ * the candidates are kept and the next frame is tried. After DAT_CRC_LEARN such frames in a row,
+ * either nothing ever matched (unknown CRC), or the frames that narrowed the candidates were
+ * the corrupt ones, and learning starts over.
+ *
+ * @return 0 if the frame CRC is bad
+ */
+static bool check_crc(struct dat_parser *dp, const u8 *frame, unsigned hl, unsigned cl) {
+	const u8 *pcrc = &frame[hl + DAT_PLHDR + cl];
+	u16 want_be = (u16) ((pcrc[0] << 8) | pcrc[1]);
+	u16 want_le = (u16) ((pcrc[1] << 8) | pcrc[0]);
+	const u8 *start;
+	unsigned len;
+
+	if (dp->crc == -2) return 1;	//unknown : can't tell
+	if (dp->crc >= 0) {
+		unsigned cand = (unsigned) dp->crc;
+		unsigned le = cand & 1;
+		crc_range(frame, hl, cl, (enum crc_range) ((cand / 2) % CR_MAX), &start, &len);
+		u16 crc = crc16(&crc_algs[cand / 2 / CR_MAX], start, len);
+		return crc == (le ? want_le : want_be);
+	}
+
+	//alive[] : 1 = candidate, 2 = candidate that matches this frame
+	unsigned alg, cr, nmatch = 0, first = 0;
+	for (alg = 0; alg < ARRAY_SIZE(crc_algs); alg++) {
+		for (cr = 0; cr < CR_MAX; cr++) {
+			unsigned cbe = CAND(alg, cr, 0), cle = CAND(alg, cr, 1);
+			if (!dp->alive[cbe] && !dp->alive[cle]) continue;
+			crc_range(frame, hl, cl, (enum crc_range) cr, &start, &len);
+			u16 crc = crc16(&crc_algs[alg], start, len);
+			if (dp->alive[cbe] && (crc == want_be)) {
+				if (!nmatch++) first = cbe;
+				dp->alive[cbe] = 2;
+			}
+			if (dp->alive[cle] && (crc == want_le)) {
+				if (!nmatch++) first = cle;
+				dp->alive[cle] = 2;
+			}
+		}
+	}
+
+	if (!nmatch) {
+		dp->misses++;
+		dp->pend_errs++;
+		if (dp->misses < DAT_CRC_LEARN) return 1;	//can't tell yet
+		dp->misses = 0;
+		dp->pend_errs = 0;
+		if (!dp->learned) {
+			DBG_PRINTF("dat : CRC algorithm not recognized, CRCs not verified\n");
+			dp->crc = -2;
+			return 1;
+		}
+		DBG_PRINTF("dat : CRC candidates stopped matching, learning again\n");
+		dp->learned = 0;
+		memset(dp->alive, 1, CRC_NCAND);
+		return 1;
+	}
+
+	for (cr = 0; cr < CRC_NCAND; cr++) {
+		dp->alive[cr] = (dp->alive[cr] == 2);
+	}
+	//the frames that didn't match are bad, now that something does
+	dp->st.crc_errs += dp->pend_errs;
+	dp->pend_errs = 0;
+	dp->misses = 0;
+	dp->learned++;
+	if (dp->learned >= DAT_CRC_LEARN) {
+		dp->crc = (int) first;
+	}
+	return 1;
+}
+
+static void set_crc_name(struct dat_parser *dp) {
+	if (dp->crc < 0) {
+		dp->st.crc_name[0] = 0;
+		return;
+	}
+	unsigned cand = (unsigned) dp->crc;
+	snprintf(dp->st.crc_name, sizeof(dp->st.crc_name), "%s %s %s", crc_algs[cand / 2 / CR_MAX].name,
+			(cand & 1) ? "LE" : "BE", crc_range_names[(cand / 2) % CR_MAX]);
+}
+
+
+/********** framing */
+
+/** try to parse a payload frame at buf.
+ * @return frame length if it is one, 0 if not, -1 if more bytes are needed to tell
+ */
+static int try_frame(struct dat_parser *dp, const u8 *buf, size_t avail) {
+	if (!avail) return -1;
+
+	u8 fmt = buf[0];
+	unsigned hl = 1 + ((fmt & 0xC0) ? 2 : 0) + ((fmt & 0x3F) ? 0 : 1);
+	if (avail < (hl + DAT_PLHDR)) {
+		//check what we can before asking for more
+		if ((avail > hl) && (buf[hl] != DAT_SID0)) return 0;
+		if ((avail > (hl + 1)) && (buf[hl + 1] != DAT_SID1)) return 0;
+		return -1;
+	}
+	if ((buf[hl] != DAT_SID0) || (buf[hl + 1] != DAT_SID1)) return 0;
+
+	unsigned len = (fmt & 0x3F) ? (fmt & 0x3FU) : buf[hl - 1];
+	if (len < (DAT_PLHDR + DAT_CRCLEN)) return 0;
+	unsigned cl = buf[hl + 5];
+	if (cl != (len - DAT_PLHDR - DAT_CRCLEN)) return 0;
+
+	unsigned flen = hl + len + 1;
+	if (avail < flen) return -1;
+
+	//it's a payload frame
+	u8 cks = 0;
+	unsigned i;
+	for (i = 0; i < (hl + len); i++) cks += buf[i];
+
+	u32 addr = ((u32) buf[hl + 2] << 16) | ((u32) buf[hl + 3] << 8) | buf[hl + 4];
+	if (cks != buf[hl + len]) {
+		DBG_PRINTF("dat : bad CKS in frame @ addr %06lX\n", (unsigned long) addr);
+		dp->st.cks_errs++;
+	} else if (!check_crc(dp, buf, hl, cl)) {
+		DBG_PRINTF("dat : bad CRC in frame @ addr %06lX\n", (unsigned long) addr);
+		dp->st.crc_errs++;
+	}
+	if (dp->st.frames && (addr != dp->nextaddr)) {
+		DBG_PRINTF("addr skip @ %lX\n", (unsigned long) addr);
+		dp->st.addr_skips++;
+	}
+	dp->nextaddr = addr + cl;
+	dp->st.frames++;
+	dp->st.plbytes += cl;
+
+	if (dp->sink(dp->ctx, addr, &buf[hl + DAT_PLHDR], cl)) {
+		dp->stopped = 1;
+	}
+	return (int) flen;
+}
+
+int dat_init(struct dat_parser *dp, dat_sink sink, void *ctx) {
+	assert(dp && sink);
+	pthread_once(&crc_once, crc_build);
+
+	memset(dp, 0, sizeof(*dp));
+	dp->sink = sink;
+	dp->ctx = ctx;
+	dp->crc = -1;
+	dp->alive = malloc(CRC_NCAND);
+	if (!dp->alive) return -1;
+	memset(dp->alive, 1, CRC_NCAND);
+	return 0;
+}
+
+/** parse buf as far as possible. @return bytes consumed; the rest can't be resolved yet */
+static size_t parse_buf(struct dat_parser *dp, const u8 *buf, size_t len, size_t stop) {
+	size_t pos = 0;
+
+	while (!dp->stopped && (pos < stop)) {
+		int rv = try_frame(dp, &buf[pos], len - pos);
+		if (rv < 0) break;
+		if (rv == 0) {
+			dp->st.skipped++;
+			pos++;
+			continue;
+		}
+		pos += (unsigned) rv;
+	}
+	return pos;
+}
+
+int dat_feed(struct dat_parser *dp, const u8 *buf, size_t len) {
+	assert(dp && (buf || !len));
+	size_t pos = 0;
+
+	if (dp->stopped) return -1;
+
+	if (dp->clen) {
+		//finish the frames that started in the carried tail; that needs at most DAT_MAXFRAME new bytes
+		unsigned old = dp->clen;
+		size_t take = MIN(len, (size_t) DAT_MAXFRAME);
+		memcpy(&dp->carry[old], buf, take);
+		size_t done = parse_buf(dp, dp->carry, old + take, old);
+		if (done < old) {
+			//still unresolved : only possible if we ran out of input
+			memmove(dp->carry, &dp->carry[done], old + take - done);
+			dp->clen = (unsigned) (old + take - done);
+			return dp->stopped ? -1 : 0;
+		}
+		dp->clen = 0;
+		pos = done - old;
+	}
+
+	pos += parse_buf(dp, &buf[pos], len - pos, len - pos);
+	if (!dp->stopped && (pos < len)) {
+		assert((len - pos) < DAT_MAXFRAME);
+		memcpy(dp->carry, &buf[pos], len - pos);
+		dp->clen = (unsigned) (len - pos);
+	}
+	return dp->stopped ? -1 : 0;
+}
+
+void dat_finish(struct dat_parser *dp) {
+	assert(dp);
+	dp->st.skipped += dp->clen;
+	dp->clen = 0;
+	if ((dp->crc == -1) && dp->learned) {
+		//fewer frames than DAT_CRC_LEARN : take the best guess
+		dp->st.crc_errs += dp->pend_errs;
+		dp->pend_errs = 0;
+		unsigned cand;
+		for (cand = 0; cand < CRC_NCAND; cand++) {
+			if (dp->alive[cand]) {
+				dp->crc = (int) cand;
+				break;
+			}
+		}
+	}
+	set_crc_name(dp);
+}
+
+void dat_done(struct dat_parser *dp) {
+	if (!dp) return;
+	free(dp->alive);
+	dp->alive = NULL;
+}
+
+int dat_parse_file(struct dat_parser *dp, const char *fname) {
+	assert(dp && fname);
+	int rv = 0;
+
+	if (strcmp(fname, "-") != 0) {
+		struct rom_image img;
+		if (romimg_open(&img, fname, 0)) {
+			return -1;
+		}
+		rv = dat_feed(dp, img.buf, img.siz);
+		romimg_close(&img);
+		dat_finish(dp);
+		return rv;
+	}
+
+	u8 *blk = malloc(DAT_READSIZ);
+	if (!blk) {
+		ERR_PRINTF("malloc failed\n");
+		return -1;
+	}
+	while (!rv && !feof(stdin)) {
+		size_t realbs = fread(blk, 1, DAT_READSIZ, stdin);
+		if (ferror(stdin)) {
+			perror("fread error : ");
+			rv = -1;
+			break;
+		}
+		if (!realbs) break;
+		rv = dat_feed(dp, blk, realbs);
+	}
+	free(blk);
+	dat_finish(dp);
+	return rv;
+}
+
+
+/********** whole-image unpack */
+
+struct unpack_img {
+	u8 *buf;
+	u32 siz;	//end of highest payload
+	u32 alloc;
+};
+
+static int unpack_img_sink(void *ctx, u32 addr, const u8 *pl, unsigned len) {
+	struct unpack_img *ui = ctx;
+	u32 end = addr + len;
+
+	if (end > MAX_ROMSIZE) {
+		ERR_PRINTF("dat : payload @ %06lX past max ROM size\n", (unsigned long) addr);
+		return -1;
+	}
+	if (end > ui->alloc) {
+		u32 newalloc = ui->alloc ? ui->alloc : (256 * 1024UL);
+		while (newalloc < end) newalloc *= 2;
+		u8 *newbuf = realloc(ui->buf, newalloc);
+		if (!newbuf) return -1;
+		memset(&newbuf[ui->alloc], 0xFF, newalloc - ui->alloc);
+		ui->buf = newbuf;
+		ui->alloc = newalloc;
+	}
+	memcpy(&ui->buf[addr], pl, len);
+	ui->siz = MAX(ui->siz, end);
+	return 0;
+}
+
+int dat_unpack(const char *fname, struct rom_image *img, struct dat_stats *st) {
+	assert(fname && img);
+	struct unpack_img ui = {0};
+	struct dat_parser dp;
+
+	img->buf = NULL;
+	img->siz = 0;
+	img->mapped = 0;
+
+	if (dat_init(&dp, unpack_img_sink, &ui)) return -1;
+	int rv = dat_parse_file(&dp, fname);
+	if (st) *st = dp.st;
+	dat_done(&dp);
+
+	if (!rv && !ui.siz) {
+		ERR_PRINTF("dat : no payload in %s\n", fname);
+		rv = -1;
+	}
+	if (rv) {
+		free(ui.buf);
+		return -1;
+	}
+	img->buf = ui.buf;
+	img->siz = ui.siz;
+	return 0;
+}
@@ -0,0 +1,89 @@
+/* streaming parser for Nissan .dat repro files
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_DAT_H
+#define NISLIB_DAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nislib.h"
+#include "stypes.h"
+
+/* A .dat is mostly a sequence of KWP2000 frames :
+ *	<FMT> [<TGT> <SRC>] [<LEN>] <data> <CKS>
+ * FMT bits 7-6 are the address mode (00 : no TGT / SRC), bits 5-0 the data length, 0 if a LEN byte follows.
+ * CKS is the 8-bit sum of all preceding bytes of the frame.
+ *
+ * Payload frames have data = "34 82 AH AM AL CL <CL bytes of payload> <CRC1> <CRC2>".
+ * Anything else (other frames, file headers, junk) is skipped. The CRC algorithm isn't documented;
+ * dat_parser tries the usual CRC-16s over a few ranges of the first frames, and verifies the rest
+ * with the one that matched.
+ */
+
+#define DAT_MAXFRAME (4 + 255 + 1)	//longest possible frame
+
+/** called for each payload, in file order.
+ * @param pl : only valid during the call
+ * @return 0 to continue, else parsing stops
+ */
+typedef int (*dat_sink)(void *ctx, u32 addr, const u8 *pl, unsigned len);
+
+struct dat_stats {
+	unsigned frames;	//payload frames
+	unsigned long long plbytes;	//payload bytes
+	unsigned long long skipped;	//bytes not part of a payload frame
+	unsigned cks_errs;
+	unsigned crc_errs;
+	unsigned addr_skips;	//payload not contiguous with the previous one
+	char crc_name[48];	//detected CRC, e.g. "CRC-16/XMODEM BE payload", or "" if unknown
+};
+
+struct dat_parser {
+	dat_sink sink;
+	void *ctx;
+	struct dat_stats st;
+
+	/* private */
+	u8 carry[2 * DAT_MAXFRAME];	//unresolved tail of the previous dat_feed()
+	unsigned clen;
+	u32 nextaddr;
+	int crc;	//index of detected CRC; -1 if still learning, -2 if unknown
+	unsigned learned;	//frames that narrowed down the candidates
+	unsigned misses;	//consecutive frames matching no candidate, while learning
+	unsigned pend_errs;	//frames matching no candidate; counted as crc_errs once a candidate matches again
+	u8 *alive;	//CRC candidates consistent with every good frame so far
+	bool stopped;
+};
+
+/** @return 0 if ok; caller must dat_done() after */
+int dat_init(struct dat_parser *dp, dat_sink sink, void *ctx);
+
+/** parse len more bytes of the file. Frames may straddle calls; only the incomplete tail is copied.
+ * @return 0 if ok, else the sink stopped the parser
+ */
+int dat_feed(struct dat_parser *dp, const u8 *buf, size_t len);
+
+/** end of input : remaining bytes are counted as skipped. Stats are final after this. */
+void dat_finish(struct dat_parser *dp);
+
+void dat_done(struct dat_parser *dp);
+
+/** parse a whole file; "-" reads stdin. Regular files are mapped, anything else is read in blocks.
+ * @return 0 if ok
+ */
+int dat_parse_file(struct dat_parser *dp, const char *fname);
+
+/** unpack a whole .dat to memory, each payload at its address. Gaps are 0xFF.
+ *
+ * @param img : filled with a private, writable copy; caller must romimg_close() it
+ * @param st : optional, stats of the parse
+ * @return 0 if ok
+ */
+int dat_unpack(const char *fname, struct rom_image *img, struct dat_stats *st);
+
+#endif
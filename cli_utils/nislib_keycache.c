@@ -0,0 +1,74 @@
+/* small cache of ECUID => keyset lookups
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ecuid_list.h"
+#include "nis_romdb.h"
+#include "nislib_keycache.h"
+#include "stypes.h"
+
+void keycache_init(struct keycache *kc, unsigned long version) {
+	assert(kc);
+	memset(kc, 0, sizeof(*kc));
+	kc->version = version;
+}
+
+static unsigned slot_of(const char *ecuid) {
+	u32 h = 2166136261U;	//FNV-1a
+	unsigned idx;
+	for (idx = 0; idx < ECUID_LEN; idx++) {
+		h = (h ^ (u8) ecuid[idx]) * 16777619U;
+	}
+	return h & (KEYCACHE_SLOTS - 1);
+}
+
+/** uncached lookup */
+static bool lookup(nis_romdb *romdb, const char *ecuid, struct keyset_t *ks) {
+	const struct keyset_t *dks;
+	struct ecuid_keymatch_t km;
+
+	if (!romdb) return 0;
+	dks = romdb_q_keyset(romdb, ecuid);
+	if (!dks) {
+		//built-in list
+		if (!romdb_nearest_keys(romdb, ecuid, &km, 1) || km.dist) return 0;
+		dks = find_knownkey(romdb, KEY_S27, km.key);
+		if (!dks) {
+			//only the s27k is known
+			memset(ks, 0, sizeof(*ks));
+			ks->s27k = km.key;
+			return 1;
+		}
+	}
+	*ks = *dks;
+	return 1;
+}
+
+bool keycache_get(struct keycache *kc, nis_romdb *romdb, unsigned long version,
+			const char *ecuid, struct keyset_t *ks) {
+	assert(kc && ecuid && ks);
+	char key[ECUID_STR_LEN] = {0};
+	struct keycache_ent *ke;
+
+	strncpy(key, ecuid, ECUID_LEN);
+	if (version != kc->version) keycache_init(kc, version);
+
+	ke = &kc->ent[slot_of(key)];
+	if (ke->used && !memcmp(ke->ecuid, key, ECUID_LEN)) {
+		kc->hits++;
+		*ks = ke->ks;
+		return ke->found;
+	}
+	kc->misses++;
+	ke->found = lookup(romdb, key, &ke->ks);
+	memcpy(ke->ecuid, key, ECUID_LEN);
+	ke->used = 1;
+	*ks = ke->ks;
+	return ke->found;
+}
@@ -0,0 +1,52 @@
+/* small cache of ECUID => keyset lookups, for processes that resolve the same ECUIDs over and over
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * Entries are copies of the keysets, not pointers into a romdb, so that they survive a
+ * romdb_live reload; they are dropped when the db version changes instead.
+ * A keycache is not thread-safe : use one per thread.
+ */
+
+#ifndef NISLIB_KEYCACHE_H
+#define NISLIB_KEYCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ecuid_list.h"
+#include "nis_romdb.h"
+
+#define KEYCACHE_SLOTS	1024	//direct-mapped, power of 2
+
+struct keycache_ent {
+	char ecuid[ECUID_LEN];
+	bool used;
+	bool found;	//misses are cached too
+	struct keyset_t ks;
+};
+
+struct keycache {
+	unsigned long version;	//db version the entries came from
+	unsigned long hits;
+	unsigned long misses;	//i.e. db lookups
+	struct keycache_ent ent[KEYCACHE_SLOTS];
+};
+
+/** empty the cache, and set the version of the db it will be filled from */
+void keycache_init(struct keycache *kc, unsigned long version);
+
+/** get the keyset of an ECUID.
+ *
+ * On a miss, uses romdb_q_keyset(); if the ECUID isn't in the db, the s27k of the same ECUID
+ * in the built-in ECUID list, if any, is looked up in the db keysets (same as for .dat files).
+ *
+ * @param romdb : NULL if none is loaded yet : nothing is found. The built-in list is searched through it,
+ *	see romdb_nearest_keys(); a keyset from there may only have s27k
+ * @param version : of romdb, e.g. from romdb_live_version(); a change empties the cache
+ * @param ecuid : 5 chars, 0-termination optional
+ * @return 1 if found; *ks is filled
+ */
+bool keycache_get(struct keycache *kc, nis_romdb *romdb, unsigned long version,
+			const char *ecuid, struct keyset_t *ks);
+
+#endif
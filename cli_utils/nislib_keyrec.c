@@ -0,0 +1,351 @@
+/* key recovery for algo 1 encrypted ROMs, from structural known plaintext
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_keyrec.h"
+#include "nislib_pool.h"
+#include "nisrom_finders.h"
+#include "nisrom_romfile.h"
+#include "nissan_romdefs.h"
+#include "stypes.h"
+
+#define KR_MAXIVT2	8	//distinct IVT2 locations for one ROM size
+#define KR_CHUNK	(64 * 1024U)	//streaming checksum : decrypted this much at a time
+#define KR_JOBS	256	//search : low halves of the key are split in this many jobs
+#define KR_MAXCANDS	65536	//search : give up past this many keys with a plausible IVT, in one job
+
+struct kr_ctx {
+	const u8 *enc;
+	u32 siz;	//rounded down to a multiple of 4
+	nis_romdb *romdb;
+
+	bool ivt_ok;	//ciphertext has the repeated PC / SP of an IVT
+	bool want_std;	//some FID type of this size has a std cks (or the size is unknown)
+	bool want_full;	//some FID type of this size has no std cks
+	bool ivt2_req;	//every FID type of this size has an IVT2
+	u32 ivt2[KR_MAXIVT2];
+	unsigned nivt2;
+
+	u32 verified;	//atomic : also counted by the search workers
+
+	/* search */
+	unsigned found_job;	//atomic : lowest job that confirmed a key, KR_JOBS if none yet
+	struct keyrec_result *sres;	//filled by kr_search_emit()
+	bool overflow;
+};
+
+/** what the FID types of that ROM size have in common */
+static void kr_layouts(struct kr_ctx *kc) {
+	unsigned fti, nmatch = 0, nivt2 = 0;
+
+	for (fti = FID_UNK + 1; fti < FID_MAX; fti++) {
+		const struct fidtype_t *ft = &fidtypes[fti];
+		if (ft->ROMsize != kc->siz) continue;
+		nmatch++;
+		if (ft->features & ROM_HAS_STDCKS) {
+			kc->want_std = 1;
+		} else {
+			kc->want_full = 1;
+		}
+		if (!(ft->features & ROM_HAS_IVT2) || !ft->IVT2_expected) continue;
+		nivt2++;
+
+		unsigned idx;
+		for (idx = 0; idx < kc->nivt2; idx++) {
+			if (kc->ivt2[idx] == ft->IVT2_expected) break;
+		}
+		if ((idx == kc->nivt2) && (kc->nivt2 < KR_MAXIVT2) &&
+				(ft->IVT2_expected <= (kc->siz - IVT_MINSIZE))) {
+			kc->ivt2[kc->nivt2++] = ft->IVT2_expected;
+		}
+	}
+	if (!nmatch) {
+		//unknown size : try everything
+		kc->want_std = 1;
+		kc->want_full = 1;
+	}
+	kc->ivt2_req = nmatch && (nivt2 == nmatch) && kc->nivt2;
+}
+
+/** decrypt the first 16 bytes of an IVT at <pos> */
+static bool kr_ivt(const struct kr_ctx *kc, u32 pos, u32 key) {
+	u8 ivt[16];
+	dec1_buf(&kc->enc[pos], ivt, sizeof(ivt), key);
+	//check_ivt() only reads 16 bytes; siz is only its sanity check
+	return check_ivt(ivt, kc->siz - pos);
+}
+
+/** cheap tests : IVT, and IVT2 if expected.
+ * Reentrant, like kr_verify(); called from the search workers.
+ */
+static bool kr_quick(const struct kr_ctx *kc, u32 key) {
+	unsigned idx;
+
+	if (kc->ivt_ok && !kr_ivt(kc, 0, key)) return 0;
+	if (!kc->ivt2_req) return 1;
+	for (idx = 0; idx < kc->nivt2; idx++) {
+		if (kr_ivt(kc, kc->ivt2[idx], key)) return 1;
+	}
+	return 0;
+}
+
+/** std checksum of the decrypted image, without keeping it : sum32 over decrypted chunks,
+ * then look for the encrypted cks and ckx values in the ciphertext.
+ */
+static bool kr_stdcks(const struct kr_ctx *kc, u32 key) {
+	u8 *chunk = malloc(KR_CHUNK);
+	u32 sumt = 0, xort = 0;
+	u32 pos;
+
+	if (!chunk) return 0;
+	for (pos = 0; pos < kc->siz; pos += KR_CHUNK) {
+		u32 len = MIN(KR_CHUNK, kc->siz - pos);
+		u32 s, x;
+		dec1_buf(&kc->enc[pos], chunk, len, key);
+		sum32(chunk, len, &s, &x);
+		sumt += s;
+		xort ^= x;
+	}
+	free(chunk);
+
+	//same as checksum_alt2()
+	u32 cks = xort;
+	u32 ckx = sumt - 2 * xort;
+	return u32memstr(kc->enc, kc->siz, enc1(cks, key)) &&
+		u32memstr(kc->enc, kc->siz, enc1(ckx, key));
+}
+
+/** decrypt everything and check the structures and checksums for the FID type found in there.
+ * @return name of the valid checksum, NULL if none
+ */
+static const char *kr_full(const struct kr_ctx *kc, u32 key) {
+	static const u8 s_loader[] = "LOADER";
+	static const u8 s_database[] = "DATABASE";
+	struct romfile rf = {.romdb = kc->romdb};
+	const char *confirm = NULL;
+
+	rf.img.buf = malloc(kc->siz);
+	if (!rf.img.buf) return NULL;
+	rf.img.siz = kc->siz;
+	dec1_buf(kc->enc, rf.img.buf, kc->siz, key);
+
+	//the strings find_loader() and find_fid() need; quicker than a failed parse
+	if (!u8memstr(rf.img.buf, kc->siz, s_loader, sizeof(s_loader) - 1) &&
+			!u8memstr(rf.img.buf, kc->siz, s_database, sizeof(s_database) - 1)) {
+		romimg_close(&rf.img);
+		return NULL;
+	}
+	if (romfile_attach(&rf, "keyrec") || romfile_anchors(&rf)) goto exit;
+	(void) find_loader(&rf);
+	if (find_fid(&rf) == UINT32_MAX) goto exit;
+	(void) find_ramf(&rf);
+
+	const struct fid_plan *fp = rf.plan;
+	u32 p_cks, p_ckx;
+	if (fp->stdcks && !checksum_std(rf.buf, rf.siz, &p_cks, &p_ckx)) {
+		confirm = "std cks";
+		goto exit;
+	}
+	if (fp->alt2cks) {
+		find_alt2cks(&rf);
+		if (rf.cks_alt2_good) {
+			confirm = "alt2 cks";
+			goto exit;
+		}
+	}
+	if (fp->altcks && (rf.p_acstart != UINT32_MAX) && !validate_altcks(&rf)) {
+		confirm = "alt cks";
+	}
+exit:
+	close_rom(&rf);
+	return confirm;
+}
+
+/** full verification of a key that passed kr_quick()
+ * @return name of the check that confirmed it, NULL if bad
+ */
+static const char *kr_verify(struct kr_ctx *kc, u32 key) {
+	__atomic_add_fetch(&kc->verified, 1, __ATOMIC_RELAXED);
+	if (kc->want_std && kr_stdcks(kc, key)) return "std cks";
+	if (!kc->want_full) return NULL;
+	return kr_full(kc, key);
+}
+
+
+struct kr_kscb {
+	struct kr_ctx *kc;
+	struct keyrec_result *res;
+};
+
+static bool kr_keyset_cb(const struct keyset_t *keyset, void *data) {
+	struct kr_kscb *kcb = data;
+	const u32 keys[KEY_INVALID] = {
+		[KEY_S27] = keyset->s27k,
+		[KEY_S36K1] = keyset->s36k1,
+		[KEY_S36K2] = keyset->s36k2,
+	};
+	//the ROM is normally encrypted with the factory payload key
+	static const enum key_type order[] = {KEY_S36K2, KEY_S36K1, KEY_S27};
+	unsigned idx;
+
+	kcb->res->keysets_tried++;
+	for (idx = 0; idx < ARRAY_SIZE(order); idx++) {
+		u32 key = keys[order[idx]];
+		if (!key) continue;
+		if ((idx > 0) && (key == keys[order[idx - 1]])) continue;
+		if (!kr_quick(kcb->kc, key)) continue;
+
+		const char *confirm = kr_verify(kcb->kc, key);
+		if (!confirm) continue;
+		kcb->res->key = key;
+		kcb->res->src = KR_KEYSET;
+		kcb->res->keyset = keyset;
+		kcb->res->ktype = order[idx];
+		kcb->res->confirm = confirm;
+		return 1;
+	}
+	return 0;
+}
+
+
+struct kr_jobres {
+	u32 *keys;	//keys with a plausible IVT
+	u32 n;
+	u32 alloc;
+	bool overflow;
+	const struct kr_ctx *kc;
+
+	u32 key;	//first confirmed key, if confirm != NULL
+	const char *confirm;
+};
+
+static bool kr_search_cb(u32 key, void *data) {
+	struct kr_jobres *jr = data;
+
+	if (!kr_quick(jr->kc, key)) return 1;
+	if (jr->n == jr->alloc) {
+		u32 nalloc = jr->alloc ? (jr->alloc * 2) : 64;
+		u32 *nk;
+		if (nalloc > KR_MAXCANDS) {
+			jr->overflow = 1;
+			return 0;
+		}
+		nk = realloc(jr->keys, nalloc * sizeof(*nk));
+		if (!nk) {
+			jr->overflow = 1;
+			return 0;
+		}
+		jr->keys = nk;
+		jr->alloc = nalloc;
+	}
+	jr->keys[jr->n++] = key;
+	return 1;
+}
+
+/** search one range of low halves, and verify the candidates found there */
+static void *kr_search_work(unsigned jobidx, void *ctx) {
+	struct kr_ctx *kc = ctx;
+	struct kr_jobres *jr = calloc(1, sizeof(*jr));
+	const u32 klmin = jobidx * (65536 / KR_JOBS);
+	//reset PC, reset SP
+	const struct dec1_cons cons[2] = {
+		{ .enc = reconst_32(&kc->enc[0]), .lmask = 1, .lval = 0, .hmin = 0, .hmax = 0x00FF },
+		{ .enc = reconst_32(&kc->enc[4]), .lmask = 3, .lval = 0, .hmin = 0xFFF8, .hmax = 0xFFFF },
+	};
+	u32 idx;
+
+	if (!jr) return NULL;
+	jr->kc = kc;
+	(void) dec1_search(cons, ARRAY_SIZE(cons), klmin, klmin + (65536 / KR_JOBS) - 1, kr_search_cb, jr);
+	if (jr->overflow) return jr;
+
+	for (idx = 0; idx < jr->n; idx++) {
+		//an earlier job already has a key : the result wouldn't be used
+		if (__atomic_load_n(&kc->found_job, __ATOMIC_RELAXED) < jobidx) break;
+		jr->confirm = kr_verify(kc, jr->keys[idx]);
+		if (!jr->confirm) continue;
+		jr->key = jr->keys[idx];
+
+		unsigned prev = __atomic_load_n(&kc->found_job, __ATOMIC_RELAXED);
+		while ((jobidx < prev) &&
+			!__atomic_compare_exchange_n(&kc->found_job, &prev, jobidx, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		break;
+	}
+	return jr;
+}
+
+/** consume job results in key order; the first confirmed key wins */
+static void kr_search_emit(unsigned jobidx, void *result, void *ctx) {
+	struct kr_ctx *kc = ctx;
+	struct kr_jobres *jr = result;
+	(void) jobidx;
+
+	if (!jr || jr->overflow) {
+		kc->overflow = 1;
+	} else if (!kc->sres->confirm) {
+		kc->sres->ivt_cands += jr->n;
+		if (jr->confirm) {
+			kc->sres->key = jr->key;
+			kc->sres->src = KR_SEARCH;
+			kc->sres->confirm = jr->confirm;
+		}
+	}
+	if (!jr) return;
+	free(jr->keys);
+	free(jr);
+}
+
+static int kr_search(struct kr_ctx *kc, const struct keyrec_opts *opts, struct keyrec_result *res) {
+	kc->found_job = KR_JOBS;
+	kc->sres = res;
+	if (pool_run(KR_JOBS, opts->nthreads, kr_search_work, kr_search_emit, kc)) return -1;
+	if (res->confirm) return 0;
+	if (kc->overflow) {
+		ERR_PRINTF("too many keys give a plausible IVT, giving up\n");
+	}
+	return -1;
+}
+
+
+int keyrec_run(const u8 *enc, u32 siz, const struct keyrec_opts *opts, struct keyrec_result *res) {
+	struct kr_ctx kc = {
+		.enc = enc,
+		.siz = siz & ~3U,
+		.romdb = opts->romdb,
+	};
+
+	assert(enc && opts && res);
+	memset(res, 0, sizeof(*res));
+	if (kc.siz < IVT_MINSIZE) {
+		ERR_PRINTF("image too small\n");
+		return -1;
+	}
+	kr_layouts(&kc);
+	//PC, SP repeated for the manual reset : same ciphertext, whatever the key
+	kc.ivt_ok = (reconst_32(&enc[0]) == reconst_32(&enc[8])) &&
+			(reconst_32(&enc[4]) == reconst_32(&enc[12]));
+
+	if (opts->romdb) {
+		struct kr_kscb kcb = {.kc = &kc, .res = res};
+		keysets_iterate(opts->romdb, kr_keyset_cb, &kcb);
+	}
+	res->verified = kc.verified;
+	if (res->src != KR_NONE) return 0;
+	if (opts->no_search) return -1;
+	if (!kc.ivt_ok) {
+		ERR_PRINTF("no vector table at the start of the image, can't search\n");
+		return -1;
+	}
+
+	int rv = kr_search(&kc, opts, res);
+	res->verified = kc.verified;
+	return rv;
+}
@@ -0,0 +1,56 @@
+/* key recovery for algo 1 encrypted ROMs, from structural known plaintext
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * Every ROM starts with a vector table : reset PC in the bottom 16MB and even, SP in RAM and
+ * 4-aligned, both repeated for the manual reset (see check_ivt()). That is enough plaintext to
+ * search the whole key space with dec1_search(); the few hundred keys that give a plausible IVT
+ * are then narrowed down with the IVT2 expected for that ROM size (fidtype_t), and confirmed
+ * with a checksum of the decrypted image.
+ */
+
+#ifndef NISLIB_KEYREC_H
+#define NISLIB_KEYREC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nis_romdb.h"
+#include "stypes.h"
+
+enum keyrec_src {
+	KR_NONE = 0,
+	KR_KEYSET,	//a key of a known keyset
+	KR_SEARCH,	//exhaustive search
+};
+
+struct keyrec_opts {
+	nis_romdb *romdb;	//optional, for the known keysets
+	unsigned nthreads;	//0 for one per CPU
+	bool no_search;	//only try known keysets
+};
+
+struct keyrec_result {
+	u32 key;
+	enum keyrec_src src;
+	const struct keyset_t *keyset;	//KR_KEYSET only
+	enum key_type ktype;	//KR_KEYSET only : which key of the keyset
+	const char *confirm;	//which check confirmed the key, e.g. "std cks"
+
+	u32 keysets_tried;
+	u32 ivt_cands;	//search : keys that gave a plausible IVT (and IVT2), up to the one found
+	u32 verified;	//keys that went through a checksum verification
+};
+
+/** find the key of an encrypted ROM.
+ *
+ * Known keysets are tried first (s36k2, s36k1 then s27k of each), then, unless opts->no_search,
+ * every key that gives a valid IVT. A key is accepted when the decrypted image has a
+ * valid std checksum, or else valid checksums for the FID type found in it.
+ *
+ * @param enc : encrypted image, siz bytes
+ * @return 0 if a key was found
+ */
+int keyrec_run(const u8 *enc, u32 siz, const struct keyrec_opts *opts, struct keyrec_result *res);
+
+#endif
@@ -0,0 +1,214 @@
+/* compiled sets of SH opcode patterns, matched in a single pass
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_patset.h"
+#include "nislib_shindex.h"
+#include "stypes.h"
+
+#define NOPCODES 0x10000
+
+struct sh_patset {
+	unsigned npats;
+	u32 *pstart;	//[npats] : first opcode of each pattern in ops[], masks[]
+	u32 *plen;	//[npats]
+	u16 *ops;	//pat & mask, all patterns concatenated
+	u16 *masks;
+
+	u32 *bstart;	//[NOPCODES + 1] : patterns starting with opcode v are bids[bstart[v]] to bids[bstart[v+1] - 1]
+	u32 *bids;	//ascending within each bucket
+	u16 *firsts;	//opcode values with a non-empty bucket, ascending
+	u32 nfirsts;
+};
+
+struct patmatch {
+	u32 pos;
+	u32 id;
+};
+
+
+void sh_patset_free(struct sh_patset *ps) {
+	if (!ps) return;
+	free(ps->pstart);
+	free(ps->plen);
+	free(ps->ops);
+	free(ps->masks);
+	free(ps->bstart);
+	free(ps->bids);
+	free(ps->firsts);
+	free(ps);
+}
+
+struct sh_patset *sh_patset_compile(const struct sh_pattern *pats, unsigned npats) {
+	assert(pats || !npats);
+	struct sh_patset *ps = calloc(1, sizeof(*ps));
+	u32 *fill = NULL;
+	unsigned id;
+	u32 nops = 0, nbids = 0, v;
+
+	if (!ps) return NULL;
+	ps->npats = npats;
+
+	for (id = 0; id < npats; id++) {
+		assert(pats[id].len && pats[id].pat && pats[id].mask);
+		nops += pats[id].len;
+		//one bucket entry for each opcode value matching the first masked opcode
+		nbids += 1U << __builtin_popcount((u16) ~pats[id].mask[0]);
+	}
+
+	ps->pstart = malloc((npats + 1) * sizeof(*ps->pstart));
+	ps->plen = malloc((npats + 1) * sizeof(*ps->plen));
+	ps->ops = malloc((nops + 1) * sizeof(*ps->ops));
+	ps->masks = malloc((nops + 1) * sizeof(*ps->masks));
+	ps->bstart = calloc(NOPCODES + 1, sizeof(*ps->bstart));
+	ps->bids = malloc((nbids + 1) * sizeof(*ps->bids));
+	fill = malloc(NOPCODES * sizeof(*fill));
+	if (!ps->pstart || !ps->plen || !ps->ops || !ps->masks || !ps->bstart || !ps->bids || !fill) {
+		goto badexit;
+	}
+
+	nops = 0;
+	for (id = 0; id < npats; id++) {
+		unsigned i;
+		ps->pstart[id] = nops;
+		ps->plen[id] = pats[id].len;
+		for (i = 0; i < pats[id].len; i++) {
+			ps->masks[nops] = pats[id].mask[i];
+			ps->ops[nops] = pats[id].pat[i] & pats[id].mask[i];
+			nops++;
+		}
+	}
+
+	/* bucket sizes, then offsets; free bits are enumerated like sh_index_opcode_masked() */
+	for (id = 0; id < npats; id++) {
+		u16 free_bits = (u16) ~pats[id].mask[0];
+		u16 base = ps->ops[ps->pstart[id]];
+		u16 opc = 0;
+		do {
+			ps->bstart[(u16) (base | opc) + 1]++;
+			opc = (opc - free_bits) & free_bits;
+		} while (opc);
+	}
+	for (v = 0; v < NOPCODES; v++) {
+		if (ps->bstart[v + 1]) ps->nfirsts++;
+		ps->bstart[v + 1] += ps->bstart[v];
+	}
+	memcpy(fill, ps->bstart, NOPCODES * sizeof(*fill));
+	for (id = 0; id < npats; id++) {
+		u16 free_bits = (u16) ~pats[id].mask[0];
+		u16 base = ps->ops[ps->pstart[id]];
+		u16 opc = 0;
+		do {
+			ps->bids[fill[(u16) (base | opc)]++] = id;
+			opc = (opc - free_bits) & free_bits;
+		} while (opc);
+	}
+	free(fill);
+
+	ps->firsts = malloc((ps->nfirsts + 1) * sizeof(*ps->firsts));
+	if (!ps->firsts) goto badexit;
+	ps->nfirsts = 0;
+	for (v = 0; v < NOPCODES; v++) {
+		if (ps->bstart[v + 1] != ps->bstart[v]) ps->firsts[ps->nfirsts++] = (u16) v;
+	}
+	return ps;
+
+badexit:
+	ERR_PRINTF("sh_patset : malloc failed\n");
+	free(fill);
+	sh_patset_free(ps);
+	return NULL;
+}
+
+/** @return 1 if pattern <id> matches at pos; its first opcode is known to match */
+static bool pat_match(const struct sh_patset *ps, unsigned id, const u8 *buf, u32 siz, u32 pos) {
+	u32 len = ps->plen[id];
+	const u16 *ops = &ps->ops[ps->pstart[id]];
+	const u16 *masks = &ps->masks[ps->pstart[id]];
+	u32 i;
+
+	//same bounds as find_pattern()
+	if ((siz <= (len * 2)) || (pos >= (siz - len * 2))) return 0;
+	for (i = 1; i < len; i++) {
+		if ((reconst_16(&buf[pos + i * 2]) & masks[i]) != ops[i]) return 0;
+	}
+	return 1;
+}
+
+u32 sh_patset_scan(const struct sh_patset *ps, const uint8_t *buf, uint32_t siz, sh_patset_cb cb, void *ctx) {
+	assert(ps && buf);
+	u32 pos, nmatch = 0;
+
+	for (pos = 0; (pos + 2) <= siz; pos += 2) {
+		u16 opc = reconst_16(&buf[pos]);
+		u32 k, end = ps->bstart[opc + 1];
+
+		for (k = ps->bstart[opc]; k < end; k++) {
+			unsigned id = ps->bids[k];
+			if (!pat_match(ps, id, buf, siz, pos)) continue;
+			nmatch++;
+			if (cb && cb(ctx, id, pos)) return nmatch;
+		}
+	}
+	return nmatch;
+}
+
+static int cmp_patmatch(const void *a, const void *b) {
+	const struct patmatch *ma = a, *mb = b;
+	if (ma->pos != mb->pos) return (ma->pos < mb->pos) ? -1 : 1;
+	if (ma->id != mb->id) return (ma->id < mb->id) ? -1 : 1;
+	return 0;
+}
+
+u32 sh_patset_scan_index(const struct sh_patset *ps, const struct sh_index *idx,
+			const uint8_t *buf, uint32_t siz, sh_patset_cb cb, void *ctx) {
+	assert(ps && idx && buf);
+	struct patmatch *m = NULL;
+	u32 nm = 0, nalloc = 0;
+	u32 f, nmatch = 0;
+
+	//each position has a single opcode, so it's visited at most once
+	for (f = 0; f < ps->nfirsts; f++) {
+		u16 opc = ps->firsts[f];
+		const u32 *sites;
+		u32 nsites = sh_index_opcode(idx, opc, &sites);
+		u32 s, k, end = ps->bstart[opc + 1];
+
+		for (s = 0; s < nsites; s++) {
+			for (k = ps->bstart[opc]; k < end; k++) {
+				unsigned id = ps->bids[k];
+				if (!pat_match(ps, id, buf, siz, sites[s])) continue;
+				if (nm == nalloc) {
+					u32 newalloc = nalloc ? (2 * nalloc) : 256;
+					struct patmatch *newm = realloc(m, newalloc * sizeof(*newm));
+					if (!newm) {
+						ERR_PRINTF("sh_patset : malloc failed\n");
+						free(m);
+						return 0;
+					}
+					m = newm;
+					nalloc = newalloc;
+				}
+				m[nm].pos = sites[s];
+				m[nm].id = id;
+				nm++;
+			}
+		}
+	}
+
+	if (nm > 1) qsort(m, nm, sizeof(*m), cmp_patmatch);
+	for (f = 0; f < nm; f++) {
+		nmatch++;
+		if (cb && cb(ctx, m[f].id, m[f].pos)) break;
+	}
+	free(m);
+	return nmatch;
+}
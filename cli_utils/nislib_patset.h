@@ -0,0 +1,53 @@
+/* compiled sets of SH opcode patterns, matched in a single pass
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_PATSET_H
+#define NISLIB_PATSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nislib_shindex.h"
+#include "stypes.h"
+
+/** one masked opcode sequence, as for find_pattern() */
+struct sh_pattern {
+	unsigned len;	//# of opcodes
+	const u16 *pat;
+	const u16 *mask;
+};
+
+/** opaque compiled set. Read-only once compiled, can be shared between threads. */
+struct sh_patset;
+
+/** compile patterns into a dispatch table keyed on the first opcode : every opcode value maps
+ * to the (usually short) list of patterns it can start, so a scan costs one lookup per position
+ * plus the checks for the few candidates, regardless of the number of patterns.
+ *
+ * pats[] can be freed after this; pattern ids are indices into pats[].
+ * @return NULL if failed
+ */
+struct sh_patset *sh_patset_compile(const struct sh_pattern *pats, unsigned npats);
+
+void sh_patset_free(struct sh_patset *ps);
+
+/** called for each match, in ascending position order, then by pattern id.
+ * @return 0 to continue, else the scan stops
+ */
+typedef int (*sh_patset_cb)(void *ctx, unsigned patid, u32 pos);
+
+/** find every match of every pattern in buf, with the same bounds as find_pattern() for each.
+ * @param cb : may be NULL to just count
+ * @return number of matches reported
+ */
+u32 sh_patset_scan(const struct sh_patset *ps, const uint8_t *buf, uint32_t siz, sh_patset_cb cb, void *ctx);
+
+/** same results as sh_patset_scan(), but only the positions of opcodes that start a pattern are
+ * looked at, using the code index of buf.
+ */
+u32 sh_patset_scan_index(const struct sh_patset *ps, const struct sh_index *idx,
+			const uint8_t *buf, uint32_t siz, sh_patset_cb cb, void *ctx);
+
+#endif
@@ -0,0 +1,197 @@
+/* minimal worker pool with in-order results
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>	//sysconf
+
+#include "nislib_pool.h"
+
+#define POOL_WINDOW_PER_THREAD	4	//how many pending results we tolerate, per worker
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond_done;	//signals the emitter that a job finished
+	pthread_cond_t cond_window;	//signals the workers that the window moved
+	pthread_cond_t cond_batch;	//signals the workers that a batch started, or to quit
+
+	pthread_t *threads;
+	unsigned nthreads;	//started; 0 if none could be
+	unsigned gen;	//batch number
+	bool quit;
+
+	/* current batch */
+	unsigned njobs;
+	unsigned window;
+	unsigned next_job;	//next job to hand out
+	unsigned next_emit;	//next result to emit
+
+	void **results;
+	bool *done;
+
+	pool_work_cb work;
+	void *ctx;
+};
+
+static void *pool_worker(void *arg) {
+	struct pool *p = arg;
+	unsigned seen = 0;	//last batch worked on
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!p->quit && (p->gen == seen)) {
+			pthread_cond_wait(&p->cond_batch, &p->lock);
+		}
+		if (p->quit) break;
+		seen = p->gen;
+
+		while (1) {
+			while ((p->next_job < p->njobs) &&
+					((p->next_job - p->next_emit) >= p->window)) {
+				pthread_cond_wait(&p->cond_window, &p->lock);
+			}
+			if (p->next_job >= p->njobs) break;
+
+			unsigned jobidx = p->next_job++;
+			pool_work_cb work = p->work;
+			void *ctx = p->ctx;
+			pthread_mutex_unlock(&p->lock);
+
+			void *res = work(jobidx, ctx);
+
+			pthread_mutex_lock(&p->lock);
+			p->results[jobidx] = res;
+			p->done[jobidx] = 1;
+			if (jobidx == p->next_emit) {
+				pthread_cond_signal(&p->cond_done);
+			}
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+unsigned pool_ncpus(void) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) return 1;
+	return (unsigned) ncpu;
+}
+
+struct pool *pool_new(unsigned nthreads) {
+	struct pool *p = calloc(1, sizeof(*p));
+	if (!p) return NULL;
+
+	if (!nthreads) nthreads = pool_ncpus();
+	p->threads = calloc(nthreads, sizeof(*p->threads));
+	if (!p->threads) {
+		free(p);
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond_done, NULL);
+	pthread_cond_init(&p->cond_window, NULL);
+	pthread_cond_init(&p->cond_batch, NULL);
+
+	for (p->nthreads = 0; p->nthreads < nthreads; p->nthreads++) {
+		if (pthread_create(&p->threads[p->nthreads], NULL, pool_worker, p)) break;
+	}
+	return p;
+}
+
+void pool_free(struct pool *p) {
+	unsigned idx;
+	if (!p) return;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond_batch);
+	pthread_mutex_unlock(&p->lock);
+	for (idx = 0; idx < p->nthreads; idx++) {
+		pthread_join(p->threads[idx], NULL);
+	}
+
+	pthread_cond_destroy(&p->cond_batch);
+	pthread_cond_destroy(&p->cond_window);
+	pthread_cond_destroy(&p->cond_done);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	free(p);
+}
+
+int pool_exec(struct pool *p, unsigned njobs, pool_work_cb work, pool_emit_cb emit, void *ctx) {
+	unsigned idx;
+
+	assert(p && work && emit);
+
+	if (!njobs) return 0;
+
+	if (!p->nthreads) {
+		// no threads at all : do it the old way
+		for (idx = 0; idx < njobs; idx++) {
+			emit(idx, work(idx, ctx), ctx);
+		}
+		return 0;
+	}
+
+	void **results = calloc(njobs, sizeof(*results));
+	bool *done = calloc(njobs, sizeof(*done));
+	if (!results || !done) {
+		free(results);
+		free(done);
+		return -1;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->njobs = njobs;
+	p->window = p->nthreads * POOL_WINDOW_PER_THREAD;
+	p->next_job = 0;
+	p->next_emit = 0;
+	p->results = results;
+	p->done = done;
+	p->work = work;
+	p->ctx = ctx;
+	p->gen++;
+	pthread_cond_broadcast(&p->cond_batch);
+
+	while (p->next_emit < njobs) {
+		unsigned jobidx = p->next_emit;
+		while (!p->done[jobidx]) {
+			pthread_cond_wait(&p->cond_done, &p->lock);
+		}
+		void *res = p->results[jobidx];
+		pthread_mutex_unlock(&p->lock);
+
+		emit(jobidx, res, ctx);
+
+		pthread_mutex_lock(&p->lock);
+		p->next_emit++;
+		pthread_cond_broadcast(&p->cond_window);
+	}
+	//every job was handed out and finished : workers won't touch these again
+	p->results = NULL;
+	p->done = NULL;
+	pthread_mutex_unlock(&p->lock);
+
+	free(done);
+	free(results);
+	return 0;
+}
+
+int pool_run(unsigned njobs, unsigned nthreads, pool_work_cb work, pool_emit_cb emit, void *ctx) {
+	assert(work && emit);
+
+	if (!njobs) return 0;
+	if (!nthreads) nthreads = pool_ncpus();
+	if (nthreads > njobs) nthreads = njobs;
+
+	struct pool *p = pool_new(nthreads);
+	if (!p) return -1;
+	int rv = pool_exec(p, njobs, work, emit, ctx);
+	pool_free(p);
+	return rv;
+}
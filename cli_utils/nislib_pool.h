@@ -0,0 +1,57 @@
+/* minimal worker pool : run independent jobs on several threads,
+ * and consume the results in job order.
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_POOL_H
+#define NISLIB_POOL_H
+
+/** job worker, called from a worker thread.
+ * Must be reentrant; anything shared through ctx must be read-only.
+ * It can also run on the thread that called pool_run() (see below) : thread-local state
+ * such as dbg_stream must be restored before returning.
+ * @return result handed to the emit callback; may be NULL
+ */
+typedef void *(*pool_work_cb)(unsigned jobidx, void *ctx);
+
+/** result consumer, called from the thread that called pool_run(),
+ * in increasing jobidx order. Takes ownership of the result.
+ */
+typedef void (*pool_emit_cb)(unsigned jobidx, void *result, void *ctx);
+
+/** run jobs [0, njobs[ on a pool of worker threads.
+ *
+ * @param nthreads : number of workers; 0 means one per online CPU
+ *
+ * Workers stay at most a few jobs ahead of the oldest un-emitted result,
+ * to bound the number of pending results when one job is much slower.
+ * If no thread can be started, jobs are run sequentially by the caller.
+ *
+ * @return 0 if ok
+ */
+int pool_run(unsigned njobs, unsigned nthreads, pool_work_cb work, pool_emit_cb emit, void *ctx);
+
+/** persistent pool : workers stay up between batches, for callers that run many short
+ * batches (e.g. one per input chunk) and shouldn't pay thread setup for each.
+ */
+struct pool;
+
+/** start nthreads workers (0 : one per online CPU). If none can be started, pool_exec()
+ * runs the jobs sequentially on the caller's thread.
+ * @return NULL if error
+ */
+struct pool *pool_new(unsigned nthreads);
+
+/** like pool_run(), with the workers of p. One pool_exec() at a time per pool.
+ * @return 0 if ok
+ */
+int pool_exec(struct pool *p, unsigned njobs, pool_work_cb work, pool_emit_cb emit, void *ctx);
+
+/** stop and join the workers. Must not be called during pool_exec() */
+void pool_free(struct pool *p);
+
+/** @return number of online CPUs, at least 1 */
+unsigned pool_ncpus(void);
+
+#endif
@@ -0,0 +1,91 @@
+/* opt-in profiling : per-thread stage timers and work counters
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nislib_prof.h"
+
+__thread struct prof_stats *prof_cur;
+
+static const char *timer_names[PT_MAX] = {
+	[PT_INDEX] = "sh_index_build",
+	[PT_ANCHORS] = "anchors_scan",
+	[PT_LOADER] = "find_loader",
+	[PT_FID] = "find_fid",
+	[PT_RAMF] = "find_ramf",
+	[PT_ALTCKS] = "validate_altcks",
+	[PT_STDCKS] = "checksum_std",
+	[PT_ALT2CKS] = "checksum_alt2",
+	[PT_KEYFIND] = "keyfinder",
+	[PT_KF_STRAT1] = "kf_strat1",
+	[PT_KF_STRAT2] = "kf_strat2",
+	[PT_KF_BRUTE] = "kf_bruteforce",
+	[PT_EEP] = "find_eep",
+	[PT_ECUID] = "find_ecuid",
+	[PT_CALLTABLE] = "find_calltable",
+	[PT_DATUNPACK] = "dat_unpack",
+	[PT_DATDEC] = "dat_decrypt",
+};
+
+static const char *counter_names[PC_MAX] = {
+	[PC_BYTES_SCANNED] = "bytes_scanned",
+	[PC_TRACK_NODES] = "track_nodes",
+	[PC_KEYSETS_TRIED] = "keysets_tried",
+};
+
+uint64_t prof_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void prof_merge(struct prof_stats *dst, const struct prof_stats *src) {
+	assert(dst && src);
+	unsigned idx;
+
+	for (idx = 0; idx < PT_MAX; idx++) {
+		dst->ns[idx] += src->ns[idx];
+		dst->calls[idx] += src->calls[idx];
+	}
+	for (idx = 0; idx < PC_MAX; idx++) {
+		dst->cnt[idx] += src->cnt[idx];
+	}
+}
+
+void prof_json_str(FILE *fh, const char *str) {
+	assert(fh && str);
+
+	fputc('"', fh);
+	for (; *str; str++) {
+		unsigned char c = (unsigned char) *str;
+		if ((c == '"') || (c == '\\')) {
+			fprintf(fh, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(fh, "\\u%04X", c);
+		} else {
+			fputc(c, fh);
+		}
+	}
+	fputc('"', fh);
+}
+
+void prof_json_stats(FILE *fh, const struct prof_stats *ps) {
+	assert(fh && ps);
+	unsigned idx;
+
+	fprintf(fh, "\"timers\":{");
+	for (idx = 0; idx < PT_MAX; idx++) {
+		fprintf(fh, "%s\"%s\":{\"ns\":%llu,\"calls\":%lu}", idx ? "," : "", timer_names[idx],
+				(unsigned long long) ps->ns[idx], (unsigned long) ps->calls[idx]);
+	}
+	fprintf(fh, "},\"counters\":{");
+	for (idx = 0; idx < PC_MAX; idx++) {
+		fprintf(fh, "%s\"%s\":%llu", idx ? "," : "", counter_names[idx],
+				(unsigned long long) ps->cnt[idx]);
+	}
+	fprintf(fh, "}");
+}
@@ -0,0 +1,81 @@
+/* opt-in profiling : per-thread stage timers and work counters
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_PROF_H
+#define NISLIB_PROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Instrumented code calls prof_start() / prof_stop() and prof_count(); these
+ * do nothing unless the current thread has set prof_cur.
+ * Timers can nest (e.g. find_ramf includes validate_altcks), so they don't add up to the total.
+ */
+
+enum prof_timer {
+	PT_INDEX = 0,	//sh_index_build
+	PT_ANCHORS,	//anchors_scan
+	PT_LOADER,
+	PT_FID,
+	PT_RAMF,
+	PT_ALTCKS,	//validate_altcks
+	PT_STDCKS,
+	PT_ALT2CKS,
+	PT_KEYFIND,	//whole keyfinder_run, i.e. slowest strategy or first good one
+	PT_KF_STRAT1,
+	PT_KF_STRAT2,
+	PT_KF_BRUTE,
+	PT_EEP,
+	PT_ECUID,	//find_ecuid
+	PT_CALLTABLE,
+	PT_DATUNPACK,	//.dat input : dat_unpack
+	PT_DATDEC,	//.dat input : decrypt + key selection
+	PT_MAX,
+};
+
+enum prof_counter {
+	PC_BYTES_SCANNED = 0,	//ROM bytes read by linear scans and checksums
+	PC_TRACK_NODES,	//opcodes visited by sh_track_reg
+	PC_KEYSETS_TRIED,	//known-key lookups of candidate keys
+	PC_MAX,
+};
+
+struct prof_stats {
+	uint64_t ns[PT_MAX];
+	uint32_t calls[PT_MAX];
+	uint64_t cnt[PC_MAX];
+};
+
+/** stats of the current thread; NULL (default) disables profiling */
+extern __thread struct prof_stats *prof_cur;
+
+/** @return monotonic time in ns */
+uint64_t prof_now(void);
+
+/** @return start timestamp for prof_stop(), or 0 if not profiling */
+static inline uint64_t prof_start(void) {
+	return prof_cur ? prof_now() : 0;
+}
+
+static inline void prof_stop(enum prof_timer pt, uint64_t t0) {
+	if (!prof_cur) return;
+	prof_cur->ns[pt] += prof_now() - t0;
+	prof_cur->calls[pt] += 1;
+}
+
+static inline void prof_count(enum prof_counter pc, uint64_t n) {
+	if (prof_cur) prof_cur->cnt[pc] += n;
+}
+
+/** add src to dst, e.g. stats from a helper thread */
+void prof_merge(struct prof_stats *dst, const struct prof_stats *src);
+
+/** write <str> as a quoted JSON string */
+void prof_json_str(FILE *fh, const char *str);
+
+/** write "timers":{...},"counters":{...} members, without the enclosing braces */
+void prof_json_stats(FILE *fh, const struct prof_stats *ps);
+
+#endif
@@ -0,0 +1,364 @@
+/* decoded code index for SH ROMs
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_arena.h"
+#include "nislib_shindex.h"
+#include "nislib_shtools.h"
+#include "sh_opcodes.h"
+#include "stypes.h"
+
+#define OPC_VALUES	65536
+
+struct sh_index {
+	struct arena *arena;	//if set, everything is in there and sh_index_free() does nothing
+	const u8 *buf;
+	u32 siz;	//rounded down to a multiple of 2
+
+	/* CSR : positions of opcode X are opc_pos[opc_start[X] .. opc_start[X + 1][ */
+	u32 *opc_start;
+	u32 *opc_pos;
+
+	struct sh_opinfo *dec;	//sh_optable() entry of each halfword
+
+	struct sh_xref *pcimm;	//sorted by val, then pos
+	u32 npcimm;
+
+	struct sh_xref *bsr;	//val is the call target; sorted by val, then pos
+	u32 nbsr;
+
+	u32 *funcs;	//sorted, unique
+	u32 nfuncs;
+};
+
+static int cmp_xref(const void *a, const void *b) {
+	const struct sh_xref *xa = a, *xb = b;
+	if (xa->val != xb->val) return (xa->val < xb->val) ? -1 : 1;
+	if (xa->pos != xb->pos) return (xa->pos < xb->pos) ? -1 : 1;
+	return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	u32 ua = *(const u32 *) a, ub = *(const u32 *) b;
+	if (ua != ub) return (ua < ub) ? -1 : 1;
+	return 0;
+}
+
+/* @return 1 if literal of the mov.x @(disp,PC) at pos fits in buf */
+static bool pcimm_inbounds(u16 opc, u32 pos, u32 siz) {
+	u32 lpos;
+	if (opc & 0x4000) {
+		lpos = (pos + ((opc & 0xFF) * 4) + 4) & ~0x03;
+		return ((lpos + 4) <= siz);
+	}
+	lpos = pos + ((opc & 0xFF) * 2) + 4;
+	return ((lpos + 2) <= siz);
+}
+
+static void *idx_malloc(struct arena *a, size_t size) {
+	return a ? arena_alloc(a, size) : malloc(size);
+}
+
+static void *idx_calloc(struct arena *a, size_t nmemb, size_t size) {
+	return a ? arena_calloc(a, nmemb, size) : calloc(nmemb, size);
+}
+
+static void build_funcstarts(struct sh_index *idx) {
+	u32 cnt = 0, cur;
+	u32 *funcs = idx_malloc(idx->arena, (idx->nbsr + idx->npcimm + 1) * sizeof(*funcs));
+	if (!funcs) return;	//not fatal, just no function starts
+
+	for (cur = 0; cur < idx->nbsr; cur++) {
+		u32 tgt = idx->bsr[cur].val;
+		if ((tgt < idx->siz) && !(tgt & 1)) funcs[cnt++] = tgt;
+	}
+	for (cur = 0; cur < idx->npcimm; cur++) {
+		u32 tgt = idx->pcimm[cur].val;
+		u32 pos = idx->pcimm[cur].pos;
+		if (!(reconst_16(&idx->buf[pos]) & 0x4000)) continue;	//mov.w can't hold a code address
+		if ((tgt & 1) || ((tgt + 2) > idx->siz)) continue;
+		if (!sh_isprologue(&idx->buf[tgt])) continue;
+		funcs[cnt++] = tgt;
+	}
+	qsort(funcs, cnt, sizeof(*funcs), cmp_u32);
+
+	//dedup
+	u32 uniq = 0;
+	for (cur = 0; cur < cnt; cur++) {
+		if (uniq && (funcs[uniq - 1] == funcs[cur])) continue;
+		funcs[uniq++] = funcs[cur];
+	}
+	idx->funcs = funcs;
+	idx->nfuncs = uniq;
+}
+
+struct sh_index *sh_index_build(const uint8_t *buf, uint32_t siz) {
+	return sh_index_build_arena(buf, siz, NULL);
+}
+
+struct sh_index *sh_index_build_arena(const uint8_t *buf, uint32_t siz, struct arena *a) {
+	assert(buf && siz && (siz <= MAX_ROMSIZE));
+
+	struct sh_index *idx = idx_calloc(a, 1, sizeof(*idx));
+	if (!idx) return NULL;
+
+	idx->arena = a;
+	idx->buf = buf;
+	idx->siz = siz & ~1;
+	u32 nopc = idx->siz / 2;
+	u32 pos;
+
+	idx->opc_start = idx_calloc(a, OPC_VALUES + 1, sizeof(*idx->opc_start));
+	idx->opc_pos = idx_malloc(a, (nopc + 1) * sizeof(*idx->opc_pos));
+	idx->dec = idx_malloc(a, (nopc + 1) * sizeof(*idx->dec));
+	if (!idx->opc_start || !idx->opc_pos || !idx->dec) goto bad;
+	const struct sh_opinfo *ot = sh_optable();
+
+	/* 1) count opcodes and xref sites */
+	u32 npcimm = 0, nbsr = 0;
+	for (pos = 0; pos < idx->siz; pos += 2) {
+		u16 opc = reconst_16(&buf[pos]);
+		idx->opc_start[opc + 1] += 1;
+		if ((opc & 0xB000) == 0x9000) npcimm++;
+		if ((opc & 0xF000) == 0xB000) nbsr++;
+	}
+	unsigned opc;
+	for (opc = 0; opc < OPC_VALUES; opc++) {
+		idx->opc_start[opc + 1] += idx->opc_start[opc];
+	}
+
+	idx->pcimm = idx_malloc(a, (npcimm + 1) * sizeof(*idx->pcimm));
+	idx->bsr = idx_malloc(a, (nbsr + 1) * sizeof(*idx->bsr));
+	if (!idx->pcimm || !idx->bsr) goto bad;
+
+	/* 2) fill. opc_start[X] is used as the fill cursor, then restored */
+	for (pos = 0; pos < idx->siz; pos += 2) {
+		u16 op = reconst_16(&buf[pos]);
+		idx->opc_pos[idx->opc_start[op]++] = pos;
+		idx->dec[pos / 2] = ot[op];
+
+		//mov.w @(disp,PC), Rn : 1001nnnndddddddd; mov.l @(disp,PC), Rn : 1101nnnndddddddd
+		if (((op & 0xB000) == 0x9000) && pcimm_inbounds(op, pos, idx->siz)) {
+			idx->pcimm[idx->npcimm].val = sh_get_PCimm(buf, pos);
+			idx->pcimm[idx->npcimm].pos = pos;
+			idx->npcimm++;
+		}
+		if ((op & 0xF000) == 0xB000) {
+			idx->bsr[idx->nbsr].val = disarm_12bit_offset(pos, op & 0xFFF);
+			idx->bsr[idx->nbsr].pos = pos;
+			idx->nbsr++;
+		}
+	}
+	for (opc = OPC_VALUES; opc > 0; opc--) {
+		idx->opc_start[opc] = idx->opc_start[opc - 1];
+	}
+	idx->opc_start[0] = 0;
+
+	qsort(idx->pcimm, idx->npcimm, sizeof(*idx->pcimm), cmp_xref);
+	qsort(idx->bsr, idx->nbsr, sizeof(*idx->bsr), cmp_xref);
+	build_funcstarts(idx);
+	return idx;
+
+bad:
+	ERR_PRINTF("sh_index : malloc failed\n");
+	sh_index_free(idx);
+	return NULL;
+}
+
+void sh_index_free(struct sh_index *idx) {
+	if (!idx || idx->arena) return;
+	free(idx->opc_start);
+	free(idx->opc_pos);
+	free(idx->dec);
+	free(idx->pcimm);
+	free(idx->bsr);
+	free(idx->funcs);
+	free(idx);
+}
+
+const struct sh_opinfo *sh_index_decoded(const struct sh_index *idx) {
+	assert(idx);
+	return idx->dec;
+}
+
+u32 sh_index_opcode(const struct sh_index *idx, u16 opc, const u32 **sites) {
+	assert(idx && sites);
+	*sites = &idx->opc_pos[idx->opc_start[opc]];
+	return idx->opc_start[opc + 1] - idx->opc_start[opc];
+}
+
+u32 sh_index_opcode_masked(const struct sh_index *idx, u16 pat, u16 mask, u32 **sites) {
+	assert(idx && sites);
+	u32 total = 0;
+	unsigned opc;
+
+	*sites = NULL;
+	pat &= mask;
+	//enumerate every opcode value with the fixed bits of pat : only the bits outside mask vary
+	u16 free_bits = ~mask;
+	opc = 0;
+	do {
+		u16 val = pat | (u16) opc;
+		total += idx->opc_start[val + 1] - idx->opc_start[val];
+		opc = (opc - free_bits) & free_bits;
+	} while (opc);
+
+	if (!total) return 0;
+	u32 *list = malloc(total * sizeof(*list));
+	if (!list) {
+		ERR_PRINTF("sh_index : malloc failed\n");
+		return 0;
+	}
+
+	u32 cnt = 0;
+	opc = 0;
+	do {
+		u16 val = pat | (u16) opc;
+		u32 n = idx->opc_start[val + 1] - idx->opc_start[val];
+		memcpy(&list[cnt], &idx->opc_pos[idx->opc_start[val]], n * sizeof(*list));
+		cnt += n;
+		opc = (opc - free_bits) & free_bits;
+	} while (opc);
+
+	if (free_bits) qsort(list, cnt, sizeof(*list), cmp_u32);
+	*sites = list;
+	return cnt;
+}
+
+u32 sh_index_pattern(const struct sh_index *idx, unsigned patlen, const u16 *pat, const u16 *mask, u32 **sites) {
+	assert(idx && patlen && pat && mask && sites);
+	u32 *cands;
+	u32 ncands, cur, nmatch = 0;
+
+	*sites = NULL;
+	if (idx->siz <= (patlen * 2)) return 0;
+
+	ncands = sh_index_opcode_masked(idx, pat[0], mask[0], &cands);
+	for (cur = 0; cur < ncands; cur++) {
+		u32 pos = cands[cur];
+		unsigned patcur;
+
+		//same bounds as find_pattern()
+		if (pos >= (idx->siz - patlen * 2)) break;
+		for (patcur = 1; patcur < patlen; patcur++) {
+			u16 val = reconst_16(&idx->buf[pos + patcur * 2]);
+			if ((val & mask[patcur]) != (pat[patcur] & mask[patcur])) break;
+		}
+		if (patcur == patlen) {
+			cands[nmatch++] = pos;	//compact in place
+		}
+	}
+	if (!nmatch) {
+		free(cands);
+		return 0;
+	}
+	*sites = cands;
+	return nmatch;
+}
+
+/* @return index of the first xref with val >= key */
+static u32 xref_lower_bound(const struct sh_xref *xr, u32 num, u32 key) {
+	u32 lo = 0, hi = num;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (xr[mid].val < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static u32 xref_lookup(const struct sh_xref *xr, u32 num, u32 key, const struct sh_xref **sites) {
+	u32 first = xref_lower_bound(xr, num, key);
+	u32 last = first;
+	while ((last < num) && (xr[last].val == key)) last++;
+	*sites = &xr[first];
+	return last - first;
+}
+
+u32 sh_index_pcimm(const struct sh_index *idx, u32 imm, const struct sh_xref **sites) {
+	assert(idx && sites);
+	return xref_lookup(idx->pcimm, idx->npcimm, imm, sites);
+}
+
+u32 sh_index_bsr(const struct sh_index *idx, u32 tgt, const struct sh_xref **sites) {
+	assert(idx && sites);
+	return xref_lookup(idx->bsr, idx->nbsr, tgt, sites);
+}
+
+u32 sh_index_allpcimm(const struct sh_index *idx, const struct sh_xref **sites) {
+	assert(idx && sites);
+	*sites = idx->pcimm;
+	return idx->npcimm;
+}
+
+u32 sh_index_allbsr(const struct sh_index *idx, const struct sh_xref **sites) {
+	assert(idx && sites);
+	*sites = idx->bsr;
+	return idx->nbsr;
+}
+
+void sh_index_find_bsr(const struct sh_index *idx, u32 tgt,
+			void (*found_bsr_cb)(const uint8_t *buf, uint32_t pos, void *data), void *cbdata) {
+	assert(idx && found_bsr_cb);
+	const struct sh_xref *sites;
+	u32 n = sh_index_bsr(idx, tgt, &sites);
+	if (!n) return;
+
+	/* sites are sorted by pos; the "bsr" at tgt - 4 is the nearest.
+	 * Walk outwards from there : first the one before, then the one after, like find_bsr().
+	 * Below 4, every site is after the center : clamping keeps that order */
+	u32 center = (tgt >= 4) ? tgt - 4 : 0;
+	u32 below = 0;	//sites[0 .. below[ have pos <= center
+	while ((below < n) && (sites[below].pos <= center)) below++;
+	u32 lo = below, hi = below;	//next candidates : sites[lo - 1] going down, sites[hi] going up
+
+	while ((lo > 0) || (hi < n)) {
+		bool take_lo;
+		if (lo == 0) {
+			take_lo = 0;
+		} else if (hi == n) {
+			take_lo = 1;
+		} else {
+			//at equal distance, the lower one comes first
+			take_lo = ((center - sites[lo - 1].pos) <= (sites[hi].pos - center));
+		}
+		if (take_lo) {
+			lo--;
+			found_bsr_cb(idx->buf, sites[lo].pos, cbdata);
+		} else {
+			found_bsr_cb(idx->buf, sites[hi].pos, cbdata);
+			hi++;
+		}
+	}
+}
+
+u32 sh_index_funcstarts(const struct sh_index *idx, const u32 **funcs) {
+	assert(idx && funcs);
+	*funcs = idx->funcs;
+	return idx->nfuncs;
+}
+
+bool sh_index_isfuncstart(const struct sh_index *idx, u32 pos) {
+	assert(idx);
+	u32 lo = 0, hi = idx->nfuncs;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (idx->funcs[mid] < pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return ((lo < idx->nfuncs) && (idx->funcs[lo] == pos));
+}
@@ -0,0 +1,99 @@
+/* decoded code index for SH ROMs : built in one pass, then
+ * finders use lookups instead of rescanning the whole ROM.
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_SHINDEX_H
+#define NISLIB_SHINDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stypes.h"
+
+/** cross-reference : value (immediate, call target) used at pos */
+struct sh_xref {
+	u32 val;
+	u32 pos;
+};
+
+/** opaque index. Read-only once built, can be shared between threads. */
+struct sh_index;
+
+/** index every aligned opcode of buf.
+ *
+ * buf must stay valid until sh_index_free().
+ * @return NULL if failed
+ */
+struct sh_index *sh_index_build(const uint8_t *buf, uint32_t siz);
+
+struct arena;
+
+/** same, allocated in arena <a> : sh_index_free() is then a no-op and the index lives until arena_reset() */
+struct sh_index *sh_index_build_arena(const uint8_t *buf, uint32_t siz, struct arena *a);
+
+void sh_index_free(struct sh_index *idx);
+
+struct sh_opinfo;
+
+/** decoded opcodes, one per halfword : [pos / 2] is sh_optable()[opcode at pos].
+ * Can be given to sh_tracker_setdecoded() for trackers working on the same buf.
+ */
+const struct sh_opinfo *sh_index_decoded(const struct sh_index *idx);
+
+/** positions of a given opcode, in ascending order
+ * @return number of sites; *sites points inside the index
+ */
+u32 sh_index_opcode(const struct sh_index *idx, u16 opc, const u32 **sites);
+
+/** positions where (opcode & mask) == (pat & mask), in ascending order
+ * @return number of sites; caller must free(*sites); 0 if none (*sites = NULL)
+ */
+u32 sh_index_opcode_masked(const struct sh_index *idx, u16 pat, u16 mask, u32 **sites);
+
+/** all positions where the opcode pattern matches, same semantics as find_pattern()
+ * over the whole buffer, in ascending order.
+ *
+ * @return number of matches; caller must free(*sites); 0 if none (*sites = NULL)
+ */
+u32 sh_index_pattern(const struct sh_index *idx, unsigned patlen, const u16 *pat, const u16 *mask, u32 **sites);
+
+/** mov.w / mov.l @(disp, PC), Rn sites that load immediate <imm>.
+ * .pos of each xref is the opcode position, in ascending order.
+ * Literals outside the buffer are not indexed.
+ * @return number of sites; *sites points inside the index
+ */
+u32 sh_index_pcimm(const struct sh_index *idx, u32 imm, const struct sh_xref **sites);
+
+/** "bsr" sites that call <tgt>, in ascending order
+ * @return number of sites; *sites points inside the index
+ */
+u32 sh_index_bsr(const struct sh_index *idx, u32 tgt, const struct sh_xref **sites);
+
+/** every mov.w / mov.l @(disp, PC), Rn site, sorted by value then position
+ * @return number of sites; *sites points inside the index
+ */
+u32 sh_index_allpcimm(const struct sh_index *idx, const struct sh_xref **sites);
+
+/** every "bsr" site, sorted by target then position
+ * @return number of sites; *sites points inside the index
+ */
+u32 sh_index_allbsr(const struct sh_index *idx, const struct sh_xref **sites);
+
+/** call cb for each "bsr" to <tgt>; drop-in for find_bsr().
+ * Sites are reported nearest first, alternating before / after tgt like find_bsr().
+ */
+void sh_index_find_bsr(const struct sh_index *idx, u32 tgt,
+			void (*found_bsr_cb)(const uint8_t *buf, uint32_t pos, void *data), void *cbdata);
+
+/** likely function starts : bsr targets, and mov.l literals pointing to a function prologue
+ * (jsr targets). Sorted, no duplicates.
+ * @return number of entries; *funcs points inside the index
+ */
+u32 sh_index_funcstarts(const struct sh_index *idx, const u32 **funcs);
+
+/** @return 1 if pos is a likely function start */
+bool sh_index_isfuncstart(const struct sh_index *idx, u32 pos);
+
+#endif
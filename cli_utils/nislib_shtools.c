@@ -4,11 +4,15 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>	//for printf(); probably can go away someday
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "nislib.h"
+#include "nislib_prof.h"
 #include "nisrom_finders.h"
 #include "nislib_shtools.h"
 #include "sh_opcodes.h"
@@ -308,12 +312,7 @@ bool bt_MOVW_R0_REGDISP(const u8 *buf, u32 startpos, u32 min, u32 *found_pos, en
 	return 0;
 }
 
-/* unreliable - check if opcode at *buf could be a valid func prologue.
- * for now, accepts :
- * "2F <Rn>6" (mov.l Rn, @-r15)
- * "4F 22 (sts.l pr, @-r15)
- */
-static bool sh_isprologue(const uint8_t *buf) {
+bool sh_isprologue(const uint8_t *buf) {
 	uint16_t opc;
 	assert(buf);
 
@@ -421,7 +420,8 @@ u32 disarm_12bit_offset (u32 pos, u32 insoff) {
 	return (pos) + (off<<1) + 4;
 }
 
-enum opcode_dest sh_getopcode_dest(u16 code) {
+/* reference decoder for sh_getopcode_dest(); only used to build the table */
+static enum opcode_dest opcode_dest_chain(u16 code) {
 
 	if (IS_MOVB_R0REL_TO_REG(code) || (IS_MOVW_R0REL_TO_REG(code)) || (IS_MOVL_R0REL_TO_REG(code)) ||
 		IS_MOVT(code) || (IS_STSMAC(code)) || (IS_STCSR1(code)) || IS_STSPR(code)
@@ -471,106 +471,334 @@ enum opcode_dest sh_getopcode_dest(u16 code) {
 	return OPC_DEST_OTHER;
 }
 
+/* decode table : 64k entries (256kB), filled once from the IS_* macros */
+static struct sh_opinfo optable[65536];
+static pthread_once_t optable_once = PTHREAD_ONCE_INIT;
+
+static void opinfo_decode(struct sh_opinfo *oi, u16 code) {
+	oi->dest = opcode_dest_chain(code);
+	oi->flow = SH_FLOW_NONE;
+	oi->disp = SH_DISP_NONE;
+	oi->flags = 0;
+
+	if (IS_BT_OR_BF(code)) {
+		oi->flow = SH_FLOW_BTF;
+		oi->disp = SH_DISP_8;
+		if (IS_BTS(code) || IS_BFS(code)) oi->flags |= SH_OPF_DELAY;
+	} else if (IS_BRA(code)) {
+		oi->flow = SH_FLOW_BRA;
+		oi->disp = SH_DISP_12;
+		oi->flags |= SH_OPF_DELAY;
+	} else if ((code & 0xF000) == 0xB000) {
+		oi->flow = SH_FLOW_BSR;
+		oi->disp = SH_DISP_12;
+		oi->flags |= SH_OPF_DELAY;
+	} else if (IS_BRAF(code)) {
+		oi->flow = SH_FLOW_BRAF;
+		oi->flags |= SH_OPF_DELAY;
+	} else if (IS_BSRF(code)) {
+		oi->flow = SH_FLOW_BSRF;
+		oi->flags |= SH_OPF_DELAY;
+	} else if (IS_JMP(code)) {
+		oi->flow = SH_FLOW_JMP;
+		oi->flags |= SH_OPF_DELAY;
+	} else if (IS_JSR(code)) {
+		oi->flow = SH_FLOW_JSR;
+		oi->flags |= SH_OPF_DELAY;
+	} else if (IS_RTS(code)) {
+		oi->flow = SH_FLOW_RTS;
+		oi->flags |= SH_OPF_DELAY;
+	} else if (IS_RTE(code)) {
+		oi->flow = SH_FLOW_RTE;
+		oi->flags |= SH_OPF_DELAY;
+	}
 
-#define SH_TRACK_REG_MAXRECURSE 2000	//Hitting this limit is definitely abnormal and possibly indicates a bug
-/* recursive reg tracker.
- * The visited[] cells are bitfielsd : when a certain location has been parsed
- * while tracking a certain reg, the corresponding bit (1 << regno) is set.
- * To fit inside a u16 value, gbr is aliased to r15 since r15 is normally only
- * used as a stack ptr. */
-void sh_track_reg(const u8 *buf, u32 pos, u32 siz, unsigned regno, u16 *visited,
-			void (*tracker_cb)(const uint8_t *buf, uint32_t pos, unsigned regno, void *data), void *cbdata) {
+	if ((code & 0xF000) == 0x9000) {
+		oi->disp = SH_DISP_PC8W;
+		oi->flags |= SH_OPF_PCLOAD_W;
+	} else if ((code & 0xF000) == 0xD000) {
+		oi->disp = SH_DISP_PC8L;
+		oi->flags |= SH_OPF_PCLOAD_L;
+	} else if (IS_MOVA_PCREL_R0(code)) {
+		oi->disp = SH_DISP_PC8L;
+		oi->flags |= SH_OPF_MOVA;
+	}
 
-	static int recurselevel = 0;
-	recurselevel += 1;
+	if (IS_MOV_REGS(code)) oi->flags |= SH_OPF_MOVRR;
+	if ((code & 0xF0FF) == 0x401E) oi->flags |= SH_OPF_LDCGBR;
+	if ((code & 0xF0FF) == 0x0012) oi->flags |= SH_OPF_STCGBR;
+}
+
+static void optable_build(void) {
+	unsigned code;
+	for (code = 0; code < ARRAY_SIZE(optable); code++) {
+		opinfo_decode(&optable[code], (u16) code);
+	}
+}
+
+const struct sh_opinfo *sh_optable(void) {
+	pthread_once(&optable_once, optable_build);
+	return optable;
+}
+
+enum opcode_dest sh_getopcode_dest(u16 code) {
+	return sh_optable()[code].dest;
+}
 
-	assert(buf && siz && (siz <= MAX_ROMSIZE) && (pos < siz) &&
-				(regno <= 0x0F) && visited && tracker_cb);
+void sh_decode_buf(struct sh_opinfo *dec, const uint8_t *buf, uint32_t siz) {
+	assert(dec && buf);
+	const struct sh_opinfo *ot = sh_optable();
+	u32 pos;
 
-	if (recurselevel >= SH_TRACK_REG_MAXRECURSE) {
-		printf("Warning : hit maximum recursion depth @ %lX!!\n", (unsigned long) pos);
-		goto endrec;
+	for (pos = 0; (pos + 1) < siz; pos += 2) {
+		dec[pos / 2] = ot[reconst_16(&buf[pos])];
 	}
+}
 
-	for (; pos < siz; pos += 2) {
-		unsigned aliased_regno = regno;
-		if (aliased_regno > 15) aliased_regno = 15;
 
-		if (visited[pos] & (1 << aliased_regno)) {
-			//deja vu with this reg
-			goto endrec;
-		}
-		visited[pos] |= (1 << aliased_regno);
+/* register tracker.
+ * The visited[] cells are bitfields, one per halfword : when a certain location has been parsed
+ * while tracking a certain reg, the corresponding bit (1 << regno) is set.
+ * To fit inside a u16 value, gbr is aliased to r15 since r15 is normally only
+ * used as a stack ptr.
+ *
+ * Paths are followed with an explicit stack of frames instead of recursion. A frame that
+ * spawns a new path (reg copy, bt/bf) is suspended with 'resume' set, and finishes processing
+ * the same opcode once the new path is done : this gives exactly the old depth-first order.
+ */
+struct trk_frame {
+	u32 pos;
+	u8 regno;
+	bool resume;	//new path done, finish processing opcode at pos
+};
+
+struct sh_tracker {
+	u32 siz;
+	u16 *visited;	//one cell per halfword
+
+	u32 *touched;	//indexes of nonzero visited[] cells, for cheap resets
+	u32 ntouched;
+	u32 touched_alloc;
+	bool full_reset;	//touched[] couldn't grow, need to clear everything
+
+	struct trk_frame *stack;
+	unsigned depth;
+	unsigned stack_alloc;
+
+	const struct sh_opinfo *dec;	//optional per-ROM decode, else the table
+};
+
+#define TRK_STACK_INITIAL	64
+#define TRK_TOUCHED_INITIAL	4096
+
+struct sh_tracker *sh_tracker_new(uint32_t siz) {
+	assert(siz && (siz <= MAX_ROMSIZE));
+
+	struct sh_tracker *trk = calloc(1, sizeof(*trk));
+	if (!trk) return NULL;
+
+	trk->siz = siz;
+	trk->visited = calloc((siz / 2) + 1, sizeof(*trk->visited));
+	trk->touched_alloc = TRK_TOUCHED_INITIAL;
+	trk->touched = malloc(trk->touched_alloc * sizeof(*trk->touched));
+	trk->stack_alloc = TRK_STACK_INITIAL;
+	trk->stack = malloc(trk->stack_alloc * sizeof(*trk->stack));
+	if (!trk->visited || !trk->touched || !trk->stack) {
+		sh_tracker_free(trk);
+		return NULL;
+	}
+	return trk;
+}
 
-		u16 opc = reconst_16(&buf[pos]);
+void sh_tracker_free(struct sh_tracker *trk) {
+	if (!trk) return;
+	free(trk->visited);
+	free(trk->touched);
+	free(trk->stack);
+	free(trk);
+}
 
-		//end recursion if we hit RTS
-		if (IS_RTS(opc) || IS_RTE(opc)) {
-			//go check next opcode for delay slot
-			tracker_cb(buf, pos + 2, regno, cbdata);
-			goto endrec;
-		}
+void sh_tracker_setdecoded(struct sh_tracker *trk, const struct sh_opinfo *dec) {
+	assert(trk);
+	trk->dec = dec;
+}
 
-		if (regno < 16) {
-			//new recurse if match mov Rm, Rn
-			if ((opc & 0xF0FF) == ((regno << 4) | 0x6003)) {
-				//regno is copied to a new one.
-				int newreg = (opc & 0xF00) >> 8;
-				fprintf(dbg_stream, "Entering %4d.%6lX MOV\n", recurselevel, (unsigned long) pos + 2);
-				sh_track_reg(buf, pos + 2, siz, newreg, visited, tracker_cb, cbdata);
-			}
+void sh_tracker_reset(struct sh_tracker *trk) {
+	assert(trk);
 
-			//new recurse if we copy to gbr ( LDC Rm,GBR 0100mmmm00011110 )
-			if (opc == (0x401E | (regno << 8))) {
-				fprintf(dbg_stream, "Entering %4d.%6lX LDC GBR\n", recurselevel, (unsigned long) pos + 2);
-				sh_track_reg(buf, pos + 2, siz, GBR, visited, tracker_cb, cbdata);
-			}
+	if (trk->full_reset) {
+		memset(trk->visited, 0, ((trk->siz / 2) + 1) * sizeof(*trk->visited));
+		trk->full_reset = 0;
+	} else {
+		u32 idx;
+		for (idx = 0; idx < trk->ntouched; idx++) {
+			trk->visited[trk->touched[idx]] = 0;
 		}
+	}
+	trk->ntouched = 0;
+}
 
-		if (regno == GBR) {
-			//new recurse if we STC gbr, Rn
-			if ((opc & 0xF0FF) == 0x0012) {
-				int newreg = (opc >> 8) & 0xF;
-				fprintf(dbg_stream, "Entering %4d.%6lX STC GBR\n", recurselevel, (unsigned long) pos + 2);
-				sh_track_reg(buf, pos + 2, siz, newreg, visited, tracker_cb, cbdata);
-			}
+/* @return 0 if the stack can't grow */
+static bool trk_push(struct sh_tracker *trk, u32 pos, unsigned regno) {
+	if (trk->depth == trk->stack_alloc) {
+		struct trk_frame *newstack = realloc(trk->stack, 2 * trk->stack_alloc * sizeof(*newstack));
+		if (!newstack) {
+			ERR_PRINTF("Warning : tracker stack full @ %lX!!\n", (unsigned long) pos);
+			return 0;
 		}
+		trk->stack = newstack;
+		trk->stack_alloc *= 2;
+	}
+	trk->stack[trk->depth].pos = pos;
+	trk->stack[trk->depth].regno = regno;
+	trk->stack[trk->depth].resume = 0;
+	trk->depth += 1;
+	return 1;
+}
 
-		//new recurse if bt/bf. TODO : split case with a delay slot, since
-		//there is a corner case where it copies/alters the reg before jumping
-		if (IS_BT_OR_BF(opc)) {
-			u32 newpos = disarm_8bit_offset(pos, GET_BTF_OFFSET(opc));
-			fprintf(dbg_stream, "Branch %4d.%6lX BT/BF to %6lX\n", recurselevel, (unsigned long) pos, (unsigned long) newpos);
-			sh_track_reg(buf, newpos, siz, regno, visited, tracker_cb, cbdata);
+/* mark cell as visited with regbit.
+ * @return 0 if it already was
+ */
+static bool trk_visit(struct sh_tracker *trk, u32 pos, u16 regbit) {
+	u32 hw = pos / 2;
+	u16 cell = trk->visited[hw];
+
+	if (cell & regbit) return 0;
+	if (!cell && !trk->full_reset) {
+		if (trk->ntouched == trk->touched_alloc) {
+			u32 *newt = realloc(trk->touched, 2 * trk->touched_alloc * sizeof(*newt));
+			if (newt) {
+				trk->touched = newt;
+				trk->touched_alloc *= 2;
+			} else {
+				trk->full_reset = 1;
+			}
 		}
-
-		bool isbra = 0;
-		u32 bra_newpos = pos + 2;
-		//bra : don't recurse, just alter path
-		if (IS_BRA(opc)) {
-			bra_newpos = disarm_12bit_offset(pos, GET_BRA_OFFSET(opc));
-			fprintf(dbg_stream, "Branch %4d.%6lX BRA to %6lX\n", recurselevel, (unsigned long) pos, (unsigned long) bra_newpos);
-			isbra = 1;
+		if (!trk->full_reset) {
+			trk->touched[trk->ntouched++] = hw;
 		}
+	}
+	trk->visited[hw] = cell | regbit;
+	return 1;
+}
 
-		//TODO : how to deal with jsr / bsr ?
+void sh_track_reg(struct sh_tracker *trk, const u8 *buf, u32 pos, u32 siz, unsigned regno,
+			void (*tracker_cb)(const uint8_t *buf, uint32_t pos, unsigned regno, void *data), void *cbdata) {
+
+	assert(trk && buf && siz && (siz <= trk->siz) && (pos < siz) &&
+				(regno <= GBR) && tracker_cb);
+
+	//nested calls (from tracker_cb) run above the frames of the caller
+	const unsigned base = trk->depth;
+	const struct sh_opinfo *ot = sh_optable();
+	const struct sh_opinfo *dec = trk->dec;
+	u32 nodes = 0;
+	if (!trk_push(trk, pos, regno)) return;
+
+	while (trk->depth > base) {
+		const unsigned fidx = trk->depth - 1;
+		const int level = (int) (fidx - base + 1);
+		u32 fpos = trk->stack[fidx].pos;
+		const unsigned freg = trk->stack[fidx].regno;
+		bool resume = trk->stack[fidx].resume;
+		bool spawned = 0;
+
+		trk->stack[fidx].resume = 0;
+
+		for (; fpos < siz; fpos += 2) {
+			u16 opc = reconst_16(&buf[fpos]);
+			const struct sh_opinfo oi = dec ? dec[fpos / 2] : ot[opc];
+
+			if (!resume) {
+				unsigned aliased_regno = MIN(freg, 15);
+				if (!trk_visit(trk, fpos, 1 << aliased_regno)) {
+					//deja vu with this reg
+					break;
+				}
+				nodes++;
+
+				//end path if we hit RTS
+				if ((oi.flow == SH_FLOW_RTS) || (oi.flow == SH_FLOW_RTE)) {
+					//go check next opcode for delay slot
+					tracker_cb(buf, fpos + 2, freg, cbdata);
+					break;
+				}
+
+				u32 newpos = fpos + 2;
+				unsigned newreg = freg;
+				bool spawn = 0;
+				if (freg < 16) {
+					//new path if match mov Rm, Rn
+					if ((oi.flags & SH_OPF_MOVRR) && (GET_SOURCE_REG(opc) == freg)) {
+						//regno is copied to a new one.
+						newreg = (opc & 0xF00) >> 8;
+						spawn = 1;
+						TRACE(TC_TRACKER, TL_VERBOSE, "Entering %4d.%6lX MOV\n", level, (unsigned long) fpos + 2);
+					}
+
+					//new path if we copy to gbr ( LDC Rm,GBR 0100mmmm00011110 )
+					if ((oi.flags & SH_OPF_LDCGBR) && (GET_TARGET_REG(opc) == freg)) {
+						newreg = GBR;
+						spawn = 1;
+						TRACE(TC_TRACKER, TL_VERBOSE, "Entering %4d.%6lX LDC GBR\n", level, (unsigned long) fpos + 2);
+					}
+				}
+
+				if (freg == GBR) {
+					//new path if we STC gbr, Rn
+					if (oi.flags & SH_OPF_STCGBR) {
+						newreg = (opc >> 8) & 0xF;
+						spawn = 1;
+						TRACE(TC_TRACKER, TL_VERBOSE, "Entering %4d.%6lX STC GBR\n", level, (unsigned long) fpos + 2);
+					}
+				}
 
-		// almost done: check if we have a hit
-		if (isbra) {
+				//new path if bt/bf. TODO : split case with a delay slot, since
+				//there is a corner case where it copies/alters the reg before jumping
+				if (oi.flow == SH_FLOW_BTF) {
+					newpos = disarm_8bit_offset(fpos, GET_BTF_OFFSET(opc));
+					spawn = 1;
+					TRACE(TC_TRACKER, TL_VERBOSE, "Branch %4d.%6lX BT/BF to %6lX\n", level, (unsigned long) fpos, (unsigned long) newpos);
+				}
+
+				if (spawn) {
+					//suspend this frame; if the stack is full, just skip the new path
+					trk->stack[fidx].pos = fpos;
+					trk->stack[fidx].resume = 1;
+					if (trk_push(trk, newpos, newreg)) {
+						spawned = 1;
+						break;
+					}
+					trk->stack[fidx].resume = 0;
+				}
+			}
+			resume = 0;
+
+			//bra : don't spawn, just alter path
+			if (oi.flow == SH_FLOW_BRA) {
+				u32 bra_newpos = disarm_12bit_offset(fpos, GET_BRA_OFFSET(opc));
+				TRACE(TC_TRACKER, TL_VERBOSE, "Branch %4d.%6lX BRA to %6lX\n", level, (unsigned long) fpos, (unsigned long) bra_newpos);
 				//go check next opcode for delay slot
-			tracker_cb(buf, pos + 2, regno, cbdata);
-			pos = bra_newpos -2;	//alter path
-			continue;
-		}
-		tracker_cb(buf, pos, regno, cbdata);
+				tracker_cb(buf, fpos + 2, freg, cbdata);
+				fpos = bra_newpos - 2;	//alter path
+				continue;
+			}
 
-		//end recursion if reg is clobbered
-		if (sh_getopcode_dest(opc) == regno) {
-			goto endrec;
-		}
-	}	//for
+			//TODO : how to deal with jsr / bsr ?
 
-endrec:
-	recurselevel -= 1;
-	return;
+			// almost done: check if we have a hit
+			tracker_cb(buf, fpos, freg, cbdata);
+
+			//end path if reg is clobbered
+			if (oi.dest == freg) {
+				break;
+			}
+		}	//for
+
+		if (spawned) continue;
+		//path done. Nested calls from tracker_cb always return with depth restored
+		assert(trk->depth == fidx + 1);
+		trk->depth = fidx;
+	}
+	prof_count(PC_TRACK_NODES, nodes);
 }
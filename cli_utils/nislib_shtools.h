@@ -23,6 +23,13 @@
 */
 uint32_t find_calltable(const uint8_t *buf, uint32_t skip, uint32_t siz, unsigned *ctlen);
 
+/** unreliable - check if opcode at *buf could be a valid func prologue.
+ * for now, accepts :
+ * "2F <Rn>6" (mov.l Rn, @-r15)
+ * "4F 22 (sts.l pr, @-r15)
+ */
+bool sh_isprologue(const uint8_t *buf);
+
 /** Find opcode pattern... bleh
  * "patlen" is # of opcodes
  */
@@ -91,12 +98,87 @@ uint32_t disarm_12bit_offset (uint32_t pos, uint32_t insoff);
 enum opcode_dest sh_getopcode_dest(uint16_t code);
 
 
-/** recursively track usage of register <regno>.
- * start at <pos> in buffer (typically opcode after the one setting regno);
- * updates the <visited> array (provided as =={0} by caller)
+/** control flow class of an opcode */
+enum sh_flow {
+	SH_FLOW_NONE = 0,
+	SH_FLOW_BTF,	//bt, bf, bt/s, bf/s
+	SH_FLOW_BRA,
+	SH_FLOW_BSR,
+	SH_FLOW_BRAF,
+	SH_FLOW_BSRF,
+	SH_FLOW_JMP,
+	SH_FLOW_JSR,
+	SH_FLOW_RTS,
+	SH_FLOW_RTE,
+};
+
+/** PC-relative displacement held in the opcode */
+enum sh_disp {
+	SH_DISP_NONE = 0,
+	SH_DISP_8,	//bt/bf : disarm_8bit_offset()
+	SH_DISP_12,	//bra/bsr : disarm_12bit_offset()
+	SH_DISP_PC8W,	//mov.w @(disp,PC), Rn
+	SH_DISP_PC8L,	//mov.l @(disp,PC), Rn and mova
+};
+
+#define SH_OPF_DELAY	0x01	//delayed branch
+#define SH_OPF_PCLOAD_W	0x02	//mov.w @(disp,PC), Rn
+#define SH_OPF_PCLOAD_L	0x04	//mov.l @(disp,PC), Rn
+#define SH_OPF_MOVA	0x08	//mova @(disp,PC), R0
+#define SH_OPF_MOVRR	0x10	//mov Rm, Rn
+#define SH_OPF_LDCGBR	0x20	//ldc Rm, GBR
+#define SH_OPF_STCGBR	0x40	//stc GBR, Rn
+
+/** decoded opcode : everything the tracker and finders test, without the mask chains */
+struct sh_opinfo {
+	u8 dest;	//enum opcode_dest, same as sh_getopcode_dest()
+	u8 flow;	//enum sh_flow
+	u8 disp;	//enum sh_disp
+	u8 flags;	//SH_OPF_*
+};
+
+/** dense decode table, indexed by opcode. Built on the first call; thread-safe.
+ * Fetch the pointer once and keep it for the hot loops.
+ */
+const struct sh_opinfo *sh_optable(void);
+
+/** decode every aligned opcode of buf : dec[pos / 2] = sh_optable()[opcode at pos]
+ * @param dec : (siz / 2) entries
+ */
+void sh_decode_buf(struct sh_opinfo *dec, const uint8_t *buf, uint32_t siz);
+
+
+/** register tracker state : visited positions and path stack.
+ * Reused across sh_track_reg() calls; one per thread.
+ */
+struct sh_tracker;
+
+/** @param siz : largest buffer size that will be tracked
+ * @return NULL if failed
+ */
+struct sh_tracker *sh_tracker_new(uint32_t siz);
+
+void sh_tracker_free(struct sh_tracker *trk);
+
+/** use a per-ROM decoded array (sh_decode_buf(), sh_index_decoded()) instead of the decode table.
+ * It must have been decoded from the buf passed to sh_track_reg(); NULL to go back to the table.
+ */
+void sh_tracker_setdecoded(struct sh_tracker *trk, const struct sh_opinfo *dec);
+
+/** forget all visited positions.
+ * Only clears what was visited since the last reset, so starting a new seed is cheap.
+ */
+void sh_tracker_reset(struct sh_tracker *trk);
+
+/** track usage of register <regno> (0-15, or GBR).
+ * start at <pos> in buffer (typically opcode after the one setting regno).
+ * Positions already visited with the same register are skipped, until sh_tracker_reset().
  * on every instruction, invokes the tracker_cb callback while passing it <cbdata> as a generic holder.
+ *
+ * Not recursive, so there is no depth limit. tracker_cb may call sh_track_reg() again with the
+ * same tracker, to follow a derived value; visited positions are shared.
  */
-void sh_track_reg(const uint8_t *buf, uint32_t pos, uint32_t siz, unsigned regno, uint16_t *visited,
+void sh_track_reg(struct sh_tracker *trk, const uint8_t *buf, uint32_t pos, uint32_t siz, unsigned regno,
 			void (*tracker_cb)(const uint8_t *buf, uint32_t pos, unsigned regno, void *data), void *cbdata);
 
 #endif
@@ -0,0 +1,804 @@
+/* content-addressed, deduplicating archive of ROM images
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "md5/md5.h"
+#include "nislib.h"
+#include "nislib_store.h"
+#include "stypes.h"
+
+#include "uthash/uthash.h"
+#include "uthash/utstring.h"
+
+#define NISSTORE_MAGIC "#nisstore"
+#define NISSTORE_VERS "v1"
+#define NISSTORE_MAXCHUNK (1024 * 1024UL)
+#define NISSTORE_SUMS_MAGIC "NISSUMS1"
+#define NISSTORE_SUMS_HDR 16	//magic, u32 chunk size, u32 reserved
+
+struct store_img {
+	struct nisstore_img pub;
+	unsigned idx;
+	u32 *slots;
+	u32 nslots;
+	struct store_img *next_ecuid;	//next image with the same ECUID
+	UT_hash_handle hh;	//by md5
+	UT_hash_handle hh_ecuid;	//only the first image of each ECUID is in this table
+};
+
+struct chunk_ent {
+	u8 digest[MD5_DIGEST_LENGTH];
+	u32 slot;
+	UT_hash_handle hh;
+};
+
+struct nisstore {
+	char *idxname;
+	char *datname;
+	char *sumname;
+	bool writable;
+	bool dirty;
+
+	u32 chunk;	//chunk size
+	u32 nchunks_disk;	//slots saved in .dat
+	u32 nchunks;	//including pending ones
+	struct rom_image dat;	//first nchunks_disk slots
+	int fd;	//.dat, for image views; -1 if n/a
+
+	u8 *pend;	//unsaved slots [nchunks_disk, nchunks[
+	size_t pend_alloc;	//in bytes
+
+	struct store_img **imgs;
+	unsigned nimg;
+	unsigned imgalloc;
+	struct store_img *by_md5;
+	struct store_img *by_ecuid;
+
+	struct chunk_ent *chunks;	//built on first nisstore_add()
+	bool chunks_indexed;
+	u8 (*sums)[MD5_DIGEST_LENGTH];	//digest of every slot, once chunks_indexed
+	u32 sums_alloc;
+	u32 nsums_disk;	//valid digests in .sum
+};
+
+
+static void md5_hex(const u8 digest[MD5_DIGEST_LENGTH], char buf[MD5_DIGEST_STRING_LENGTH]) {
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+		buf[i + i] = hex[digest[i] >> 4];
+		buf[i + i + 1] = hex[digest[i] & 0x0f];
+	}
+	buf[i + i] = '\0';
+}
+
+static const u8 *slot_data(const struct nisstore *st, u32 slot) {
+	if (slot < st->nchunks_disk) {
+		return &st->dat.buf[(size_t) slot * st->chunk];
+	}
+	return &st->pend[(size_t) (slot - st->nchunks_disk) * st->chunk];
+}
+
+static u32 slots_for(const struct nisstore *st, u32 siz) {
+	return (siz + st->chunk - 1) / st->chunk;
+}
+
+/** append image to the tables. si is taken over even if this fails */
+static bool img_insert(struct nisstore *st, struct store_img *si) {
+	struct store_img *other;
+
+	if (st->nimg == st->imgalloc) {
+		unsigned newalloc = st->imgalloc ? (2 * st->imgalloc) : 64;
+		struct store_img **newimgs = realloc(st->imgs, newalloc * sizeof(*newimgs));
+		if (!newimgs) {
+			free((char *) si->pub.name);
+			free(si->slots);
+			free(si);
+			return 0;
+		}
+		st->imgs = newimgs;
+		st->imgalloc = newalloc;
+	}
+	si->idx = st->nimg;
+	st->imgs[st->nimg++] = si;
+
+	HASH_ADD_STR(st->by_md5, pub.md5, si);
+	if (si->pub.ecuid[0]) {
+		HASH_FIND(hh_ecuid, st->by_ecuid, si->pub.ecuid, strlen(si->pub.ecuid), other);
+		if (!other) {
+			HASH_ADD_KEYPTR(hh_ecuid, st->by_ecuid, si->pub.ecuid, strlen(si->pub.ecuid), si);
+		} else {
+			while (other->next_ecuid) other = other->next_ecuid;
+			other->next_ecuid = si;
+		}
+	}
+	return 1;
+}
+
+/** "a,b-c,..." -> slots. @return 1 if ok */
+static bool parse_slots(const struct nisstore *st, struct store_img *si, const char *list) {
+	u32 want = slots_for(st, si->pub.siz);
+	u32 n = 0;
+	const char *cur = list;
+
+	si->slots = malloc(want * sizeof(*si->slots));
+	if (!si->slots) return 0;
+
+	while (*cur) {
+		char *end;
+		unsigned long first = strtoul(cur, &end, 10);
+		unsigned long last = first;
+		if (end == cur) return 0;
+		if (*end == '-') {
+			cur = end + 1;
+			last = strtoul(cur, &end, 10);
+			if ((end == cur) || (last < first)) return 0;
+		}
+		if (last >= st->nchunks) return 0;
+		if ((last - first) >= (want - n)) return 0;
+		for (; first <= last; first++) {
+			si->slots[n++] = (u32) first;
+		}
+		cur = end;
+		if (*cur == ',') {
+			cur++;
+		} else if (*cur) {
+			return 0;
+		}
+	}
+	si->nslots = n;
+	return (n == want);
+}
+
+/** parse "<md5>\t<ecuid>\t<siz>\t<name>\t<slots>". @return 1 if ok */
+static bool parse_imgline(struct nisstore *st, char *line) {
+	char *fields[5];
+	unsigned nf;
+	char *cur = line;
+	struct store_img *si, *dup;
+
+	for (nf = 0; nf < ARRAY_SIZE(fields); nf++) {
+		fields[nf] = cur;
+		cur = strchr(cur, '\t');
+		if (!cur) break;
+		*cur++ = 0;
+	}
+	if (nf != (ARRAY_SIZE(fields) - 1)) return 0;
+
+	if (strlen(fields[0]) != (MD5_DIGEST_STRING_LENGTH - 1)) return 0;
+	HASH_FIND_STR(st->by_md5, fields[0], dup);
+	if (dup) return 0;
+
+	si = calloc(1, sizeof(*si));
+	if (!si) return 0;
+	strcpy(si->pub.md5, fields[0]);
+	if (strcmp(fields[1], "-")) {
+		if (strlen(fields[1]) != ECUID_LEN) {
+			free(si);
+			return 0;
+		}
+		strcpy(si->pub.ecuid, fields[1]);
+	}
+	char *end;
+	unsigned long siz = strtoul(fields[2], &end, 0);
+	if (*end || !siz || (siz > MAX_ROMSIZE)) {
+		free(si);
+		return 0;
+	}
+	si->pub.siz = (u32) siz;
+	si->pub.name = strdup(fields[3]);
+	if (!si->pub.name || !parse_slots(st, si, fields[4])) {
+		free((char *) si->pub.name);
+		free(si->slots);
+		free(si);
+		return 0;
+	}
+	return img_insert(st, si);
+}
+
+/** @return 1 if ok or no index yet */
+static bool load_index(struct nisstore *st) {
+	char *line = NULL;
+	size_t linesz = 0;
+	ssize_t len;
+	unsigned lineno = 0;
+	bool ok = 1;
+
+	FILE *fh = fopen(st->idxname, "r");
+	if (!fh) {
+		if (errno != ENOENT) {
+			ERR_PRINTF("can't open %s : %s\n", st->idxname, strerror(errno));
+			return 0;
+		}
+		if (!st->writable) {
+			ERR_PRINTF("no store %s\n", st->idxname);
+			return 0;
+		}
+		st->chunk = NISSTORE_CHUNK;
+		return 1;
+	}
+
+	while (ok && ((len = getline(&line, &linesz, fh)) > 0)) {
+		while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+			line[--len] = 0;
+		}
+		lineno++;
+		if (lineno == 1) {
+			unsigned chunk, nchunks;
+			if ((sscanf(line, NISSTORE_MAGIC "\t" NISSTORE_VERS "\tchunk=%u\tnchunks=%u", &chunk, &nchunks) != 2) ||
+				!chunk || (chunk > NISSTORE_MAXCHUNK) || (chunk % 4)) {
+				ERR_PRINTF("%s : not a store, or unsupported version\n", st->idxname);
+				ok = 0;
+				break;
+			}
+			st->chunk = chunk;
+			st->nchunks = st->nchunks_disk = nchunks;
+			continue;
+		}
+		if (!len) continue;
+		if (!parse_imgline(st, line)) {
+			ERR_PRINTF("%s:%u : bad entry\n", st->idxname, lineno);
+			ok = 0;
+		}
+	}
+	if (ok && !lineno) {
+		ERR_PRINTF("%s : empty index\n", st->idxname);
+		ok = 0;
+	}
+	free(line);
+	fclose(fh);
+	return ok;
+}
+
+/** map the saved part of .dat. @return 1 if ok */
+static bool load_dat(struct nisstore *st) {
+	if (!st->nchunks_disk) return 1;
+
+	if (romimg_open(&st->dat, st->datname, 0)) {
+		return 0;
+	}
+	if (st->dat.siz < ((uint64_t) st->nchunks_disk * st->chunk)) {
+		ERR_PRINTF("%s is truncated\n", st->datname);
+		romimg_close(&st->dat);
+		return 0;
+	}
+#ifndef _WIN32
+	st->fd = open(st->datname, O_RDONLY);
+#endif
+	return 1;
+}
+
+static void unload_dat(struct nisstore *st) {
+	romimg_close(&st->dat);
+#ifndef _WIN32
+	if (st->fd >= 0) close(st->fd);
+#endif
+	st->fd = -1;
+}
+
+struct nisstore *nisstore_open(const char *path, bool writable) {
+	assert(path);
+	struct nisstore *st = calloc(1, sizeof(*st));
+	UT_string fn;
+
+	if (!st) return NULL;
+	st->fd = -1;
+	st->writable = writable;
+
+	utstring_init(&fn);
+	utstring_printf(&fn, "%s.idx", path);
+	st->idxname = strdup(utstring_body(&fn));
+	utstring_clear(&fn);
+	utstring_printf(&fn, "%s.dat", path);
+	st->datname = strdup(utstring_body(&fn));
+	utstring_clear(&fn);
+	utstring_printf(&fn, "%s.sum", path);
+	st->sumname = strdup(utstring_body(&fn));
+	utstring_done(&fn);
+
+	if (!st->idxname || !st->datname || !st->sumname ||
+		!load_index(st) || !load_dat(st)) {
+		nisstore_close(st);
+		return NULL;
+	}
+	return st;
+}
+
+/** write index to a temp file, then replace the old one. @return 1 if ok */
+static bool save_index(struct nisstore *st) {
+	UT_string tmpname;
+	UT_string slist;
+	bool ok = 1;
+	unsigned idx;
+
+	utstring_init(&tmpname);
+	utstring_printf(&tmpname, "%s.tmp", st->idxname);
+	FILE *fh = fopen(utstring_body(&tmpname), "w");
+	if (!fh) {
+		ERR_PRINTF("can't write %s\n", utstring_body(&tmpname));
+		utstring_done(&tmpname);
+		return 0;
+	}
+
+	utstring_init(&slist);
+	fprintf(fh, NISSTORE_MAGIC "\t" NISSTORE_VERS "\tchunk=%lu\tnchunks=%lu\n",
+			(unsigned long) st->chunk, (unsigned long) st->nchunks);
+	for (idx = 0; idx < st->nimg; idx++) {
+		const struct store_img *si = st->imgs[idx];
+		u32 i, j;
+
+		utstring_clear(&slist);
+		for (i = 0; i < si->nslots; i = j + 1) {
+			for (j = i; ((j + 1) < si->nslots) && (si->slots[j + 1] == (si->slots[j] + 1)); j++) {}
+			if (i) utstring_printf(&slist, ",");
+			if (j == i) {
+				utstring_printf(&slist, "%lu", (unsigned long) si->slots[i]);
+			} else {
+				utstring_printf(&slist, "%lu-%lu", (unsigned long) si->slots[i], (unsigned long) si->slots[j]);
+			}
+		}
+		fprintf(fh, "%s\t%s\t%lu\t%s\t%s\n", si->pub.md5, si->pub.ecuid[0] ? si->pub.ecuid : "-",
+				(unsigned long) si->pub.siz, si->pub.name, utstring_body(&slist));
+	}
+	utstring_done(&slist);
+	if (ferror(fh)) ok = 0;
+	if (fclose(fh)) ok = 0;
+
+	if (ok && rename(utstring_body(&tmpname), st->idxname)) {
+		ERR_PRINTF("can't replace %s : %s\n", st->idxname, strerror(errno));
+		ok = 0;
+	}
+	if (!ok) remove(utstring_body(&tmpname));
+	utstring_done(&tmpname);
+	return ok;
+}
+
+/** append pending chunks to .dat, past the saved ones. @return 1 if ok */
+static bool save_chunks(struct nisstore *st) {
+	size_t plen = (size_t) (st->nchunks - st->nchunks_disk) * st->chunk;
+	bool ok = 1;
+
+	if (!plen) return 1;
+
+	FILE *fh = fopen(st->datname, st->nchunks_disk ? "r+b" : "wb");
+	if (!fh) {
+		ERR_PRINTF("can't write %s : %s\n", st->datname, strerror(errno));
+		return 0;
+	}
+	if (fseek(fh, (long) st->nchunks_disk * st->chunk, SEEK_SET) ||
+		(fwrite(st->pend, 1, plen, fh) != plen)) {
+		ok = 0;
+	}
+	if (fflush(fh)) ok = 0;
+#ifndef _WIN32
+	//chunks must be on disk before the index refers to them
+	if (ok && fsync(fileno(fh))) ok = 0;
+#endif
+	if (fclose(fh)) ok = 0;
+	if (!ok) ERR_PRINTF("trouble writing %s\n", st->datname);
+	return ok;
+}
+
+/** append digests of the slots past nsums_disk to .sum, after the chunks themselves.
+ * The digests are only a cache : on failure, the next index_chunks() hashes those slots again.
+ */
+static void save_sums(struct nisstore *st) {
+	u32 nnew = st->nchunks - st->nsums_disk;
+	bool ok = 1;
+
+	if (!nnew) return;
+	assert(st->chunks_indexed);
+
+	FILE *fh = fopen(st->sumname, st->nsums_disk ? "r+b" : "wb");
+	if (!fh) {
+		ERR_PRINTF("can't write %s : %s\n", st->sumname, strerror(errno));
+		return;
+	}
+	if (!st->nsums_disk) {
+		u8 hdr[NISSTORE_SUMS_HDR] = {0};
+		memcpy(hdr, NISSTORE_SUMS_MAGIC, 8);
+		write_32b(st->chunk, &hdr[8]);
+		if (fwrite(hdr, 1, sizeof(hdr), fh) != sizeof(hdr)) ok = 0;
+	}
+	if (!ok || fseek(fh, NISSTORE_SUMS_HDR + (long) st->nsums_disk * MD5_DIGEST_LENGTH, SEEK_SET) ||
+		(fwrite(st->sums[st->nsums_disk], MD5_DIGEST_LENGTH, nnew, fh) != nnew)) {
+		ok = 0;
+	}
+	if (fclose(fh)) ok = 0;
+	if (!ok) {
+		ERR_PRINTF("trouble writing %s\n", st->sumname);
+		return;
+	}
+	st->nsums_disk = st->nchunks;
+}
+
+bool nisstore_save(struct nisstore *st) {
+	assert(st);
+
+	if (!st->dirty) return 1;
+	if (!st->writable) return 0;
+
+	if (!save_chunks(st)) {
+		return 0;
+	}
+	//the index is saved last : whatever it refers to is on disk
+	save_sums(st);
+	if (!save_index(st)) {
+		return 0;
+	}
+
+	//pending chunks now live in .dat
+	unload_dat(st);
+	st->nchunks_disk = st->nchunks;
+	free(st->pend);
+	st->pend = NULL;
+	st->pend_alloc = 0;
+	st->dirty = 0;
+	if (!load_dat(st)) {
+		//the store is saved but unusable; only nisstore_close() is safe now
+		st->nchunks = st->nchunks_disk = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void nisstore_close(struct nisstore *st) {
+	struct chunk_ent *ce, *ctmp;
+	unsigned idx;
+
+	if (!st) return;
+
+	HASH_ITER(hh, st->chunks, ce, ctmp) {
+		HASH_DEL(st->chunks, ce);
+		free(ce);
+	}
+	HASH_CLEAR(hh_ecuid, st->by_ecuid);
+	HASH_CLEAR(hh, st->by_md5);
+	for (idx = 0; idx < st->nimg; idx++) {
+		free((char *) st->imgs[idx]->pub.name);
+		free(st->imgs[idx]->slots);
+		free(st->imgs[idx]);
+	}
+	free(st->imgs);
+	unload_dat(st);
+	free(st->pend);
+	free(st->sums);
+	free(st->idxname);
+	free(st->datname);
+	free(st->sumname);
+	free(st);
+}
+
+
+/** make room for the digest of slot <nslots - 1>. @return 1 if ok */
+static bool sums_reserve(struct nisstore *st, u32 nslots) {
+	if (nslots <= st->sums_alloc) return 1;
+	u32 newalloc = st->sums_alloc ? (2 * st->sums_alloc) : 1024;
+	if (newalloc < nslots) newalloc = nslots;
+	u8 (*newsums)[MD5_DIGEST_LENGTH] = realloc(st->sums, (size_t) newalloc * sizeof(*newsums));
+	if (!newsums) return 0;
+	st->sums = newsums;
+	st->sums_alloc = newalloc;
+	return 1;
+}
+
+/** read saved digests of the first nchunks_disk slots.
+ * A missing file, or one for another chunk size, just means that the slots get hashed again.
+ * @return number of digests loaded
+ */
+static u32 load_sums(struct nisstore *st) {
+	u8 hdr[NISSTORE_SUMS_HDR];
+	u32 n = 0;
+
+	if (!st->nchunks_disk) return 0;
+	FILE *fh = fopen(st->sumname, "rb");
+	if (!fh) return 0;
+	if ((fread(hdr, 1, sizeof(hdr), fh) == sizeof(hdr)) &&
+		!memcmp(hdr, NISSTORE_SUMS_MAGIC, 8) && (reconst_32(&hdr[8]) == st->chunk)) {
+		//digests past nchunks_disk (interrupted save) are ignored, and overwritten by the next save
+		n = (u32) fread(st->sums, MD5_DIGEST_LENGTH, st->nchunks_disk, fh);
+	}
+	fclose(fh);
+	return n;
+}
+
+/** chunk digest -> slot table, for deduplication.
+ * Digests of saved slots come from .sum; only the slots it doesn't cover are hashed.
+ * @return 1 if ok
+ */
+static bool index_chunks(struct nisstore *st) {
+	u32 slot;
+	if (st->chunks_indexed) return 1;
+
+	if (!sums_reserve(st, st->nchunks)) return 0;
+	st->nsums_disk = load_sums(st);
+	for (slot = st->nsums_disk; slot < st->nchunks; slot++) {
+		MD5_CTX md5c;
+		MD5Init(&md5c);
+		MD5Update(&md5c, slot_data(st, slot), st->chunk);
+		MD5Final(st->sums[slot], &md5c);
+	}
+
+	for (slot = 0; slot < st->nchunks; slot++) {
+		struct chunk_ent *ce = calloc(1, sizeof(*ce));
+		if (!ce) return 0;
+		memcpy(ce->digest, st->sums[slot], sizeof(ce->digest));
+		ce->slot = slot;
+
+		struct chunk_ent *other;
+		HASH_FIND(hh, st->chunks, ce->digest, sizeof(ce->digest), other);
+		if (other) {
+			//already stored elsewhere (e.g. store written by something else); keep the first
+			free(ce);
+			continue;
+		}
+		HASH_ADD(hh, st->chunks, digest, sizeof(ce->digest), ce);
+	}
+	st->chunks_indexed = 1;
+	return 1;
+}
+
+/** find or add a chunk-sized block. @return slot, or UINT32_MAX if error */
+static u32 store_chunk(struct nisstore *st, const u8 *cdata) {
+	MD5_CTX md5c;
+	u8 digest[MD5_DIGEST_LENGTH];
+	struct chunk_ent *ce;
+
+	MD5Init(&md5c);
+	MD5Update(&md5c, cdata, st->chunk);
+	MD5Final(digest, &md5c);
+
+	HASH_FIND(hh, st->chunks, digest, sizeof(digest), ce);
+	if (ce && !memcmp(slot_data(st, ce->slot), cdata, st->chunk)) {
+		return ce->slot;
+	}
+
+	if (((uint64_t) st->nchunks + 1) * st->chunk >= UINT32_MAX) {
+		ERR_PRINTF("store is full\n");
+		return UINT32_MAX;
+	}
+	if (!sums_reserve(st, st->nchunks + 1)) return UINT32_MAX;
+	size_t need = (size_t) (st->nchunks + 1 - st->nchunks_disk) * st->chunk;
+	if (need > st->pend_alloc) {
+		size_t newalloc = st->pend_alloc ? (2 * st->pend_alloc) : (64 * (size_t) st->chunk);
+		u8 *newpend = realloc(st->pend, newalloc);
+		if (!newpend) return UINT32_MAX;
+		st->pend = newpend;
+		st->pend_alloc = newalloc;
+	}
+	u32 slot = st->nchunks++;
+	memcpy((u8 *) slot_data(st, slot), cdata, st->chunk);
+	memcpy(st->sums[slot], digest, sizeof(digest));
+
+	if (!ce) {
+		//on a (very unlikely) collision the first chunk keeps the table entry
+		ce = calloc(1, sizeof(*ce));
+		if (!ce) return UINT32_MAX;
+		memcpy(ce->digest, digest, sizeof(digest));
+		ce->slot = slot;
+		HASH_ADD(hh, st->chunks, digest, sizeof(ce->digest), ce);
+	}
+	return slot;
+}
+
+/** @return 1 if the stored image is identical to buf */
+static bool img_equal(const struct nisstore *st, const struct store_img *si, const u8 *buf, u32 siz) {
+	u32 i;
+	if (si->pub.siz != siz) return 0;
+	for (i = 0; i < si->nslots; i++) {
+		u32 off = i * st->chunk;
+		if (memcmp(slot_data(st, si->slots[i]), &buf[off], MIN(st->chunk, siz - off))) return 0;
+	}
+	return 1;
+}
+
+enum nisstore_addres nisstore_add(struct nisstore *st, const uint8_t *buf, uint32_t siz,
+			const char *name, const char *ecuid) {
+	assert(st && buf && name);
+	MD5_CTX md5c;
+	u8 digest[MD5_DIGEST_LENGTH];
+	char md5_str[MD5_DIGEST_STRING_LENGTH];
+	struct store_img *si;
+	u8 *cbuf = NULL;
+
+	if (!st->writable || !siz || (siz > MAX_ROMSIZE)) return NISSTORE_ERR;
+	if (ecuid && ecuid[0] && (strlen(ecuid) != ECUID_LEN)) return NISSTORE_ERR;
+
+	MD5Init(&md5c);
+	MD5Update(&md5c, buf, siz);
+	MD5Final(digest, &md5c);
+	md5_hex(digest, md5_str);
+
+	HASH_FIND_STR(st->by_md5, md5_str, si);
+	if (si) {
+		if (img_equal(st, si, buf, siz)) return NISSTORE_DUP;
+		ERR_PRINTF("MD5 collision with %s, can't add %s\n", si->pub.name, name);
+		return NISSTORE_ERR;
+	}
+
+	if (!index_chunks(st)) return NISSTORE_ERR;
+
+	si = calloc(1, sizeof(*si));
+	if (!si) return NISSTORE_ERR;
+	strcpy(si->pub.md5, md5_str);
+	if (ecuid && ecuid[0]) {
+		unsigned i;
+		for (i = 0; i < ECUID_LEN; i++) si->pub.ecuid[i] = toupper((unsigned char) ecuid[i]);
+	}
+	si->pub.siz = siz;
+
+	//only the basename is kept, and the index can't hold tabs or newlines
+	const char *base = name + strlen(name);
+	while ((base > name) && (base[-1] != '/') && (base[-1] != '\\')) base--;
+	char *sname = strdup(*base ? base : "-");
+	si->pub.name = sname;
+	si->nslots = slots_for(st, siz);
+	si->slots = malloc(si->nslots * sizeof(*si->slots));
+	cbuf = calloc(1, st->chunk);
+	if (!sname || !si->slots || !cbuf) goto badexit;
+	for (; *sname; sname++) {
+		if ((*sname == '\t') || (*sname == '\n') || (*sname == '\r')) *sname = '_';
+	}
+
+	u32 i;
+	for (i = 0; i < si->nslots; i++) {
+		u32 off = i * st->chunk;
+		const u8 *cdata = &buf[off];
+		if ((siz - off) < st->chunk) {
+			//0-padded tail
+			memcpy(cbuf, cdata, siz - off);
+			cdata = cbuf;
+		}
+		si->slots[i] = store_chunk(st, cdata);
+		if (si->slots[i] == UINT32_MAX) goto badexit;
+	}
+	free(cbuf);
+
+	//slots added before a failure are kept; they only waste space
+	st->dirty = 1;
+	if (!img_insert(st, si)) return NISSTORE_ERR;
+	return NISSTORE_ADDED;
+
+badexit:
+	free(cbuf);
+	free((char *) si->pub.name);
+	free(si->slots);
+	free(si);
+	return NISSTORE_ERR;
+}
+
+unsigned nisstore_count(const struct nisstore *st) {
+	assert(st);
+	return st->nimg;
+}
+
+const struct nisstore_img *nisstore_get(const struct nisstore *st, unsigned idx) {
+	assert(st);
+	if (idx >= st->nimg) return NULL;
+	return &st->imgs[idx]->pub;
+}
+
+int nisstore_find(const struct nisstore *st, const char *key, int after) {
+	assert(st && key);
+	struct store_img *si;
+	size_t klen = strlen(key);
+	char kbuf[MD5_DIGEST_STRING_LENGTH];
+	unsigned i;
+
+	if (klen == (MD5_DIGEST_STRING_LENGTH - 1)) {
+		for (i = 0; i < klen; i++) kbuf[i] = tolower((unsigned char) key[i]);
+		kbuf[klen] = 0;
+		HASH_FIND_STR(st->by_md5, kbuf, si);
+		if (si) return ((int) si->idx > after) ? (int) si->idx : -1;
+	}
+
+	if (klen == ECUID_LEN) {
+		for (i = 0; i < klen; i++) kbuf[i] = toupper((unsigned char) key[i]);
+		HASH_FIND(hh_ecuid, st->by_ecuid, kbuf, klen, si);
+		if (si) {
+			for (; si; si = si->next_ecuid) {
+				if ((int) si->idx > after) return (int) si->idx;
+			}
+			return -1;
+		}
+	}
+
+	for (i = (unsigned) (after + 1); i < st->nimg; i++) {
+		if (!strcmp(st->imgs[i]->pub.name, key)) return (int) i;
+	}
+	return -1;
+}
+
+int nisstore_read(const struct nisstore *st, unsigned idx, uint8_t *buf) {
+	assert(st && buf);
+	u32 i;
+
+	if (idx >= st->nimg) return -1;
+	const struct store_img *si = st->imgs[idx];
+	for (i = 0; i < si->nslots; i++) {
+		u32 off = i * st->chunk;
+		memcpy(&buf[off], slot_data(st, si->slots[i]), MIN(st->chunk, si->pub.siz - off));
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+/** map every run of consecutive slots in place, over an anonymous reservation.
+ * @return 0 if ok
+ */
+static int map_view(const struct nisstore *st, const struct store_img *si, struct rom_image *img) {
+	long pgsiz = sysconf(_SC_PAGESIZE);
+	u32 siz = si->pub.siz;
+	u32 i, j;
+
+	if ((st->fd < 0) || (pgsiz <= 0) || (st->chunk % (unsigned long) pgsiz)) return -1;
+	for (i = 0; i < si->nslots; i++) {
+		if (si->slots[i] >= st->nchunks_disk) return -1;
+	}
+
+	size_t vsiz = ((size_t) siz + pgsiz - 1) & ~((size_t) pgsiz - 1);
+	u8 *view = mmap(NULL, vsiz, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (view == MAP_FAILED) return -1;
+
+	for (i = 0; i < si->nslots; i = j + 1) {
+		for (j = i; ((j + 1) < si->nslots) && (si->slots[j + 1] == (si->slots[j] + 1)); j++) {}
+		size_t off = (size_t) i * st->chunk;
+		size_t len = MIN((size_t) (j - i + 1) * st->chunk, siz - off);
+		void *m = mmap(&view[off], len, PROT_READ, MAP_PRIVATE | MAP_FIXED, st->fd,
+					(off_t) si->slots[i] * st->chunk);
+		if (m == MAP_FAILED) {
+			munmap(view, vsiz);
+			return -1;
+		}
+	}
+	img->buf = view;
+	img->siz = siz;
+	img->mapped = 1;
+	return 0;
+}
+#endif
+
+int nisstore_map(const struct nisstore *st, unsigned idx, struct rom_image *img) {
+	assert(st && img);
+
+	img->buf = NULL;
+	img->siz = 0;
+	img->mapped = 0;
+	if (idx >= st->nimg) return -1;
+
+#ifndef _WIN32
+	if (!map_view(st, st->imgs[idx], img)) return 0;
+#endif
+	img->buf = malloc(st->imgs[idx]->pub.siz);
+	if (!img->buf) return -1;
+	img->siz = st->imgs[idx]->pub.siz;
+	return nisstore_read(st, idx, img->buf);
+}
+
+void nisstore_stats(const struct nisstore *st, uint64_t *stored, uint64_t *logical) {
+	assert(st && stored && logical);
+	unsigned idx;
+
+	*stored = (uint64_t) st->nchunks * st->chunk;
+	*logical = 0;
+	for (idx = 0; idx < st->nimg; idx++) {
+		*logical += st->imgs[idx]->pub.siz;
+	}
+}
@@ -0,0 +1,96 @@
+/* content-addressed, deduplicating archive of ROM images
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISLIB_STORE_H
+#define NISLIB_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ecuid_list.h"
+#include "md5/md5.h"
+#include "nislib.h"
+
+/* A store is three files :
+ *	<store>.dat : fixed-size chunks ("slots"), each stored once. The last chunk of an image is 0-padded.
+ *	<store>.sum : MD5 of each slot, in slot order, after a 16-byte "NISSUMS1" + chunk size header.
+ *		Only a cache to avoid re-hashing .dat on every add session; missing or short is ok.
+ *	<store>.idx : text index, rewritten atomically on nisstore_save() :
+ *		"#nisstore\tv1\tchunk=<chunksize>\tnchunks=<n>" header, then one line per image :
+ *		"<md5>\t<ECUID or ->\t<size>\t<name>\t<slots>", where <slots> is a comma-separated list of
+ *		slot numbers or "first-last" runs.
+ *
+ * Dumps of one family mostly differ in calibration tables and checksums, so most of their chunks
+ * are shared. Slots past the index's nchunks (interrupted save) are ignored, and overwritten by the next save.
+ * Chunks are deduplicated by MD5 then compared, so a hash collision can't corrupt an image.
+ */
+
+#define NISSTORE_CHUNK 4096	//chunk size of new stores. Images can be mmap'ed if it's a multiple of the page size
+
+struct nisstore;
+
+/** index entry of one image */
+struct nisstore_img {
+	char md5[MD5_DIGEST_STRING_LENGTH];	//of the whole image, lowercase hex
+	char ecuid[ECUID_STR_LEN];	//"" if unknown
+	const char *name;	//original filename, without path
+	uint32_t siz;
+};
+
+enum nisstore_addres {
+	NISSTORE_ERR = 0,
+	NISSTORE_ADDED,
+	NISSTORE_DUP,	//identical image already in store; not added
+};
+
+/** open a store; a writable store that doesn't exist yet is created on nisstore_save().
+ * Read-only stores can be used by several threads at once.
+ *
+ * @param path : store name, without the .idx / .dat / .sum suffixes
+ * @return NULL if error. Must be closed with nisstore_close()
+ */
+struct nisstore *nisstore_open(const char *path, bool writable);
+
+/** write new chunks and the index, if modified.
+ * @return 1 if ok
+ */
+bool nisstore_save(struct nisstore *st);
+
+/** close store, dropping unsaved additions */
+void nisstore_close(struct nisstore *st);
+
+/** add an image. Not thread-safe.
+ *
+ * @param name : original filename; the path is stripped and tabs are replaced
+ * @param ecuid : NULL or "" if unknown
+ */
+enum nisstore_addres nisstore_add(struct nisstore *st, const uint8_t *buf, uint32_t siz,
+			const char *name, const char *ecuid);
+
+unsigned nisstore_count(const struct nisstore *st);
+
+/** @return NULL if idx is out of range */
+const struct nisstore_img *nisstore_get(const struct nisstore *st, unsigned idx);
+
+/** find next image after <after> (-1 to start) matching key : full MD5, ECUID (case-insensitive), or name
+ * @return index, or -1 if no more matches
+ */
+int nisstore_find(const struct nisstore *st, const char *key, int after);
+
+/** reassemble image into buf, which must hold nisstore_get(idx)->siz bytes
+ * @return 0 if ok
+ */
+int nisstore_read(const struct nisstore *st, unsigned idx, uint8_t *buf);
+
+/** load image as a read-only view of the .dat chunks if possible, else as a private copy.
+ * No temporary files are involved.
+ * @return 0 if ok; caller must romimg_close(img) after
+ */
+int nisstore_map(const struct nisstore *st, unsigned idx, struct rom_image *img);
+
+/** total size of distinct chunks, and sum of image sizes */
+void nisstore_stats(const struct nisstore *st, uint64_t *stored, uint64_t *logical);
+
+#endif
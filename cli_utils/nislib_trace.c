@@ -0,0 +1,148 @@
+/* leveled, per-category debug tracing, buffered per thread
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_trace.h"
+
+uint8_t trace_level[TC_NUM] = {
+	[TC_GEN] = TL_INFO,
+	[TC_TRACKER] = TL_INFO,
+	[TC_KEYFIND] = TL_INFO,
+	[TC_CKS] = TL_INFO,
+	[TC_ROMDB] = TL_INFO,
+};
+
+static const char *cat_names[TC_NUM] = {
+	[TC_GEN] = "gen",
+	[TC_TRACKER] = "tracker",
+	[TC_KEYFIND] = "keyfind",
+	[TC_CKS] = "cks",
+	[TC_ROMDB] = "romdb",
+};
+
+static const char *level_names[] = {
+	[TL_OFF] = "off",
+	[TL_ERR] = "err",
+	[TL_WARN] = "warn",
+	[TL_INFO] = "info",
+	[TL_DEBUG] = "debug",
+	[TL_VERBOSE] = "verbose",
+};
+
+#define TRACE_BUFSIZ	(16 * 1024)
+
+/* static so that threads don't need a destructor; 16k of TLS per thread is fine */
+static __thread struct {
+	size_t len;
+	char buf[TRACE_BUFSIZ];
+} tbuf;
+
+
+void trace_flush(void) {
+	if (!tbuf.len) return;
+	if (dbg_stream) fwrite(tbuf.buf, 1, tbuf.len, dbg_stream);
+	tbuf.len = 0;
+}
+
+void trace_printf(const char *fmt, ...) {
+	va_list ap;
+	int len;
+
+	if (!dbg_stream) return;
+	if ((dbg_stream == stdout) || (dbg_stream == stderr)) {
+		//interleaved with normal output, and stdio buffers those anyway
+		trace_flush();
+		va_start(ap, fmt);
+		vfprintf(dbg_stream, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	va_start(ap, fmt);
+	len = vsnprintf(tbuf.buf + tbuf.len, TRACE_BUFSIZ - tbuf.len, fmt, ap);
+	va_end(ap);
+	if (len < 0) return;
+	if ((size_t) len < (TRACE_BUFSIZ - tbuf.len)) {
+		tbuf.len += len;
+		return;
+	}
+
+	//didn't fit : discard the partial message, flush and retry
+	trace_flush();
+	va_start(ap, fmt);
+	if ((size_t) len < TRACE_BUFSIZ) {
+		tbuf.len = vsnprintf(tbuf.buf, TRACE_BUFSIZ, fmt, ap);
+	} else {
+		vfprintf(dbg_stream, fmt, ap);
+	}
+	va_end(ap);
+}
+
+
+/** parse level name or number
+ * ret -1 if unrecognized */
+static int parse_level(const char *s, size_t len) {
+	unsigned lvl;
+	char *endp;
+
+	for (lvl = 0; lvl < ARRAY_SIZE(level_names); lvl++) {
+		if ((strlen(level_names[lvl]) == len) && !strncmp(s, level_names[lvl], len)) {
+			return lvl;
+		}
+	}
+	lvl = strtoul(s, &endp, 0);
+	if ((endp != s + len) || (lvl > TL_VERBOSE)) return -1;
+	return lvl;
+}
+
+bool trace_config(const char *spec) {
+	const char *cur = spec;
+
+	if (!spec) return 1;
+	while (*cur) {
+		size_t toklen = strcspn(cur, ",");
+		const char *eq = memchr(cur, '=', toklen);
+		int lvl;
+		unsigned cat;
+
+		if (!toklen) {
+			cur++;
+			continue;
+		}
+		if (!eq) {
+			ERR_PRINTF("trace spec \"%.*s\" : expected <category>=<level>\n", (int) toklen, cur);
+			return 0;
+		}
+		lvl = parse_level(eq + 1, toklen - (eq + 1 - cur));
+		if (lvl < 0) {
+			ERR_PRINTF("trace spec \"%.*s\" : unknown level\n", (int) toklen, cur);
+			return 0;
+		}
+		if (((eq - cur) == 3) && !strncmp(cur, "all", 3)) {
+			for (cat = 0; cat < TC_NUM; cat++) trace_level[cat] = lvl;
+		} else {
+			for (cat = 0; cat < TC_NUM; cat++) {
+				if ((strlen(cat_names[cat]) == (size_t) (eq - cur)) && !strncmp(cur, cat_names[cat], eq - cur)) break;
+			}
+			if (cat == TC_NUM) {
+				ERR_PRINTF("trace spec \"%.*s\" : unknown category\n", (int) toklen, cur);
+				return 0;
+			}
+			trace_level[cat] = lvl;
+		}
+		if (lvl > TRACE_MAXLEVEL) {
+			ERR_PRINTF("trace level %s was compiled out, rebuild with -DTRACE_MAXLEVEL=%d\n", level_names[lvl], lvl);
+		}
+		cur += toklen;
+	}
+	return 1;
+}
@@ -0,0 +1,71 @@
+/* leveled, per-category debug tracing, buffered per thread
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * TRACE() output goes to the thread's dbg_stream. A message is only formatted
+ * if its level is enabled for its category; otherwise the cost is one compare,
+ * and the arguments are not evaluated.
+ * Levels above TRACE_MAXLEVEL are removed at compile time : build with e.g.
+ * CPPFLAGS=-DTRACE_MAXLEVEL=TL_VERBOSE to get the tracker path traces.
+ *
+ * When dbg_stream is not stdout / stderr, messages are collected in a per-thread
+ * buffer that is written in bulk. Code that closes or replaces dbg_stream must call
+ * trace_flush() first.
+ */
+
+#ifndef NISLIB_TRACE_H
+#define NISLIB_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum trace_cat {
+	TC_GEN = 0,	//everything printed with DBG_PRINTF
+	TC_TRACKER,	//sh_track_reg and the register tracking in findrefs / findcallargs
+	TC_KEYFIND,	//nisrom_keyfinders
+	TC_CKS,	//checksum search and fixing
+	TC_ROMDB,	//nis_romdb parsing and reloads
+	TC_NUM,
+};
+
+enum trace_level {
+	TL_OFF = 0,
+	TL_ERR,
+	TL_WARN,
+	TL_INFO,	//one-off results; default
+	TL_DEBUG,	//per-candidate messages
+	TL_VERBOSE,	//per-opcode messages, in the hottest loops
+};
+
+#ifndef TRACE_MAXLEVEL
+#define TRACE_MAXLEVEL TL_DEBUG
+#endif
+
+/** runtime level of each category, TL_INFO by default.
+ * Only change this before starting threads.
+ */
+extern uint8_t trace_level[TC_NUM];
+
+#define trace_on(cat, lvl) (((lvl) <= TRACE_MAXLEVEL) && ((lvl) <= trace_level[(cat)]))
+
+#define TRACE(cat, lvl, fmt, ...) \
+	do { if (trace_on((cat), (lvl))) trace_printf(fmt, ##__VA_ARGS__); } while (0)
+
+/** append a message to the current thread's buffer. Use TRACE() instead. */
+void trace_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/** write out the current thread's buffer to dbg_stream */
+void trace_flush(void);
+
+/** set levels from a spec like "keyfind=debug,tracker=verbose" or "all=warn".
+ * Levels are names (off, err, warn, info, debug, verbose) or numbers.
+ * NULL or empty spec : no change
+ *
+ * ret 1 if ok
+ */
+bool trace_config(const char *spec);
+
+/** name of the environment variable that tools pass to trace_config() */
+#define TRACE_ENV "NISTRACE"
+
+#endif
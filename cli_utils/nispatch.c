@@ -0,0 +1,321 @@
+/* nispatch : apply byte patches to a ROM, and fix its std, alt and alt2 checksums.
+ * In-place patching only rewrites the modified bytes.
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nislib.h"
+#include "nislib_ckpatch.h"
+#include "nisrom_romfile.h"
+#include "stypes.h"
+
+__thread FILE *dbg_stream;
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+		"**** Apply patches and fix all checksums\n"
+		"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s [-c <&corrections>] [-f] [-n] [-o <out_file>] <rom.bin> <patchfile> [<patchfile>...]\n"
+		"\tPatch files have one \"<offset> <hex bytes>\" patch per line, e.g. \"0x4A10 0009 000B\";\n"
+		"\t'#' starts a comment, \"-\" reads patches from stdin.\n"
+		"\tThe ROM must have valid checksums before patching, to locate them.\n"
+		"\t-c: keep the std checksum, set 3 correction u32s at <&corrections> (hex) instead (like nisckfix1)\n"
+		"\t-f: continue if some checksum expected for this FID type was not found\n"
+		"\t-n: dry run, only show what would change\n"
+		"\t-o: write the patched ROM to <out_file>; default is to patch <rom.bin> in place\n"
+		"\tExample: %s -o hackrom.bin rom.bin tweaks.txt\n", progname, progname);
+}
+
+/* automatic variables, a few patch lines are enough */
+#define MAX_PATCHLINE	4096
+
+static int hexval(int c) {
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	c = tolower(c);
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	return -1;
+}
+
+/** parse and apply one patch file
+ * @return 0 if ok
+ */
+static int apply_patchfile(struct ckpatch *cp, const char *fname, unsigned *npatches) {
+	FILE *fh = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	char line[MAX_PATCHLINE];
+	u8 data[MAX_PATCHLINE / 2];
+	unsigned lineno = 0;
+	int rv = 0;
+
+	if (!fh) {
+		ERR_PRINTF("can't open %s : %s\n", fname, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fh)) {
+		char *cur = line;
+		char *endp;
+		unsigned long offs;
+		u32 len = 0;
+
+		lineno++;
+		if (!strchr(line, '\n') && !feof(fh)) {
+			ERR_PRINTF("%s:%u : line too long\n", fname, lineno);
+			rv = -1;
+			break;
+		}
+		char *comment = strchr(line, '#');
+		if (comment) *comment = 0;
+		while (isspace((unsigned char) *cur)) cur++;
+		if (!*cur) continue;
+
+		offs = strtoul(cur, &endp, 16);
+		if ((endp == cur) || !isspace((unsigned char) *endp)) {
+			ERR_PRINTF("%s:%u : bad offset\n", fname, lineno);
+			rv = -1;
+			break;
+		}
+		//bytes, whitespace between them is optional
+		for (cur = endp; *cur; cur++) {
+			int hi, lo;
+			if (isspace((unsigned char) *cur)) continue;
+			hi = hexval(*cur);
+			lo = (hi >= 0) ? hexval(cur[1]) : -1;
+			if (lo < 0) break;
+			data[len++] = (u8) ((hi << 4) | lo);
+			cur++;
+		}
+		if (*cur || !len) {
+			ERR_PRINTF("%s:%u : bad patch bytes\n", fname, lineno);
+			rv = -1;
+			break;
+		}
+		if ((offs > UINT32_MAX) || ckpatch_write(cp, (u32) offs, data, len)) {
+			ERR_PRINTF("%s:%u : patch refused\n", fname, lineno);
+			rv = -1;
+			break;
+		}
+		*npatches += 1;
+	}
+	if (fh != stdin) fclose(fh);
+	return rv;
+}
+
+/** locate std, alt and alt2 checksums (before patching !) and add their regions.
+ * @return 0 if ok
+ */
+static int find_regions(struct romfile *rf, struct ckpatch *cp, u32 p_corr, bool use_corr, bool force) {
+	const struct fid_plan *fp;
+	bool missing = 0;
+
+	if (romfile_anchors(rf)) return -1;
+	(void) find_loader(rf);
+	if (find_fid(rf) == UINT32_MAX) {
+		ERR_PRINTF("no FID struct, cannot tell which checksums apply\n");
+		return -1;
+	}
+	(void) find_ramf(rf);
+	fp = rf->plan;
+	printf("%s : %.8s\n", rf->filename, (const char *) rf->fid_cpu);
+
+	/* inner blocks first, only for readability : ckpatch_fix() orders them anyway */
+	if (fp->altcks) {
+		if ((rf->p_acstart != UINT32_MAX) && !validate_altcks(rf)) {
+			struct ck_region reg = {
+				.name = "alt",
+				.start = rf->p_acstart,
+				.len = romfile_altcks_len(rf),
+				.p_sum = rf->p_acs,
+				.p_xor = rf->p_acx,
+				.p_skip = UINT32_MAX,
+			};
+			if (ckpatch_addregion(cp, &reg)) return -1;
+			printf("\talt cks block 0x%06lX - 0x%06lX, values @ 0x%lX, 0x%lX\n",
+				(unsigned long) reg.start, (unsigned long) (reg.start + reg.len - 1),
+				(unsigned long) reg.p_sum, (unsigned long) reg.p_xor);
+		} else {
+			printf("\talt cks not found\n");
+			missing = 1;
+		}
+	}
+	if (fp->alt2cks) {
+		find_alt2cks(rf);
+		if (rf->cks_alt2_good) {
+			struct ck_region reg = {
+				.name = "alt2",
+				.start = rf->p_ac2start,
+				.len = rf->siz - rf->p_ac2start,
+				.p_sum = rf->p_a2cs,
+				.p_xor = rf->p_a2cx,
+				.p_skip = rf->p_ivt2 - 4,	//same as find_alt2cks()
+			};
+			if (ckpatch_addregion(cp, &reg)) return -1;
+			printf("\talt2 cks block 0x%06lX - end, values @ 0x%lX, 0x%lX\n",
+				(unsigned long) reg.start, (unsigned long) reg.p_sum, (unsigned long) reg.p_xor);
+		} else {
+			printf("\talt2 cks not found\n");
+			missing = 1;
+		}
+	}
+	if (fp->stdcks) {
+		struct ck_region reg = {
+			.name = "std",
+			.start = 0,
+			.len = rf->siz,
+			.p_skip = UINT32_MAX,
+			.fix = use_corr ? CKFIX_CORRECT : CKFIX_REWRITE,
+			.p_corr = p_corr,
+		};
+		if (!checksum_std(rf->buf, rf->siz, &reg.p_sum, &reg.p_xor)) {
+			if (ckpatch_addregion(cp, &reg)) return -1;
+			printf("\tstd cks values @ 0x%lX, 0x%lX", (unsigned long) reg.p_sum, (unsigned long) reg.p_xor);
+			if (use_corr) printf(", corrections @ 0x%lX", (unsigned long) p_corr);
+			printf("\n");
+		} else {
+			printf("\tstd cks not found\n");
+			missing = 1;
+		}
+	}
+	if (!cp->nregions) {
+		ERR_PRINTF("no checksums to fix\n");
+		return -1;
+	}
+	if (missing && !force) {
+		ERR_PRINTF("some checksums were not found (ROM already modified ?); use -f to fix the others anyway\n");
+		return -1;
+	}
+	return 0;
+}
+
+/** rewrite only the modified ranges of the file
+ * @return 0 if ok
+ */
+static int write_inplace(const struct ckpatch *cp, const char *fname, unsigned *nruns, u32 *nbytes) {
+	u32 pos = 0, len;
+	int fd = open(fname, O_WRONLY);
+
+	if (fd < 0) {
+		ERR_PRINTF("can't open %s : %s\n", fname, strerror(errno));
+		return -1;
+	}
+	while (ckpatch_dirty(cp, pos, &pos, &len)) {
+		if (pwrite(fd, &cp->buf[pos], len, pos) != (ssize_t) len) {
+			ERR_PRINTF("write error @ 0x%lX : %s\n", (unsigned long) pos, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		*nruns += 1;
+		*nbytes += len;
+		pos += len;
+	}
+	if (close(fd)) {
+		ERR_PRINTF("error closing %s : %s\n", fname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *ofname = NULL;
+	unsigned long p_corr = 0;
+	bool use_corr = 0, force = 0, dryrun = 0;
+	struct romfile rf = {0};
+	struct ckpatch cp = {0};
+	unsigned npatches = 0;
+	int opt;
+	int rv = -1;
+
+	if (!trace_config(getenv(TRACE_ENV))) return -1;
+
+	while ((opt = getopt(argc, argv, "c:fhno:")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (sscanf(optarg, "%lx", &p_corr) != 1) {
+				printf("did not understand %s\n", optarg);
+				return -1;
+			}
+			use_corr = 1;
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'n':
+			dryrun = 1;
+			break;
+		case 'o':
+			ofname = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	if ((argc - optind) < 2) {
+		usage(argv[0]);
+		return 0;
+	}
+
+	dbg_stream = tmpfile();	//before calling nislib funcs
+	if (!dbg_stream) {
+		printf("problem creating temp file!?\n");
+		return -1;
+	}
+
+	const char *romname = argv[optind];
+	if (romimg_open(&rf.img, romname, 1)) goto exit;
+	if (romfile_attach(&rf, romname)) goto exit;
+	if (ckpatch_init(&cp, rf.img.buf, rf.siz)) goto exit;
+	if (find_regions(&rf, &cp, (u32) p_corr, use_corr, force)) goto exit;
+
+	int argi;
+	for (argi = optind + 1; argi < argc; argi++) {
+		if (apply_patchfile(&cp, argv[argi], &npatches)) goto exit;
+	}
+	if (ckpatch_fix(&cp)) {
+		ERR_PRINTF("could not fix checksums, nothing written\n");
+		goto exit;
+	}
+	printf("%u patches applied, checksums fixed\n", npatches);
+
+	u32 pos = 0, len;
+	unsigned nruns = 0;
+	u32 nbytes = 0;
+	if (dryrun) {
+		while (ckpatch_dirty(&cp, pos, &pos, &len)) {
+			printf("\t0x%06lX : %lu bytes\n", (unsigned long) pos, (unsigned long) len);
+			pos += len;
+		}
+		rv = 0;
+	} else if (ofname) {
+		FILE *outf = fopen(ofname, "wb");
+		if (!outf) {
+			printf("error opening %s.\n", ofname);
+			goto exit;
+		}
+		if ((fwrite(rf.img.buf, 1, rf.siz, outf) != rf.siz) | fclose(outf)) {
+			ERR_PRINTF("trouble writing %s\n", ofname);
+			goto exit;
+		}
+		printf("wrote %s\n", ofname);
+		rv = 0;
+	} else if (!write_inplace(&cp, romname, &nruns, &nbytes)) {
+		printf("%s : rewrote %lu bytes in %u ranges\n", romname, (unsigned long) nbytes, nruns);
+		rv = 0;
+	}
+
+exit:
+	ckpatch_done(&cp);
+	close_rom(&rf);
+	fclose(dbg_stream);
+	return rv;
+}
@@ -7,13 +7,14 @@
  */
 
 #include <assert.h>
-#include <ctype.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>	//for offsetof()
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>	//memcmp
+#include <strings.h>	//strncasecmp
 #include <stdlib.h>	//malloc etc
 
 #include <getopt.h>
@@ -23,9 +24,18 @@
 
 #include "nissan_romdefs.h"
 #include "nislib.h"
+#include "nislib_arena.h"
+#include "nislib_corpus.h"
+#include "nislib_pool.h"
+#include "nislib_prof.h"
+#include "nislib_shindex.h"
 #include "nislib_shtools.h"
+#include "nislib_store.h"
+#include "nisrom_anchors.h"
+#include "nisrom_cache.h"
 #include "nisrom_finders.h"
 #include "nisrom_keyfinders.h"
+#include "nisrom_romfile.h"
 #include "nis_romdb.h"
 
 #include "stypes.h"
@@ -34,599 +44,25 @@
 #define DBG_OUTFILE	"nisrom_dbg.log"	//default log file
 #define KEYSET_CSV "../romdb/keysets.csv"	//default keyset db file
 
+/* analysis cache (-C) : entries are only reused if they were produced by the same
+ * analyzer version and keyset db. Bump this whenever any rendered property can change.
+ */
+#define NISROM_CACHE_VERS	3
+
 #if (CHAR_BIT != 8)
 #error HAH ! a non-8bit char system. Some of this will not work
 #endif
 
 const char *progname="nisrom";
 
-FILE *dbg_stream;
-
-static bool force_parse = 0;	//force parsing a ROM, ignoring errors as much as possible. Can cause segfaults
-
-// generic ROM struct. For the file offsets in here, UINT32_MAX signals invalid / inexistant target
-struct romfile {
-	FILE *hf;
-	const char *filename;
-	u32 siz;	//in bytes
-	uint8_t *buf;	//copied here
-
-	nis_romdb *romdb;
-
-	//and some metadata
-	rom_offset p_loader;	//struct loader
-	enum loadvers_t loader_v;	//version (10, 50, 60 etc)
-
-	rom_offset p_fid;	//location of struct fid_base
-	enum fidtype_ic fid_ic;
-	const struct fidtype_t *fidtype;
-
-	u32 sfid_size;	//sizeof correct struct fid_base
-	rom_offset p_ramf;	//location of struct ramf
-	rel_offset	ramf_offset;	//RAMF struct wasn't found where expected (offset != 0)
-
-	/* these point in buf, and so are not necessarily 0-terminated strings */
-	const uint8_t *loader_cpu;	//LOADERxx CPU code
-	const uint8_t *fid;	//firmware ID itself
-	const uint8_t *fid_cpu;	//FID CPU code
-
-	rom_offset p_cks;	//position of std_checksum sum
-	rom_offset p_ckx;	//position of std_checksum xor
-
-	rom_offset p_acs;	//pos of alt_cks sum
-	rom_offset p_acx;	//pos of alt_cks xor
-
-	rom_offset p_a2cs;
-	rom_offset p_a2cx;	//pos of alt2 cks sum, xor
-
-	/* real metadata here. Unknown values must be set to UINT32_MAX */
-	rom_offset p_ivt2;	//pos of alt. vector table
-	rom_offset p_acstart;	//start of alt_cks block
-	rom_offset p_acend;	//end of alt_cks block
-	rom_offset p_ecurec;	//if ROM_HAS_ECUREC
-
-	rom_offset p_ac2start;	//start of alt2 cks block (end is always ROMEND ?)
-
-	rom_offset	p_eepread;	//address of eeprom_read() func
-	uint32_t	eep_port;	//PORT reg used for EEPROM pins
-
-	/* some flags */
-	bool	cks_alt_good;	//alt cks values found + valid
-	bool	cks_alt2_good;	//alt2 cks values found + valid
-	bool	has_rm160;	//RIPEMD160 hash found
-
-	struct ramf_unified ramf;	//not useful atm
-};
-
-
-//load ROM to a new buffer
-//ret 0 if OK
-//caller MUST call close_rom() after
-static int open_rom(struct romfile *rf, const char *fname) {
-	FILE *fbin;
-	uint8_t *buf;	//load whole ROM
-	u32 file_len;
-
-	rf->hf = NULL;	//not needed
-
-	if ((fbin=fopen(fname,"rb"))==NULL) {
-		ERR_PRINTF("error opening %s.\n", fname);
-		return -1;
-	}
-	rf->filename = fname;
-
-	file_len = flen(fbin);
-	if ((!file_len) ||
-		(file_len > MAX_ROMSIZE) ||
-		(file_len < MIN_ROMSIZE)) {
-		ERR_PRINTF("unlikely file size %lu\n", (unsigned long) file_len);
-		if (!force_parse) {
-			fclose(fbin);
-			return -1;
-		}
-	}
-	rf->siz = file_len;
-
-	buf = malloc(file_len);
-	if (!buf) {
-		ERR_PRINTF("malloc choke\n");
-		fclose(fbin);
-		return -1;
-	}
-
-	/* load whole ROM */
-	if (fread(buf,1,file_len,fbin) != file_len) {
-		ERR_PRINTF("trouble reading\n");
-		free(buf);
-		fclose(fbin);
-		return -1;
-	}
-	rf->buf = buf;
-
-	fclose(fbin);
-
-	return 0;
-}
-
-/** close & free romfile contents
- *
- * safe to call multiple times or if nothing is open yet
- */
-void close_rom(struct romfile *rf) {
-	if (!rf) return;
-	if (rf->buf) {
-		free(rf->buf);
-		rf->buf = NULL;
-	}
-	return;
-}
-
-
-/** try to extract an ECUID from given full filename
- *
- * @param [out] ecuid if found, write 5+1 bytes here (includes 0 term)
- * @param filename can be full abs/rel path, or just filename. Must be 0-terminated
- *
- * return 1 if ok
-*/
-static bool ecuid_from_filename(const char *filename, char *ecuid) {
-	// first : search backwards for a fwd/back slash
-	// pathological test cases : "/", "abc"
-	const char *pfile;
-    pfile = filename + strlen(filename);
-    for (; pfile > filename; pfile--) {
-        if ((*pfile == '\\') || (*pfile == '/')) {
-            pfile++;
-            break;
-        }
-    }
-
-    unsigned basename_len = strlen(pfile);
-    if (basename_len < ECUID_LEN) {
-		return 0;
-    }
-
-    // make temp copy because strtok needs a writeable char *
-    char tmp_basename[1 + ECUID_LEN +2] =  {0};	//possible '1' prefix, + separator, + 0-term
-	strncpy(tmp_basename, pfile, ECUID_LEN+2);
-
-    // next : take first "token" of filename as the ECUID
-    char *tok = strtok(tmp_basename, "-_. ");
-    if (!tok) {
-		return 0;
-    }
-    unsigned tok_len = strlen(tok);
-    if ((tok_len != ECUID_LEN) &&
-		(tok_len != (1 + ECUID_LEN))) {
-		return 0;
-    }
-
-    //validate chars and make uppercase : 0-9, a-z, A-Z
-    for (unsigned idx = 0; idx < tok_len; idx++) {
-		if (!isalnum(tok[idx])) {
-			return 0;
-		}
-		tok[idx] = toupper(tok[idx]);
-    }
-
-
-    if ((tok_len == (ECUID_LEN + 1)) &&
-		(tok[0] == '1')) {
-		// 6-char string starting with '1' , e.g. 18U92A
-		memcpy(ecuid, &tok[1], ECUID_STR_LEN);
-		return 1;
-	} else if (tok_len == ECUID_LEN) {
-		//normal ECUID
-		memcpy(ecuid, tok, ECUID_STR_LEN);
-		return 1;
-	}
-
-	return 0;
-}
-
-/** find offset of LOADER struct if possible, update romfile struct
- * ret -1 if not ok
- */
-u32 find_loader(struct romfile *rf) {
-	const uint8_t loadstr[]="LOADER";
-	const uint8_t *sl;
-	int loadv;
-
-	if (!rf) return -1;
-	if (!(rf->buf)) return -1;
-
-	rf->loader_v = L_UNK;
-
-	/* look for "LOADER", backtrack to beginning of struct. */
-	sl = u8memstr(rf->buf, rf->siz, loadstr, 6);
-	if (!sl) {
-		DBG_PRINTF("LOADER not found !\n");
-		return -1;
-	}
-
-	//decode version #
-	if (sscanf((const char *) (sl + 6), "%d", &loadv) == 1) {
-		rf->loader_v = loadv;
-	}
-
-	//convert to file offset
-	rf->p_loader = (u32) (sl - rf->buf) - offsetof(struct loader_t, loader);
-
-	// this is the same for all loader verions:
-	rf->loader_cpu = &rf->buf[rf->p_loader + offsetof(struct loader_t, cpu)];
-
-	return rf->p_loader;
-}
-
-//parse second part of FID struct and fill altcks + ivt2 + rf->ramf-> stuff
-static void parse_ramf(struct romfile *rf) {
-	const struct fidtype_t *ft;	//helper
-	assert(rf);
-
-	ft = rf->fidtype;
-	unsigned features = ft->features;	//another helper
-
-	if (ft->pRAMjump) {
-		rf->ramf.pRAMjump = reconst_32(&rf->buf[rf->p_ramf + ft->pRAMjump]);
-		rf->ramf.pRAM_DLAmax = reconst_32(&rf->buf[rf->p_ramf + ft->pRAM_DLAmax]);
-	}
-
-	if (features & ROM_HAS_ALTCKS) {
-		//gross : find_romend may have filled these in
-		if ((rf->p_acstart == 0) &&
-				(rf->p_acend == 0)) {
-			assert(ft->packs_start);
-			rf->p_acstart = reconst_32(&rf->buf[rf->p_ramf + ft->packs_start]);
-			rf->p_acend = reconst_32(&rf->buf[rf->p_ramf + ft->packs_end]);
-		}
-	} else {
-		rf->p_acstart = UINT32_MAX;
-		rf->p_acend = UINT32_MAX;
-	}
-
-	if (ft->pIVT2) {
-		// same : find_romend may have filled in
-		if (rf->p_ivt2 == 0) {
-			rf->p_ivt2 = reconst_32(&rf->buf[rf->p_ramf + ft->pIVT2]);
-		}
-	} else {
-		rf->p_ivt2 = UINT32_MAX;
-	}
-
-	return;
-}
-
-
-//find offset of FID struct, parse & update romfile struct. find_loader() must have been run before calling this.
-//ret -1 if not ok
-u32 find_fid(struct romfile *rf) {
-	const uint8_t dbstr[]="DATAB";
-	const uint8_t loadstr[]="LOADER";
-	const uint8_t *sf;
-	u32 sf_offset;	//offset in file
-
-	if (!rf) return -1;
-	if (!(rf->buf)) return -1;
-
-	rf->fid_ic = FID_UNK;
-
-	/* look for "DATABASE" */
-	sf = u8memstr(rf->buf, rf->siz, dbstr, 5);
-	if (!sf) {
-		DBG_PRINTF("no DATABASE found !?\n");
-		return -1;
-	}
-	//convert to file offset
-	//Luckily, the database member is at the same offset for all variants of struct fid.
-	sf_offset = (sf - rf->buf) - offsetof(struct fid_base1_t, database);
-
-	/* check if this was the LOADER database */
-	if (memcmp(sf - offsetof(struct loader_t, database), loadstr, 4) == 0 ) {
-		//search again, skipping the first instance
-		if ((sf_offset + 6) < rf->siz) {
-			sf = u8memstr(&rf->buf[sf_offset + sizeof(struct loader_t)], rf->siz - sf_offset - 1 , dbstr, 5);
-		}
-		if (!sf) {
-			DBG_PRINTF("no FID DATABASE found !\n");
-			return -1;
-		}
-		//convert to file offset again
-		sf_offset = (sf - rf->buf) - offsetof(struct fid_base1_t, database);
-	}
-
-	//bounds check
-	if ((sf_offset + FID_MAXSIZE) >= rf->siz) {
-		DBG_PRINTF("Possibly incomplete / bad dump ? FID too close to end of ROM\n");
-		return -1;
-	}
+__thread FILE *dbg_stream;
 
-	rf->p_fid = sf_offset;
 
-	/* independant of loader version : */
-	rf->fid = &rf->buf[sf_offset + offsetof(struct fid_base1_t, FID)];
-	rf->fid_cpu = &rf->buf[sf_offset + offsetof(struct fid_base1_t, cpu)];
-
-	/* determine FID type : iterate through array of known types, matching the CPU string */
-	rf->fid_ic = get_fidtype(rf->fid_cpu);
-	if (rf->fid_ic == FID_UNK) {
-		DBG_PRINTF("Unknown FID IC type %.8s ! Cannot proceed\n", rf->fid_cpu);
-		return -1;
-	}
-
-	rf->fidtype = &fidtypes[rf->fid_ic];
-	if (rf->siz != (rf->fidtype->ROMsize)) {
-		DBG_PRINTF("Warning : ROM size %u k, expected %u k; possibly incomplete dump\n",
-				rf->siz / 1024, rf->fidtype->ROMsize / 1024);
-	}
-
-	rf->sfid_size = rf->fidtype->FIDbase_size;
-
-	return sf_offset;
-}
-
-/** validate alt cks block in pre-parsed romfile
- * needs (features & ROM_HAS_ALTCKS)
- *
- * @return 0 if ok
- */
-int validate_altcks(struct romfile *rf) {
-	/* validate alt_cks block; it's a std algo that skips 2 u32 locs (altcks_s, altcks_x).
-	 * But it seems those locs are always outside the block?
-	 */
-	uint32_t acs=0, acx=0;
-	u32 altcs_bsize;
-	const uint8_t *pacs, *pacx;
-
-	assert(rf);
-	assert(rf->buf);
-	if (!(rf->fidtype->features & ROM_HAS_ALTCKS)) return -1;
-
-	if ((rf->p_acstart == UINT32_MAX) ||
-		(rf->p_acend == UINT32_MAX) ||
-		(rf->p_acstart >= rf->p_acend)) {
-		return -1;
-	}
-
-	/* p_acstart is so far always u32 aligned, but not p_acend (usually 2 bytes before FID, except on some SH705828 ROMs....
-	 * This gives rise to some weird behavior where
-	 * sometimes the cks area includes the first u32 of the FID struct. I wonder if this was really intended by the Nissan devs !
-	 */
-	altcs_bsize = (((rf->p_acend + 1) - rf->p_acstart) & (~0x03)) + 4;
-
-	sum32(&rf->buf[rf->p_acstart], altcs_bsize, &acs, &acx);
-
-	DBG_PRINTF("alt cks block 0x%06lX - 0x%06lX: sumt=0x%08lX, xort=0x%08lX\n",
-		(unsigned long) rf->p_acstart, (unsigned long) rf->p_acend,
-			(unsigned long) acs, (unsigned long) acx);
-	pacs = u32memstr(rf->buf, rf->siz, acs);
-	pacx = u32memstr(rf->buf, rf->siz, acx);
-	if (!pacs || !pacx) {
-		DBG_PRINTF("altcks values not found in ROM, possibly unskipped vals or bad algo\n");
-		return -1;
-	} else {
-		rf->p_acs = (u32) (pacs - rf->buf);
-		rf->p_acx = (u32) (pacx - rf->buf);
-		DBG_PRINTF("confirmed altcks values found : acs @ 0x%lX, acx @ 0x%lX\n",
-				(unsigned long) rf->p_acs, (unsigned long) rf->p_acx);
-		rf->cks_alt_good = 1;
-		//TODO : validate altcks val offsets VS end-of-IVT2, i.e. they seem to be always @
-		// IVT2 + 0x400
-	}
-	return 0;
-}
-
-
-/* if ROM_HAS_ECUREC, try to locate &IVT2 near ROMEND
- *
- * ret 1 if ok and update romfile struct
- */
-bool find_ecurec(struct romfile *rf) {
-	const struct fidtype_t *ft;
-	assert(rf);
-
-	ft = rf->fidtype;
-	if (!(ft->features & ROM_HAS_ECUREC)) {
-		return 0;
-	}
-
-	bool found = 0;
-	rom_offset p_romend, temp_ivt2, pp_ecurec;
-
-	u32 start_offs = 0;
-	const u8 *ivt2_maybe = rf->buf;
-	for (; start_offs < (rf->siz - 100); start_offs = (u32) (ivt2_maybe - rf->buf)+4) {
-			// iterate over occurences of &IVT2
-		ivt2_maybe = u32memstr(&rf->buf[start_offs], rf->siz - start_offs, ft->IVT2_expected);
-		if (!ivt2_maybe) {
-			return 0;
-		}
-		temp_ivt2 = (rom_offset) (ivt2_maybe - rf->buf);
-		pp_ecurec = temp_ivt2 - ft->pIVT2;
-		p_romend = pp_ecurec + ft->pROMend;
-		if (p_romend >= (rf->siz - 4)) {
-			continue;
-		}
-		u32 romend = reconst_32(&rf->buf[p_romend]);
-		if ((romend + 1) != (ft->ROMsize)) {
-			//IVT2/ROMEND field mismatch
-			continue;
-		}
-		//found !
-		found = 1;
-		break;
-	}
-	if (!found) {
-		DBG_PRINTF("IVT2/ROMEND not found\n");
-		return 0;
-	}
-	rf->p_ivt2 = ft->IVT2_expected;
-	rf->p_acstart = reconst_32(&rf->buf[pp_ecurec + ft->packs_start]);
-	rf->p_acend = reconst_32(&rf->buf[pp_ecurec + ft->packs_end]);
-	rf->p_ecurec = reconst_32(&rf->buf[pp_ecurec]);
-	return 1;
-}
-
-
-/** find & analyze 'struct ramf'
- *
- * @return 0 if ok
- *
- * it's right after struct fid, easy. The rom must already have
- * loader and fid structs found (find_loader, find_fid)
- */
-
-u32 find_ramf(struct romfile *rf) {
-	uint32_t testval;
-	const struct fidtype_t *ft;	//helper
-
-	assert(rf);
-	if ((rf->fid_ic == FID_UNK) ||
-		(rf->fid_ic >= FID_MAX) ||
-		(rf->p_fid == UINT32_MAX)) {
-		 return -1;
-	}
-
-	rf->p_ramf = rf->p_fid + rf->sfid_size;
-	ft = rf->fidtype;
-	unsigned features = ft->features;	//helper
-
-	if (ft->RAMF_header == 0) {
-		bool found_stuff = 0;
-		if (features & ROM_HAS_ECUREC) {
-			// alternate structure : no RAMF, instead search for &IVT2 near ROMEND
-			found_stuff = find_ecurec(rf);
-		}
-		if (!found_stuff) {
-			DBG_PRINTF("not trying to find RAMF.\n");
-			return 0;
-		}
-	} else {
-		// try to find RAMF by looking for first member, typically FFFF8000.
-		testval = reconst_32(&rf->buf[rf->p_ramf]);
-		if (testval != ft->RAMF_header) {
-			long ramf_adj = 4;
-			long sign = 1;
-			DBG_PRINTF("Unlikely contents for struct ramf; got 0x%lX.\n",
-						(unsigned long) testval);
-			while (ramf_adj < ft->pRAMF_maxdist) {
-				//search around, in a pattern like +4, -4, +8, -8, +12  and then +16, +20 etc
-				testval = reconst_32(&rf->buf[rf->p_ramf + (sign * ramf_adj)]);
-				if (testval == ft->RAMF_header) {
-					DBG_PRINTF("probable RAMF found @ delta = %+d\n",
-								(int) (sign * ramf_adj));
-					rf->ramf_offset = (sign * ramf_adj);
-					rf->p_ramf += rf->ramf_offset;
-					break;
-				}
-				if (ramf_adj < 0x0c) {
-					sign = -sign;	//flip sign;
-					if (sign == 1) ramf_adj += 4;
-				} else {
-					sign = 1;
-					ramf_adj += 4;
-				}
-			}
-		}
-	}
-
-	parse_ramf(rf);
-
-	if (features & ROM_HAS_ALTCKS) {
-		if ((rf->p_acstart >= rf->siz) ||
-			(rf->p_acend >= rf->siz) ||
-			(rf->p_acstart >= rf->p_acend)) {
-			DBG_PRINTF("bad alt cks bounds; 0x%lX - 0x%lX\n",
-					(unsigned long) rf->p_acstart, (unsigned long) rf->p_acend);
-			rf->p_acstart = UINT32_MAX;
-			rf->p_acend = UINT32_MAX;
-		}
-		if (rf->p_acstart != UINT32_MAX) {
-			(void) validate_altcks(rf);
-		}
-	}
-
-	if (rf->p_ivt2 != UINT32_MAX) {
-		if (rf->p_ivt2 >= (rf->siz - IVT_MINSIZE)) {
-			DBG_PRINTF("warning : IVT2 value out of bound, probably due to unusual RAMF structure.\n");
-			rf->p_ivt2 = UINT32_MAX;
-		} else {
-			if (rf->p_ivt2 != ft->IVT2_expected) {
-				DBG_PRINTF("Unexpected IVT2 0x%lX ! Please report this\n", (unsigned long) rf->p_ivt2);
-			}
-			if (!check_ivt(&rf->buf[rf->p_ivt2], rf->siz - rf->p_ivt2)) {
-				DBG_PRINTF("Unlikely IVT2 location 0x%06lX :\n", (unsigned long) rf->p_ivt2);
-				DBG_PRINTF("%08lX %08lX %08lX %08lX...\n", (unsigned long) reconst_32(&rf->buf[rf->p_ivt2+0]),
-							(unsigned long) reconst_32(&rf->buf[rf->p_ivt2+4]),
-							(unsigned long) reconst_32(&rf->buf[rf->p_ivt2+8]),
-							(unsigned long) reconst_32(&rf->buf[rf->p_ivt2+12]));
-				rf->p_ivt2 = UINT32_MAX;	//run the bruteforce IVT2 search instead
-			}
-		}
-	}
-
-	// edge case for 705822 which does have ECUREC but still uses the "normal" method : need to define p_ecurec manually here
-	if (!(features & ROM_HAS_ECUREC)) {
-		rf->p_ecurec = reconst_32(&rf->buf[rf->p_ramf + ft->pECUREC]);
-	}
-
-	rom_offset pecurec = rf->p_ecurec;
-
-	//display some LOADER > 80 specific garbage
-	if (features & ROM_HAS_ECUREC) {
-		//parse ECUREC
-		if ((pecurec + 6) >= rf->siz) {
-			DBG_PRINTF("unlikely pecurec = %lX\n", (unsigned long) pecurec);
-			pecurec = UINT32_MAX;
-		} else {
-			//skip leading '1'
-			DBG_PRINTF("probable ECUID @ %lX: %.*s\n",
-					(unsigned long) pecurec, 5,  &rf->buf[pecurec + 1]);
-		}
-	}
-
-	/* Locate RIPEMD-160 magic numbers */
-	if ((u32memstr(rf->buf, rf->siz, 0x67452301) != NULL) &&
-		(u32memstr(rf->buf, rf->siz, 0x98BADCFE) != NULL)) {
-		rf->has_rm160 = 1;
-	}
-
-	/* Locate cks_alt2 checksum. Starts at ECUREC */
-	if ((features & ROM_HAS_ALT2CKS) &&
-		(pecurec < rf->siz) &&
-		(rf->p_ivt2 < rf->siz)) {
-
-		u32 p_as = 0, p_ax = 0;
-		u32 p_skip1, p_skip2;
-		p_skip1 = UINT32_MAX;
-		p_skip2 = (rf->p_ivt2 - 4) - pecurec;
-		rf->p_ac2start = pecurec;
-		if (checksum_alt2(&rf->buf[pecurec], rf->siz - pecurec, &p_as, &p_ax, p_skip1, p_skip2) == 0) {
-			rf->cks_alt2_good = 1;
-			rf->p_a2cs = p_as + pecurec;
-			rf->p_a2cx = p_ax + pecurec;
-		} else {
-			DBG_PRINTF("alt2 checksum not found ?? Bad algo, bad skip, or other problem...\n");
-		}
-	}
-
-	return rf->p_ramf;
-}
-
-
-
-void find_eep(struct romfile *rf) {
-	uint32_t port;
-	uint32_t eepread = find_eepread(rf->buf, rf->siz, &port);
-	if (eepread > 0) {
-		rf->p_eepread = eepread;
-		rf->eep_port = port;
-	}
-}
 
 // for every property that will be shown, fill one of these
 struct printable_prop {
 	const char *csv_name;	//CSV column header. NULL to mark end of array
-	UT_string rendered_value;	//either quoted string or numeric value.
+	const char *rendered_value;	//either quoted string or numeric value; NULL if unknown. In the ROM's arena
 };
 
 enum rom_properties {
@@ -664,90 +100,213 @@ enum rom_properties {
 	RP_EEP_READ_OFFS,
 	RP_EEP_PORT,
 	RP_MD5,
+	RP_ROM_ECUID,	//from the contents, see find_ecuid()
 	RP_MAX,	//not a property, just the end marker
 };
 
 const struct printable_prop props_template[] = {
-	[RP_ECUID] = {"ECUID", {0}},
-	[RP_FILE] = {"file", {0}},
-	[RP_SIZE] = {"size", {0}},
-	[RP_LOADER] = {"LOADER ##", {0}},
-	[RP_LOADER_OFS] = {"LOADER ofs", {0}},
-	[RP_LOADER_CPU] = {"LOADER CPU", {0}},
-	[RP_LOADER_CPUCODE] = {"LOADER CPUcode", {0}},
-	[RP_FID] = {"FID", {0}},
-	[RP_FID_OFS] = {"&FID", {0}},
-	[RP_FID_CPU] = {"FID CPU", {0}},
-	[RP_FID_CPUCODE] = {"FID CPUcode", {0}},
-	[RP_RAMF_WEIRD] = {"RAMF_weird", {0}},
-	[RP_RAMJUMP] = {"RAMjump_entry", {0}},
-	[RP_IVT2] = {"IVT2", {0}},
-	[RP_IVT2_CONF] = {"IVT2 confidence", {0}},
-	[RP_STD_CKS] = {"std cks?", {0}},
-	[RP_STD_S_OFS] = {"&std_s", {0}},
-	[RP_STD_X_OFS] = {"&std_x", {0}},
-	[RP_ALT_CKS] = {"alt cks?", {0}},
-	[RP_ALT_S_OFS] = {"&alt_s", {0}},
-	[RP_ALT_X_OFS] = {"&alt_x", {0}},
-	[RP_ALT_START] = {"alt_start", {0}},
-	[RP_ALT_END] = {"alt_end", {0}},
-	[RP_ALT2_CKS] = {"alt2 cks?", {0}},
-	[RP_ALT2_S_OFS] = {"&alt2_s", {0}},
-	[RP_ALT2_X_OFS] = {"&alt2_x", {0}},
-	[RP_ALT2_START] = {"alt2_start", {0}},
-	[RP_RIPEMD160] = {"RIPEMD160", {0}},
-	[RP_KEYSET_QUAL] = {"keyset quality", {0}},
-	[RP_S27K] = {"s27k", {0}},
-	[RP_S36K] = {"s36k1", {0}},
-	[RP_EEP_READ_OFFS] = {"&EEPROM_read()", {0}},
-	[RP_EEP_PORT] = {"EEPROM PORT", {0}},
-	[RP_MD5] = {"MD5", {0}},
-	[RP_MAX] = {NULL, {0}},
+	[RP_ECUID] = {"ECUID", NULL},
+	[RP_FILE] = {"file", NULL},
+	[RP_SIZE] = {"size", NULL},
+	[RP_LOADER] = {"LOADER ##", NULL},
+	[RP_LOADER_OFS] = {"LOADER ofs", NULL},
+	[RP_LOADER_CPU] = {"LOADER CPU", NULL},
+	[RP_LOADER_CPUCODE] = {"LOADER CPUcode", NULL},
+	[RP_FID] = {"FID", NULL},
+	[RP_FID_OFS] = {"&FID", NULL},
+	[RP_FID_CPU] = {"FID CPU", NULL},
+	[RP_FID_CPUCODE] = {"FID CPUcode", NULL},
+	[RP_RAMF_WEIRD] = {"RAMF_weird", NULL},
+	[RP_RAMJUMP] = {"RAMjump_entry", NULL},
+	[RP_IVT2] = {"IVT2", NULL},
+	[RP_IVT2_CONF] = {"IVT2 confidence", NULL},
+	[RP_STD_CKS] = {"std cks?", NULL},
+	[RP_STD_S_OFS] = {"&std_s", NULL},
+	[RP_STD_X_OFS] = {"&std_x", NULL},
+	[RP_ALT_CKS] = {"alt cks?", NULL},
+	[RP_ALT_S_OFS] = {"&alt_s", NULL},
+	[RP_ALT_X_OFS] = {"&alt_x", NULL},
+	[RP_ALT_START] = {"alt_start", NULL},
+	[RP_ALT_END] = {"alt_end", NULL},
+	[RP_ALT2_CKS] = {"alt2 cks?", NULL},
+	[RP_ALT2_S_OFS] = {"&alt2_s", NULL},
+	[RP_ALT2_X_OFS] = {"&alt2_x", NULL},
+	[RP_ALT2_START] = {"alt2_start", NULL},
+	[RP_RIPEMD160] = {"RIPEMD160", NULL},
+	[RP_KEYSET_QUAL] = {"keyset quality", NULL},
+	[RP_S27K] = {"s27k", NULL},
+	[RP_S36K] = {"s36k1", NULL},
+	[RP_EEP_READ_OFFS] = {"&EEPROM_read()", NULL},
+	[RP_EEP_PORT] = {"EEPROM PORT", NULL},
+	[RP_MD5] = {"MD5", NULL},
+	[RP_ROM_ECUID] = {"ROM ECUID", NULL},
+	[RP_MAX] = {NULL, NULL},
 };
 
-// some fwd decls
+/* analysis stages. Each property is filled by one stage, and stages only run
+ * if a selected property needs them (directly, or through a later stage).
+ * LOADER and FID are always needed, since nothing else can be done without them.
+ */
+enum prop_stage {
+	PS_BASE = 0,	//filename, size, LOADER, FID
+	PS_RAMF,
+	PS_IVT2,	//needs RAMF
+	PS_STDCKS,
+	PS_ALTCKS,	//needs RAMF
+	PS_ALT2CKS,	//needs RAMF
+	PS_RM160,
+	PS_KEYS,	//needs code index
+	PS_EEP,	//needs code index
+	PS_MD5,
+	PS_ECUID,	//needs RAMF
+	PS_ECUID_FB,	//PS_ECUID, only if the filename ECUID is missing or unknown to romdb
+	PS_MAX
+};
+#define PS_BIT(stage) (1U << (stage))
+#define PS_ALL	(PS_BIT(PS_MAX) - 1)
+
+static const u8 prop_stage[RP_MAX] = {
+	[RP_ECUID] = PS_ECUID_FB,
+	[RP_RAMF_WEIRD] = PS_RAMF,
+	[RP_RAMJUMP] = PS_RAMF,
+	[RP_IVT2] = PS_IVT2,
+	[RP_IVT2_CONF] = PS_IVT2,
+	[RP_STD_CKS] = PS_STDCKS,
+	[RP_STD_S_OFS] = PS_STDCKS,
+	[RP_STD_X_OFS] = PS_STDCKS,
+	[RP_ALT_CKS] = PS_ALTCKS,
+	[RP_ALT_S_OFS] = PS_ALTCKS,
+	[RP_ALT_X_OFS] = PS_ALTCKS,
+	[RP_ALT_START] = PS_ALTCKS,
+	[RP_ALT_END] = PS_ALTCKS,
+	[RP_ALT2_CKS] = PS_ALT2CKS,
+	[RP_ALT2_S_OFS] = PS_ALT2CKS,
+	[RP_ALT2_X_OFS] = PS_ALT2CKS,
+	[RP_ALT2_START] = PS_ALT2CKS,
+	[RP_RIPEMD160] = PS_RM160,
+	[RP_KEYSET_QUAL] = PS_KEYS,
+	[RP_S27K] = PS_KEYS,
+	[RP_S36K] = PS_KEYS,
+	[RP_EEP_READ_OFFS] = PS_EEP,
+	[RP_EEP_PORT] = PS_EEP,
+	[RP_MD5] = PS_MD5,
+	[RP_ROM_ECUID] = PS_ECUID,
+};
 
-static void free_properties(struct printable_prop *props);
+/** properties to show, in output order */
+struct colsel {
+	unsigned num;
+	unsigned rp[RP_MAX];
+};
 
+/** set a property value, in arena <a> */
+static void prop_printf(struct arena *a, struct printable_prop *prop, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+static void prop_printf(struct arena *a, struct printable_prop *prop, const char *fmt, ...) {
+	va_list ap;
 
-static void print_csv_header(const struct printable_prop *props) {
-	assert(props);
-	const struct printable_prop *prop = props;
+	va_start(ap, fmt);
+	prop->rendered_value = arena_vprintf(a, fmt, ap);
+	va_end(ap);
+}
 
-	//print first field separately to avoid extra field separator
-	printf("\"%s\"", prop->csv_name);
-	prop++;
-	while (prop->csv_name != NULL) {
-		printf(",\"%s\"", prop->csv_name);
-		prop++;
+static const char *prop_val(const struct printable_prop *prop) {
+	return prop->rendered_value ? prop->rendered_value : "";
+}
+
+
+static void print_csv_header(FILE *fout, const struct printable_prop *props, const struct colsel *cols) {
+	assert(fout && props && cols);
+	unsigned idx;
+
+	for (idx = 0; idx < cols->num; idx++) {
+		//no separator before the first field
+		fprintf(fout, "%s\"%s\"", idx ? "," : "", props[cols->rp[idx]].csv_name);
 	}
-	printf("\n");
+	fprintf(fout, "\n");
 	return;
 }
 
-static void print_csv_values(const struct printable_prop *props) {
-	assert(props);
-	const struct printable_prop *prop = props;
+static void print_csv_values(FILE *fout, const struct printable_prop *props, const struct colsel *cols) {
+	assert(fout && props && cols);
+	unsigned idx;
+
+	for (idx = 0; idx < cols->num; idx++) {
+		fprintf(fout, "%s%s", idx ? "," : "", prop_val(&props[cols->rp[idx]]));
+	}
+	fprintf(fout, "\n");
+}
+
+static void print_human(FILE *fout, const struct printable_prop *props, const struct colsel *cols) {
+	assert(fout && props && cols);
+	unsigned idx;
 
-	printf("%s", utstring_body(&prop->rendered_value));
-	prop++;
-	while (prop->csv_name != NULL) {
-		printf(",%s", utstring_body(&prop->rendered_value));
-		prop++;
+	for (idx = 0; idx < cols->num; idx++) {
+		const struct printable_prop *prop = &props[cols->rp[idx]];
+		fprintf(fout, "\n%s\t", prop->csv_name);
+		fprintf(fout, "%s", prop_val(prop));
 	}
-	printf("\n");
+	fprintf(fout, "\n");
 }
 
-static void print_human(const struct printable_prop *props) {
-	assert(props);
-	const struct printable_prop *prop = props;
+/** columns only shown if selected with -s, to keep the default CSV layout */
+static bool prop_optin(unsigned rp) {
+	return (rp == RP_ROM_ECUID);
+}
 
-	while (prop->csv_name != NULL) {
-		printf("\n%s\t", prop->csv_name);
-		printf("%s", utstring_body(&prop->rendered_value));
-		prop++;
+/** select the default properties, in the default order */
+static void colsel_default(struct colsel *cols) {
+	unsigned rp;
+	cols->num = 0;
+	for (rp = 0; rp < RP_MAX; rp++) {
+		if (prop_optin(rp)) continue;
+		cols->rp[cols->num++] = rp;
 	}
-	printf("\n");
+}
+
+/** parse a comma-separated list of column names (case-insensitive, as in the CSV header)
+ * @return 0 if ok
+ */
+static int colsel_parse(struct colsel *cols, const char *list) {
+	const char *cur = list;
+
+	cols->num = 0;
+	while (1) {
+		const char *end = strchr(cur, ',');
+		size_t len = end ? (size_t) (end - cur) : strlen(cur);
+		unsigned rp;
+
+		for (rp = 0; rp < RP_MAX; rp++) {
+			const char *name = props_template[rp].csv_name;
+			if ((strlen(name) == len) && (strncasecmp(name, cur, len) == 0)) break;
+		}
+		if (rp == RP_MAX) {
+			ERR_PRINTF("unknown column \"%.*s\"\n", (int) len, cur);
+			return -1;
+		}
+		if (cols->num == RP_MAX) {
+			ERR_PRINTF("too many columns\n");
+			return -1;
+		}
+		cols->rp[cols->num++] = rp;
+		if (!end) break;
+		cur = end + 1;
+	}
+	return 0;
+}
+
+/** @return mask of PS_BIT() stages needed for the selected properties, including dependencies */
+static unsigned colsel_stages(const struct colsel *cols) {
+	unsigned need = PS_BIT(PS_BASE);
+	unsigned idx;
+
+	for (idx = 0; idx < cols->num; idx++) {
+		need |= PS_BIT(prop_stage[cols->rp[idx]]);
+	}
+	if (need & (PS_BIT(PS_IVT2) | PS_BIT(PS_ALTCKS) | PS_BIT(PS_ALT2CKS) | PS_BIT(PS_ECUID))) {
+		need |= PS_BIT(PS_RAMF);
+	}
+	return need;
 }
 
 
@@ -766,92 +325,148 @@ static void render_md5(const u8 digest[MD5_DIGEST_LENGTH], char buf[MD5_DIGEST_S
 	return;
 }
 
-/** alloc + fill a new array of properties.
- * must be free'd with free_properties()
- *
- * return NULL if error
+/** MD5 digest of whole ROM, as hex string */
+static void rom_md5(const struct romfile *rf, char md5_str[MD5_DIGEST_STRING_LENGTH]) {
+	MD5_CTX md5c;
+	u8 md5_digest[MD5_DIGEST_LENGTH];
+
+	MD5Init(&md5c);
+	MD5Update(&md5c, rf->buf, rf->siz);
+	MD5Final(md5_digest, &md5c);
+	render_md5(md5_digest, md5_str);
+}
+
+/** properties that depend on the filename rather than the ROM contents; these are never cached */
+static bool prop_from_filename(unsigned rp) {
+	return (rp == RP_ECUID) || (rp == RP_FILE);
+}
+
+/** alloc a new array of properties in the ROM's arena, and fill the filename-related ones.
+ * Valid until close_rom().
  */
-static struct printable_prop *new_properties(struct romfile *rf) {
-	assert(rf);
-	struct printable_prop *prop, *props;
-	props = malloc(sizeof(props_template));
+static struct printable_prop *alloc_properties(const struct romfile *rf) {
+	struct printable_prop *props;
+	props = arena_alloc(rf->arena, sizeof(props_template));
 	if (!props) return NULL;
 
 	memcpy(props, props_template, sizeof(props_template));
 
-	prop = props;
-	while (prop->csv_name != NULL) {
-		utstring_init(&prop->rendered_value);
-		prop++;
-	}
-
-	/* fill in all properties now */
-
 	char ecuid[ECUID_STR_LEN] = {0};
 	if (ecuid_from_filename(rf->filename, ecuid)) {
-		utstring_printf(&props[RP_ECUID].rendered_value, "\"%s\"", ecuid);
+		prop_printf(rf->arena, &props[RP_ECUID], "\"%s\"", ecuid);
 	}
 
-	utstring_printf(&props[RP_FILE].rendered_value, "\"%s\"", rf->filename);
-	utstring_printf(&props[RP_SIZE].rendered_value, "%luk", (unsigned long) rf->siz / 1024);
+	prop_printf(rf->arena, &props[RP_FILE], "\"%s\"", rf->filename);
+	return props;
+}
+
+static bool ecuid_in_romdb(nis_romdb *romdb, const char *ecuid) {
+	return (romdb_q_fidtype(romdb, ecuid) != FID_UNK) || romdb_q_s27k(romdb, ecuid);
+}
+
+/** @return 1 if ecuid_fallback() could use the in-ROM ECUID, i.e. the filename gives none,
+ * or one that romdb doesn't know
+ */
+static bool ecuid_fallback_possible(nis_romdb *romdb, const struct printable_prop *props) {
+	const char *fromname = props[RP_ECUID].rendered_value;
+
+	if (!fromname) return 1;
+	//values are quoted : skip the '"'
+	return romdb && !ecuid_in_romdb(romdb, fromname + 1);
+}
+
+/** alloc + fill a new array of properties, valid until close_rom().
+ *
+ * @param need : PS_BIT() mask of stages to run, see colsel_stages(). Properties of skipped stages stay empty.
+ * The code index (rf->shidx) is built here if a stage needs it.
+ *
+ * return NULL if error
+ */
+static struct printable_prop *new_properties(struct romfile *rf, unsigned need) {
+	assert(rf);
+	struct printable_prop *props;
+	props = alloc_properties(rf);
+	if (!props) return NULL;
+
+	prop_printf(rf->arena, &props[RP_SIZE], "%luk", (unsigned long) rf->siz / 1024);
+
+	if (romfile_anchors(rf)) {
+		return NULL;
+	}
 
+	uint64_t t0 = prof_start();
 	u32 loaderpos = find_loader(rf);
+	prof_stop(PT_LOADER, t0);
 	if (loaderpos != UINT32_MAX) {
 		const char *scpu;
 		scpu = (const char *) rf->loader_cpu;
-		utstring_printf(&props[RP_LOADER].rendered_value, "%02d", rf->loader_v);
-		utstring_printf(&props[RP_LOADER_OFS].rendered_value, "0x%lX", (unsigned long) loaderpos);
-		utstring_printf(&props[RP_LOADER_CPU].rendered_value, "\"%.6s\"",scpu);
-		utstring_printf(&props[RP_LOADER_CPUCODE].rendered_value, "\"%.2s\"",scpu+6);
+		prop_printf(rf->arena, &props[RP_LOADER], "%02d", rf->loader_v);
+		prop_printf(rf->arena, &props[RP_LOADER_OFS], "0x%lX", (unsigned long) loaderpos);
+		prop_printf(rf->arena, &props[RP_LOADER_CPU], "\"%.6s\"",scpu);
+		prop_printf(rf->arena, &props[RP_LOADER_CPUCODE], "\"%.2s\"",scpu+6);
 	}
 
+	t0 = prof_start();
 	u32 fidpos = find_fid(rf);
+	prof_stop(PT_FID, t0);
 	if (fidpos != UINT32_MAX) {
 		const char *scpu = (const char *) rf->fid_cpu;	//shortcut
-		utstring_printf(&props[RP_FID_OFS].rendered_value, "0x%lX", (unsigned long) rf->p_fid);
-		utstring_printf(&props[RP_FID].rendered_value, "\"%.*s\"",
+		prop_printf(rf->arena, &props[RP_FID_OFS], "0x%lX", (unsigned long) rf->p_fid);
+		prop_printf(rf->arena, &props[RP_FID], "\"%.*s\"",
 						(int) sizeof(((struct fid_base1_t *)NULL)->FID), (const char *) rf->fid);
-		utstring_printf(&props[RP_FID_CPU].rendered_value, "%.8s", scpu);
-		utstring_printf(&props[RP_FID_CPUCODE].rendered_value, "%.2s", scpu+6);
+		prop_printf(rf->arena, &props[RP_FID_CPU], "%.8s", scpu);
+		prop_printf(rf->arena, &props[RP_FID_CPUCODE], "%.2s", scpu+6);
 	} else {
 		DBG_PRINTF("error: no FID struct ? Cannot continue.\n");
-		free_properties(props);
 		return NULL;
 	}
 
+	assert(rf->plan);
+	const struct fid_plan *fp = rf->plan;
+
+	//the in-ROM ECUID scan is only worth it for its own column, or if the filename ECUID may be replaced
+	if ((need & PS_BIT(PS_ECUID_FB)) && ecuid_fallback_possible(rf->romdb, props)) {
+		need |= PS_BIT(PS_ECUID) | PS_BIT(PS_RAMF);
+	}
+
 	//"RAMF_off\RAMjump entry
-	u32 ramfpos = find_ramf(rf);
-
-	assert(rf->fidtype);
-	unsigned features = rf->fidtype->features;
-	if (features & ROM_HAS_ECUREC) {
-		//no RAMF for these
-	} else if (ramfpos == UINT32_MAX) {
-		DBG_PRINTF("find_ramf() failed !!\n");
-	} else {
-		utstring_printf(&props[RP_RAMF_WEIRD].rendered_value, "%+d", rf->ramf_offset);
-		utstring_printf(&props[RP_RAMJUMP].rendered_value, "0x%08X", rf->ramf.pRAMjump);
+	if (need & PS_BIT(PS_RAMF)) {
+		t0 = prof_start();
+		u32 ramfpos = find_ramf(rf);
+		prof_stop(PT_RAMF, t0);
+
+		if (fp->ramf == PLAN_ECUREC) {
+			//no RAMF for these
+		} else if (ramfpos == UINT32_MAX) {
+			DBG_PRINTF("find_ramf() failed !!\n");
+		} else {
+			prop_printf(rf->arena, &props[RP_RAMF_WEIRD], "%+d", rf->ramf_offset);
+			prop_printf(rf->arena, &props[RP_RAMJUMP], "0x%08X", rf->ramf.pRAMjump);
+		}
+	}
+
+	if ((need & PS_BIT(PS_ECUID)) && (find_ecuid(rf) != UINT32_MAX)) {
+		prop_printf(rf->arena, &props[RP_ROM_ECUID], "\"%s\"", rf->ecuid);
 	}
 
 	//IVT2\tIVT2 confidence\t"
-	if (features & ROM_HAS_IVT2) {
+	if ((need & PS_BIT(PS_IVT2)) && fp->ivt2) {
 		int ivt_conf = 0;
 		if (rf->p_ivt2 != UINT32_MAX) {
 			ivt_conf = 99;
 		} else {
 			u32 iter;
-			DBG_PRINTF("no IVT2 ?? wtf. Last resort, brute force technique:\n");
+			DBG_PRINTF("no IVT2 ?? wtf. Last resort, every IVT candidate:\n");
 			iter = 0x100;	//skip power-on IVT
 			bool ivtfound = 0;
 			while ((iter + 0x400) < rf->siz) {
-				u32 new_offs;
-				new_offs = find_ivt(rf->buf + iter, rf->siz - iter);
-				if (new_offs == UINT32_MAX) {
+				const struct anchor_hit *hit = anchors_next(rf->anch, ANCH_IVT, iter);
+				if (!hit) {
 					if (ivtfound) break;
 					DBG_PRINTF("\t no IVT2 found.\n");
 					break;
 				}
-				iter += new_offs;
+				iter = hit->pos;
 				ivt_conf = 50;
 				DBG_PRINTF("\tPossible IVT @ 0x%lX\n",(unsigned long) iter);
 				if (reconst_32(rf->buf + iter + 4) ==0xffff7ffc) {
@@ -862,98 +477,93 @@ static struct printable_prop *new_properties(struct romfile *rf) {
 				iter += 0x4;
 			}
 		}
-		utstring_printf(&props[RP_IVT2].rendered_value, "0x%lX", (unsigned long) rf->p_ivt2);
-		utstring_printf(&props[RP_IVT2_CONF].rendered_value, "%02d", ivt_conf);
+		prop_printf(rf->arena, &props[RP_IVT2], "0x%lX", (unsigned long) rf->p_ivt2);
+		prop_printf(rf->arena, &props[RP_IVT2_CONF], "%02d", ivt_conf);
 	}
 
-	if (features & ROM_HAS_STDCKS) {
-		if (!checksum_std(rf->buf, rf->siz, &rf->p_cks, &rf->p_ckx)) {
-			utstring_printf(&props[RP_STD_CKS].rendered_value, "1");
-			utstring_printf(&props[RP_STD_S_OFS].rendered_value, "0x%lX", (unsigned long) rf->p_cks);
-			utstring_printf(&props[RP_STD_X_OFS].rendered_value, "0x%lX", (unsigned long) rf->p_ckx);
+	if ((need & PS_BIT(PS_STDCKS)) && fp->stdcks) {
+		t0 = prof_start();
+		int stdrc = checksum_std(rf->buf, rf->siz, &rf->p_cks, &rf->p_ckx);
+		prof_stop(PT_STDCKS, t0);
+		prof_count(PC_BYTES_SCANNED, rf->siz);
+		if (!stdrc) {
+			prop_printf(rf->arena, &props[RP_STD_CKS], "1");
+			prop_printf(rf->arena, &props[RP_STD_S_OFS], "0x%lX", (unsigned long) rf->p_cks);
+			prop_printf(rf->arena, &props[RP_STD_X_OFS], "0x%lX", (unsigned long) rf->p_ckx);
 		} else {
-			utstring_printf(&props[RP_STD_CKS].rendered_value, "0");
+			prop_printf(rf->arena, &props[RP_STD_CKS], "0");
 		}
 	}
 
-	if (features & ROM_HAS_ALTCKS) {
+	if ((need & PS_BIT(PS_ALTCKS)) && fp->altcks) {
+		if (rf->p_acstart != UINT32_MAX) {
+			t0 = prof_start();
+			(void) validate_altcks(rf);
+			prof_stop(PT_ALTCKS, t0);
+		}
 		// expecting altcks : either good or bad
-		utstring_printf(&props[RP_ALT_CKS].rendered_value, "%d", (int) rf->cks_alt_good);
-		utstring_printf(&props[RP_ALT_S_OFS].rendered_value, "0x%lX", (unsigned long) rf->p_acs);
-		utstring_printf(&props[RP_ALT_X_OFS].rendered_value, "0x%lX", (unsigned long) rf->p_acx);
-		utstring_printf(&props[RP_ALT_START].rendered_value, "0x%lX", (unsigned long) rf->p_acstart);
-		utstring_printf(&props[RP_ALT_END].rendered_value, "0x%lX", (unsigned long) rf->p_acend);
+		prop_printf(rf->arena, &props[RP_ALT_CKS], "%d", (int) rf->cks_alt_good);
+		prop_printf(rf->arena, &props[RP_ALT_S_OFS], "0x%lX", (unsigned long) rf->p_acs);
+		prop_printf(rf->arena, &props[RP_ALT_X_OFS], "0x%lX", (unsigned long) rf->p_acx);
+		prop_printf(rf->arena, &props[RP_ALT_START], "0x%lX", (unsigned long) rf->p_acstart);
+		prop_printf(rf->arena, &props[RP_ALT_END], "0x%lX", (unsigned long) rf->p_acend);
 	}
 
-	if (features & ROM_HAS_ALT2CKS) {
+	if (fp->alt2cks) {
 		// expecting altcks : either good or bad
-		utstring_printf(&props[RP_ALT2_CKS].rendered_value, "%d", (int) rf->cks_alt2_good);
-		utstring_printf(&props[RP_ALT2_S_OFS].rendered_value, "0x%lX", (unsigned long) rf->p_a2cs);
-		utstring_printf(&props[RP_ALT2_X_OFS].rendered_value, "0x%lX", (unsigned long) rf->p_a2cx);
-		utstring_printf(&props[RP_ALT2_START].rendered_value, "0x%lX", (unsigned long) rf->p_ac2start);
-		utstring_printf(&props[RP_RIPEMD160].rendered_value, "%d", (int) rf->has_rm160);
+		if (need & PS_BIT(PS_ALT2CKS)) {
+			find_alt2cks(rf);
+			prop_printf(rf->arena, &props[RP_ALT2_CKS], "%d", (int) rf->cks_alt2_good);
+			prop_printf(rf->arena, &props[RP_ALT2_S_OFS], "0x%lX", (unsigned long) rf->p_a2cs);
+			prop_printf(rf->arena, &props[RP_ALT2_X_OFS], "0x%lX", (unsigned long) rf->p_a2cx);
+			prop_printf(rf->arena, &props[RP_ALT2_START], "0x%lX", (unsigned long) rf->p_ac2start);
+		}
+		if (need & PS_BIT(PS_RM160)) {
+			find_rm160(rf);
+			prop_printf(rf->arena, &props[RP_RIPEMD160], "%d", (int) rf->has_rm160);
+		}
+	}
+
+	if ((need & (PS_BIT(PS_KEYS) | PS_BIT(PS_EEP))) && romfile_index(rf)) {
+		return NULL;
 	}
 
 	//known / guessed keysets
-	enum key_quality keyq;
-	uint32_t s27k, s36k;
-	keyq = find_s27_hardcore(rf->romdb, rf->buf, rf->siz, &s27k, &s36k);
-	if (keyq > KEYQ_UNK) {
-		utstring_printf(&props[RP_KEYSET_QUAL].rendered_value, "%d", keyq);
-		utstring_printf(&props[RP_S27K].rendered_value, "0x%08lX", (unsigned long) s27k);
-		utstring_printf(&props[RP_S36K].rendered_value, "0x%08lX", (unsigned long) s36k);
-	} else {
-		// only bruteforce if code analysis failed, since it's much slower
-		const struct keyset_t *tmp_keyset;
-		tmp_keyset = find_keys_bruteforce(rf->romdb, rf->buf, rf->siz, &keyq, 0);
-		if (tmp_keyset && (keyq > KEYQ_UNK)) {
-			utstring_printf(&props[RP_KEYSET_QUAL].rendered_value, "%d", keyq);
-			utstring_printf(&props[RP_S27K].rendered_value, "0x%08lX",
-							(unsigned long) tmp_keyset->s27k);
-			utstring_printf(&props[RP_S36K].rendered_value, "0x%08lX",
-							(unsigned long) tmp_keyset->s36k1);
-		} else {
-			utstring_printf(&props[RP_KEYSET_QUAL].rendered_value, "0");
+	if (need & PS_BIT(PS_KEYS)) {
+		enum key_quality keyq;
+		uint32_t s27k, s36k;
+		keyq = keyfinder_run(rf->romdb, rf->shidx, rf->buf, rf->siz, &s27k, &s36k);
+		prop_printf(rf->arena, &props[RP_KEYSET_QUAL], "%d", keyq);
+		if (keyq > KEYQ_UNK) {
+			prop_printf(rf->arena, &props[RP_S27K], "0x%08lX", (unsigned long) s27k);
+			prop_printf(rf->arena, &props[RP_S36K], "0x%08lX", (unsigned long) s36k);
 		}
 	}
 
 	// EEPROM info
-	find_eep(rf);
-	if (rf->p_eepread) {
-		utstring_printf(&props[RP_EEP_READ_OFFS].rendered_value, "0x%lX",
-						(unsigned long) rf->p_eepread);
-		utstring_printf(&props[RP_EEP_PORT].rendered_value, "0x%08lX",
-						(unsigned long) rf->eep_port);
+	if (need & PS_BIT(PS_EEP)) {
+		t0 = prof_start();
+		find_eep(rf);
+		prof_stop(PT_EEP, t0);
+		if (rf->p_eepread) {
+			prop_printf(rf->arena, &props[RP_EEP_READ_OFFS], "0x%lX",
+							(unsigned long) rf->p_eepread);
+			prop_printf(rf->arena, &props[RP_EEP_PORT], "0x%08lX",
+							(unsigned long) rf->eep_port);
+		}
 	}
 
 	// MD5 digest of ROM
-	MD5_CTX md5c;
-	u8 md5_digest[MD5_DIGEST_LENGTH];
-	char md5_str[MD5_DIGEST_STRING_LENGTH];
-	MD5Init(&md5c);
-	MD5Update(&md5c, rf->buf, rf->siz);
-	MD5Final(md5_digest, &md5c);
-	render_md5(md5_digest, md5_str);
-	utstring_printf(&props[RP_MD5].rendered_value, "%s", md5_str);
-	DBG_PRINTF("MD5: %s\n", md5_str);
+	if (need & PS_BIT(PS_MD5)) {
+		char md5_str[MD5_DIGEST_STRING_LENGTH];
+		rom_md5(rf, md5_str);
+		prop_printf(rf->arena, &props[RP_MD5], "%s", md5_str);
+		DBG_PRINTF("MD5: %s\n", md5_str);
+	}
 
 	return props;
 }
 
-/** free array of properties and the value strings */
-static void free_properties(struct printable_prop *props) {
-	assert(props);
-	struct printable_prop *prop = props;
-
-	while (prop->csv_name != NULL) {
-		utstring_done(&prop->rendered_value);
-		prop++;
-	}
-	free(props);
-	return;
-}
-
-
 /** get length of the path prefix of a given filename
  *
  * i.e. strips the filename and keeps the absolute or relative path, including
@@ -991,35 +601,426 @@ static void generate_csv_path(UT_string *dest, const char *csv_filename, const c
 }
 
 
+/** add the MD5 of every store image matching key (see nisstore_find()), or of all images if key is NULL
+ * ret 1 if ok
+ */
+static bool filelist_addstore(struct filelist *fl, const struct nisstore *st, const char *key) {
+	int idx;
+
+	if (!key) {
+		for (idx = 0; idx < (int) nisstore_count(st); idx++) {
+			if (!filelist_add(fl, nisstore_get(st, (unsigned) idx)->md5)) return 0;
+		}
+		return 1;
+	}
+	idx = nisstore_find(st, key, -1);
+	if (idx < 0) {
+		ERR_PRINTF("no image matching %s in store\n", key);
+		return 1;
+	}
+	for (; idx >= 0; idx = nisstore_find(st, key, idx)) {
+		if (!filelist_add(fl, nisstore_get(st, (unsigned) idx)->md5)) return 0;
+	}
+	return 1;
+}
+
+
+/** options common to all ROMs of a run */
+struct analysis_opts {
+	bool human;	//human-readable output, overrides csv_vals
+	bool csv_vals;
+	bool force_parse;
+	struct romcache *cache;	//optional; shared by all threads
+	const struct colsel *cols;	//columns to print
+	unsigned need;	//PS_BIT() mask of stages required by cols
+	bool partial;	//not all stages are run : don't cache, skip extra debug scans
+	const struct nisstore *store;	//if set, "filenames" are keys of images in this store
+	bool dat;	//inputs are .dat repro files
+	u32 scode;	//.dat decryption key; 0 : get from romdb by ECUID
+};
+
+
+/** number of cached values per ROM */
+static unsigned cached_prop_count(void) {
+	unsigned rp, n = 0;
+	for (rp = 0; rp < RP_MAX; rp++) {
+		if (!prop_from_filename(rp)) n++;
+	}
+	return n;
+}
+
+/** cache value index => property index */
+static unsigned cached_prop_idx(unsigned idx) {
+	unsigned rp;
+	for (rp = 0; rp < RP_MAX; rp++) {
+		if (prop_from_filename(rp)) continue;
+		if (!idx) break;
+		idx--;
+	}
+	assert(rp < RP_MAX);
+	return rp;
+}
+
+struct cache_copy {
+	struct printable_prop *props;
+	struct arena *arena;
+};
+
+static void cache_copy_cb(unsigned idx, const char *val, void *data) {
+	struct cache_copy *cc = data;
+	prop_printf(cc->arena, &cc->props[cached_prop_idx(idx)], "%s", val);
+}
+
+/** look up ROM in cache.
+ *
+ * @param props : set to a new array of properties if found and not failed
+ */
+static enum romcache_res props_from_cache(struct romcache *cache, const struct romfile *rf,
+				const char *md5_str, struct printable_prop **props) {
+	struct printable_prop *cprops;
+	enum romcache_res res;
+
+	*props = NULL;
+	cprops = alloc_properties(rf);
+	if (!cprops) return ROMCACHE_MISS;
+
+	struct cache_copy cc = {.props = cprops, .arena = rf->arena};
+	res = romcache_get(cache, md5_str, cache_copy_cb, &cc);
+	if (res == ROMCACHE_OK) {
+		*props = cprops;
+	}
+	return res;
+}
+
+/** save analysis results; props == NULL for a failed analysis */
+static void props_to_cache(struct romcache *cache, const char *md5_str, const struct printable_prop *props) {
+	const char *vals[RP_MAX];
+	unsigned rp, n = 0;
+
+	if (!props) {
+		romcache_put(cache, md5_str, 1, NULL);
+		return;
+	}
+	for (rp = 0; rp < RP_MAX; rp++) {
+		if (prop_from_filename(rp)) continue;
+		vals[n++] = prop_val(&props[rp]);
+	}
+	if (!romcache_put(cache, md5_str, 0, vals)) {
+		DBG_PRINTF("could not cache results\n");
+	}
+}
+
+/** fill RP_ECUID from the ROM contents if the filename has none, or has one that romdb doesn't know
+ * while the one in the ROM is known (misnamed file).
+ */
+static void ecuid_fallback(nis_romdb *romdb, struct printable_prop *props) {
+	const char *fromrom = props[RP_ROM_ECUID].rendered_value;
+	const char *fromname = props[RP_ECUID].rendered_value;
+
+	if (!fromrom) return;
+	if (fromname) {
+		if (!strcmp(fromname, fromrom)) return;
+		//values are quoted : skip the '"'
+		if (!romdb || ecuid_in_romdb(romdb, fromname + 1) || !ecuid_in_romdb(romdb, fromrom + 1)) {
+			DBG_PRINTF("filename ECUID %s, ROM has %s\n", fromname, fromrom);
+			return;
+		}
+		DBG_PRINTF("filename ECUID %s unknown, using %s from ROM\n", fromname, fromrom);
+	}
+	props[RP_ECUID].rendered_value = fromrom;
+}
+
+/* per-ROM profiling record (-P) */
+struct rom_prof {
+	struct prof_stats ps;
+	char fid_cpu[16];	//"FID CPU" property, empty if unknown
+	bool cached;
+};
+
+/** analyze one ROM and print its properties to fout.
+ *
+ * @param romdb already loaded, is shared by all ROMs
+ * @param rp : optional, filled with some ROM info for the profiling record
+ * ret 0 if ok
+ */
+static int analyze_rom(nis_romdb *romdb, const char *filename, const struct analysis_opts *opts, FILE *fout,
+			struct rom_prof *rp) {
+	struct romfile rf = {0};
+
+	rf.romdb = romdb;
+	rf.force_parse = opts->force_parse;
+	rf.arena = arena_thread();	//reset by close_rom()
+
+	if (opts->store) {
+		int sidx = nisstore_find(opts->store, filename, -1);
+		if ((sidx < 0) || nisstore_map(opts->store, (unsigned) sidx, &rf.img) ||
+			romfile_attach(&rf, nisstore_get(opts->store, (unsigned) sidx)->name)) {
+			ERR_PRINTF("Trouble loading %s from store\n", filename);
+			return -1;
+		}
+	} else if (opts->dat) {
+		if (open_rom_dat(&rf, filename, opts->scode)) {
+			ERR_PRINTF("Trouble unpacking %s\n", filename);
+			return -1;
+		}
+	} else if (open_rom(&rf, filename)) {
+		ERR_PRINTF("Trouble in open_rom(%s)\n", filename);
+		return -1;
+	}
+
+	/* add header to dbg log */
+	DBG_PRINTF("\n********************\n**** Started analyzing %s\n", filename);
+
+	struct printable_prop *props = NULL;
+	char md5_str[MD5_DIGEST_STRING_LENGTH];
+	struct romcache *cache = opts->force_parse ? NULL : opts->cache;
+	enum romcache_res cres = ROMCACHE_MISS;
+	uint64_t t0;
+
+	if (cache) {
+		rom_md5(&rf, md5_str);
+		cres = props_from_cache(cache, &rf, md5_str, &props);
+	}
+
+	switch (cres) {
+	case ROMCACHE_FAILED:
+		DBG_PRINTF("cached : analysis failed (MD5 %s)\n", md5_str);
+		ERR_PRINTF("Could not analyze %s (cached)\n", filename);
+		close_rom(&rf);
+		return -1;
+	case ROMCACHE_OK:
+		DBG_PRINTF("cached results (MD5 %s)\n", md5_str);
+		break;
+	case ROMCACHE_MISS:
+		props = new_properties(&rf, opts->need);
+		//incomplete results must not end up in the cache
+		if (cache && !opts->partial) props_to_cache(cache, md5_str, props);
+		break;
+	}
+
+	if (!props) {
+		ERR_PRINTF("Could not analyze %s\n", filename);
+		close_rom(&rf);
+		return -1;
+	}
+
+	ecuid_fallback(romdb, props);
+
+	if (opts->human) {
+		print_human(fout, props, opts->cols);
+	} else if (opts->csv_vals) {
+		print_csv_values(fout, props, opts->cols);
+	}
+	if (rp) {
+		rp->cached = (cres == ROMCACHE_OK);
+		snprintf(rp->fid_cpu, sizeof(rp->fid_cpu), "%s", prop_val(&props[RP_FID_CPU]));
+	}
+
+	if ((cres == ROMCACHE_OK) || opts->partial) {
+		close_rom(&rf);
+		return 0;
+	}
+
+	//test : find calltable
+	unsigned ctlen = 0;
+	uint32_t ctpos = 0;
+	t0 = prof_start();
+	while (1) {
+		u32 ctstart = ctpos + ctlen * 4;
+		ctpos = find_calltable(rf.buf, ctstart, rf.siz, &ctlen);
+		if (ctpos == (u32) -1) {
+			prof_count(PC_BYTES_SCANNED, rf.siz - ctstart);
+			break;
+		}
+		prof_count(PC_BYTES_SCANNED, ctpos + ctlen * 4 - ctstart);
+		DBG_PRINTF("possible calltable @ %lX, len=0x%X\n", (unsigned long) ctpos, ctlen);
+	}
+	prof_stop(PT_CALLTABLE, t0);
+
+	close_rom(&rf);
+	return 0;
+}
+
+/** analyze_rom(), and if fprof is set, append a JSON line with the ROM's timers and counters */
+static int analyze_rom_prof(nis_romdb *romdb, const char *filename, const struct analysis_opts *opts, FILE *fout,
+			FILE *fprof) {
+	struct rom_prof rp = {0};
+
+	if (!fprof) return analyze_rom(romdb, filename, opts, fout, NULL);
+
+	prof_cur = &rp.ps;
+	uint64_t t0 = prof_now();
+	int rc = analyze_rom(romdb, filename, opts, fout, &rp);
+	uint64_t total = prof_now() - t0;
+	prof_cur = NULL;
+
+	fprintf(fprof, "{\"file\":");
+	prof_json_str(fprof, filename);
+	fprintf(fprof, ",\"rc\":%d,\"cached\":%s,\"fid_cpu\":", rc, rp.cached ? "true" : "false");
+	prof_json_str(fprof, rp.fid_cpu);
+	fprintf(fprof, ",\"total_ns\":%llu,", (unsigned long long) total);
+	prof_json_stats(fprof, &rp.ps);
+	fprintf(fprof, "}\n");
+	return rc;
+}
+
+
+/********** multi-threaded batch analysis
+ * Each worker renders its output row and debug log to memory buffers;
+ * these are written out in input order by the main thread.
+ */
+
+struct batch_ctx {
+	nis_romdb *romdb;
+	const struct filelist *files;
+	const struct analysis_opts *opts;
+	FILE *dbg_out;	//real debug log, only written by the emitter
+	FILE *prof_out;	//optional profiling records, only written by the emitter
+	unsigned failed;
+};
+
+struct batch_result {
+	int rc;
+	char *out;	//rendered row(s)
+	size_t outlen;
+	char *log;	//debug output
+	size_t loglen;
+	char *prof;	//profiling record
+	size_t proflen;
+};
+
+static void *batch_work(unsigned jobidx, void *ctx) {
+	struct batch_ctx *bc = ctx;
+	struct batch_result *res;
+	FILE *fout;
+	FILE *fprof = NULL;
+	FILE *prev_dbg = dbg_stream;	//not NULL if run by the caller of pool_run()
+
+	res = calloc(1, sizeof(*res));
+	if (!res) return NULL;
+	res->rc = -1;
+
+	fout = open_memstream(&res->out, &res->outlen);
+	dbg_stream = open_memstream(&res->log, &res->loglen);
+	if (bc->prof_out) fprof = open_memstream(&res->prof, &res->proflen);
+	if (fout && dbg_stream && (fprof || !bc->prof_out)) {
+		res->rc = analyze_rom_prof(bc->romdb, bc->files->names[jobidx], bc->opts, fout, fprof);
+	}
+	if (fprof) fclose(fprof);
+	if (fout) fclose(fout);
+	trace_flush();
+	if (dbg_stream) fclose(dbg_stream);
+	dbg_stream = prev_dbg;
+	return res;
+}
+
+static void batch_emit(unsigned jobidx, void *result, void *ctx) {
+	struct batch_ctx *bc = ctx;
+	struct batch_result *res = result;
+	(void) jobidx;
+
+	if (!res) {
+		bc->failed++;
+		return;
+	}
+	if (res->rc) bc->failed++;
+	if (res->log) {
+		trace_flush();	//this thread's own messages go first
+		fwrite(res->log, 1, res->loglen, bc->dbg_out);
+		free(res->log);
+	}
+	if (res->out) {
+		fwrite(res->out, 1, res->outlen, stdout);
+		free(res->out);
+	}
+	if (res->prof) {
+		fwrite(res->prof, 1, res->proflen, bc->prof_out);
+		free(res->prof);
+	}
+	free(res);
+}
+
+
+/** open analysis cache. Its tag identifies the analyzer version and keyset db contents */
+static struct romcache *open_cache(const char *fname, const char *db_fname) {
+	struct rom_image img = {0};
+	char md5_str[MD5_DIGEST_STRING_LENGTH];
+	char tag[64];
+	MD5_CTX md5c;
+	u8 md5_digest[MD5_DIGEST_LENGTH];
+
+	if (romimg_open(&img, db_fname, 0)) {
+		return NULL;
+	}
+	MD5Init(&md5c);
+	MD5Update(&md5c, img.buf, img.siz);
+	MD5Final(md5_digest, &md5c);
+	romimg_close(&img);
+	render_md5(md5_digest, md5_str);
+
+	snprintf(tag, sizeof(tag), "v%d db=%s", NISROM_CACHE_VERS, md5_str);
+	return romcache_open(fname, tag, cached_prop_count());
+}
+
+
 static void usage(void) {
 	printf(	"**** %s\n"
 			"**** Analyze Nissan ROM\n"
 			"**** (c) 2015-2022 fenugrec\n", progname);
-	printf("Usage:\t%s <ROMFILE> [OPTIONS] : analyze ROM dump.\n"
+	printf("Usage:\t%s <ROMFILE> [ROMFILE...] [OPTIONS] : analyze ROM dump(s).\n"
+			"\tEach ROMFILE can also be a directory (scanned recursively),\n"
+			"\tor \"-\" to read a list of filenames from stdin, one per line.\n"
 			"OPTIONS:\n"
 			"\t-c: CSV output\n"
+			"\t-C <file>: cache results in <file> (e.g. ../romdb/nisrom_cache.txt), keyed by ROM MD5.\n"
+			"\t\tUnchanged ROMs are not re-analyzed. Not used with -f\n"
+			"\t-d: ROMFILEs are .dat repro files : unpack, decrypt and analyze them in memory.\n"
+			"\t\tThe key comes from the romdb by ECUID (a compiled db with ECUIDs helps), or -k\n"
+			"\t-D <file>: use compiled romdb (see nisromdb) instead of " KEYSET_CSV "\n"
 			"\t-h: show this help\n"
+			"\t-j <n>: analyze <n> ROMs in parallel (0 = one per CPU). Output order is unchanged\n"
+			"\t-k <scode>: with -d, decrypt with this key (hex)\n"
 			"\t-l: CSV headers (can be combined with -c)\n"
+			"\t-P <file>: write per-ROM stage timings and counters to <file>, one JSON object per line\n"
+			"\t-S <store>: analyze images from a nisstore archive instead of files. ROMFILE args are then\n"
+			"\t\tMD5s, ECUIDs or original filenames; all images if none are given\n"
+			"\t-s <cols>: only compute and show these columns (CSV header names, comma-separated),\n"
+			"\t\te.g. -s \"file,ECUID,FID\". Analysis stages not needed for these are skipped.\n"
+			"\t\t\"ROM ECUID\" (ECUID found in the ROM contents) is only shown if selected\n"
 			"\t-v: human-readable output (default)\n"
-			"\t-f: force parsing, ignoring errors (may cause crashes, do not use)\n", progname);
+			"\t-f: force parsing, ignoring errors (may cause crashes, do not use)\n"
+			"Debug output goes to " DBG_OUTFILE "; set " TRACE_ENV "=<category>=<level>,... for more or less of it,\n"
+			"\te.g. " TRACE_ENV "=keyfind=debug,cks=warn. Categories gen, tracker, keyfind, cks, romdb, all\n", progname);
 	return;
 }
 
 int main(int argc, char *argv[])
 {
 	bool	dbg_file;	//flag if dbgstream is a real file
-	struct romfile rf = {0};
+	nis_romdb *romdb = NULL;
+	struct filelist files = {0};
+	struct analysis_opts opts = {0};
+	unsigned failed = 0;
+	unsigned njobs = 1;
+	const char *cache_fname = NULL;
+	const char *db_fname = NULL;	//compiled romdb
+	const char *prof_fname = NULL;
+	FILE *prof_out = NULL;
+	const char *store_fname = NULL;
+	struct nisstore *store = NULL;
+	const char *sel_list = NULL;
+	struct colsel cols;
 
 	bool enable_csv_header = 0;
 	bool enable_csv_vals = 0;
 	bool enable_human = 0;	//this overrides the previous print_csv_* flags
 
-	const char *filename=NULL;
-
 	char c;
 	int optidx;
 
-	while((c = getopt(argc, argv, "cfhlv")) != -1) {
+	if (!trace_config(getenv(TRACE_ENV))) return -1;
+
+	while((c = getopt(argc, argv, "cC:dD:fhj:k:lP:s:S:v")) != -1) {
 		switch(c) {
 		case 'h':
 			usage();
@@ -1027,12 +1028,40 @@ int main(int argc, char *argv[])
 		case 'c':
 			enable_csv_vals = 1;
 			break;
+		case 'C':
+			cache_fname = optarg;
+			break;
+		case 'd':
+			opts.dat = 1;
+			break;
+		case 'D':
+			db_fname = optarg;
+			break;
 		case 'f':
-			force_parse = 1;
+			opts.force_parse = 1;
+			break;
+		case 'j':
+			njobs = (unsigned) strtoul(optarg, NULL, 0);
+			if (!njobs) njobs = pool_ncpus();
+			break;
+		case 'k':
+			if (sscanf(optarg, "%x", &opts.scode) != 1) {
+				ERR_PRINTF("did not understand %s\n", optarg);
+				return -1;
+			}
 			break;
 		case 'l':
 			enable_csv_header = 1;
 			break;
+		case 'P':
+			prof_fname = optarg;
+			break;
+		case 's':
+			sel_list = optarg;
+			break;
+		case 'S':
+			store_fname = optarg;
+			break;
 		case 'v':
 			enable_human = 1;
 			break;
@@ -1046,31 +1075,55 @@ int main(int argc, char *argv[])
 	if (!enable_csv_vals && !enable_csv_header) {
 		enable_human = 1;
 	}
+	opts.human = enable_human;
+	opts.csv_vals = enable_csv_vals;
+
+	if (!sel_list) {
+		colsel_default(&cols);
+		//still run everything : cached results must have the opt-in columns too
+		opts.need = PS_ALL;
+	} else if (colsel_parse(&cols, sel_list)) {
+		return -1;
+	} else {
+		opts.need = colsel_stages(&cols);
+	}
+	opts.cols = &cols;
+	opts.partial = (opts.need != PS_ALL);
 
-		//second loop for non-option args
-	for (optidx = optind; optidx < argc; optidx++) {
-		if (!filename) {
-			filename = argv[optidx];
-			continue;
+	if (store_fname) {
+		store = nisstore_open(store_fname, 0);
+		if (!store) {
+			ERR_PRINTF("trouble opening store %s\n", store_fname);
+			return -1;
+		}
+		opts.store = store;
+		if ((optind == argc) && !filelist_addstore(&files, store, NULL)) {
+			ERR_PRINTF("trouble building file list\n");
+			nisstore_close(store);
+			return -1;
 		}
-		ERR_PRINTF("junk argument\n");
-		return -1;
 	}
 
-	dbg_file = 1;
-	dbg_stream = fopen(DBG_OUTFILE, "a");
-	if (!dbg_stream) {
-		dbg_file = 0;
-		dbg_stream = stdout;
+		//second loop for non-option args
+	for (optidx = optind; optidx < argc; optidx++) {
+		bool ok = store ? filelist_addstore(&files, store, argv[optidx]) :
+					filelist_addarg(&files, argv[optidx]);
+		if (!ok) {
+			ERR_PRINTF("trouble building file list\n");
+			filelist_free(&files);
+			nisstore_close(store);
+			return -1;
+		}
 	}
 
 	/* print headers if possible, regardless of missing args */
 	if (!enable_human && enable_csv_header) {
-		print_csv_header(props_template);
+		print_csv_header(stdout, props_template, &cols);
 	}
 
 	// only scenario where filename is not required is if we're just printing csv headers
-	if (!filename) {
+	if (!files.num) {
+		nisstore_close(store);
 		if (enable_csv_header) {
 			return 0;
 		}
@@ -1078,66 +1131,104 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	rf.romdb = romdb_new();
-	if (!rf.romdb) {
+	dbg_file = 1;
+	dbg_stream = fopen(DBG_OUTFILE, "a");
+	if (!dbg_stream) {
+		dbg_file = 0;
+		dbg_stream = stdout;
+	}
+
+	romdb = romdb_new();
+	if (!romdb) {
 		ERR_PRINTF("trouble in romdb_new\n");
 		goto badexit;
 	}
 
 	UT_string csvpath;
 	utstring_init(&csvpath);
-	generate_csv_path(&csvpath, KEYSET_CSV, argv[0]);
-
-	if (!romdb_keyset_addcsv(rf.romdb, utstring_body(&csvpath))) {
-		ERR_PRINTF("csv trouble\n");
-		goto badexit;
+	if (db_fname) {
+		utstring_printf(&csvpath, "%s", db_fname);
+		if (!romdb_load_compiled(romdb, db_fname)) {
+			ERR_PRINTF("trouble loading %s\n", db_fname);
+			utstring_done(&csvpath);
+			goto badexit;
+		}
+	} else {
+		generate_csv_path(&csvpath, KEYSET_CSV, argv[0]);
+		if (!romdb_keyset_addcsv(romdb, utstring_body(&csvpath))) {
+			ERR_PRINTF("csv trouble\n");
+			utstring_done(&csvpath);
+			goto badexit;
+		}
 	}
 
-	if (open_rom(&rf, filename)) {
-		ERR_PRINTF("Trouble in open_rom()\n");
-		goto badexit;
+	if (cache_fname) {
+		opts.cache = open_cache(cache_fname, utstring_body(&csvpath));
+		if (!opts.cache) {
+			ERR_PRINTF("trouble with cache %s\n", cache_fname);
+			utstring_done(&csvpath);
+			goto badexit;
+		}
 	}
+	utstring_done(&csvpath);
 
-	/* add header to dbg log */
-	DBG_PRINTF("\n********************\n**** Started analyzing %s\n", filename);
-
-	struct printable_prop *props = new_properties(&rf);
-	if (!props) {
-		goto badexit;
+	if (prof_fname) {
+		prof_out = fopen(prof_fname, "w");
+		if (!prof_out) {
+			ERR_PRINTF("can't open %s\n", prof_fname);
+			goto badexit;
+		}
 	}
 
-	if (enable_human) {
-		print_human(props);
+	if ((njobs > 1) && (files.num > 1)) {
+		struct batch_ctx bc = {
+			.romdb = romdb,
+			.files = &files,
+			.opts = &opts,
+			.dbg_out = dbg_stream,
+			.prof_out = prof_out,
+		};
+		if (pool_run(files.num, njobs, batch_work, batch_emit, &bc)) {
+			ERR_PRINTF("trouble in pool_run\n");
+			goto badexit;
+		}
+		failed = bc.failed;
 	} else {
-		/* print values */
-		if (enable_csv_vals) {
-			print_csv_values(props);
+		unsigned idx;
+		for (idx = 0; idx < files.num; idx++) {
+			if (analyze_rom_prof(romdb, files.names[idx], &opts, stdout, prof_out)) {
+				failed++;
+			}
 		}
 	}
 
-	free_properties(props);
-
-	//test : find calltable
-	unsigned ctlen = 0;
-	uint32_t ctpos = 0;
-	while (1) {
-		ctpos = find_calltable(rf.buf, ctpos + ctlen * 4, rf.siz, &ctlen);
-		if (ctpos == (u32) -1) break;
-		DBG_PRINTF("possible calltable @ %lX, len=0x%X\n", (unsigned long) ctpos, ctlen);
+	if (failed && (files.num > 1)) {
+		ERR_PRINTF("%u / %u files could not be analyzed\n", failed, files.num);
 	}
 
-	romdb_close(rf.romdb);
-	rf.romdb = NULL;
-	close_rom(&rf);
+	if (opts.cache) {
+		if (!romcache_save(opts.cache)) {
+			ERR_PRINTF("could not save cache %s\n", cache_fname);
+		}
+		romcache_close(opts.cache);
+	}
+	if (prof_out) fclose(prof_out);
+	romdb_close(romdb);
+	nisstore_close(store);
+	filelist_free(&files);
+	trace_flush();
 	if (dbg_file) fclose(dbg_stream);
-	return 0;
+	return failed ? -1 : 0;
 
 badexit:
-	if (rf.romdb) {
-		romdb_close(rf.romdb);
-		rf.romdb = NULL;
+	if (prof_out) fclose(prof_out);
+	romcache_close(opts.cache);
+	if (romdb) {
+		romdb_close(romdb);
 	}
-	close_rom(&rf);
+	nisstore_close(store);
+	filelist_free(&files);
+	trace_flush();
 	if (dbg_file) fclose(dbg_stream);
 	return -1;
 }
@@ -0,0 +1,419 @@
+/* one-pass anchor scan for nisrom
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * The string anchors go through an Aho-Corasick automaton, compiled once into a full
+ * transition table; the u32 values and IVT candidates are tested at each aligned position
+ * of the same pass. Most of a ROM can't start any anchor, so blocks are first tested
+ * for the few possible string prefixes and u32 values (16 bytes at a time with SSE2,
+ * else one u32 at a time) and the automaton only runs near candidates.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_arena.h"
+#include "nisrom_anchors.h"
+#include "nisrom_finders.h"
+#include "nissan_romdefs.h"
+#include "stypes.h"
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#define AC_MAXSTATES 256
+#define AC_MAXPATS (FID_MAX + 2)
+#define MAX_U32VALS (FID_MAX + 2)
+#define ANCH_LISTS (ANCH_U32 + MAX_U32VALS)	//the ANCH_U32 lists are per value
+#define MAX_FIRSTBYTES 4	//above this, the automaton runs on every byte
+#define MAX_PREFIXES 4	//2-byte string prefixes for the SSE2 prefilter; above this, no prefilter
+
+struct ac_pat {
+	const u8 *str;
+	unsigned len;
+	enum anchor_kind kind;
+	u32 val;
+};
+
+/* automaton and value table, built once by anchors_init() then read-only */
+static pthread_once_t anchors_once = PTHREAD_ONCE_INIT;
+static u16 ac_next[AC_MAXSTATES][256];
+static int ac_out[AC_MAXSTATES];	//index in ac_pats of the pattern ending here, -1 if none
+static u16 ac_dict[AC_MAXSTATES];	//next state in the fail chain with an ac_out; 0 if none
+static bool ac_hasout[AC_MAXSTATES];	//ac_out or ac_dict
+static unsigned ac_nstates;
+static struct ac_pat ac_pats[AC_MAXPATS];
+static unsigned ac_npats;
+
+static u32 first_bytes[MAX_FIRSTBYTES];	//possible first bytes of the string anchors, x4
+static unsigned nfirst;	//UINT_MAX if too many
+static u8 prefixes[MAX_PREFIXES][2];	//possible first 2 bytes of the string anchors
+static unsigned nprefix;	//UINT_MAX if too many
+
+static u32 u32vals[MAX_U32VALS];
+static u32 u32vals_mem[MAX_U32VALS];	//same, in host memory order
+static unsigned nu32vals;
+static bool u32_msb[256];	//possible MSBs of u32vals[]
+
+struct hitlist {
+	struct anchor_hit *hits;
+	u32 num;
+	u32 alloc;
+};
+
+struct rom_anchors {
+	struct arena *arena;	//if set, hit lists are in there
+	struct hitlist list[ANCH_LISTS];
+	bool failed;	//alloc failure during scan
+};
+
+
+/** add pattern to the trie. The first one wins if there are duplicates */
+static void ac_add(const u8 *str, unsigned len, enum anchor_kind kind, u32 val) {
+	unsigned st = 0;
+	unsigned idx;
+
+	assert(ac_npats < AC_MAXPATS);
+	for (idx = 0; idx < len; idx++) {
+		u16 nst = ac_next[st][str[idx]];
+		if (!nst) {
+			assert(ac_nstates < AC_MAXSTATES);
+			nst = ac_nstates++;
+			ac_out[nst] = -1;
+			ac_next[st][str[idx]] = nst;
+		}
+		st = nst;
+	}
+	if (ac_out[st] >= 0) return;
+
+	ac_pats[ac_npats] = (struct ac_pat) {.str = str, .len = len, .kind = kind, .val = val};
+	ac_out[st] = (int) ac_npats++;
+}
+
+/** compute fail links in BFS order and turn the trie into a full transition table */
+static void ac_compile(void) {
+	u16 queue[AC_MAXSTATES];
+	u16 fail[AC_MAXSTATES] = {0};
+	unsigned qhead = 0, qtail = 0;
+	unsigned c;
+
+	for (c = 0; c < 256; c++) {
+		u16 child = ac_next[0][c];
+		if (child) queue[qtail++] = child;	//fail = root
+	}
+	while (qhead < qtail) {
+		u16 st = queue[qhead++];
+		for (c = 0; c < 256; c++) {
+			u16 child = ac_next[st][c];
+			if (!child) {
+				ac_next[st][c] = ac_next[fail[st]][c];
+				continue;
+			}
+			u16 fst = ac_next[fail[st]][c];
+			fail[child] = fst;
+			ac_dict[child] = (ac_out[fst] >= 0) ? fst : ac_dict[fst];
+			queue[qtail++] = child;
+		}
+	}
+	for (c = 0; c < ac_nstates; c++) {
+		ac_hasout[c] = (ac_out[c] >= 0) || ac_dict[c];
+	}
+}
+
+/** fill first_bytes[] from the root transitions; call before ac_compile() */
+static void ac_firstbytes(void) {
+	unsigned c;
+
+	nfirst = 0;
+	for (c = 0; c < 256; c++) {
+		if (!ac_next[0][c]) continue;
+		if (nfirst == MAX_FIRSTBYTES) {
+			nfirst = UINT_MAX;
+			return;
+		}
+		first_bytes[nfirst++] = c * 0x01010101U;
+	}
+}
+
+/** fill prefixes[] from the trie; call before ac_compile() */
+static void ac_prefixes(void) {
+	unsigned c0, c1;
+
+	nprefix = 0;
+	for (c0 = 0; c0 < 256; c0++) {
+		u16 st = ac_next[0][c0];
+		if (!st) continue;
+		if (ac_out[st] >= 0) {
+			//1-byte pattern
+			nprefix = UINT_MAX;
+			return;
+		}
+		for (c1 = 0; c1 < 256; c1++) {
+			if (!ac_next[st][c1]) continue;
+			if (nprefix == MAX_PREFIXES) {
+				nprefix = UINT_MAX;
+				return;
+			}
+			prefixes[nprefix][0] = c0;
+			prefixes[nprefix][1] = c1;
+			nprefix++;
+		}
+	}
+}
+
+/** @return 1 if any byte of w (in any order) can start a string anchor */
+static inline bool has_firstbyte(u32 w) {
+	unsigned idx;
+
+	if (nfirst == UINT_MAX) return 1;
+	for (idx = 0; idx < nfirst; idx++) {
+		u32 v = w ^ first_bytes[idx];
+		//nonzero iff v has a 0 byte
+		if ((v - 0x01010101U) & ~v & 0x80808080U) return 1;
+	}
+	return 0;
+}
+
+static void add_u32val(u32 val) {
+	unsigned idx;
+	for (idx = 0; idx < nu32vals; idx++) {
+		if (u32vals[idx] == val) return;
+	}
+	assert(nu32vals < MAX_U32VALS);
+	u8 vbytes[4];
+	write_32b(val, vbytes);
+	memcpy(&u32vals_mem[nu32vals], vbytes, 4);
+	u32vals[nu32vals++] = val;
+	u32_msb[val >> 24] = 1;
+}
+
+static void anchors_init(void) {
+	static const u8 loadstr[] = "LOADER";
+	static const u8 dbstr[] = "DATAB";
+	unsigned fti;
+
+	ac_nstates = 1;
+	ac_out[0] = -1;
+	ac_add(loadstr, 6, ANCH_LOADER, 0);
+	ac_add(dbstr, 5, ANCH_DATABASE, 0);
+	for (fti = FID_UNK + 1; fti < FID_MAX; fti++) {
+		ac_add(fidtypes[fti].FIDIC, FIDTYPE_LEN, ANCH_FIDIC, fti);
+		if (fidtypes[fti].features & ROM_HAS_ECUREC) {
+			add_u32val(fidtypes[fti].IVT2_expected);
+		}
+	}
+	ac_firstbytes();
+	ac_prefixes();
+	ac_compile();
+
+	add_u32val(RM160_INIT0);
+	add_u32val(RM160_INIT1);
+}
+
+
+static void add_hit(struct rom_anchors *ra, unsigned list, u32 pos, u32 val) {
+	struct hitlist *hl = &ra->list[list];
+
+	if (hl->num == hl->alloc) {
+		u32 nalloc = hl->alloc ? (hl->alloc * 2) : 16;
+		struct anchor_hit *nh = ra->arena ?
+			arena_grow(ra->arena, hl->hits, hl->alloc * sizeof(*nh), nalloc * sizeof(*nh)) :
+			realloc(hl->hits, nalloc * sizeof(*nh));
+		if (!nh) {
+			ra->failed = 1;
+			return;
+		}
+		hl->hits = nh;
+		hl->alloc = nalloc;
+	}
+	hl->hits[hl->num++] = (struct anchor_hit) {.pos = pos, .val = val};
+}
+
+/** record every pattern ending at buf[end] */
+static void emit_strings(struct rom_anchors *ra, unsigned st, u32 end, u32 siz) {
+	if (ac_out[st] < 0) st = ac_dict[st];
+	for (; st; st = ac_dict[st]) {
+		const struct ac_pat *pat = &ac_pats[ac_out[st]];
+		u32 pos = end + 1 - pat->len;
+		//same bounds as u8memstr
+		if ((pos + pat->len) >= siz) continue;
+		add_hit(ra, pat->kind, pos, pat->val);
+	}
+}
+
+/** aligned tests at buf[pos]; needs 4 bytes */
+static inline void scan_aligned(struct rom_anchors *ra, const u8 *buf, u32 siz, u32 pos) {
+	if (u32_msb[buf[pos]]) {
+		u32 word = reconst_32(&buf[pos]);
+		unsigned idx;
+
+		for (idx = 0; idx < nu32vals; idx++) {
+			if (word == u32vals[idx]) add_hit(ra, ANCH_U32 + idx, pos, word);
+		}
+	}
+	//any IVT needs PC < 0x01000000 and SP >= 0xFFF80000 : check the MSBs before the real test
+	if ((buf[pos] == 0) && ((siz - pos) >= IVT_MINSIZE) && (buf[pos + 4] == 0xFF) &&
+		check_ivt(&buf[pos], siz - pos)) {
+		add_hit(ra, ANCH_IVT, pos, 0);
+	}
+}
+
+/** scan nwords u32s starting at aligned pos
+ * @return automaton state after the last byte
+ */
+static unsigned scan_words(struct rom_anchors *ra, const u8 *buf, u32 siz, u32 pos, u32 nwords, unsigned st) {
+	for (; nwords; nwords--, pos += 4) {
+		u32 word;
+		unsigned idx;
+
+		scan_aligned(ra, buf, siz, pos);
+
+		memcpy(&word, &buf[pos], 4);
+		if (!st && !has_firstbyte(word)) continue;
+		for (idx = 0; idx < 4; idx++) {
+			st = ac_next[st][buf[pos + idx]];
+			if (ac_hasout[st]) emit_strings(ra, st, pos + idx, siz);
+		}
+	}
+	return st;
+}
+
+#ifdef __SSE2__
+/* prefilter constants, copied to the stack by anchors_scan() so they stay in registers */
+struct block_filter {
+	__m128i pre0[MAX_PREFIXES];
+	__m128i pre1[MAX_PREFIXES];
+	__m128i vals[MAX_U32VALS];
+	unsigned nprefix;
+	unsigned nvals;
+};
+
+static void block_filter_init(struct block_filter *bf) {
+	unsigned idx;
+
+	bf->nprefix = nprefix;
+	for (idx = 0; idx < nprefix; idx++) {
+		bf->pre0[idx] = _mm_set1_epi8((char) prefixes[idx][0]);
+		bf->pre1[idx] = _mm_set1_epi8((char) prefixes[idx][1]);
+	}
+	bf->nvals = nu32vals;
+	for (idx = 0; idx < nu32vals; idx++) {
+		bf->vals[idx] = _mm_set1_epi32((int) u32vals_mem[idx]);
+	}
+}
+
+/** @return 0 if no anchor can start in the 16 bytes at aligned buf[pos]; reads 20 bytes.
+ * Same tests as scan_words(), the IVT one is only the MSB prefilter.
+ * Don't use if nprefix == UINT_MAX */
+static inline bool block_maybe(const struct block_filter *bf, const u8 *buf, u32 pos) {
+	__m128i a = _mm_loadu_si128((const __m128i *) &buf[pos]);
+	__m128i a1 = _mm_loadu_si128((const __m128i *) &buf[pos + 1]);
+	__m128i b = _mm_loadu_si128((const __m128i *) &buf[pos + 4]);
+	__m128i hit;
+	unsigned idx;
+
+	//x86 : byte 0 of each u32 is the LSB
+	__m128i pc = _mm_cmpeq_epi32(_mm_and_si128(a, _mm_set1_epi32(0xFF)), _mm_setzero_si128());
+	__m128i sp = _mm_cmpeq_epi32(_mm_and_si128(b, _mm_set1_epi32(0xF8FF)), _mm_set1_epi32(0xF8FF));
+	hit = _mm_and_si128(pc, sp);
+	for (idx = 0; idx < bf->nprefix; idx++) {
+		hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(a, bf->pre0[idx]),
+							_mm_cmpeq_epi8(a1, bf->pre1[idx])));
+	}
+	for (idx = 0; idx < bf->nvals; idx++) {
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi32(a, bf->vals[idx]));
+	}
+	return _mm_movemask_epi8(hit) != 0;
+}
+#endif
+
+struct rom_anchors *anchors_scan(const uint8_t *buf, uint32_t siz) {
+	return anchors_scan_arena(buf, siz, NULL);
+}
+
+struct rom_anchors *anchors_scan_arena(const uint8_t *buf, uint32_t siz, struct arena *a) {
+	assert(buf);
+	struct rom_anchors *ra;
+	u32 pos = 0;
+	unsigned st = 0;
+
+	pthread_once(&anchors_once, anchors_init);
+
+	ra = a ? arena_calloc(a, 1, sizeof(*ra)) : calloc(1, sizeof(*ra));
+	if (!ra) return NULL;
+	ra->arena = a;
+
+#ifdef __SSE2__
+	if (nprefix != UINT_MAX) {
+		struct block_filter bf;
+		block_filter_init(&bf);
+		for (; (siz - pos) >= 20; pos += 16) {
+			if (!st && !block_maybe(&bf, buf, pos)) continue;
+			st = scan_words(ra, buf, siz, pos, 4, st);
+		}
+	}
+#endif
+	st = scan_words(ra, buf, siz, pos, (siz - pos) / 4, st);
+	pos += (siz - pos) & ~3U;
+	for (; pos < siz; pos++) {
+		st = ac_next[st][buf[pos]];
+		if (ac_hasout[st]) emit_strings(ra, st, pos, siz);
+	}
+
+	if (ra->failed) {
+		anchors_free(ra);
+		return NULL;
+	}
+	return ra;
+}
+
+void anchors_free(struct rom_anchors *ra) {
+	unsigned idx;
+
+	if (!ra || ra->arena) return;
+	for (idx = 0; idx < ANCH_LISTS; idx++) {
+		free(ra->list[idx].hits);
+	}
+	free(ra);
+}
+
+/** first hit at or after <from>, NULL if none */
+static const struct anchor_hit *list_lbound(const struct hitlist *hl, u32 from) {
+	u32 lo = 0, hi = hl->num;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (hl->hits[mid].pos < from) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < hl->num) ? &hl->hits[lo] : NULL;
+}
+
+const struct anchor_hit *anchors_next(const struct rom_anchors *ra, enum anchor_kind kind, u32 from) {
+	assert(ra && (kind < ANCH_U32));
+	return list_lbound(&ra->list[kind], from);
+}
+
+bool anchors_u32(const struct rom_anchors *ra, u32 val, u32 from, u32 *pos) {
+	assert(ra && pos);
+	unsigned idx;
+
+	for (idx = 0; idx < nu32vals; idx++) {
+		if (u32vals[idx] == val) break;
+	}
+	if (idx == nu32vals) return 0;
+
+	const struct anchor_hit *hit = list_lbound(&ra->list[ANCH_U32 + idx], from);
+	*pos = hit ? hit->pos : UINT32_MAX;
+	return 1;
+}
@@ -0,0 +1,63 @@
+/* one-pass anchor scan for nisrom : every fixed pattern the structure finders
+ * look for is found in a single sequential pass over the ROM,
+ * instead of one full-ROM search per finder.
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISROM_ANCHORS_H
+#define NISROM_ANCHORS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stypes.h"
+
+enum anchor_kind {
+	ANCH_LOADER = 0,	//"LOADER"
+	ANCH_DATABASE,	//"DATAB"
+	ANCH_FIDIC,	//any fidtypes[].FIDIC CPU string; .val is the enum fidtype_ic
+	ANCH_IVT,	//4-byte aligned, check_ivt() is true
+	ANCH_U32,	//4-byte aligned big-endian u32 : &IVT2 of ECUREC types, RIPEMD160 init values. See anchors_u32()
+};
+
+/* first two RIPEMD160 init values, as found in ROMs that implement it */
+#define RM160_INIT0 0x67452301
+#define RM160_INIT1 0x98BADCFE
+
+struct anchor_hit {
+	u32 pos;	//offset of first byte in ROM
+	u32 val;
+};
+
+/** opaque table of hits. Read-only once built */
+struct rom_anchors;
+
+/** scan buf once for all anchors.
+ *
+ * Strings use the same bounds as u8memstr() (the last possible position is never reported),
+ * u32 values the same as u32memstr().
+ * @return NULL if failed
+ */
+struct rom_anchors *anchors_scan(const uint8_t *buf, uint32_t siz);
+
+struct arena;
+
+/** same, allocated in arena <a> : anchors_free() is then a no-op */
+struct rom_anchors *anchors_scan_arena(const uint8_t *buf, uint32_t siz, struct arena *a);
+
+void anchors_free(struct rom_anchors *ra);
+
+/** first hit of <kind> at or after <from>; not for ANCH_U32
+ * @return NULL if none
+ */
+const struct anchor_hit *anchors_next(const struct rom_anchors *ra, enum anchor_kind kind, u32 from);
+
+/** first aligned occurence of big-endian <val> at or after <from>
+ *
+ * @param pos : set to the offset, or UINT32_MAX if not found
+ * @return 0 if <val> is not one of the scanned values; caller must search some other way (u32memstr)
+ */
+bool anchors_u32(const struct rom_anchors *ra, u32 val, u32 from, u32 *pos);
+
+#endif
@@ -0,0 +1,265 @@
+/* persistent cache of per-ROM analysis results
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nisrom_cache.h"
+
+#include "uthash/uthash.h"
+#include "uthash/utstring.h"
+
+#define ROMCACHE_MAGIC "#nisrom cache"
+
+struct cache_ent {
+	char key[ROMCACHE_KEYLEN];
+	bool failed;
+	char *vals;	//all values, '\t'-separated
+	UT_hash_handle hh;
+};
+
+struct romcache {
+	char *fname;
+	char *tag;
+	unsigned nvals;
+	bool dirty;
+	struct cache_ent *table;
+	pthread_mutex_t lock;
+};
+
+
+/** replace or add entry. vals is taken over */
+static bool cache_insert(struct romcache *rc, const char *key, bool failed, char *vals) {
+	struct cache_ent *ent;
+
+	if (strlen(key) >= ROMCACHE_KEYLEN) {
+		free(vals);
+		return 0;
+	}
+
+	HASH_FIND_STR(rc->table, key, ent);
+	if (ent) {
+		free(ent->vals);
+	} else {
+		ent = calloc(1, sizeof(*ent));
+		if (!ent) {
+			free(vals);
+			return 0;
+		}
+		strcpy(ent->key, key);
+		HASH_ADD_STR(rc->table, key, ent);
+	}
+	ent->failed = failed;
+	ent->vals = vals;
+	return 1;
+}
+
+/** parse one "<key>\t<status>[\t<vals>]" line, without trailing newline. */
+static void parse_line(struct romcache *rc, char *line) {
+	char *status = strchr(line, '\t');
+	if (!status) return;
+	*status++ = 0;
+
+	if (strcmp(status, "fail") == 0) {
+		cache_insert(rc, line, 1, NULL);
+		return;
+	}
+	if (strncmp(status, "ok\t", 3) && strcmp(status, "ok")) return;
+
+	char *vals = status + 2;
+	unsigned tabs = 0;
+	const char *cur;
+	for (cur = vals; *cur; cur++) {
+		if (*cur == '\t') tabs++;
+	}
+	if (tabs != rc->nvals) {
+		//corrupt, or from a different analyzer : ignore
+		return;
+	}
+	vals = strdup(tabs ? (vals + 1) : "");
+	if (!vals) return;
+	cache_insert(rc, line, 0, vals);
+}
+
+static void load_cache(struct romcache *rc, FILE *fh) {
+	char *line = NULL;
+	size_t linesz = 0;
+	ssize_t len;
+	bool header = 1;
+
+	while ((len = getline(&line, &linesz, fh)) > 0) {
+		while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+			line[--len] = 0;
+		}
+		if (header) {
+			header = 0;
+			size_t mlen = strlen(ROMCACHE_MAGIC);
+			if (strncmp(line, ROMCACHE_MAGIC, mlen) || (line[mlen] != '\t') ||
+				strcmp(&line[mlen + 1], rc->tag)) {
+				ERR_PRINTF("cache %s is stale or from another version, ignoring its contents\n", rc->fname);
+				rc->dirty = 1;
+				break;
+			}
+			continue;
+		}
+		parse_line(rc, line);
+	}
+	free(line);
+}
+
+struct romcache *romcache_open(const char *fname, const char *tag, unsigned nvals) {
+	assert(fname && tag);
+	struct romcache *rc = calloc(1, sizeof(*rc));
+	if (!rc) return NULL;
+
+	rc->fname = strdup(fname);
+	rc->tag = strdup(tag);
+	rc->nvals = nvals;
+	if (!rc->fname || !rc->tag || pthread_mutex_init(&rc->lock, NULL)) {
+		free(rc->fname);
+		free(rc->tag);
+		free(rc);
+		return NULL;
+	}
+
+	FILE *fh = fopen(fname, "r");
+	if (!fh) {
+		if (errno != ENOENT) {
+			ERR_PRINTF("can't open cache %s : %s\n", fname, strerror(errno));
+			romcache_close(rc);
+			return NULL;
+		}
+		//new cache
+		rc->dirty = 1;
+		return rc;
+	}
+	load_cache(rc, fh);
+	fclose(fh);
+	return rc;
+}
+
+bool romcache_save(struct romcache *rc) {
+	assert(rc);
+	struct cache_ent *ent, *tmp;
+	UT_string tmpname;
+	bool ok = 1;
+
+	if (!rc->dirty) return 1;
+
+	utstring_init(&tmpname);
+	utstring_printf(&tmpname, "%s.tmp", rc->fname);
+
+	FILE *fh = fopen(utstring_body(&tmpname), "w");
+	if (!fh) {
+		ERR_PRINTF("can't write %s\n", utstring_body(&tmpname));
+		utstring_done(&tmpname);
+		return 0;
+	}
+
+	fprintf(fh, "%s\t%s\n", ROMCACHE_MAGIC, rc->tag);
+	HASH_ITER(hh, rc->table, ent, tmp) {
+		if (ent->failed) {
+			fprintf(fh, "%s\tfail\n", ent->key);
+		} else {
+			fprintf(fh, "%s\tok\t%s\n", ent->key, ent->vals);
+		}
+	}
+	if (ferror(fh)) ok = 0;
+	if (fclose(fh)) ok = 0;
+
+	if (ok && rename(utstring_body(&tmpname), rc->fname)) {
+		ERR_PRINTF("can't replace %s : %s\n", rc->fname, strerror(errno));
+		ok = 0;
+	}
+	if (!ok) {
+		remove(utstring_body(&tmpname));
+	} else {
+		rc->dirty = 0;
+	}
+	utstring_done(&tmpname);
+	return ok;
+}
+
+void romcache_close(struct romcache *rc) {
+	struct cache_ent *ent, *tmp;
+
+	if (!rc) return;
+	HASH_ITER(hh, rc->table, ent, tmp) {
+		HASH_DEL(rc->table, ent);
+		free(ent->vals);
+		free(ent);
+	}
+	pthread_mutex_destroy(&rc->lock);
+	free(rc->fname);
+	free(rc->tag);
+	free(rc);
+}
+
+enum romcache_res romcache_get(struct romcache *rc, const char *key,
+		void (*copy_cb)(unsigned idx, const char *val, void *data), void *data) {
+	assert(rc && key && copy_cb);
+	struct cache_ent *ent;
+	enum romcache_res res = ROMCACHE_MISS;
+
+	pthread_mutex_lock(&rc->lock);
+	HASH_FIND_STR(rc->table, key, ent);
+	if (ent && ent->failed) {
+		res = ROMCACHE_FAILED;
+	} else if (ent) {
+		//split a copy in place
+		char *vals = strdup(ent->vals);
+		if (vals) {
+			char *cur = vals;
+			unsigned idx;
+			for (idx = 0; idx < rc->nvals; idx++) {
+				char *next = strchr(cur, '\t');
+				if (next) *next++ = 0;
+				copy_cb(idx, cur, data);
+				cur = next;
+				if (!cur) break;
+			}
+			free(vals);
+			res = ROMCACHE_OK;
+		}
+	}
+	pthread_mutex_unlock(&rc->lock);
+	return res;
+}
+
+bool romcache_put(struct romcache *rc, const char *key, bool failed, const char * const *vals) {
+	assert(rc && key);
+	char *joined = NULL;
+	bool ok;
+
+	if (!failed) {
+		UT_string s;
+		unsigned idx;
+
+		assert(vals);
+		utstring_init(&s);
+		for (idx = 0; idx < rc->nvals; idx++) {
+			if (strpbrk(vals[idx], "\t\r\n")) {
+				utstring_done(&s);
+				return 0;
+			}
+			utstring_printf(&s, "%s%s", idx ? "\t" : "", vals[idx]);
+		}
+		joined = strdup(utstring_body(&s));
+		utstring_done(&s);
+		if (!joined) return 0;
+	}
+
+	pthread_mutex_lock(&rc->lock);
+	ok = cache_insert(rc, key, failed, joined);
+	if (ok) rc->dirty = 1;
+	pthread_mutex_unlock(&rc->lock);
+	return ok;
+}
@@ -0,0 +1,63 @@
+/* persistent cache of per-ROM analysis results
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#ifndef NISROM_CACHE_H
+#define NISROM_CACHE_H
+
+#include <stdbool.h>
+
+/* File format, one text line per ROM :
+ *	"#nisrom cache\t<tag>" header, then
+ *	"<key>\tok\t<val0>\t<val1>...\t<valn-1>" or "<key>\tfail"
+ *
+ * If the tag of an existing file differs from the expected one (analyzer version,
+ * keyset db changes...) all its entries are dropped, and the file is rewritten on romcache_save().
+ */
+
+#define ROMCACHE_KEYLEN 64	//including 0 terminator
+
+struct romcache;
+
+enum romcache_res {
+	ROMCACHE_MISS = 0,
+	ROMCACHE_OK,
+	ROMCACHE_FAILED,	//analysis failed last time too
+};
+
+/** load cache file, or start an empty cache if it doesn't exist yet.
+ *
+ * @param tag : must match the tag in the file; no tabs or newlines
+ * @param nvals : number of values per entry
+ *
+ * @return NULL if error. Must be closed with romcache_close()
+ */
+struct romcache *romcache_open(const char *fname, const char *tag, unsigned nvals);
+
+/** write the cache file back, if it was modified.
+ * The new file replaces the old one atomically.
+ * @return 1 if ok
+ */
+bool romcache_save(struct romcache *rc);
+
+void romcache_close(struct romcache *rc);
+
+/** look up an entry. Thread-safe.
+ *
+ * @param copy_cb : if found and not failed, called for each value.
+ * val is only valid during the callback
+ */
+enum romcache_res romcache_get(struct romcache *rc, const char *key,
+		void (*copy_cb)(unsigned idx, const char *val, void *data), void *data);
+
+/** add or replace an entry. Thread-safe.
+ *
+ * @param failed : record a failed analysis; vals is ignored
+ * @param vals : nvals strings, without tabs or newlines
+ *
+ * @return 1 if ok
+ */
+bool romcache_put(struct romcache *rc, const char *key, bool failed, const char * const *vals);
+
+#endif
@@ -4,11 +4,15 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>	//for printf(); probably can go away someday
 #include <stdbool.h>
+#include <stdlib.h>
 
 #include "nislib.h"
+#include "nislib_patset.h"
+#include "nislib_shindex.h"
 #include "nislib_shtools.h"
 #include "nisrom_finders.h"
 #include "sh_opcodes.h"
@@ -101,7 +105,7 @@ static bool analyze_eepread(const u8 *buf, u32 siz, u32 func, u32 *portreg) {
 			good = 1;
 			/* Bonus : identify the port register */
 			*portreg = literal;
-			fprintf(dbg_stream, "EEPROM Port reg : 0xFFFF%04X\n", literal);
+			DBG_PRINTF("EEPROM Port reg : 0xFFFF%04X\n", literal);
 			goto exit;
 		}
 	}
@@ -113,8 +117,66 @@ exit:
 #define EEPREAD_MAXBT 25	//max backtrack to locate the mov that loads the function address
 #define EEPREAD_MINJ 1		//min # of identical, nearby calls to eepread()
 #define EEPREAD_JSRWINDOW 10	//search within a radius of _JSRWINDOW for identical jsr opcodes
+#define EEPREAD_7CWINDOW 10	//search within a radius of _7CWINDOW for the "mov 0x7C, r4"
+
+/* the two eeprom command loads : mov #0x7B, r4 and mov #0x7C, r4 */
+enum eep_sig {EEP_MOV7B, EEP_MOV7C, EEP_NSIGS};
+static const u16 eep_pats[EEP_NSIGS] = {0xE47B, 0xE47C};
+static const u16 eep_mask = 0xFFFF;
+
+static pthread_once_t eep_once = PTHREAD_ONCE_INIT;
+static struct sh_patset *eep_sigs;
+
+static void eep_sigs_init(void) {
+	struct sh_pattern pats[EEP_NSIGS];
+	unsigned id;
+	for (id = 0; id < EEP_NSIGS; id++) {
+		pats[id].len = 1;
+		pats[id].pat = &eep_pats[id];
+		pats[id].mask = &eep_mask;
+	}
+	eep_sigs = sh_patset_compile(pats, EEP_NSIGS);
+}
+
+/* match positions of each eep_sig, ascending */
+struct eep_sites {
+	u32 *pos[EEP_NSIGS];
+	u32 num[EEP_NSIGS];
+	u32 alloc[EEP_NSIGS];
+	bool failed;
+};
+
+static int eep_collect(void *ctx, unsigned patid, u32 pos) {
+	struct eep_sites *es = ctx;
+	if (es->num[patid] == es->alloc[patid]) {
+		u32 newalloc = es->alloc[patid] ? (2 * es->alloc[patid]) : 64;
+		u32 *newpos = realloc(es->pos[patid], newalloc * sizeof(*newpos));
+		if (!newpos) {
+			es->failed = 1;
+			return 1;
+		}
+		es->pos[patid] = newpos;
+		es->alloc[patid] = newalloc;
+	}
+	es->pos[patid][es->num[patid]++] = pos;
+	return 0;
+}
+
+/** @return index of the first of sites[] >= key; num if none */
+static u32 u32_lower_bound(const u32 *sites, u32 num, u32 key) {
+	u32 lo = 0, hi = num;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (sites[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-uint32_t find_eepread(const uint8_t *buf, uint32_t siz, uint32_t *real_portreg) {
+uint32_t find_eepread(const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *real_portreg) {
 	int occurences = 0;
 	uint32_t cur = 0;
 	uint32_t jackpot = 0;
@@ -122,11 +184,26 @@ uint32_t find_eepread(const uint8_t *buf, uint32_t siz, uint32_t *real_portreg)
 	uint32_t portreg = 0;
 
 	siz &= ~1;
-	assert(buf && siz && real_portreg &&
+	assert(idx && buf && siz && real_portreg &&
 		(siz <= MAX_ROMSIZE));
 
-	for (cur = 0; cur <= (siz - 2); cur += 2) {
-		/* find E4 7B opcode, for every occurence check if the pattern is credible */
+	/* find E4 7B and E4 7C opcodes in one pass */
+	pthread_once(&eep_once, eep_sigs_init);
+	if (!eep_sigs) return 0;
+	struct eep_sites es = {0};
+	sh_patset_scan_index(eep_sigs, idx, buf, siz, eep_collect, &es);
+	if (es.failed) {
+		ERR_PRINTF("malloc failed\n");
+		free(es.pos[EEP_MOV7B]);
+		free(es.pos[EEP_MOV7C]);
+		return 0;
+	}
+
+	/* for every E4 7B occurence, check if the pattern is credible */
+	const u32 *sites = es.pos[EEP_MOV7B];
+	u32 nsites = es.num[EEP_MOV7B];
+	u32 site;
+	for (site = 0; site < nsites; site++) {
 		uint16_t opc;
 		int jumpreg;
 		int window;
@@ -134,8 +211,8 @@ uint32_t find_eepread(const uint8_t *buf, uint32_t siz, uint32_t *real_portreg)
 		uint32_t jsr_loc;	//offset of jsr instr
 		uint32_t jsr_opcode;	//copy of opcode
 
-		opc = reconst_16(&buf[cur]);
-		if (opc != 0xE47B) continue;
+		cur = sites[site];
+		if (cur > (siz - 2)) break;
 		/* We found a "mov 0x7B, r4" :
 		 * see if there's a jsr just before, or within [POSTJSR] instructions
 		*/
@@ -175,7 +252,7 @@ uint32_t find_eepread(const uint8_t *buf, uint32_t siz, uint32_t *real_portreg)
 		}
 		if (!found_seq) {
 			//unusual; algo should be tweaked if this happens
-			fprintf(dbg_stream, "Occurence %d : jumpreg setting not found near 0x%x \n",
+			DBG_PRINTF("Occurence %d : jumpreg setting not found near 0x%x \n",
 				occurences, cur);
 			continue;
 		}
@@ -208,44 +285,41 @@ uint32_t find_eepread(const uint8_t *buf, uint32_t siz, uint32_t *real_portreg)
 			//printf("Occurence %d @ 0x%0X : Unlikely, not enough identical 'jsr's\n", occurences, cur + window * 2);
 			continue;
 		}
-		found_seq = 0;
 		/* improve moar : there should be another call with "mov 0x7C, r4" */
-		for (window = -10; window <= 10; window ++ ) {
-			// cppcheck-suppress integerOverflow
-			opc = reconst_16(&buf[jsr_loc + window * 2]);
-			if (opc == 0xE47C) {
-				found_seq = 1;
-				break;
-			}
-		}
-		if (!found_seq) {
+		u32 near_lo = jsr_loc - MIN(jsr_loc, EEPREAD_7CWINDOW * 2);
+		u32 c7 = u32_lower_bound(es.pos[EEP_MOV7C], es.num[EEP_MOV7C], near_lo);
+		if ((c7 == es.num[EEP_MOV7C]) ||
+			(es.pos[EEP_MOV7C][c7] > (jsr_loc + EEPREAD_7CWINDOW * 2))) {
 			continue;
 			//printf("Occurence %d @ 0x%0X : no 7C nearby\n", occurences, cur + window * 2);
 		}
+		window = ((int) es.pos[EEP_MOV7C][c7] - (int) jsr_loc) / 2;
 
 		/* last test : follow inside eep_read() to see if we access IO registers pretty soon */
 		if (analyze_eepread(buf, siz, jackpot, &portreg)) {
 			occurences += 1;
 			real_jackpot = jackpot;
 			*real_portreg = 0xFFFF0000 | portreg;
-			fprintf(dbg_stream, "Occurence %d @ 0x%0X : &eep_read() = 0x%0X\n", occurences, cur + window * 2, jackpot);
+			DBG_PRINTF("Occurence %d @ 0x%0X : &eep_read() = 0x%0X\n", occurences, cur + window * 2, jackpot);
 		} else {
-			fprintf(dbg_stream, "didn't recognize &eep_read()\n");
+			DBG_PRINTF("didn't recognize &eep_read()\n");
 		}
 
 
 	}	//for
+	free(es.pos[EEP_MOV7B]);
+	free(es.pos[EEP_MOV7C]);
 	//return last occurence.
 	switch (occurences) {
 	case 0:
-		fprintf(dbg_stream, "eep_read() not found ! Needs better heuristics\n");
+		DBG_PRINTF("eep_read() not found ! Needs better heuristics\n");
 		real_jackpot = 0;
 		break;
 	case 1:
 		//normal result
 		break;
 	default:
-		fprintf(dbg_stream, "more than one likely eep_read() found ! Needs better heuristics\n");
+		DBG_PRINTF("more than one likely eep_read() found ! Needs better heuristics\n");
 		real_jackpot = 0;
 		break;
 	}
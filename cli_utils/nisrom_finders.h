@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "nislib_shindex.h"
+
 /** Verify if a vector table (IVT) is sane.
  * @param ivt : start of vector table
  * @param siz : bytes in buf[]
@@ -30,6 +32,6 @@ uint32_t find_ivt(const uint8_t *buf, uint32_t siz);
 /** find EEPROM read_byte(addr, &dest) function address and IO port used
  * returns address of eepread() function, otherwise 0 if nothing found
  */
-uint32_t find_eepread(const uint8_t *buf, uint32_t siz, uint32_t *real_portreg);
+uint32_t find_eepread(const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *real_portreg);
 
 #endif
@@ -5,11 +5,16 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "nislib.h"
+#include "nislib_prof.h"
 #include "nis_romdb.h"
+#include "nislib_patset.h"
+#include "nislib_shindex.h"
 #include "nislib_shtools.h"
 #include "nisrom_keyfinders.h"
 
@@ -18,102 +23,97 @@
 #include "stypes.h"
 
 
-#define SPLITKEY_MAXDIST 16
-/** find literal key
- *
- * @param thorough : continue search for multiple occurences
- *
- * @return 1 if ok
- *
- * this does no code analysis, only looking for two halfkeys stored nearby.
- */
-static bool find_key_literal(const u8 *buf, u32 siz, u32 key, bool thorough) {
-	assert(buf && siz);
-
-	u32 kph_cur = 0;
-	int occurences = 0;
-
-	while (kph_cur + 2 < siz) {
-		const uint8_t *kp_h, *kp_l;
-		uint16_t ckh, ckl;
-		ckh = key >> 16;
-		ckl = key >> 0;
-
-		/* find one 16bit half */
-		kp_h = u16memstr(buf + kph_cur, siz - kph_cur, ckh);
-		if (kp_h == NULL) {
-			// no match: abort
-			return 0;
-		}
-		u32 kp_h_pos = (kp_h - buf);
-
-		/* got one half; search for other close by */
-		u32 start_offs = kp_h_pos - MIN(SPLITKEY_MAXDIST, kp_h_pos);	//start a bit before kp_h
-		u32 end_offs = MIN(kp_h_pos + SPLITKEY_MAXDIST, siz - 2);	//don't overflow
-		kp_l = u16memstr(buf + start_offs, end_offs - start_offs, ckl);
-		if (kp_l == NULL) {
-			// no match: try to find more occurences of kp_h.
-			kph_cur = end_offs;
-			continue;
-		}
-
-		fprintf(dbg_stream, "Key %lX found near 0x%lX !\n", (unsigned long) key, (unsigned long) kp_h_pos);
-		occurences += 1;
-		if (thorough) {
-			kph_cur = end_offs;
-			continue;
-		}
-		break;
+#define KEYFIND_POLL_MASK 0xFFF	//literal scan : check for cancellation every 4k halfwords
 
-	}	//while
-
-	if (occurences > 1) {
-		fprintf(dbg_stream, "warning : multiple copies of key found !?\n");
-	}
-	return 1;
+/* set by keyfinder_run() in each strategy thread; points to the shared cancel flag */
+static __thread const int *keyfind_cancel;
 
+/** @return 1 if another strategy already found a good result, and this one should bail out */
+static bool keyfind_cancelled(void) {
+	return keyfind_cancel && __atomic_load_n(keyfind_cancel, __ATOMIC_RELAXED);
 }
 
+/* opcode signatures of the strategies, compiled once by sigs_init() */
+enum kf_sig {SIG_SPF, SIG_SPF2, SIG_NUM};
+static const struct sh_patset *kf_sigset(enum kf_sig sig);
 
-/* keep track of literal search results */
-struct litsearch_status {
-	const u8 *buf;
-	u32 siz;
+/** try to find the low half of a key close to its high half at hpos.
+ * Each aligned position in [hpos - SPLITKEY_MAXDIST, hpos + SPLITKEY_MAXDIST[ is tested.
+ */
+static bool find_lohalf(const u8 *buf, u32 siz, u32 hpos, u16 lo) {
+	u32 start_offs = hpos - MIN(SPLITKEY_MAXDIST, hpos);	//start a bit before kp_h
+	u32 end_offs = MIN(hpos + SPLITKEY_MAXDIST, siz - 2);	//don't overflow
+	u32 cur;
 
-	const struct keyset_t *found_keyset;	//set by callback if found
+	for (cur = start_offs; (cur + 2) <= end_offs; cur += 2) {
+		if (reconst_16(&buf[cur]) == lo) return 1;
+	}
+	return 0;
+}
 
-	enum key_type ktype;
+u32 find_key_literal(const u8 *buf, u32 siz, u32 key) {
+	assert(buf);
+	u32 pos;
 
-	bool thorough;
-};
+	for (pos = 0; (pos + 2) <= siz; pos += 2) {
+		if (reconst_16(&buf[pos]) != (key >> 16)) continue;
+		if (find_lohalf(buf, siz, pos, key & 0xFFFF)) return pos;
+	}
+	return UINT32_MAX;
+}
 
-/* this callback runs for each known keyset, and tries to find two 16 bit halves close by. */
-bool keysearch_literal_cb(const struct keyset_t *keyset, void *data) {
-	assert(keyset && data);
-	struct litsearch_status *lss = data;
+/* per-key results of the literal scan */
+struct litsearch_hit {
+	u32 first_pos;
+	unsigned occurences;
+};
 
-	u32 needle;
-	switch (lss->ktype) {
-	case KEY_S27:
-		needle = keyset->s27k;
-		break;
-	case KEY_S36K1:
-		needle = keyset->s36k1;
-		break;
-	case KEY_S36K2:
-		needle = keyset->s36k2;
-		break;
-	default:
-		assert(0);
-		break;
-	}
+/** find every known key as two 16bit halves stored nearby, in a single pass.
+ *
+ * The ROM is walked once by aligned halfword; only values present in the index bitmap
+ * cost a lookup, so the cost barely depends on the number of known keysets.
+ *
+ * @param hits : one per index entry, zeroed by caller
+ * @param thorough : keep counting occurences after the first
+ *
+ * this does no code analysis.
+ */
+static void scan_literal_keys(const struct halfkey_index *hki, const u8 *buf, u32 siz,
+				struct litsearch_hit *hits, bool thorough) {
+	u32 pos;
+	u32 tried = 0;
+
+	for (pos = 0; (pos + 2) <= siz; pos += 2) {
+		if (!((pos >> 1) & KEYFIND_POLL_MASK) && keyfind_cancelled()) break;
+		u16 hi = reconst_16(&buf[pos]);
+		if (!(hki->hi_bitmap[hi >> 5] & (1UL << (hi & 31)))) continue;
+
+		/* locate first entry with this hi value */
+		unsigned lo_idx = 0, hi_idx = hki->num_ents;
+		while (lo_idx < hi_idx) {
+			unsigned mid = (lo_idx + hi_idx) / 2;
+			if (hki->ents[mid].hi < hi) {
+				lo_idx = mid + 1;
+			} else {
+				hi_idx = mid;
+			}
+		}
 
-	bool rv = find_key_literal(lss->buf, lss->siz, needle, lss->thorough);
-	if (rv) {
-		lss->found_keyset = keyset;
-		return 1;
+		unsigned idx;
+		for (idx = lo_idx; (idx < hki->num_ents) && (hki->ents[idx].hi == hi); idx++) {
+			struct litsearch_hit *lsh = &hits[idx];
+			if (lsh->occurences && !thorough) continue;
+			tried++;
+			if (!find_lohalf(buf, siz, pos, hki->ents[idx].lo)) continue;
+
+			u32 key = ((u32) hi << 16) | hki->ents[idx].lo;
+			TRACE(TC_KEYFIND, TL_DEBUG, "Key %lX found near 0x%lX !\n", (unsigned long) key, (unsigned long) pos);
+			if (!lsh->occurences) lsh->first_pos = pos;
+			lsh->occurences += 1;
+		}
 	}
-	return 0;
+	prof_count(PC_BYTES_SCANNED, pos);
+	prof_count(PC_KEYSETS_TRIED, tried);
 }
 
 const struct keyset_t *find_keys_bruteforce(nis_romdb *romdb, const u8 *buf, u32 siz, enum key_quality *keyq, bool thorough) {
@@ -122,44 +122,71 @@ const struct keyset_t *find_keys_bruteforce(nis_romdb *romdb, const u8 *buf, u32
 	/* method 1 (removed) : search for every known key with u32memstr. Was not very effective.
 	 */
 
-	/* method 2 : search as two 16bit halves close by;
-	 * this is slower but much better.
+	/* method 2 : search as two 16bit halves close by, one pass for all keys;
+	 * then pick the keyset exactly as a per-keyset search in keysets_iterate() order would :
+	 * first keyset with a s27k (better if its s36k1 is also there), else first with a s36k1.
 	 */
 
-	bool rv;
-	struct litsearch_status lss = {0};
-	lss.buf = buf;
-	lss.siz = siz;
-	lss.thorough = thorough;
-	lss.ktype = KEY_S27;
+	struct halfkey_index hki;
+	if (!romdb_halfkey_index(romdb, &hki) || (siz < 2)) {
+		TRACE(TC_KEYFIND, TL_INFO, "found no literal keys\n");
+		return NULL;
+	}
 
-	keysets_iterate(romdb, keysearch_literal_cb, &lss);
-	if (lss.found_keyset) {
-		*keyq = KEYQ_BRUTE_1;
-		//best scenario : also find matching s36k1
-		u32 s36k1 = lss.found_keyset->s36k1;
-		rv = find_key_literal(buf, siz, s36k1, thorough);
-		if (rv) {
-			fprintf(dbg_stream, "found literal s27 and s36, keyset %lX\n", (unsigned long) lss.found_keyset->s27k);
+	struct litsearch_hit *hits = calloc(hki.num_ents, sizeof(*hits));
+	u8 *found = calloc(hki.num_keysets, sizeof(*found));	//bit (1 << ktype) set per ordinal
+	const struct keyset_t **keysets = calloc(hki.num_keysets, sizeof(*keysets));
+	const struct keyset_t *found_keyset = NULL;
+	if (!hits || !found || !keysets) {
+		ERR_PRINTF("malloc failed\n");
+		goto exit;
+	}
+
+	scan_literal_keys(&hki, buf, siz, hits, thorough);
+
+	unsigned idx;
+	for (idx = 0; idx < hki.num_ents; idx++) {
+		const struct halfkey_ent *hke = &hki.ents[idx];
+		if (!hits[idx].occurences) continue;
+		if (hits[idx].occurences > 1) {
+			TRACE(TC_KEYFIND, TL_WARN, "warning : multiple copies of key %lX found !?\n",
+					(unsigned long) (((u32) hke->hi << 16) | hke->lo));
+		}
+		found[hke->ordinal] |= 1U << hke->ktype;
+		keysets[hke->ordinal] = hke->keyset;
+	}
+
+	unsigned ord;
+	for (ord = 0; ord < hki.num_keysets; ord++) {
+		if (!(found[ord] & (1U << KEY_S27))) continue;
+		found_keyset = keysets[ord];
+		if (found[ord] & (1U << KEY_S36K1)) {
+			//best scenario : also find matching s36k1
+			TRACE(TC_KEYFIND, TL_INFO, "found literal s27 and s36, keyset %lX\n", (unsigned long) found_keyset->s27k);
 			*keyq = KEYQ_BRUTE_BOTH;
-			return lss.found_keyset;
+			goto exit;
 		}
-		fprintf(dbg_stream, "found only literal s27, keyset %lX\n", (unsigned long) lss.found_keyset->s27k);
-		return lss.found_keyset;
+		TRACE(TC_KEYFIND, TL_INFO, "found only literal s27, keyset %lX\n", (unsigned long) found_keyset->s27k);
+		*keyq = KEYQ_BRUTE_1;
+		goto exit;
 	}
 
 	// no s27k found, try s36.
-	lss.found_keyset = NULL;
-	lss.ktype = KEY_S36K1;
-	keysets_iterate(romdb, keysearch_literal_cb, &lss);
-	if (lss.found_keyset) {
-		fprintf(dbg_stream, "found only literal s36k1, keyset %lX\n", (unsigned long) lss.found_keyset->s27k);
+	for (ord = 0; ord < hki.num_keysets; ord++) {
+		if (!(found[ord] & (1U << KEY_S36K1))) continue;
+		found_keyset = keysets[ord];
+		TRACE(TC_KEYFIND, TL_INFO, "found only literal s36k1, keyset %lX\n", (unsigned long) found_keyset->s27k);
 		*keyq = KEYQ_BRUTE_1;
-		return lss.found_keyset;
+		goto exit;
 	}
 
-	fprintf(dbg_stream, "found no literal keys\n");
-	return NULL;
+	TRACE(TC_KEYFIND, TL_INFO, "found no literal keys\n");
+
+exit:
+	free(keysets);
+	free(found);
+	free(hits);
+	return found_keyset;
 }
 
 
@@ -220,7 +247,7 @@ static uint32_t fs27_bt_stmem(const uint8_t *buf, uint32_t bsr_offs) {
 		cur -= 2;
 	}
 	if (occ != 2) {
-		fprintf(dbg_stream, "couldn't find two imm->mem stores ?\n");
+		TRACE(TC_KEYFIND, TL_INFO, "couldn't find two imm->mem stores ?\n");
 		return 0;
 	}
 	/* rebuild key from halves : */
@@ -229,7 +256,7 @@ static uint32_t fs27_bt_stmem(const uint8_t *buf, uint32_t bsr_offs) {
 	} else {
 		key = h[0] | (h[1] << 16);
 	}
-	fprintf(dbg_stream, "key : %lX\n", (unsigned long) key);
+	TRACE(TC_KEYFIND, TL_INFO, "key : %lX\n", (unsigned long) key);
 	return key;
 }
 
@@ -256,7 +283,7 @@ static void found_strat1_bsr(const u8 *buf, u32 pos, void *data) {
 
 	assert(buf && (pos < MAX_ROMSIZE) && data);
 
-	fprintf(dbg_stream, "found bsr swapf at %lX\n", (unsigned long) pos);
+	TRACE(TC_KEYFIND, TL_INFO, "found bsr swapf at %lX\n", (unsigned long) pos);
 	skf = data;
 	skf->swapf_xrefs += 1;
 	/* now, backtrack to find constants */
@@ -300,10 +327,10 @@ static void found_strat2_bsr(const u8 *buf, u32 pos, void *data) {
 
 	bool found = bt_MOVW_R0_REGDISP(buf, pos, min_pos, &movw_pos, &reg_dest, &mem_disp);
 	if (!found) {
-		fprintf(dbg_stream, "found a weird strat2 bsr @ %lX. Look here for sid27 / sid36 keys !\n", (unsigned long) pos);
+		TRACE(TC_KEYFIND, TL_INFO, "found a weird strat2 bsr @ %lX. Look here for sid27 / sid36 keys !\n", (unsigned long) pos);
 		return;
 	}
-	fprintf(dbg_stream, "found a strat2 bsr @ %lX. Look here for sid27 / sid36 keys !\n", (unsigned long) pos);
+	TRACE(TC_KEYFIND, TL_INFO, "found a strat2 bsr @ %lX. Look here for sid27 / sid36 keys !\n", (unsigned long) pos);
 
 	// next : find value loaded into R0 , this is KEY_L
 	u16 key_l, key_h;
@@ -311,7 +338,7 @@ static void found_strat2_bsr(const u8 *buf, u32 pos, void *data) {
 	if (sh_bt_immload(&imm_temp, buf, movw_pos - MIN(movw_pos, S27_STRAT2_IMMLOAD_MAXBT), movw_pos, 0)) {
 		//probably found a halfkey
 		key_l = (u16) imm_temp & 0xFFFF;
-		fprintf(dbg_stream, "halfkey 0x%04X\n", (unsigned) key_l);
+		TRACE(TC_KEYFIND, TL_DEBUG, "halfkey 0x%04X\n", (unsigned) key_l);
 	} else {
 		//can't continue
 		return;
@@ -338,14 +365,14 @@ static void found_strat2_bsr(const u8 *buf, u32 pos, void *data) {
 		}
 		if (sh_bt_immload(&imm_temp, buf, movw_pos - MIN(movw_pos, S27_STRAT2_IMMLOAD_MAXBT), movw_pos, 0)) {
 			key_h = (u16) imm_temp & 0xFFFF;
-			fprintf(dbg_stream, "halfkey 0x%04X\n", (unsigned) key_h);
+			TRACE(TC_KEYFIND, TL_DEBUG, "halfkey 0x%04X\n", (unsigned) key_h);
 			found = 1;
 		}
 		break;
 	}
 
 	if (!found) {
-		fprintf(dbg_stream, "strat2 couldn't find other halfkey\n");
+		TRACE(TC_KEYFIND, TL_INFO, "strat2 couldn't find other halfkey\n");
 		return;
 	}
 	u32 key_candidate = (key_h << 16) + key_l;
@@ -357,9 +384,15 @@ static void found_strat2_bsr(const u8 *buf, u32 pos, void *data) {
 	// not sure if we found a s27 or s36 key. Best scenario is finding it in known keysets.
 	// Assign the other without setting the _found flag
 	struct s27_keyfinding *skf = data;
+	const struct keyset_t *known[1][KEY_INVALID];
 	const struct keyset_t *keyset;
 
-	keyset = find_knownkey(skf->romdb, KEY_S27, key_candidate);
+	prof_count(PC_KEYSETS_TRIED, 1);
+	if (!find_knownkeys(skf->romdb, &key_candidate, 1, known)) {
+		return;
+	}
+
+	keyset = known[0][KEY_S27];
 	if (keyset) {
 		skf->s27_found = 1;
 		*skf->s27k = key_candidate;
@@ -367,7 +400,7 @@ static void found_strat2_bsr(const u8 *buf, u32 pos, void *data) {
 		*skf->s36k = keyset->s36k1;
 	}
 
-	keyset = find_knownkey(skf->romdb, KEY_S36K1, key_candidate);
+	keyset = known[0][KEY_S36K1];
 	if (keyset) {
 		skf->s36_found = 1;
 		*skf->s36k = key_candidate;
@@ -375,9 +408,9 @@ static void found_strat2_bsr(const u8 *buf, u32 pos, void *data) {
 		*skf->s27k = keyset->s27k;
 	}
 
-	keyset = find_knownkey(skf->romdb, KEY_S36K2, key_candidate);
+	keyset = known[0][KEY_S36K2];
 	if (keyset) {
-		fprintf(dbg_stream, "strat2 indirectly found a known SID36k2 : 0x%08lX\n", (unsigned long) key_candidate);
+		TRACE(TC_KEYFIND, TL_INFO, "strat2 indirectly found a known SID36k2 : 0x%08lX\n", (unsigned long) key_candidate);
 	}
 	return;
 }
@@ -397,8 +430,45 @@ static const uint16_t spf2_pattern[]={0x4529, 0x351c, 0x257a, 0x252a, 0x000b};
 static const uint16_t spf2_mask[]={0xf0ff, 0xf00f, 0xf00f, 0xf00f, 0xffff};
 #define S27_STRAT2_MAX_FUNCLEN 0x30	// max distance between function entry and start of pattern. Typically around 0x22
 
-enum key_quality find_s27_strat2(nis_romdb *romdb, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k) {
-	assert(buf && siz && (siz <= MAX_ROMSIZE) && s27k && s36k);
+/* per-scan context for the signature callbacks */
+struct sig_scan {
+	const struct sh_index *idx;
+	const u8 *buf;
+	u32 siz;
+	struct s27_keyfinding *skf;
+	u32 swapf_cur;
+};
+
+/** sh_patset_cb for every encrypt() signature; ctx is a (struct sig_scan *) */
+static int strat2_sig(void *ctx, unsigned patid, u32 patpos) {
+	struct sig_scan *ss = ctx;
+	(void) patid;
+
+	if (ss->swapf_cur >= (ss->siz - S27_STRAT2_MAX_FUNCLEN)) return 1;
+	if (keyfind_cancelled()) return 1;
+	assert((patpos & 1) == 0);
+	ss->swapf_cur = patpos + 2;
+
+	// backtrack to guess function entry , by looking for previous RTS opcode.
+	u32 searchlength = MIN(patpos, S27_STRAT2_MAX_FUNCLEN);	//safe clamp
+	u32 startpos = patpos - searchlength;
+	const u8 *maybe_entry = u16memstr_rev(&ss->buf[startpos], searchlength, 0x000b);
+
+	if (!maybe_entry) {
+		TRACE(TC_KEYFIND, TL_INFO, "found a weird encrypt() pattern @ %lX\n", (unsigned long) patpos);
+		return 0;
+	}
+	u32 func_entry = (u32) (maybe_entry - ss->buf) + 4;	//skip over RTS and slot opcode
+
+	TRACE(TC_KEYFIND, TL_INFO, "found a likely encrypt() func @ %lX\n", (unsigned long) func_entry);
+
+	/* Find xrefs (bsr) to this possible encrypt() instance. */
+	sh_index_find_bsr(ss->idx, func_entry, found_strat2_bsr, ss->skf);
+	return 0;
+}
+
+enum key_quality find_s27_strat2(nis_romdb *romdb, const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k) {
+	assert(idx && buf && siz && (siz <= MAX_ROMSIZE) && s27k && s36k);
 
 	struct s27_keyfinding skf={0};
 	skf.romdb = romdb;
@@ -408,47 +478,24 @@ enum key_quality find_s27_strat2(nis_romdb *romdb, const uint8_t *buf, uint32_t
 	skf.s36_found = 0;
 	skf.swapf_xrefs = 0;	//xrefs to "encrypt" func ; should be 2, one from each S27 and S36 func
 
-	u32 swapf_cur = 0;
-
-	while ( swapf_cur < (siz - S27_STRAT2_MAX_FUNCLEN)) {
-		u32 patpos;
-		patpos = find_pattern(&buf[swapf_cur], siz - swapf_cur,
-			S27_STRAT2_PATLEN, spf2_pattern, spf2_mask);
-		if (patpos == UINT32_MAX) break;
-		assert((patpos & 1) == 0);
-
-		patpos += swapf_cur;	//re-adjust to a rom_offset !
-		swapf_cur = patpos + 2;
+	const struct sh_patset *sig = kf_sigset(SIG_SPF2);
+	if (!sig) return KEYQ_UNK;
 
-		// backtrack to guess function entry , by looking for previous RTS opcode.
-		u32 searchlength = MIN(patpos, S27_STRAT2_MAX_FUNCLEN);	//safe clamp
-		u32 startpos = patpos - searchlength;
-		const u8 *maybe_entry = u16memstr_rev(&buf[startpos], searchlength, 0x000b);
-
-		if (!maybe_entry) {
-			fprintf(dbg_stream, "found a weird encrypt() pattern @ %lX\n", (unsigned long) patpos);
-			continue;
-		}
-		u32 func_entry = (u32) (maybe_entry - buf) + 4;	//skip over RTS and slot opcode
-
-		fprintf(dbg_stream, "found a likely encrypt() func @ %lX\n", (unsigned long) func_entry);
-
-		/* Find xrefs (bsr) to this possible encrypt() instance. */
-		find_bsr(buf, func_entry, found_strat2_bsr, &skf);
-	}
+	struct sig_scan ss = {idx, buf, siz, &skf, 0};
+	sh_patset_scan_index(sig, idx, buf, siz, strat2_sig, &ss);
 
 	if (skf.s27_found && skf.s36_found) {
-		fprintf(dbg_stream, "strat2 found known keys @ 0x%06lX, 0x%06lX\n",
+		TRACE(TC_KEYFIND, TL_INFO, "strat2 found known keys @ 0x%06lX, 0x%06lX\n",
 				(unsigned long) skf.s27k_pos, (unsigned long) skf.s36k_pos);
 		return KEYQ_STRAT_BOTH;
 	}
 	if (skf.s27_found) {
-		fprintf(dbg_stream, "strat2 found s27k @ 0x%06lX\n",
+		TRACE(TC_KEYFIND, TL_INFO, "strat2 found s27k @ 0x%06lX\n",
 				(unsigned long) skf.s27k_pos);
 		return KEYQ_STRAT_1;
 	}
 	if (skf.s36_found) {
-		fprintf(dbg_stream, "strat2 found new s36 @ 0x%06lX\n",
+		TRACE(TC_KEYFIND, TL_INFO, "strat2 found new s36 @ 0x%06lX\n",
 				(unsigned long) skf.s36k_pos);
 		return KEYQ_STRAT_1;
 	}
@@ -466,11 +513,43 @@ enum key_quality find_s27_strat2(nis_romdb *romdb, const uint8_t *buf, uint32_t
 static const uint16_t spf_pattern[]={0x6001, 0x6001, 0x2001, 0x000b, 0x2001};
 static const uint16_t spf_mask[]={0xf00f, 0xf00f, 0xf00f, 0xffff, 0xf00f};
 
-enum key_quality find_s27_strat1(nis_romdb *romdb, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k) {
-	uint32_t swapf_cur = 0;
+static pthread_once_t sigs_once = PTHREAD_ONCE_INIT;
+static struct sh_patset *sigs[SIG_NUM];
+
+static void sigs_init(void) {
+	static const struct sh_pattern pats[SIG_NUM] = {
+		[SIG_SPF] = {S27_SPF_PATLEN, spf_pattern, spf_mask},
+		[SIG_SPF2] = {S27_STRAT2_PATLEN, spf2_pattern, spf2_mask},
+	};
+	unsigned id;
+	for (id = 0; id < SIG_NUM; id++) {
+		sigs[id] = sh_patset_compile(&pats[id], 1);
+	}
+}
+
+/** @return NULL if the set couldn't be compiled */
+static const struct sh_patset *kf_sigset(enum kf_sig sig) {
+	pthread_once(&sigs_once, sigs_init);
+	return sigs[sig];
+}
+
+/** sh_patset_cb for every swapf signature; ctx is a (struct sig_scan *) */
+static int strat1_sig(void *ctx, unsigned patid, u32 patpos) {
+	struct sig_scan *ss = ctx;
+	(void) patid;
+
+	if (keyfind_cancelled()) return 1;
+	//printf("got 1 swapf @ %0lX;\n", patpos + 0UL);
+
+	/* Find xrefs (bsr) to this swapf instance. */
+	sh_index_find_bsr(ss->idx, patpos, found_strat1_bsr, ss->skf);
+	return 0;
+}
+
+enum key_quality find_s27_strat1(nis_romdb *romdb, const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k) {
 	//int swapf_instances = 0;
 
-	assert(buf && siz && (siz <= MAX_ROMSIZE) && s27k && s36k);
+	assert(idx && buf && siz && (siz <= MAX_ROMSIZE) && s27k && s36k);
 
 	struct s27_keyfinding skf={0};
 	skf.romdb = romdb;
@@ -481,54 +560,46 @@ enum key_quality find_s27_strat1(nis_romdb *romdb, const uint8_t *buf, uint32_t
 	skf.swapf_xrefs = 0;
 
 
-	while ( swapf_cur < siz ) {
-		uint32_t patpos;
-		patpos = find_pattern(&buf[swapf_cur], siz - swapf_cur,
-			S27_SPF_PATLEN, spf_pattern, spf_mask);
-		if (patpos == (u32) -1) break;
-		patpos += swapf_cur;	//re-adjust !
-		//swapf_instances +=1 ;
-		//printf("got 1 swapf @ %0lX;\n", patpos + 0UL);
+	const struct sh_patset *sig = kf_sigset(SIG_SPF);
+	if (!sig) return KEYQ_UNK;
 
-		/* Find xrefs (bsr) to this swapf instance. */
-		find_bsr(buf, patpos, found_strat1_bsr, &skf);
-
-		swapf_cur = patpos + 2;
-
-	}
+	struct sig_scan ss = {idx, buf, siz, &skf, 0};
+	sh_patset_scan_index(sig, idx, buf, siz, strat1_sig, &ss);
 
 	const struct keyset_t *tmp27 = NULL;
 	const struct keyset_t *tmp36 = NULL;
 	if (skf.s27_found) {
+		prof_count(PC_KEYSETS_TRIED, 1);
 		tmp27 = find_knownkey(romdb, KEY_S27, *s27k);
 	}
 	if (skf.s36_found) {
+		prof_count(PC_KEYSETS_TRIED, 1);
 		tmp36 = find_knownkey(romdb, KEY_S36K1, *s36k);
 	}
 	if (tmp27 && tmp36) {
 		if (tmp27 != tmp36) {
 			//weird, shouldn't happen
-			fprintf(dbg_stream, "strat1 found mismatched keys !?  %lX @ %lX, %lX @ %lX\n",
+			TRACE(TC_KEYFIND, TL_WARN, "strat1 found mismatched keys !?  %lX @ %lX, %lX @ %lX\n",
 					(unsigned long) *s27k, (unsigned long) skf.s27k_pos,
 					(unsigned long) *s36k, (unsigned long) skf.s36k_pos);
 			return KEYQ_STRAT_1;
 		}
-		fprintf(dbg_stream, "strat1 found full keyset %lX @ %lX\n",
+		TRACE(TC_KEYFIND, TL_INFO, "strat1 found full keyset %lX @ %lX\n",
 				(unsigned long) *s27k, (unsigned long) skf.s27k_pos);
 		return KEYQ_STRAT_BOTH;
 	}
 	if (skf.s27_found && skf.s36_found) {
-		fprintf(dbg_stream, "strat1 found new s27k @ 0x%06lX, s36k1 @ 0x%06lX\n",
+		TRACE(TC_KEYFIND, TL_INFO, "strat1 found new s27k @ 0x%06lX, s36k1 @ 0x%06lX\n",
 				(unsigned long) skf.s27k_pos, (unsigned long) skf.s36k_pos);
 		return KEYQ_STRAT_2NEW;
 	}
 	if (skf.s27_found) {
-		fprintf(dbg_stream, "strat1 found new s27k @ 0x%06lX\n",
+		TRACE(TC_KEYFIND, TL_INFO, "strat1 found new s27k @ 0x%06lX\n",
 				(unsigned long) skf.s27k_pos);
 		return KEYQ_STRAT_1NEW;
 	}
 	if (skf.s36_found) {
-		fprintf(dbg_stream, "strat1 found new s36 @ 0x%06lX\n",
+		TRACE(TC_KEYFIND, TL_INFO, "strat1 found new s36 @ 0x%06lX\n",
 				(unsigned long) skf.s36k_pos);
 		return KEYQ_STRAT_1NEW;
 	}
@@ -543,20 +614,182 @@ enum key_quality find_s27_strat1(nis_romdb *romdb, const uint8_t *buf, uint32_t
  * also assign the other key. I.e. it's unlikely that one of these methods would produce a value that
  * is wrong, but coincidentally part of a known keyset.
 */
-enum key_quality find_s27_hardcore(nis_romdb *romdb, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k) {
-	assert(buf && siz && (siz <= MAX_ROMSIZE) && s27k && s36k);
+enum key_quality find_s27_hardcore(nis_romdb *romdb, const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k) {
+	assert(idx && buf && siz && (siz <= MAX_ROMSIZE) && s27k && s36k);
 
 	enum key_quality keyq;
 
-	keyq = find_s27_strat1(romdb, buf, siz, s27k, s36k);
+	keyq = find_s27_strat1(romdb, idx, buf, siz, s27k, s36k);
 	if (keyq > KEYQ_UNK) {
 		return keyq;
 	}
 
-	keyq = find_s27_strat2(romdb, buf, siz, s27k, s36k);
+	keyq = find_s27_strat2(romdb, idx, buf, siz, s27k, s36k);
 	if (keyq > KEYQ_UNK) {
 		return keyq;
 	}
 
 	return KEYQ_UNK;
 }
+
+
+/*** strategy runner */
+
+enum keyfind_strat {
+	KF_STRAT1 = 0,	//same order as PT_KF_*
+	KF_STRAT2,
+	KF_BRUTE,
+	KF_NUM,	//also the arbitration order when qualities are equal
+};
+
+/* best quality each strategy can return */
+static const enum key_quality strat_maxq[KF_NUM] = {
+	[KF_STRAT1] = KEYQ_STRAT_BOTH,
+	[KF_STRAT2] = KEYQ_STRAT_BOTH,
+	[KF_BRUTE] = KEYQ_BRUTE_BOTH,
+};
+
+struct keyfind_ctl;
+
+struct keyfind_job {
+	struct keyfind_ctl *ctl;
+	enum keyfind_strat strat;
+	enum key_quality keyq;
+	u32 s27k;
+	u32 s36k;
+	int cancel;	//set by a strategy whose result this one can't beat
+	char *log;	//debug output of this strategy, replayed by keyfinder_run()
+	size_t loglen;
+	FILE *parent_dbg;
+	bool profiling;
+	struct prof_stats prof;	//merged into the caller's stats by keyfinder_run()
+};
+
+struct keyfind_ctl {
+	nis_romdb *romdb;
+	const struct sh_index *idx;
+	const u8 *buf;
+	u32 siz;
+	struct keyfind_job jobs[KF_NUM];
+};
+
+static void keyfind_strat_run(struct keyfind_job *job) {
+	struct keyfind_ctl *ctl = job->ctl;
+	const struct keyset_t *ks;
+	uint64_t t0 = prof_start();
+
+	job->keyq = KEYQ_UNK;
+	switch (job->strat) {
+	case KF_STRAT1:
+		job->keyq = find_s27_strat1(ctl->romdb, ctl->idx, ctl->buf, ctl->siz, &job->s27k, &job->s36k);
+		break;
+	case KF_STRAT2:
+		job->keyq = find_s27_strat2(ctl->romdb, ctl->idx, ctl->buf, ctl->siz, &job->s27k, &job->s36k);
+		break;
+	case KF_BRUTE:
+		ks = find_keys_bruteforce(ctl->romdb, ctl->buf, ctl->siz, &job->keyq, 0);
+		if (!ks) {
+			job->keyq = KEYQ_UNK;
+			break;
+		}
+		job->s27k = ks->s27k;
+		job->s36k = ks->s36k1;
+		break;
+	default:
+		assert(0);
+		break;
+	}
+
+	prof_stop(PT_KF_STRAT1 + job->strat, t0);
+
+	/* only stop the strategies that would lose the arbitration anyway, so the
+	 * result doesn't depend on which thread finishes first */
+	unsigned other;
+	for (other = 0; other < KF_NUM; other++) {
+		if (other == job->strat) continue;
+		if ((strat_maxq[other] < job->keyq) ||
+				((strat_maxq[other] == job->keyq) && (other > job->strat))) {
+			__atomic_store_n(&ctl->jobs[other].cancel, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void *keyfind_worker(void *arg) {
+	struct keyfind_job *job = arg;
+
+	keyfind_cancel = &job->cancel;
+	prof_cur = job->profiling ? &job->prof : NULL;
+	dbg_stream = open_memstream(&job->log, &job->loglen);
+	if (!dbg_stream) {
+		//stdio streams are locked anyway; output just gets interleaved
+		dbg_stream = job->parent_dbg;
+	}
+
+	keyfind_strat_run(job);
+
+	trace_flush();
+	if (dbg_stream != job->parent_dbg) fclose(dbg_stream);
+	dbg_stream = NULL;
+	prof_cur = NULL;
+	return NULL;
+}
+
+enum key_quality keyfinder_run(nis_romdb *romdb, const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k) {
+	assert(idx && buf && siz && (siz <= MAX_ROMSIZE) && s27k && s36k);
+
+	struct keyfind_ctl ctl = {
+		.romdb = romdb,
+		.idx = idx,
+		.buf = buf,
+		.siz = siz,
+	};
+	pthread_t threads[KF_NUM];
+	bool started[KF_NUM] = {0};
+	unsigned strat;
+	uint64_t t0 = prof_start();
+
+	for (strat = 0; strat < KF_NUM; strat++) {
+		struct keyfind_job *job = &ctl.jobs[strat];
+		job->ctl = &ctl;
+		job->strat = strat;
+		job->parent_dbg = dbg_stream;
+		job->profiling = (prof_cur != NULL);
+		if (pthread_create(&threads[strat], NULL, keyfind_worker, job) == 0) {
+			started[strat] = 1;
+		}
+	}
+
+	// whatever couldn't be started runs here, after the others
+	const int *prev_cancel = keyfind_cancel;
+	for (strat = 0; strat < KF_NUM; strat++) {
+		if (started[strat]) continue;
+		keyfind_cancel = &ctl.jobs[strat].cancel;
+		if (keyfind_cancelled()) {
+			ctl.jobs[strat].keyq = KEYQ_UNK;
+			continue;
+		}
+		keyfind_strat_run(&ctl.jobs[strat]);
+	}
+	keyfind_cancel = prev_cancel;
+
+	enum key_quality best = KEYQ_UNK;
+	for (strat = 0; strat < KF_NUM; strat++) {
+		struct keyfind_job *job = &ctl.jobs[strat];
+		if (started[strat]) {
+			pthread_join(threads[strat], NULL);
+		}
+		if (job->log) {
+			trace_flush();
+			fwrite(job->log, 1, job->loglen, dbg_stream);
+			free(job->log);
+		}
+		if (prof_cur) prof_merge(prof_cur, &job->prof);
+		if (job->keyq > best) {
+			best = job->keyq;
+			*s27k = job->s27k;
+			*s36k = job->s36k;
+		}
+	}
+	prof_stop(PT_KEYFIND, t0);
+	return best;
+}
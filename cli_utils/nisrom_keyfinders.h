@@ -10,6 +10,7 @@
 #include <stdbool.h>
 
 #include "nis_romdb.h"
+#include "nislib_shindex.h"
 
 #include "stypes.h"
 
@@ -24,18 +25,37 @@ enum key_quality {
 	KEYQ_BRUTE_BOTH,	//  found known s27+s36 key literals
 	KEYQ_STRAT_1,	// code an. found 1 known key
 	KEYQ_STRAT_BOTH,	// code an. found known s27+s36 keys
+	KEYQ_GOOD = KEYQ_BRUTE_BOTH,	// full known keyset
 };
 
 /** try to find sid27 key through code analysis
+ * @param idx : code index of buf
  * @param s27k : output
  * @param s36k : output
  *
  * @return quality > KEYQ_UNK if anything found
  */
-enum key_quality find_s27_hardcore(nis_romdb *romdb, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k);
+enum key_quality find_s27_hardcore(nis_romdb *romdb, const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k);
 
 
 
+/** run all keyfinding strategies (code analysis and literal search) in parallel on buf.
+ *
+ * The best quality wins; ties go to strat1, then strat2, then the literal search.
+ * A strategy that finishes stops the others only if they can't beat its result, e.g. strat1
+ * with KEYQ_STRAT_BOTH stops everything, but KEYQ_BRUTE_BOTH stops nothing : the result is the
+ * same as running them one after the other.
+ * Debug output of each strategy is written to dbg_stream in that same order.
+ *
+ * @param idx : code index of buf, shared read-only by the strategies
+ * @param s27k : output
+ * @param s36k : output
+ *
+ * @return quality > KEYQ_UNK if anything found
+ */
+enum key_quality keyfinder_run(nis_romdb *romdb, const struct sh_index *idx, const uint8_t *buf, uint32_t siz, uint32_t *s27k, uint32_t *s36k);
+
+
 /** find literal sid27 and/or sid36 key
  *
  * @param[out]  keyq : quality of key match
@@ -47,4 +67,12 @@ enum key_quality find_s27_hardcore(nis_romdb *romdb, const uint8_t *buf, uint32_
  */
 const struct keyset_t *find_keys_bruteforce(nis_romdb *romdb, const u8 *buf, u32 siz, enum key_quality *keyq, bool thorough);
 
+#define SPLITKEY_MAXDIST 16	//max distance between the two halves of a literal key
+
+/** first literal occurence of <key>, as found by find_keys_bruteforce()
+ *
+ * @return position of the high half; the low half is within SPLITKEY_MAXDIST. UINT32_MAX if not found
+ */
+u32 find_key_literal(const u8 *buf, u32 siz, u32 key);
+
 #endif
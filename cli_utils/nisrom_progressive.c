@@ -0,0 +1,385 @@
+/* progressive analysis of a ROM that arrives in pieces, e.g. while it's being dumped
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nislib.h"
+#include "nislib_shindex.h"
+#include "nisrom_anchors.h"
+#include "nisrom_finders.h"
+#include "nisrom_keyfinders.h"
+#include "nisrom_progressive.h"
+#include "nisrom_romfile.h"
+#include "stypes.h"
+
+#define PREFIX_RETRY	0x2000	//rescan the start of the ROM for LOADER / FID every time it grows by this much
+
+static const char *stage_names[RPS_MAX] = {
+	[RPS_LOADER] = "LOADER",
+	[RPS_FID] = "FID",
+	[RPS_RAMF] = "RAMF",
+	[RPS_ALTCKS] = "alt cks",
+	[RPS_STDCKS] = "std cks",
+	[RPS_KEYS] = "keys",
+	[RPS_EEP] = "EEPROM",
+};
+
+const char *romprog_stage_name(enum romprog_stage st) {
+	return (st < RPS_MAX) ? stage_names[st] : "?";
+}
+
+int romprog_init(struct romprog *rp, u32 siz, nis_romdb *romdb, romprog_cb cb, void *cbdata) {
+	assert(rp);
+
+	memset(rp, 0, sizeof(*rp));
+	if ((siz < MIN_ROMSIZE) || (siz > MAX_ROMSIZE)) {
+		ERR_PRINTF("unlikely ROM size %lu\n", (unsigned long) siz);
+		return -1;
+	}
+	rp->buf = malloc(siz);
+	rp->known = calloc((siz + 7) / 8, 1);
+	if (!rp->buf || !rp->known) {
+		romprog_done(rp);
+		return -1;
+	}
+	memset(rp->buf, 0xFF, siz);	//erased flash
+	rp->ivt2_wait = UINT32_MAX;
+
+	rp->rf.filename = "(progressive)";
+	rp->rf.buf = rp->buf;
+	rp->rf.siz = siz;
+	rp->rf.romdb = romdb;
+	rp->cb = cb;
+	rp->cbdata = cbdata;
+	return 0;
+}
+
+void romprog_done(struct romprog *rp) {
+	assert(rp);
+	sh_index_free(rp->rf.shidx);
+	rp->rf.shidx = NULL;
+	anchors_free(rp->rf.anch);
+	rp->rf.anch = NULL;
+	free(rp->buf);
+	free(rp->known);
+	rp->buf = NULL;
+	rp->known = NULL;
+}
+
+static bool is_known(const struct romprog *rp, u32 pos) {
+	return rp->known[pos / 8] & (1 << (pos % 8));
+}
+
+bool romprog_have(const struct romprog *rp, u32 start, u32 len) {
+	u32 idx;
+
+	if ((start > rp->rf.siz) || (len > (rp->rf.siz - start))) return 0;
+	if ((start + len) <= rp->prefix) return 1;
+	for (idx = start; idx < (start + len); idx++) {
+		if (!(idx & 7) && ((start + len - idx) >= 8)) {
+			//whole bytes of the bitmap
+			if (rp->known[idx / 8] != 0xFF) return 0;
+			idx += 7;
+			continue;
+		}
+		if (!is_known(rp, idx)) return 0;
+	}
+	return 1;
+}
+
+bool romprog_finished(const struct romprog *rp) {
+	unsigned st;
+	for (st = 0; st < RPS_MAX; st++) {
+		if (rp->res[st] == RPR_PENDING) return 0;
+	}
+	return 1;
+}
+
+static bool complete(const struct romprog *rp) {
+	return rp->nknown == rp->rf.siz;
+}
+
+static void resolve(struct romprog *rp, enum romprog_stage st, enum romprog_res res) {
+	rp->res[st] = res;
+	DBG_PRINTF("progressive : %s %s with %lu bytes known\n", stage_names[st],
+			(res == RPR_OK) ? "found" : (res == RPR_NA) ? "not applicable" : "failed",
+			(unsigned long) rp->nknown);
+	if (rp->cb) rp->cb(rp, st, res, rp->cbdata);
+}
+
+/** anchors of the known start of the ROM, or of the whole ROM once complete
+ * @return 0 if ok
+ */
+static int refresh_anchors(struct romprog *rp) {
+	u32 len = complete(rp) ? rp->rf.siz : rp->prefix;
+
+	if (rp->rf.anch && (rp->anch_len == len)) return 0;
+	anchors_free(rp->rf.anch);
+	rp->rf.anch = anchors_scan(rp->buf, len);
+	rp->anch_len = len;
+	return rp->rf.anch ? 0 : -1;
+}
+
+/** code index of what is known so far
+ * @return 0 if ok
+ */
+static int refresh_index(struct romprog *rp) {
+	if (rp->rf.shidx && (rp->idx_known == rp->nknown)) return 0;
+	sh_index_free(rp->rf.shidx);
+	rp->rf.shidx = NULL;
+	rp->idx_known = rp->nknown;
+	return romfile_index(&rp->rf);
+}
+
+/* the prefix stages : retry when it grew enough. @return 1 if an attempt is due */
+static bool prefix_due(struct romprog *rp, enum romprog_stage st) {
+	if (!complete(rp) && ((rp->prefix - rp->tried[st]) < PREFIX_RETRY)) return 0;
+	if (complete(rp) && (rp->tried[st] == rp->rf.siz)) return 0;
+	rp->tried[st] = complete(rp) ? rp->rf.siz : rp->prefix;
+	return 1;
+}
+
+/* the others : retry when RPS_RETRY more bytes are known anywhere */
+static bool known_due(struct romprog *rp, enum romprog_stage st) {
+	if (complete(rp)) {
+		if (rp->tried[st] == rp->rf.siz) return 0;
+	} else if (rp->tried[st] && ((rp->nknown - rp->tried[st]) < RPS_RETRY)) {
+		return 0;
+	}
+	rp->tried[st] = rp->nknown;
+	return 1;
+}
+
+
+/* every try_*() returns 1 if the stage was resolved */
+
+static bool try_loader(struct romprog *rp) {
+	if (!prefix_due(rp, RPS_LOADER)) return 0;
+	if (refresh_anchors(rp)) return 0;
+
+	u32 pos = find_loader(&rp->rf);
+	if ((pos != UINT32_MAX) && ((pos + sizeof(struct loader_t)) <= rp->anch_len)) {
+		resolve(rp, RPS_LOADER, RPR_OK);
+		return 1;
+	}
+	if (complete(rp)) {
+		resolve(rp, RPS_LOADER, RPR_FAILED);
+		return 1;
+	}
+	return 0;
+}
+
+static bool try_fid(struct romprog *rp) {
+	if (rp->res[RPS_LOADER] == RPR_FAILED) {
+		resolve(rp, RPS_FID, RPR_FAILED);
+		return 1;
+	}
+	if (rp->res[RPS_LOADER] != RPR_OK) return 0;
+	if (!prefix_due(rp, RPS_FID)) return 0;
+	if (refresh_anchors(rp)) return 0;
+
+	u32 pos = find_fid(&rp->rf);
+	if ((pos != UINT32_MAX) && ((pos + FID_MAXSIZE) <= rp->anch_len)) {
+		resolve(rp, RPS_FID, RPR_OK);
+		return 1;
+	}
+	if (complete(rp)) {
+		resolve(rp, RPS_FID, RPR_FAILED);
+		return 1;
+	}
+	return 0;
+}
+
+/** end of the struct ramf fields, relative to p_ramf */
+static u32 ramf_span(const struct fidtype_t *ft) {
+	rel_offset fields[] = {ft->pRAMjump, ft->pRAM_DLAmax, ft->packs_start, ft->packs_end, ft->pIVT2, ft->pECUREC};
+	rel_offset max = 0;
+	unsigned idx;
+	for (idx = 0; idx < ARRAY_SIZE(fields); idx++) {
+		if (fields[idx] > max) max = fields[idx];
+	}
+	return (u32) max + 4;
+}
+
+static bool try_ramf(struct romprog *rp) {
+	struct romfile *rf = &rp->rf;
+
+	if (rp->res[RPS_FID] == RPR_FAILED) {
+		resolve(rp, RPS_RAMF, RPR_FAILED);
+		return 1;
+	}
+	if (rp->res[RPS_FID] != RPR_OK) return 0;
+
+	const struct fidtype_t *ft = rf->fidtype;
+	const struct fid_plan *fp = rf->plan;
+
+	switch (fp->ramf) {
+	case PLAN_NONE:
+		resolve(rp, RPS_RAMF, RPR_NA);
+		return 1;
+	case PLAN_ECUREC: {
+		//located from the end of the ROM
+		if (!complete(rp) || refresh_anchors(rp)) return 0;
+		//find_ramf() returns 0 if find_ecurec() failed
+		u32 pos = find_ramf(rf);
+		resolve(rp, RPS_RAMF, ((pos == UINT32_MAX) || !pos) ? RPR_FAILED : RPR_OK);
+		return 1;
+	}
+	case PLAN_RAMF:
+		break;
+	}
+
+	if (rp->ivt2_wait == UINT32_MAX) {
+		u32 need = rf->sfid_size + (u32) ft->pRAMF_maxdist + ramf_span(ft);
+		if (!romprog_have(rp, rf->p_fid, MIN(need, rf->siz - rf->p_fid))) return 0;
+		if (find_ramf(rf) == UINT32_MAX) {
+			resolve(rp, RPS_RAMF, RPR_FAILED);
+			return 1;
+		}
+		if (fp->ivt2 != PLAN_RAMF) {
+			resolve(rp, RPS_RAMF, RPR_OK);
+			return 1;
+		}
+		//find_ramf() validates IVT2 : wait until it's there
+		u32 ivt2 = reconst_32(&rf->buf[rf->p_ramf + ft->pIVT2]);
+		if ((ivt2 >= (rf->siz - IVT_MINSIZE)) || romprog_have(rp, ivt2, IVT_MINSIZE)) {
+			resolve(rp, RPS_RAMF, RPR_OK);
+			return 1;
+		}
+		rp->ivt2_wait = ivt2;
+		return 0;
+	}
+	if (!romprog_have(rp, rp->ivt2_wait, IVT_MINSIZE)) return 0;
+	resolve(rp, RPS_RAMF, (find_ramf(rf) == UINT32_MAX) ? RPR_FAILED : RPR_OK);
+	return 1;
+}
+
+static bool try_altcks(struct romprog *rp) {
+	struct romfile *rf = &rp->rf;
+
+	if ((rp->res[RPS_FID] == RPR_OK) && !rf->plan->altcks) {
+		resolve(rp, RPS_ALTCKS, RPR_NA);
+		return 1;
+	}
+	if ((rp->res[RPS_RAMF] == RPR_FAILED) || (rp->res[RPS_RAMF] == RPR_NA) ||
+		(rp->res[RPS_FID] == RPR_FAILED)) {
+		resolve(rp, RPS_ALTCKS, RPR_FAILED);
+		return 1;
+	}
+	if (rp->res[RPS_RAMF] != RPR_OK) return 0;
+	if (rf->p_acstart == UINT32_MAX) {
+		resolve(rp, RPS_ALTCKS, RPR_FAILED);
+		return 1;
+	}
+	if (!romprog_have(rp, rf->p_acstart, romfile_altcks_len(rf)) || !known_due(rp, RPS_ALTCKS)) return 0;
+
+	//the sums are searched anywhere in the ROM; only trust them in known data
+	rf->cks_alt_good = 0;
+	if (!validate_altcks(rf) && romprog_have(rp, rf->p_acs, 4) && romprog_have(rp, rf->p_acx, 4)) {
+		resolve(rp, RPS_ALTCKS, RPR_OK);
+		return 1;
+	}
+	rf->cks_alt_good = 0;
+	if (complete(rp)) {
+		resolve(rp, RPS_ALTCKS, RPR_FAILED);
+		return 1;
+	}
+	return 0;
+}
+
+static bool try_stdcks(struct romprog *rp) {
+	struct romfile *rf = &rp->rf;
+
+	if (rp->res[RPS_FID] == RPR_FAILED) {
+		resolve(rp, RPS_STDCKS, RPR_FAILED);
+		return 1;
+	}
+	if (rp->res[RPS_FID] != RPR_OK) return 0;
+	if (!rf->plan->stdcks) {
+		resolve(rp, RPS_STDCKS, RPR_NA);
+		return 1;
+	}
+	if (!complete(rp)) return 0;
+	resolve(rp, RPS_STDCKS, checksum_std(rf->buf, rf->siz, &rf->p_cks, &rf->p_ckx) ? RPR_FAILED : RPR_OK);
+	return 1;
+}
+
+static bool try_keys(struct romprog *rp) {
+	if (!rp->rf.romdb) {
+		resolve(rp, RPS_KEYS, RPR_NA);
+		return 1;
+	}
+	if (!known_due(rp, RPS_KEYS) || refresh_index(rp)) return 0;
+
+	rp->keyq = keyfinder_run(rp->rf.romdb, rp->rf.shidx, rp->buf, rp->rf.siz, &rp->s27k, &rp->s36k);
+	if (rp->keyq == KEYQ_STRAT_BOTH) {
+		//nothing can do better
+		resolve(rp, RPS_KEYS, RPR_OK);
+		return 1;
+	}
+	if (complete(rp)) {
+		resolve(rp, RPS_KEYS, (rp->keyq > KEYQ_UNK) ? RPR_OK : RPR_FAILED);
+		return 1;
+	}
+	return 0;
+}
+
+static bool try_eep(struct romprog *rp) {
+	if (!known_due(rp, RPS_EEP) || refresh_index(rp)) return 0;
+
+	find_eep(&rp->rf);
+	if (rp->rf.p_eepread) {
+		resolve(rp, RPS_EEP, RPR_OK);
+		return 1;
+	}
+	if (complete(rp)) {
+		resolve(rp, RPS_EEP, RPR_FAILED);
+		return 1;
+	}
+	return 0;
+}
+
+static bool (*const stage_try[RPS_MAX])(struct romprog *rp) = {
+	[RPS_LOADER] = try_loader,
+	[RPS_FID] = try_fid,
+	[RPS_RAMF] = try_ramf,
+	[RPS_ALTCKS] = try_altcks,
+	[RPS_STDCKS] = try_stdcks,
+	[RPS_KEYS] = try_keys,
+	[RPS_EEP] = try_eep,
+};
+
+int romprog_feed(struct romprog *rp, u32 offs, const u8 *data, u32 len) {
+	u32 idx;
+
+	assert(rp && rp->buf && data);
+	if ((offs > rp->rf.siz) || (len > (rp->rf.siz - offs))) {
+		ERR_PRINTF("block 0x%lX-0x%lX outside ROM\n", (unsigned long) offs, (unsigned long) (offs + len));
+		return -1;
+	}
+	memcpy(&rp->buf[offs], data, len);
+	for (idx = offs; idx < (offs + len); idx++) {
+		if (is_known(rp, idx)) continue;
+		rp->known[idx / 8] |= 1 << (idx % 8);
+		rp->nknown++;
+	}
+	while ((rp->prefix < rp->rf.siz) && is_known(rp, rp->prefix)) rp->prefix++;
+
+	//a stage that resolves can unblock the ones after it
+	bool progress;
+	do {
+		unsigned st;
+		progress = 0;
+		for (st = 0; st < RPS_MAX; st++) {
+			if (rp->res[st] != RPR_PENDING) continue;
+			progress |= stage_try[st](rp);
+		}
+	} while (progress);
+	return 0;
+}
@@ -0,0 +1,99 @@
+/* progressive analysis of a ROM that arrives in pieces, e.g. while it's being dumped
+ * (c) fenugrec 2022
+ * GPLv3
+ *
+ * Bytes are fed as they come in, in any order. Each finder runs once the part of the ROM it needs
+ * is known, and a callback reports every result as soon as it is final. Unknown bytes read as 0xFF.
+ *
+ * LOADER and FID are the first hits in the ROM : they need the whole start of the ROM up to them.
+ * RAMF (and IVT2) need the FID area and the IVT2 pointed to; alt cks needs its block, and the first
+ * known occurrence of the sums is kept. ECUREC types, the std checksum, and failures in general
+ * are only final once the whole ROM is known.
+ * Keyfinders and find_eep() are retried as more code arrives, and keys are final once code analysis
+ * finds both known keys (KEYQ_STRAT_BOTH); find_eep() once it finds eeprom_read().
+ *
+ * Typical use : romprog_init(), romprog_feed() for each block read, romprog_done().
+ */
+
+#ifndef NISROM_PROGRESSIVE_H
+#define NISROM_PROGRESSIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nis_romdb.h"
+#include "nisrom_keyfinders.h"
+#include "nisrom_romfile.h"
+#include "stypes.h"
+
+enum romprog_stage {
+	RPS_LOADER = 0,
+	RPS_FID,	//needs LOADER
+	RPS_RAMF,	//needs FID; includes IVT2 and the alt cks bounds
+	RPS_ALTCKS,	//needs RAMF
+	RPS_STDCKS,	//needs FID
+	RPS_KEYS,
+	RPS_EEP,
+	RPS_MAX
+};
+
+enum romprog_res {
+	RPR_PENDING = 0,
+	RPR_OK,
+	RPR_FAILED,	//not found, or a stage it needs failed
+	RPR_NA,	//not in the plan for this FID type
+};
+
+#define RPS_RETRY	0x10000	//retry the keyfinders etc. every time this much more code is known
+
+struct romprog;
+
+/** called once per stage, when its result is final. Results are in rp->rf, rp->keyq etc. */
+typedef void (*romprog_cb)(const struct romprog *rp, enum romprog_stage st, enum romprog_res res, void *data);
+
+struct romprog {
+	struct romfile rf;	//rf.buf is the ROM being filled in
+	enum romprog_res res[RPS_MAX];
+
+	//RPS_KEYS
+	enum key_quality keyq;
+	u32 s27k;
+	u32 s36k;
+
+	/* private */
+	u8 *buf;
+	u8 *known;	//bitmap, one bit per byte of buf
+	u32 nknown;	//bytes known so far
+	u32 prefix;	//[0, prefix[ is known
+	u32 tried[RPS_MAX];	//nknown or prefix at the last attempt
+	u32 anch_len;	//rf.anch covers [0, anch_len[
+	u32 idx_known;	//rf.shidx was built with this many bytes known
+	u32 ivt2_wait;	//RAMF parsed, waiting for the IVT2 there; UINT32_MAX if not
+	romprog_cb cb;
+	void *cbdata;
+};
+
+/** @param siz : final size of the ROM
+ * @param romdb : optional, for the keyfinders
+ * @param cb : optional
+ * @return 0 if ok; must be followed by romprog_done()
+ */
+int romprog_init(struct romprog *rp, u32 siz, nis_romdb *romdb, romprog_cb cb, void *cbdata);
+
+void romprog_done(struct romprog *rp);
+
+/** copy <len> bytes read at <offs>, and run every finder that can now progress.
+ * Callbacks are called from here.
+ * @return 0 if ok
+ */
+int romprog_feed(struct romprog *rp, u32 offs, const u8 *data, u32 len);
+
+/** @return 1 if [start, start + len[ is known */
+bool romprog_have(const struct romprog *rp, u32 start, u32 len);
+
+/** @return 1 once every stage is final */
+bool romprog_finished(const struct romprog *rp);
+
+const char *romprog_stage_name(enum romprog_stage st);
+
+#endif
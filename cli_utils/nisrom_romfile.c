@@ -0,0 +1,694 @@
+/* struct romfile and the structure finders shared by nisrom and nisromdiff
+ * (c) fenugrec 2014-2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>	//for offsetof()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nissan_romdefs.h"
+#include "nislib.h"
+#include "nislib_dat.h"
+#include "nislib_prof.h"
+#include "nislib_shindex.h"
+#include "nisrom_anchors.h"
+#include "nisrom_finders.h"
+#include "nisrom_romfile.h"
+#include "stypes.h"
+
+
+//load ROM, mapped read-only if possible
+//ret 0 if OK
+//caller MUST call close_rom() after
+int open_rom(struct romfile *rf, const char *fname) {
+	if (romimg_open(&rf->img, fname, 0)) {
+		return -1;
+	}
+	return romfile_attach(rf, fname);
+}
+
+/** use <buf> as the ROM contents; on error, rf->img is closed */
+static int attach_buf(struct romfile *rf, const char *name, const uint8_t *buf, u32 file_len) {
+	rf->hf = NULL;	//not needed
+	rf->filename = name;
+
+	if ((file_len > MAX_ROMSIZE) ||
+		(file_len < MIN_ROMSIZE)) {
+		ERR_PRINTF("unlikely file size %lu\n", (unsigned long) file_len);
+		if (!rf->force_parse) {
+			romimg_close(&rf->img);
+			return -1;
+		}
+	}
+	rf->siz = file_len;
+	rf->buf = buf;
+
+	return 0;
+}
+
+int romfile_attach(struct romfile *rf, const char *name) {
+	return attach_buf(rf, name, rf->img.buf, rf->img.siz);
+}
+
+/** decryption keys to try for a .dat : s36k2 then s36k1, of the romdb keyset for this ECUID
+ * or else of the keyset matching the built-in ECUID list.
+ * @return number of keys
+ */
+static unsigned dat_keys(nis_romdb *romdb, const char *fname, u32 keys[2]) {
+	char ecuid[ECUID_STR_LEN] = {0};
+	const struct keyset_t *ks = NULL;
+	unsigned nk = 0;
+
+	if (!romdb || !ecuid_from_filename(fname, ecuid)) return 0;
+
+	ks = romdb_q_keyset(romdb, ecuid);
+	if (!ks) {
+		struct ecuid_keymatch_t km;
+		if (romdb_nearest_keys(romdb, ecuid, &km, 1) && !km.dist) ks = find_knownkey(romdb, KEY_S27, km.key);
+	}
+	if (!ks) return 0;
+	if (ks->s36k2) keys[nk++] = ks->s36k2;
+	if (ks->s36k1 && (ks->s36k1 != ks->s36k2)) keys[nk++] = ks->s36k1;
+	return nk;
+}
+
+int open_rom_dat(struct romfile *rf, const char *fname, u32 scode) {
+	struct rom_image enc;
+	u32 keys[2];
+	unsigned nk, ki;
+	u32 p_cks, p_ckx;
+
+	uint64_t t0 = prof_start();
+	if (dat_unpack(fname, &enc, NULL)) {
+		return -1;
+	}
+	prof_stop(PT_DATUNPACK, t0);
+
+	if (scode) {
+		keys[0] = scode;
+		nk = 1;
+	} else {
+		nk = dat_keys(rf->romdb, fname, keys);
+	}
+	if (!nk) {
+		ERR_PRINTF("%s : no key for this ECUID, use -k\n", fname);
+		romimg_close(&enc);
+		return -1;
+	}
+
+	struct rom_image dec = {0};
+	dec.buf = rf->arena ? arena_alloc(rf->arena, enc.siz) : malloc(enc.siz);
+	if (!dec.buf) {
+		romimg_close(&enc);
+		return -1;
+	}
+	dec.siz = enc.siz;
+	if (!rf->arena) rf->img = dec;	//else the arena owns it
+
+	//a key is right if the std checksum is; else keep the first
+	u32 alen = enc.siz & ~3U;
+	t0 = prof_start();
+	for (ki = 0; ki < nk; ki++) {
+		dec1_buf(enc.buf, dec.buf, alen, keys[ki]);
+		if ((nk == 1) || !checksum_std(dec.buf, dec.siz, &p_cks, &p_ckx)) break;
+	}
+	if (ki == nk) {
+		DBG_PRINTF("%s : no key gives a valid std checksum, using %08lX\n", fname, (unsigned long) keys[0]);
+		ki = 0;
+		dec1_buf(enc.buf, dec.buf, alen, keys[0]);
+	}
+	memcpy(&dec.buf[alen], &enc.buf[alen], enc.siz - alen);	//partial u32 : copied as-is
+	DBG_PRINTF("%s : decrypted with key %08lX\n", fname, (unsigned long) keys[ki]);
+	prof_stop(PT_DATDEC, t0);
+	romimg_close(&enc);
+
+	return attach_buf(rf, fname, dec.buf, dec.siz);
+}
+
+/** close & free romfile contents
+ *
+ * safe to call multiple times or if nothing is open yet
+ */
+void close_rom(struct romfile *rf) {
+	if (!rf) return;
+	sh_index_free(rf->shidx);
+	rf->shidx = NULL;
+	anchors_free(rf->anch);
+	rf->anch = NULL;
+	romimg_close(&rf->img);
+	rf->buf = NULL;
+	if (rf->arena) arena_reset(rf->arena);
+	return;
+}
+
+
+int romfile_anchors(struct romfile *rf) {
+	assert(rf && rf->buf);
+	if (rf->anch) return 0;
+
+	uint64_t t0 = prof_start();
+	rf->anch = anchors_scan_arena(rf->buf, rf->siz, rf->arena);
+	prof_stop(PT_ANCHORS, t0);
+	prof_count(PC_BYTES_SCANNED, rf->siz);
+	if (!rf->anch) {
+		DBG_PRINTF("anchor scan failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+int romfile_index(struct romfile *rf) {
+	assert(rf && rf->buf);
+	if (rf->shidx) return 0;
+
+	uint64_t t0 = prof_start();
+	rf->shidx = sh_index_build_arena(rf->buf, rf->siz, rf->arena);
+	prof_stop(PT_INDEX, t0);
+	prof_count(PC_BYTES_SCANNED, rf->siz);
+	if (!rf->shidx) {
+		DBG_PRINTF("could not build code index\n");
+		return -1;
+	}
+	return 0;
+}
+
+/** find offset of LOADER struct if possible, update romfile struct
+ * ret -1 if not ok
+ */
+u32 find_loader(struct romfile *rf) {
+	const struct anchor_hit *hit;
+	const uint8_t *sl;
+	int loadv;
+
+	if (!rf) return -1;
+	if (!(rf->buf)) return -1;
+	assert(rf->anch);
+
+	rf->loader_v = L_UNK;
+
+	/* first "LOADER", backtrack to beginning of struct. */
+	hit = anchors_next(rf->anch, ANCH_LOADER, 0);
+	if (!hit) {
+		DBG_PRINTF("LOADER not found !\n");
+		return -1;
+	}
+	sl = &rf->buf[hit->pos];
+
+	//decode version #
+	if (sscanf((const char *) (sl + 6), "%d", &loadv) == 1) {
+		rf->loader_v = loadv;
+	}
+
+	//convert to file offset
+	rf->p_loader = (u32) (sl - rf->buf) - offsetof(struct loader_t, loader);
+
+	// this is the same for all loader verions:
+	rf->loader_cpu = &rf->buf[rf->p_loader + offsetof(struct loader_t, cpu)];
+
+	return rf->p_loader;
+}
+
+//parse second part of FID struct and fill altcks + ivt2 + rf->ramf-> stuff
+static void parse_ramf(struct romfile *rf) {
+	const struct fidtype_t *ft;	//helper
+	assert(rf);
+
+	ft = rf->fidtype;
+	const struct fid_plan *fp = rf->plan;	//another helper
+
+	if (fp->ramjump) {
+		rf->ramf.pRAMjump = reconst_32(&rf->buf[rf->p_ramf + ft->pRAMjump]);
+		rf->ramf.pRAM_DLAmax = reconst_32(&rf->buf[rf->p_ramf + ft->pRAM_DLAmax]);
+	}
+
+	//PLAN_ECUREC fields were already filled in by find_ecurec()
+	switch (fp->altcks) {
+	case PLAN_RAMF:
+		rf->p_acstart = reconst_32(&rf->buf[rf->p_ramf + ft->packs_start]);
+		rf->p_acend = reconst_32(&rf->buf[rf->p_ramf + ft->packs_end]);
+		break;
+	case PLAN_NONE:
+		rf->p_acstart = UINT32_MAX;
+		rf->p_acend = UINT32_MAX;
+		break;
+	case PLAN_ECUREC:
+		break;
+	}
+
+	switch (fp->ivt2) {
+	case PLAN_RAMF:
+		rf->p_ivt2 = reconst_32(&rf->buf[rf->p_ramf + ft->pIVT2]);
+		break;
+	case PLAN_NONE:
+		rf->p_ivt2 = UINT32_MAX;
+		break;
+	case PLAN_ECUREC:
+		break;
+	}
+
+	return;
+}
+
+
+//find offset of FID struct, parse & update romfile struct. find_loader() must have been run before calling this.
+//ret -1 if not ok
+u32 find_fid(struct romfile *rf) {
+	const uint8_t loadstr[]="LOADER";
+	const struct anchor_hit *hit;
+	const uint8_t *sf;
+	u32 sf_offset;	//offset in file
+
+	if (!rf) return -1;
+	if (!(rf->buf)) return -1;
+	assert(rf->anch);
+
+	rf->fid_ic = FID_UNK;
+
+	/* first "DATABASE" */
+	hit = anchors_next(rf->anch, ANCH_DATABASE, 0);
+	if (!hit) {
+		DBG_PRINTF("no DATABASE found !?\n");
+		return -1;
+	}
+	sf = &rf->buf[hit->pos];
+	//convert to file offset
+	//Luckily, the database member is at the same offset for all variants of struct fid.
+	sf_offset = (sf - rf->buf) - offsetof(struct fid_base1_t, database);
+
+	/* check if this was the LOADER database */
+	if (memcmp(sf - offsetof(struct loader_t, database), loadstr, 4) == 0 ) {
+		//next one, skipping the first instance
+		hit = anchors_next(rf->anch, ANCH_DATABASE, sf_offset + sizeof(struct loader_t));
+		if (!hit) {
+			DBG_PRINTF("no FID DATABASE found !\n");
+			return -1;
+		}
+		sf = &rf->buf[hit->pos];
+		//convert to file offset again
+		sf_offset = (sf - rf->buf) - offsetof(struct fid_base1_t, database);
+	}
+
+	//bounds check
+	if ((sf_offset + FID_MAXSIZE) >= rf->siz) {
+		DBG_PRINTF("Possibly incomplete / bad dump ? FID too close to end of ROM\n");
+		return -1;
+	}
+
+	rf->p_fid = sf_offset;
+
+	/* independant of loader version : */
+	rf->fid = &rf->buf[sf_offset + offsetof(struct fid_base1_t, FID)];
+	rf->fid_cpu = &rf->buf[sf_offset + offsetof(struct fid_base1_t, cpu)];
+
+	/* determine FID type : the scan already matched all known CPU strings */
+	hit = anchors_next(rf->anch, ANCH_FIDIC, sf_offset + offsetof(struct fid_base1_t, cpu));
+	if (hit && (&rf->buf[hit->pos] == rf->fid_cpu)) {
+		rf->fid_ic = (enum fidtype_ic) hit->val;
+	}
+	if (rf->fid_ic == FID_UNK) {
+		DBG_PRINTF("Unknown FID IC type %.8s ! Cannot proceed\n", rf->fid_cpu);
+		return -1;
+	}
+
+	rf->fidtype = &fidtypes[rf->fid_ic];
+	rf->plan = get_fidplan(rf->fid_ic);
+	if (rf->siz != (rf->fidtype->ROMsize)) {
+		DBG_PRINTF("Warning : ROM size %u k, expected %u k; possibly incomplete dump\n",
+				rf->siz / 1024, rf->fidtype->ROMsize / 1024);
+	}
+
+	rf->sfid_size = rf->fidtype->FIDbase_size;
+
+	return sf_offset;
+}
+
+u32 romfile_altcks_len(const struct romfile *rf) {
+	/* p_acstart is so far always u32 aligned, but not p_acend (usually 2 bytes before FID, except on some SH705828 ROMs....
+	 * This gives rise to some weird behavior where
+	 * sometimes the cks area includes the first u32 of the FID struct. I wonder if this was really intended by the Nissan devs !
+	 */
+	return (((rf->p_acend + 1) - rf->p_acstart) & (~0x03)) + 4;
+}
+
+/** validate alt cks block in pre-parsed romfile
+ * needs an altcks step in the plan
+ *
+ * @return 0 if ok
+ */
+int validate_altcks(struct romfile *rf) {
+	/* validate alt_cks block; it's a std algo that skips 2 u32 locs (altcks_s, altcks_x).
+	 * But it seems those locs are always outside the block?
+	 */
+	uint32_t acs=0, acx=0;
+	u32 altcs_bsize;
+	const uint8_t *pacs, *pacx;
+
+	assert(rf);
+	assert(rf->buf);
+	if (!rf->plan->altcks) return -1;
+
+	if ((rf->p_acstart == UINT32_MAX) ||
+		(rf->p_acend == UINT32_MAX) ||
+		(rf->p_acstart >= rf->p_acend)) {
+		return -1;
+	}
+
+	altcs_bsize = romfile_altcks_len(rf);
+
+	sum32(&rf->buf[rf->p_acstart], altcs_bsize, &acs, &acx);
+	prof_count(PC_BYTES_SCANNED, altcs_bsize);
+
+	TRACE(TC_CKS, TL_INFO, "alt cks block 0x%06lX - 0x%06lX: sumt=0x%08lX, xort=0x%08lX\n",
+		(unsigned long) rf->p_acstart, (unsigned long) rf->p_acend,
+			(unsigned long) acs, (unsigned long) acx);
+	pacs = u32memstr(rf->buf, rf->siz, acs);
+	pacx = u32memstr(rf->buf, rf->siz, acx);
+	prof_count(PC_BYTES_SCANNED, (pacs ? (u32) (pacs - rf->buf) : rf->siz) +
+				(pacx ? (u32) (pacx - rf->buf) : rf->siz));
+	if (!pacs || !pacx) {
+		TRACE(TC_CKS, TL_INFO, "altcks values not found in ROM, possibly unskipped vals or bad algo\n");
+		return -1;
+	} else {
+		rf->p_acs = (u32) (pacs - rf->buf);
+		rf->p_acx = (u32) (pacx - rf->buf);
+		TRACE(TC_CKS, TL_INFO, "confirmed altcks values found : acs @ 0x%lX, acx @ 0x%lX\n",
+				(unsigned long) rf->p_acs, (unsigned long) rf->p_acx);
+		rf->cks_alt_good = 1;
+		//TODO : validate altcks val offsets VS end-of-IVT2, i.e. they seem to be always @
+		// IVT2 + 0x400
+	}
+	return 0;
+}
+
+
+/* if ROM_HAS_ECUREC, try to locate &IVT2 near ROMEND
+ *
+ * ret 1 if ok and update romfile struct
+ */
+bool find_ecurec(struct romfile *rf) {
+	const struct fidtype_t *ft;
+	assert(rf);
+
+	ft = rf->fidtype;
+	if (rf->plan->ramf != PLAN_ECUREC) {
+		return 0;
+	}
+
+	bool found = 0;
+	rom_offset p_romend, temp_ivt2, pp_ecurec;
+
+	u32 start_offs = 0;
+	const u8 *ivt2_maybe = rf->buf;
+	for (; start_offs < (rf->siz - 100); start_offs = (u32) (ivt2_maybe - rf->buf)+4) {
+			// iterate over occurences of &IVT2; these are normally in the anchor table
+		u32 hitpos;
+		if (anchors_u32(rf->anch, ft->IVT2_expected, start_offs, &hitpos)) {
+			ivt2_maybe = (hitpos == UINT32_MAX) ? NULL : &rf->buf[hitpos];
+		} else {
+			ivt2_maybe = u32memstr(&rf->buf[start_offs], rf->siz - start_offs, ft->IVT2_expected);
+		}
+		if (!ivt2_maybe) {
+			return 0;
+		}
+		temp_ivt2 = (rom_offset) (ivt2_maybe - rf->buf);
+		pp_ecurec = temp_ivt2 - ft->pIVT2;
+		p_romend = pp_ecurec + ft->pROMend;
+		if (p_romend >= (rf->siz - 4)) {
+			continue;
+		}
+		u32 romend = reconst_32(&rf->buf[p_romend]);
+		if ((romend + 1) != (ft->ROMsize)) {
+			//IVT2/ROMEND field mismatch
+			continue;
+		}
+		//found !
+		found = 1;
+		break;
+	}
+	if (!found) {
+		DBG_PRINTF("IVT2/ROMEND not found\n");
+		return 0;
+	}
+	rf->p_ivt2 = ft->IVT2_expected;
+	rf->p_acstart = reconst_32(&rf->buf[pp_ecurec + ft->packs_start]);
+	rf->p_acend = reconst_32(&rf->buf[pp_ecurec + ft->packs_end]);
+	rf->p_ecurec = reconst_32(&rf->buf[pp_ecurec]);
+	return 1;
+}
+
+
+/** find & analyze 'struct ramf'
+ *
+ * @return 0 if ok
+ *
+ * it's right after struct fid, easy. The rom must already have
+ * loader and fid structs found (find_loader, find_fid)
+ *
+ * This only parses; the altcks / alt2 checksums are done by validate_altcks() and find_alt2cks().
+ */
+
+u32 find_ramf(struct romfile *rf) {
+	uint32_t testval;
+	const struct fidtype_t *ft;	//helper
+
+	assert(rf);
+	if ((rf->fid_ic == FID_UNK) ||
+		(rf->fid_ic >= FID_MAX) ||
+		(rf->p_fid == UINT32_MAX)) {
+		 return -1;
+	}
+
+	rf->p_ramf = rf->p_fid + rf->sfid_size;
+	ft = rf->fidtype;
+	const struct fid_plan *fp = rf->plan;	//helper
+
+	if (fp->ramf != PLAN_RAMF) {
+		// alternate structure : no RAMF, instead search for &IVT2 near ROMEND
+		if ((fp->ramf != PLAN_ECUREC) || !find_ecurec(rf)) {
+			DBG_PRINTF("not trying to find RAMF.\n");
+			return 0;
+		}
+	} else {
+		// try to find RAMF by looking for first member, typically FFFF8000.
+		testval = reconst_32(&rf->buf[rf->p_ramf]);
+		if (testval != ft->RAMF_header) {
+			long ramf_adj = 4;
+			long sign = 1;
+			DBG_PRINTF("Unlikely contents for struct ramf; got 0x%lX.\n",
+						(unsigned long) testval);
+			while (ramf_adj < ft->pRAMF_maxdist) {
+				//search around, in a pattern like +4, -4, +8, -8, +12  and then +16, +20 etc
+				testval = reconst_32(&rf->buf[rf->p_ramf + (sign * ramf_adj)]);
+				if (testval == ft->RAMF_header) {
+					DBG_PRINTF("probable RAMF found @ delta = %+d\n",
+								(int) (sign * ramf_adj));
+					rf->ramf_offset = (sign * ramf_adj);
+					rf->p_ramf += rf->ramf_offset;
+					break;
+				}
+				if (ramf_adj < 0x0c) {
+					sign = -sign;	//flip sign;
+					if (sign == 1) ramf_adj += 4;
+				} else {
+					sign = 1;
+					ramf_adj += 4;
+				}
+			}
+		}
+	}
+
+	parse_ramf(rf);
+
+	if (fp->altcks) {
+		if ((rf->p_acstart >= rf->siz) ||
+			(rf->p_acend >= rf->siz) ||
+			(rf->p_acstart >= rf->p_acend)) {
+			TRACE(TC_CKS, TL_INFO, "bad alt cks bounds; 0x%lX - 0x%lX\n",
+					(unsigned long) rf->p_acstart, (unsigned long) rf->p_acend);
+			rf->p_acstart = UINT32_MAX;
+			rf->p_acend = UINT32_MAX;
+		}
+	}
+
+	if (rf->p_ivt2 != UINT32_MAX) {
+		if (rf->p_ivt2 >= (rf->siz - IVT_MINSIZE)) {
+			DBG_PRINTF("warning : IVT2 value out of bound, probably due to unusual RAMF structure.\n");
+			rf->p_ivt2 = UINT32_MAX;
+		} else {
+			if (rf->p_ivt2 != ft->IVT2_expected) {
+				DBG_PRINTF("Unexpected IVT2 0x%lX ! Please report this\n", (unsigned long) rf->p_ivt2);
+			}
+			if (!check_ivt(&rf->buf[rf->p_ivt2], rf->siz - rf->p_ivt2)) {
+				DBG_PRINTF("Unlikely IVT2 location 0x%06lX :\n", (unsigned long) rf->p_ivt2);
+				DBG_PRINTF("%08lX %08lX %08lX %08lX...\n", (unsigned long) reconst_32(&rf->buf[rf->p_ivt2+0]),
+							(unsigned long) reconst_32(&rf->buf[rf->p_ivt2+4]),
+							(unsigned long) reconst_32(&rf->buf[rf->p_ivt2+8]),
+							(unsigned long) reconst_32(&rf->buf[rf->p_ivt2+12]));
+				rf->p_ivt2 = UINT32_MAX;	//run the bruteforce IVT2 search instead
+			}
+		}
+	}
+
+	// edge case for 705822 which does have ECUREC but still uses the "normal" method : need to define p_ecurec manually here
+	if (fp->ecurec == PLAN_RAMF) {
+		rf->p_ecurec = reconst_32(&rf->buf[rf->p_ramf + ft->pECUREC]);
+	}
+
+	rom_offset pecurec = rf->p_ecurec;
+
+	//display some LOADER > 80 specific garbage
+	if (fp->ecurec == PLAN_ECUREC) {
+		//parse ECUREC
+		if ((pecurec + 6) >= rf->siz) {
+			DBG_PRINTF("unlikely pecurec = %lX\n", (unsigned long) pecurec);
+			rf->p_ecurec = UINT32_MAX;
+		} else {
+			//skip leading '1'
+			DBG_PRINTF("probable ECUID @ %lX: %.*s\n",
+					(unsigned long) pecurec, 5,  &rf->buf[pecurec + 1]);
+		}
+	}
+
+	return rf->p_ramf;
+}
+
+/* find_ecuid() scoring. An ECUID without a romdb hit needs most of the shape and proximity points */
+#define ECUID_MAXRUN	24	//longer runs are text, not IDs (an ECUREC string is 22 chars)
+#define ECUID_NEAR	0x400	//"close to" FID / RAMF
+#define ECUID_MINSCORE	6
+
+static bool ecuid_near(u32 pos, rom_offset target) {
+	//unset offsets are 0 or UINT32_MAX
+	if (!target || (target == UINT32_MAX)) return 0;
+	return ((pos > target) ? (pos - target) : (target - pos)) < ECUID_NEAR;
+}
+
+/** @param pos : offset of the 5 chars in ecuid
+ * @param prefixed : preceded by '1', as in ECUREC
+ * @param runlen : length of the whole [0-9A-Z] run
+ */
+static int ecuid_score(const struct romfile *rf, const char *ecuid, u32 pos, bool prefixed, u32 runlen) {
+	unsigned digits = 0, idx;
+	int score = 0;
+
+	for (idx = 0; idx < ECUID_LEN; idx++) {
+		if ((ecuid[idx] >= '0') && (ecuid[idx] <= '9')) digits++;
+	}
+	//all-digit or all-letter runs are mostly tables and code
+	if (digits && (digits < ECUID_LEN)) score += 2;
+	if (prefixed) score += 2;
+	if (runlen == (ECUID_LEN + (u32) prefixed)) score += 1;
+
+	if (rf->p_ecurec && (rf->p_ecurec != UINT32_MAX) && (pos == rf->p_ecurec + 1)) {
+		score += 4;
+	} else if (ecuid_near(pos, rf->p_fid) || ecuid_near(pos, rf->p_ramf)) {
+		score += 2;
+	}
+
+	enum fidtype_ic ic = FID_UNK;
+	bool known = 0;
+	if (rf->romdb) {
+		ic = romdb_q_fidtype(rf->romdb, ecuid);
+		known = (ic != FID_UNK) || romdb_q_s27k(rf->romdb, ecuid);
+	}
+	if (known) score += 8;
+	if ((ic != FID_UNK) && (ic == rf->fid_ic)) score += 2;
+	return score;
+}
+
+u32 find_ecuid(struct romfile *rf) {
+	u32 pos = 0, start, len;
+	u32 best_pos = UINT32_MAX;
+	int best = ECUID_MINSCORE - 1;
+
+	rf->p_ecuid = UINT32_MAX;
+	rf->ecuid[0] = 0;
+
+	uint64_t t0 = prof_start();
+	while ((start = idchar_run(rf->buf, rf->siz, pos, ECUID_LEN, &len)) != UINT32_MAX) {
+		u32 k;
+		pos = start + len;
+		if (len > ECUID_MAXRUN) continue;
+
+		//windows at the start of the run, or right after a '1'
+		for (k = 0; (k + ECUID_LEN) <= len; k++) {
+			bool prefixed = k && (rf->buf[start + k - 1] == '1');
+			char cand[ECUID_STR_LEN];
+			int score;
+
+			if (k && !prefixed) continue;
+			memcpy(cand, &rf->buf[start + k], ECUID_LEN);
+			cand[ECUID_LEN] = 0;
+			score = ecuid_score(rf, cand, start + k, prefixed, len);
+			TRACE(TC_GEN, TL_DEBUG, "ECUID candidate %s @ %lX : score %d\n", cand, (unsigned long) (start + k), score);
+			if (score > best) {
+				best = score;
+				best_pos = start + k;
+				memcpy(rf->ecuid, cand, ECUID_STR_LEN);
+			}
+		}
+	}
+	prof_stop(PT_ECUID, t0);
+	prof_count(PC_BYTES_SCANNED, rf->siz);
+
+	if (best_pos == UINT32_MAX) return UINT32_MAX;
+	DBG_PRINTF("ECUID %s @ %lX, score %d\n", rf->ecuid, (unsigned long) best_pos, best);
+	rf->p_ecuid = best_pos;
+	return best_pos;
+}
+
+/* Locate RIPEMD-160 magic numbers */
+void find_rm160(struct romfile *rf) {
+	u32 rm1, rm2;
+	bool ok;
+
+	ok = anchors_u32(rf->anch, RM160_INIT0, 0, &rm1);
+	ok &= anchors_u32(rf->anch, RM160_INIT1, 0, &rm2);
+	assert(ok);
+	if ((rm1 != UINT32_MAX) && (rm2 != UINT32_MAX)) {
+		rf->has_rm160 = 1;
+	}
+}
+
+/** Locate cks_alt2 checksum. Starts at ECUREC; needs find_ramf() */
+void find_alt2cks(struct romfile *rf) {
+	rom_offset pecurec = rf->p_ecurec;
+
+	if (rf->plan->alt2cks &&
+		(pecurec < rf->siz) &&
+		(rf->p_ivt2 < rf->siz)) {
+
+		u32 p_as = 0, p_ax = 0;
+		u32 p_skip1, p_skip2;
+		p_skip1 = UINT32_MAX;
+		p_skip2 = (rf->p_ivt2 - 4) - pecurec;
+		rf->p_ac2start = pecurec;
+		uint64_t t0 = prof_start();
+		int a2rc = checksum_alt2(&rf->buf[pecurec], rf->siz - pecurec, &p_as, &p_ax, p_skip1, p_skip2);
+		prof_stop(PT_ALT2CKS, t0);
+		prof_count(PC_BYTES_SCANNED, rf->siz - pecurec);
+		if (a2rc == 0) {
+			rf->cks_alt2_good = 1;
+			rf->p_a2cs = p_as + pecurec;
+			rf->p_a2cx = p_ax + pecurec;
+		} else {
+			TRACE(TC_CKS, TL_INFO, "alt2 checksum not found ?? Bad algo, bad skip, or other problem...\n");
+		}
+	}
+}
+
+
+
+void find_eep(struct romfile *rf) {
+	uint32_t port;
+	uint32_t eepread = find_eepread(rf->shidx, rf->buf, rf->siz, &port);
+	if (eepread > 0) {
+		rf->p_eepread = eepread;
+		rf->eep_port = port;
+	}
+}
@@ -0,0 +1,164 @@
+/* struct romfile and the structure finders shared by nisrom and nisromdiff
+ * (c) fenugrec 2014-2022
+ * GPLv3
+ */
+
+#ifndef NISROM_ROMFILE_H
+#define NISROM_ROMFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nislib.h"
+#include "nislib_arena.h"
+#include "nislib_shindex.h"
+#include "nisrom_anchors.h"
+#include "nissan_romdefs.h"
+#include "nis_romdb.h"
+#include "stypes.h"
+
+// generic ROM struct. For the file offsets in here, UINT32_MAX signals invalid / inexistant target
+struct romfile {
+	FILE *hf;
+	const char *filename;
+	u32 siz;	//in bytes
+	const uint8_t *buf;	//points in img, or in arena for a decrypted .dat; read-only
+	struct rom_image img;
+	struct sh_index *shidx;	//code index of buf, shared by the finders
+	struct rom_anchors *anch;	//strings, IVTs etc. found by anchors_scan()
+	struct arena *arena;	//optional per-ROM scratch for the index, anchors etc. Reset by close_rom()
+
+	nis_romdb *romdb;	//shared between ROMs and threads : read-only here
+	bool force_parse;	//force parsing a ROM, ignoring errors as much as possible. Can cause segfaults
+
+	//and some metadata
+	rom_offset p_loader;	//struct loader
+	enum loadvers_t loader_v;	//version (10, 50, 60 etc)
+
+	rom_offset p_fid;	//location of struct fid_base
+	enum fidtype_ic fid_ic;
+	const struct fidtype_t *fidtype;
+	const struct fid_plan *plan;	//steps that apply to this fidtype
+
+	u32 sfid_size;	//sizeof correct struct fid_base
+	rom_offset p_ramf;	//location of struct ramf
+	rel_offset	ramf_offset;	//RAMF struct wasn't found where expected (offset != 0)
+
+	/* these point in buf, and so are not necessarily 0-terminated strings */
+	const uint8_t *loader_cpu;	//LOADERxx CPU code
+	const uint8_t *fid;	//firmware ID itself
+	const uint8_t *fid_cpu;	//FID CPU code
+
+	rom_offset p_cks;	//position of std_checksum sum
+	rom_offset p_ckx;	//position of std_checksum xor
+
+	rom_offset p_acs;	//pos of alt_cks sum
+	rom_offset p_acx;	//pos of alt_cks xor
+
+	rom_offset p_a2cs;
+	rom_offset p_a2cx;	//pos of alt2 cks sum, xor
+
+	/* real metadata here. Unknown values must be set to UINT32_MAX */
+	rom_offset p_ivt2;	//pos of alt. vector table
+	rom_offset p_acstart;	//start of alt_cks block
+	rom_offset p_acend;	//end of alt_cks block
+	rom_offset p_ecurec;	//if ROM_HAS_ECUREC
+
+	rom_offset p_ac2start;	//start of alt2 cks block (end is always ROMEND ?)
+	rom_offset p_ecuid;	//ECUID found in the ROM contents by find_ecuid()
+	char ecuid[ECUID_STR_LEN];	//0-terminated
+
+	rom_offset	p_eepread;	//address of eeprom_read() func
+	uint32_t	eep_port;	//PORT reg used for EEPROM pins
+
+	/* some flags */
+	bool	cks_alt_good;	//alt cks values found + valid
+	bool	cks_alt2_good;	//alt2 cks values found + valid
+	bool	has_rm160;	//RIPEMD160 hash found
+
+	struct ramf_unified ramf;	//not useful atm
+};
+
+
+/** load ROM, mapped read-only if possible.
+ * rf must be zeroed, except .romdb and .force_parse
+ * @return 0 if OK; caller MUST call close_rom() after
+ */
+int open_rom(struct romfile *rf, const char *fname);
+
+/** like open_rom(), for an image the caller already loaded in rf->img (e.g. from a nisstore).
+ * rf->img is taken over, and closed if this fails.
+ * @param name : shown as the filename; must stay valid until close_rom()
+ * @return 0 if OK; caller MUST call close_rom() after
+ */
+int romfile_attach(struct romfile *rf, const char *name);
+
+/** like open_rom(), for a .dat repro file : unpack and decrypt (algo 1) in memory.
+ * @param scode : key; if 0, try the s36k2 then s36k1 keys of the ECUID in the filename, and keep the
+ *	one that gives a valid std checksum. Needs rf->romdb
+ * @return 0 if OK; caller MUST call close_rom() after
+ */
+int open_rom_dat(struct romfile *rf, const char *fname, u32 scode);
+
+/** close & free romfile contents
+ *
+ * safe to call multiple times or if nothing is open yet
+ */
+void close_rom(struct romfile *rf);
+
+/** run anchors_scan() if not done yet; required by the finders below
+ * @return 0 if ok
+ */
+int romfile_anchors(struct romfile *rf);
+
+/** build rf->shidx if not done yet; required by find_eep and the keyfinders
+ * @return 0 if ok
+ */
+int romfile_index(struct romfile *rf);
+
+/** find offset of LOADER struct if possible, update romfile struct
+ * ret -1 if not ok
+ */
+u32 find_loader(struct romfile *rf);
+
+/** find offset of FID struct, parse & update romfile struct. find_loader() must have been run before calling this.
+ * ret -1 if not ok
+ */
+u32 find_fid(struct romfile *rf);
+
+/** find & parse 'struct ramf' (or ECUREC), needs find_fid()
+ * @return offset of RAMF, 0 if not applicable, -1 if error
+ */
+u32 find_ramf(struct romfile *rf);
+
+/** if ROM_HAS_ECUREC, try to locate &IVT2 near ROMEND
+ * ret 1 if ok and update romfile struct
+ */
+bool find_ecurec(struct romfile *rf);
+
+/** find the ECUID in the ROM contents, from the ECUID-shaped runs of [0-9A-Z] (see idchar_run()).
+ * Candidates are scored on their shape, romdb (or built-in list) hits and distance to FID / RAMF / ECUREC;
+ * the best one is kept if it scores high enough. Needs find_fid(), and find_ramf() for the RAMF / ECUREC part.
+ * @return its offset, and fills rf->ecuid; -1 if none
+ */
+u32 find_ecuid(struct romfile *rf);
+
+/** size in bytes of the alt cks block starting at p_acstart; p_acstart and p_acend must be valid */
+u32 romfile_altcks_len(const struct romfile *rf);
+
+/** validate alt cks block in pre-parsed romfile (needs find_ramf())
+ * @return 0 if ok
+ */
+int validate_altcks(struct romfile *rf);
+
+/** Locate cks_alt2 checksum. Starts at ECUREC; needs find_ramf() */
+void find_alt2cks(struct romfile *rf);
+
+/** Locate RIPEMD-160 magic numbers */
+void find_rm160(struct romfile *rf);
+
+/** find eeprom_read() and its port; needs romfile_index() */
+void find_eep(struct romfile *rf);
+
+#endif
@@ -0,0 +1,77 @@
+/* nisromdb : compile ECUID / keyset CSV files into a binary romdb,
+ * to be loaded with nisrom -D
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <getopt.h>
+
+#include "nislib.h"
+#include "nis_romdb.h"
+
+__thread FILE *dbg_stream;
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+		"**** Compile ROM db CSV files\n"
+		"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s [-e <ecuid.csv>]... [-k <keysets.csv>]... [-d <db.bin>] -o <out.bin>\n"
+		"\t-e: add ECUID csv (columns \"ECUID\", \"FID CPU\", \"s27k\")\n"
+		"\t-k: add keyset csv (columns \"s27k\", \"s36k1\", \"s36k2\")\n"
+		"\t-d: start from an existing compiled db\n"
+		"\t-o: output file\n"
+		"\tExample: %s -k ../romdb/keysets.csv -o ../romdb/romdb.bin\n", progname, progname);
+}
+
+int main(int argc, char *argv[]) {
+	const char *ofname = NULL;
+	nis_romdb *romdb;
+	int opt;
+	int rv = -1;
+
+	dbg_stream = stdout;
+
+	romdb = romdb_new();
+	if (!romdb) {
+		printf("trouble in romdb_new\n");
+		return -1;
+	}
+
+	while ((opt = getopt(argc, argv, "d:e:hk:o:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (!romdb_load_compiled(romdb, optarg)) goto exit;
+			break;
+		case 'e':
+			if (!romdb_ecuid_addcsv(romdb, optarg)) goto exit;
+			break;
+		case 'k':
+			if (!romdb_keyset_addcsv(romdb, optarg)) goto exit;
+			break;
+		case 'o':
+			ofname = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			goto exit;
+		}
+	}
+
+	if (!ofname || (optind != argc)) {
+		usage(argv[0]);
+		goto exit;
+	}
+
+	if (romdb_compile(romdb, ofname)) {
+		rv = 0;
+	}
+
+exit:
+	romdb_close(romdb);
+	return rv;
+}
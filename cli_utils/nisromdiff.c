@@ -0,0 +1,528 @@
+/* nisromdiff : analyze a family of ROMs (same FID type) against a base ROM.
+ *
+ * The base ROM gets a full analysis. Every other ROM is compared to it block by block;
+ * the cheap structure finders (LOADER, FID, RAMF) always run, but the results of the
+ * expensive ones are taken from the base ROM if none of their input blocks changed :
+ * - alt cks : the alt cks block, and everything up to the cks values (first occurence wins)
+ * - alt2 cks : ECUREC to end of ROM
+ * - keys : the blocks around the base ROM's key literals (see find_key_literal())
+ * - eeprom_read() : the function itself
+ * The std checksum covers the whole ROM, so it's only reused for identical ROMs.
+ *
+ * The keys and eeprom_read() rules are heuristics (both finders really depend on code all over
+ * the ROM); -V runs the full analysis as well, and reports any difference.
+ *
+ * Output is CSV, one line per ROM, base ROM first.
+ *
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+
+#include "nislib.h"
+#include "nisrom_keyfinders.h"
+#include "nisrom_romfile.h"
+#include "nis_romdb.h"
+#include "nissan_romdefs.h"
+#include "stypes.h"
+
+#include "uthash/utstring.h"
+
+__thread FILE *dbg_stream;
+
+#define KEYSET_CSV "../romdb/keysets.csv"	//default keyset db file, relative to this executable
+#define DEFAULT_BLOCKSIZE 0x1000
+#define EEPREAD_SPAN 0x100	//bytes of eeprom_read() considered its input
+#define MAX_RANGES 4	//changed ranges listed per ROM
+
+/* results that may be reused : RR_* bits */
+#define RR_STDCKS (1 << 0)
+#define RR_ALTCKS (1 << 1)
+#define RR_ALT2CKS (1 << 2)
+#define RR_KEYS (1 << 3)
+#define RR_EEP (1 << 4)
+
+static const char *rr_names[] = {"stdcks", "altcks", "alt2cks", "keys", "eep"};
+
+struct rom_result {
+	int std_good;	//-1 : not applicable
+	u32 p_cks, p_ckx;
+	int alt_good;
+	u32 p_acs, p_acx;
+	int alt2_good;
+	u32 p_a2cs, p_a2cx;
+	enum key_quality keyq;
+	u32 s27k, s36k;
+	u32 p_s27k, p_s36k;	//first occurence of the key literals, UINT32_MAX if none
+	u32 p_eepread, eep_port;
+	unsigned reused;	//RR_* bits
+};
+
+struct diff_opts {
+	nis_romdb *romdb;
+	u32 blocksize;
+	bool full;	//never reuse
+	bool verify;	//full analysis too, and compare
+};
+
+/* base ROM, kept open for the whole run */
+struct diff_base {
+	struct romfile rf;
+	struct rom_result res;
+};
+
+
+/** cheap stages, always run : anchors, LOADER, FID, RAMF.
+ * @return 0 if ok
+ */
+static int analyze_structs(struct romfile *rf) {
+	if (romfile_anchors(rf)) return -1;
+	if (find_loader(rf) == UINT32_MAX) {
+		DBG_PRINTF("no LOADER\n");
+	}
+	if (find_fid(rf) == UINT32_MAX) {
+		ERR_PRINTF("%s : no FID struct\n", rf->filename);
+		return -1;
+	}
+	(void) find_ramf(rf);
+	return 0;
+}
+
+static void run_stdcks(struct romfile *rf, struct rom_result *res) {
+	res->std_good = -1;
+	if (!rf->plan->stdcks) return;
+	res->std_good = !checksum_std(rf->buf, rf->siz, &res->p_cks, &res->p_ckx);
+}
+
+static void run_altcks(struct romfile *rf, struct rom_result *res) {
+	res->alt_good = -1;
+	if (!rf->plan->altcks) return;
+	if (rf->p_acstart != UINT32_MAX) (void) validate_altcks(rf);
+	res->alt_good = rf->cks_alt_good;
+	res->p_acs = rf->p_acs;
+	res->p_acx = rf->p_acx;
+}
+
+static void run_alt2cks(struct romfile *rf, struct rom_result *res) {
+	res->alt2_good = -1;
+	if (!rf->plan->alt2cks) return;
+	find_alt2cks(rf);
+	res->alt2_good = rf->cks_alt2_good;
+	res->p_a2cs = rf->p_a2cs;
+	res->p_a2cx = rf->p_a2cx;
+}
+
+/** @return 0 if ok */
+static int run_keys(struct romfile *rf, struct rom_result *res) {
+	if (romfile_index(rf)) return -1;
+	res->keyq = keyfinder_run(rf->romdb, rf->shidx, rf->buf, rf->siz, &res->s27k, &res->s36k);
+	res->p_s27k = UINT32_MAX;
+	res->p_s36k = UINT32_MAX;
+	if (res->keyq > KEYQ_UNK) {
+		res->p_s27k = find_key_literal(rf->buf, rf->siz, res->s27k);
+		res->p_s36k = find_key_literal(rf->buf, rf->siz, res->s36k);
+	}
+	return 0;
+}
+
+/** @return 0 if ok */
+static int run_eep(struct romfile *rf, struct rom_result *res) {
+	if (romfile_index(rf)) return -1;
+	rf->p_eepread = 0;
+	rf->eep_port = 0;
+	find_eep(rf);
+	res->p_eepread = rf->p_eepread;
+	res->eep_port = rf->eep_port;
+	return 0;
+}
+
+/** full analysis, after analyze_structs()
+ * @return 0 if ok
+ */
+static int analyze_full(struct romfile *rf, struct rom_result *res) {
+	memset(res, 0, sizeof(*res));
+	run_stdcks(rf, res);
+	run_altcks(rf, res);
+	run_alt2cks(rf, res);
+	if (run_keys(rf, res)) return -1;
+	return run_eep(rf, res);
+}
+
+
+/** changed[] : 1 per block of rf that differs from the base */
+struct blockdiff {
+	u32 blocksize;
+	u32 nblocks;
+	u8 *changed;
+	u32 nchanged;
+	u32 bytes;	//differing bytes
+};
+
+static bool blockdiff_new(struct blockdiff *bd, const struct romfile *base, const struct romfile *rf, u32 blocksize) {
+	u32 blk;
+
+	assert(base->siz == rf->siz);
+	bd->blocksize = blocksize;
+	bd->nblocks = (rf->siz + blocksize - 1) / blocksize;
+	bd->nchanged = 0;
+	bd->bytes = 0;
+	bd->changed = calloc(bd->nblocks, 1);
+	if (!bd->changed) return 0;
+
+	for (blk = 0; blk < bd->nblocks; blk++) {
+		u32 start = blk * blocksize;
+		u32 len = ((rf->siz - start) < blocksize) ? (rf->siz - start) : blocksize;
+		if (memcmp(&base->buf[start], &rf->buf[start], len) == 0) continue;
+
+		u32 idx;
+		bd->changed[blk] = 1;
+		bd->nchanged++;
+		for (idx = start; idx < (start + len); idx++) {
+			if (base->buf[idx] != rf->buf[idx]) bd->bytes++;
+		}
+	}
+	return 1;
+}
+
+/** @return 1 if any byte in [start, end[ changed. Bogus ranges count as changed */
+static bool range_changed(const struct blockdiff *bd, u32 start, u32 end) {
+	u32 blk;
+
+	if ((start >= end) || (end > (bd->nblocks * bd->blocksize))) return 1;
+	for (blk = start / bd->blocksize; blk <= ((end - 1) / bd->blocksize); blk++) {
+		if (bd->changed[blk]) return 1;
+	}
+	return 0;
+}
+
+/** input region of a split key literal with its high half at pos; changed if not found */
+static bool lit_changed(const struct blockdiff *bd, u32 pos) {
+	if (pos == UINT32_MAX) return 1;
+	return range_changed(bd, pos - MIN(pos, SPLITKEY_MAXDIST), pos + SPLITKEY_MAXDIST + 2);
+}
+
+/** analyze rf, reusing base results where possible.
+ * @return 0 if ok
+ */
+static int analyze_incremental(const struct diff_base *db, struct romfile *rf, const struct blockdiff *bd,
+				struct rom_result *res) {
+	const struct romfile *brf = &db->rf;
+	const struct rom_result *bres = &db->res;
+
+	memset(res, 0, sizeof(*res));
+
+	if (!bd->nchanged) {
+		*res = *bres;
+		res->reused = RR_STDCKS | RR_ALTCKS | RR_ALT2CKS | RR_KEYS | RR_EEP;
+		return 0;
+	}
+	run_stdcks(rf, res);
+
+	if ((rf->p_acstart == brf->p_acstart) && (rf->p_acend == brf->p_acend) &&
+		(bres->alt_good == 1) &&
+		!range_changed(bd, rf->p_acstart, rf->p_acend + 1) &&
+		!range_changed(bd, 0, ((bres->p_acs > bres->p_acx) ? bres->p_acs : bres->p_acx) + 4)) {
+		res->alt_good = bres->alt_good;
+		res->p_acs = bres->p_acs;
+		res->p_acx = bres->p_acx;
+		res->reused |= RR_ALTCKS;
+	} else {
+		run_altcks(rf, res);
+	}
+
+	if ((rf->p_ecurec == brf->p_ecurec) && (rf->p_ivt2 == brf->p_ivt2) &&
+		!range_changed(bd, rf->p_ecurec, rf->siz)) {
+		res->alt2_good = bres->alt2_good;
+		res->p_a2cs = bres->p_a2cs;
+		res->p_a2cx = bres->p_a2cx;
+		res->reused |= RR_ALT2CKS;
+	} else {
+		run_alt2cks(rf, res);
+	}
+
+	if ((bres->keyq > KEYQ_UNK) && !lit_changed(bd, bres->p_s27k) && !lit_changed(bd, bres->p_s36k)) {
+		res->keyq = bres->keyq;
+		res->s27k = bres->s27k;
+		res->s36k = bres->s36k;
+		res->p_s27k = bres->p_s27k;
+		res->p_s36k = bres->p_s36k;
+		res->reused |= RR_KEYS;
+	} else if (run_keys(rf, res)) {
+		return -1;
+	}
+
+	if (bres->p_eepread && !range_changed(bd, bres->p_eepread, bres->p_eepread + EEPREAD_SPAN)) {
+		res->p_eepread = bres->p_eepread;
+		res->eep_port = bres->eep_port;
+		res->reused |= RR_EEP;
+	} else if (run_eep(rf, res)) {
+		return -1;
+	}
+	return 0;
+}
+
+/** @return 1 if both analyses agree */
+static bool results_match(const struct rom_result *a, const struct rom_result *b) {
+	struct rom_result ta = *a, tb = *b;
+	ta.reused = tb.reused = 0;
+	return memcmp(&ta, &tb, sizeof(ta)) == 0;
+}
+
+
+static void print_header(void) {
+	printf("\"file\",\"FID\",\"changed_blocks\",\"changed_bytes\",\"changed_ranges\","
+		"\"std cks?\",\"alt cks?\",\"alt2 cks?\",\"keyset quality\",\"s27k\",\"s36k1\","
+		"\"&EEPROM_read()\",\"EEPROM PORT\",\"reused\"\n");
+}
+
+/** "0x1000-0x2FFF;..." : coalesced changed blocks, at most MAX_RANGES */
+static void print_ranges(const struct blockdiff *bd) {
+	u32 blk = 0;
+	unsigned nranges = 0;
+
+	putchar('"');
+	while (blk < bd->nblocks) {
+		if (!bd->changed[blk]) {
+			blk++;
+			continue;
+		}
+		u32 first = blk;
+		while ((blk < bd->nblocks) && bd->changed[blk]) blk++;
+		if (nranges == MAX_RANGES) {
+			printf(";...");
+			break;
+		}
+		printf("%s0x%lX-0x%lX", nranges ? ";" : "", (unsigned long) (first * bd->blocksize),
+				(unsigned long) (blk * bd->blocksize - 1));
+		nranges++;
+	}
+	putchar('"');
+}
+
+static void print_cks(int good) {
+	if (good < 0) {
+		printf(",");
+	} else {
+		printf(",%d", good);
+	}
+}
+
+static void print_row(const struct romfile *rf, const struct blockdiff *bd, const struct rom_result *res, bool is_base) {
+	unsigned bit;
+	bool any = 0;
+
+	printf("\"%s\",\"%.*s\",", rf->filename, (int) sizeof(((struct fid_base1_t *)NULL)->FID), (const char *) rf->fid);
+	if (bd) {
+		printf("%lu,%lu,", (unsigned long) bd->nchanged, (unsigned long) bd->bytes);
+		print_ranges(bd);
+	} else {
+		printf("0,0,\"\"");
+	}
+	print_cks(res->std_good);
+	print_cks(res->alt_good);
+	print_cks(res->alt2_good);
+	printf(",%d", res->keyq);
+	if (res->keyq > KEYQ_UNK) {
+		printf(",0x%08lX,0x%08lX", (unsigned long) res->s27k, (unsigned long) res->s36k);
+	} else {
+		printf(",,");
+	}
+	if (res->p_eepread) {
+		printf(",0x%lX,0x%08lX", (unsigned long) res->p_eepread, (unsigned long) res->eep_port);
+	} else {
+		printf(",,");
+	}
+
+	printf(",\"");
+	if (is_base) {
+		printf("base");
+	} else {
+		for (bit = 0; bit < ARRAY_SIZE(rr_names); bit++) {
+			if (!(res->reused & (1U << bit))) continue;
+			printf("%s%s", any ? "+" : "", rr_names[bit]);
+			any = 1;
+		}
+		if (!any) printf("none");
+	}
+	printf("\"\n");
+}
+
+
+/** analyze and print one ROM of the family
+ * @return 0 if ok
+ */
+static int diff_rom(const struct diff_base *db, const char *fname, const struct diff_opts *opts, unsigned *mismatches) {
+	struct romfile rf = {0};
+	struct blockdiff bd = {0};
+	struct rom_result res;
+	int rc = -1;
+
+	rf.romdb = opts->romdb;
+	if (open_rom(&rf, fname)) {
+		ERR_PRINTF("Trouble in open_rom(%s)\n", fname);
+		return -1;
+	}
+	DBG_PRINTF("\n********************\n**** nisromdiff : %s\n", fname);
+	if (analyze_structs(&rf)) goto exit;
+	if ((rf.fid_ic != db->rf.fid_ic) || (rf.siz != db->rf.siz)) {
+		ERR_PRINTF("%s : not the same FID type / size as the base ROM, skipping\n", fname);
+		goto exit;
+	}
+	if (!blockdiff_new(&bd, &db->rf, &rf, opts->blocksize)) goto exit;
+
+	if (opts->full) {
+		if (analyze_full(&rf, &res)) goto exit;
+	} else {
+		if (analyze_incremental(db, &rf, &bd, &res)) goto exit;
+	}
+
+	if (opts->verify && !opts->full) {
+		struct rom_result fres;
+		struct romfile vrf = {0};
+
+		//fresh romfile : the finders keep some state in there
+		vrf.romdb = opts->romdb;
+		if (open_rom(&vrf, fname) || analyze_structs(&vrf) || analyze_full(&vrf, &fres)) {
+			close_rom(&vrf);
+			goto exit;
+		}
+		close_rom(&vrf);
+		if (!results_match(&res, &fres)) {
+			ERR_PRINTF("%s : reused results differ from a full analysis !\n", fname);
+			(*mismatches)++;
+		}
+	}
+
+	print_row(&rf, &bd, &res, 0);
+	rc = 0;
+
+exit:
+	free(bd.changed);
+	close_rom(&rf);
+	return rc;
+}
+
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+			"**** Analyze a family of ROMs (same FID type) against a base ROM\n"
+			"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s <BASE_ROM> <ROM> [ROM...] [OPTIONS]\n"
+			"OPTIONS:\n"
+			"\t-b <bytes>: block size for comparisons (default 0x%X)\n"
+			"\t-D <file>: use compiled romdb (see nisromdb) instead of " KEYSET_CSV "\n"
+			"\t-f: full analysis of every ROM, no reuse\n"
+			"\t-V: verify : also run a full analysis of every ROM, report differences\n"
+			"\t-h: show this help\n", progname, DEFAULT_BLOCKSIZE);
+}
+
+int main(int argc, char *argv[]) {
+	struct diff_opts opts = {.blocksize = DEFAULT_BLOCKSIZE};
+	struct diff_base db = {0};
+	const char *db_fname = NULL;
+	unsigned failed = 0, mismatches = 0;
+	int c, optidx;
+
+	while ((c = getopt(argc, argv, "b:D:fhV")) != -1) {
+		switch (c) {
+		case 'b':
+			opts.blocksize = (u32) strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			db_fname = optarg;
+			break;
+		case 'f':
+			opts.full = 1;
+			break;
+		case 'V':
+			opts.verify = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	if ((argc - optind) < 2) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (!opts.blocksize) {
+		ERR_PRINTF("bad block size\n");
+		return -1;
+	}
+
+	dbg_stream = tmpfile();	//before calling nislib funcs
+	if (!dbg_stream) {
+		ERR_PRINTF("tmpfile() trouble\n");
+		return -1;
+	}
+
+	opts.romdb = romdb_new();
+	if (!opts.romdb) {
+		ERR_PRINTF("trouble in romdb_new\n");
+		goto badexit;
+	}
+	if (db_fname) {
+		if (!romdb_load_compiled(opts.romdb, db_fname)) {
+			ERR_PRINTF("trouble loading %s\n", db_fname);
+			goto badexit;
+		}
+	} else {
+		//keyset csv is relative to the executable, same as nisrom
+		const char *slash = strrchr(argv[0], '/');
+		UT_string csvpath;
+		utstring_init(&csvpath);
+		if (slash) utstring_bincpy(&csvpath, argv[0], (size_t) (slash + 1 - argv[0]));
+		utstring_printf(&csvpath, "%s", KEYSET_CSV);
+		bool ok = romdb_keyset_addcsv(opts.romdb, utstring_body(&csvpath));
+		utstring_done(&csvpath);
+		if (!ok) {
+			ERR_PRINTF("csv trouble\n");
+			goto badexit;
+		}
+	}
+
+	db.rf.romdb = opts.romdb;
+	if (open_rom(&db.rf, argv[optind])) {
+		ERR_PRINTF("Trouble in open_rom(%s)\n", argv[optind]);
+		goto badexit;
+	}
+	if (analyze_structs(&db.rf) || analyze_full(&db.rf, &db.res)) {
+		ERR_PRINTF("Could not analyze base ROM %s\n", argv[optind]);
+		goto badexit;
+	}
+
+	print_header();
+	print_row(&db.rf, NULL, &db.res, 1);
+
+	for (optidx = optind + 1; optidx < argc; optidx++) {
+		if (diff_rom(&db, argv[optidx], &opts, &mismatches)) failed++;
+	}
+
+	if (failed) {
+		ERR_PRINTF("%u / %d files could not be analyzed\n", failed, argc - optind - 1);
+	}
+	if (opts.verify) {
+		ERR_PRINTF("verify : %u mismatches\n", mismatches);
+	}
+	close_rom(&db.rf);
+	romdb_close(opts.romdb);
+	fclose(dbg_stream);
+	return (failed || mismatches) ? -1 : 0;
+
+badexit:
+	close_rom(&db.rf);
+	if (opts.romdb) romdb_close(opts.romdb);
+	fclose(dbg_stream);
+	return -1;
+}
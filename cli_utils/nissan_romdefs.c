@@ -6,6 +6,7 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "nissan_romdefs.h"
@@ -219,13 +220,79 @@ const struct fidtype_t fidtypes[] = {
 			},
 };	//fidtypes[]
 
+/* lookup key : the 4 trailing characters, e.g. '5','5','0','7' for "SH705507" */
+static u32 fidic_key(const u8 cpustring[FIDTYPE_LEN]) {
+	return ((u32) cpustring[4] << 24) | ((u32) cpustring[5] << 16) | ((u32) cpustring[6] << 8) | (u32) cpustring[7];
+}
+
+static u32 fidkeys[FID_MAX];	//fidic_key() of every fidtypes[] entry
+static pthread_once_t fidkeys_once = PTHREAD_ONCE_INIT;
+
+static void fidkeys_init(void) {
+	unsigned fti, other;
+
+	for (fti = FID_UNK + 1; fti < FID_MAX; fti++) {
+		fidkeys[fti] = fidic_key(fidtypes[fti].FIDIC);
+		for (other = FID_UNK + 1; other < fti; other++) {
+			//a duplicate tail would hide the later entry
+			assert(fidkeys[other] != fidkeys[fti]);
+		}
+	}
+}
+
 enum fidtype_ic get_fidtype(const u8 cpustring[FIDTYPE_LEN]) {
 	assert(cpustring);
-	unsigned fid_idx;
-	for (fid_idx = 0; fid_idx < FID_MAX; fid_idx++) {
-		if (memcmp(cpustring, fidtypes[fid_idx].FIDIC, FIDTYPE_LEN) == 0) {
-			return fid_idx;
-		}
+	unsigned fti;
+
+	pthread_once(&fidkeys_once, fidkeys_init);
+
+	/* the trailing chars are unique across fidtypes[], so compare those first,
+	 * and one memcmp to reject other strings with the same tail.
+	 */
+	const u32 key = fidic_key(cpustring);
+	for (fti = FID_UNK + 1; fti < FID_MAX; fti++) {
+		if (fidkeys[fti] != key) continue;
+		if (memcmp(cpustring, fidtypes[fti].FIDIC, FIDTYPE_LEN) != 0) break;
+		return (enum fidtype_ic) fti;
 	}
 	return FID_UNK;
 }
+
+static struct fid_plan fidplans[FID_MAX];
+static pthread_once_t plans_once = PTHREAD_ONCE_INIT;
+
+static void plans_init(void) {
+	unsigned fti;
+
+	for (fti = FID_UNK + 1; fti < FID_MAX; fti++) {
+		const struct fidtype_t *ft = &fidtypes[fti];
+		struct fid_plan *fp = &fidplans[fti];
+		unsigned features = ft->features;
+
+		if (ft->RAMF_header) {
+			fp->ramf = PLAN_RAMF;
+		} else if (features & ROM_HAS_ECUREC) {
+			fp->ramf = PLAN_ECUREC;
+		}
+
+		if (features & ROM_HAS_ALTCKS) {
+			assert(ft->packs_start);
+			fp->altcks = (fp->ramf == PLAN_ECUREC) ? PLAN_ECUREC : PLAN_RAMF;
+		}
+		if (ft->pIVT2) {
+			fp->ivt2 = (fp->ramf == PLAN_ECUREC) ? PLAN_ECUREC : PLAN_RAMF;
+		}
+		assert(!(features & ROM_HAS_IVT2) == !fp->ivt2);
+		fp->ecurec = (features & ROM_HAS_ECUREC) ? PLAN_ECUREC : PLAN_RAMF;
+
+		fp->ramjump = (ft->pRAMjump != 0);
+		fp->stdcks = !!(features & ROM_HAS_STDCKS);
+		fp->alt2cks = !!(features & ROM_HAS_ALT2CKS);
+	}
+}
+
+const struct fid_plan *get_fidplan(enum fidtype_ic fti) {
+	assert(fti < FID_MAX);
+	pthread_once(&plans_once, plans_init);
+	return &fidplans[fti];
+}
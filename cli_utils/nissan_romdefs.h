@@ -9,6 +9,7 @@
 #ifndef NISSAN_ROMDEFS_H
 #define NISSAN_ROMDEFS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "stypes.h"
@@ -153,6 +154,28 @@ extern const struct fidtype_t fidtypes[];
  */
 enum fidtype_ic get_fidtype(const u8 cpustring[FIDTYPE_LEN]);
 
+/** analysis plan for a FID type : the features and optional offsets of its fidtype_t, resolved once
+ * into which steps apply and where each one gets its input.
+ */
+enum plan_src {
+	PLAN_NONE=0,	//step doesn't apply
+	PLAN_RAMF,	//field read from struct ramf
+	PLAN_ECUREC,	//field found by find_ecurec()
+};
+
+struct fid_plan {
+	enum plan_src ramf;	//how p_ramf is located : after FID + RAMF_header search, or via ECUREC
+	enum plan_src altcks;	//alt cks bounds
+	enum plan_src ivt2;
+	enum plan_src ecurec;	//p_ecurec. PLAN_RAMF is the "normal method" edge case of 705822
+	bool ramjump;	//pRAMjump / pRAM_DLAmax fields
+	bool stdcks;
+	bool alt2cks;
+};
+
+/** @return plan for that FID type; FID_UNK gives a plan with every step disabled */
+const struct fid_plan *get_fidplan(enum fidtype_ic fti);
+
 /* hold data in a single format once the specific structure is parsed,
  * this is not found in any ROM but is useful for comparing metadata
  */
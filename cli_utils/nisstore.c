@@ -0,0 +1,146 @@
+/* nisstore : maintain a deduplicating archive of ROM dumps (see nislib_store.h).
+ * Images in a store can be analyzed directly with nisrom -S.
+ * (c) fenugrec 2022
+ * GPLv3
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ecuid_list.h"
+#include "nislib.h"
+#include "nislib_store.h"
+
+__thread FILE *dbg_stream;
+
+static void usage(const char *progname) {
+	printf(	"**** %s\n"
+		"**** ROM archive with deduplicated storage\n"
+		"**** (c) 2022 fenugrec\n", progname);
+	printf("Usage:\t%s <STORE> add <ROMFILE>... : add ROMs; the ECUID is taken from the filename if possible\n"
+		"\t%s <STORE> ls : list images, and storage used\n"
+		"\t%s <STORE> get <KEY> <OUTFILE> : extract the first image matching KEY (MD5, ECUID or filename)\n"
+		"\tSTORE is the path without the .idx / .dat / .sum suffixes, e.g. ../roms/archive\n",
+		progname, progname, progname);
+}
+
+static int cmd_add(const char *stname, int nfiles, char **files) {
+	struct nisstore *st = nisstore_open(stname, 1);
+	unsigned added = 0, dups = 0, failed = 0;
+	int idx;
+
+	if (!st) return -1;
+
+	for (idx = 0; idx < nfiles; idx++) {
+		struct rom_image img = {0};
+		char ecuid[ECUID_STR_LEN] = {0};
+
+		if (romimg_open(&img, files[idx], 0)) {
+			failed++;
+			continue;
+		}
+		ecuid_from_filename(files[idx], ecuid);
+		switch (nisstore_add(st, img.buf, img.siz, files[idx], ecuid)) {
+		case NISSTORE_ADDED:
+			added++;
+			break;
+		case NISSTORE_DUP:
+			printf("%s : already in store\n", files[idx]);
+			dups++;
+			break;
+		default:
+			ERR_PRINTF("could not add %s\n", files[idx]);
+			failed++;
+			break;
+		}
+		romimg_close(&img);
+	}
+
+	int rv = 0;
+	if (!nisstore_save(st)) {
+		ERR_PRINTF("could not save %s\n", stname);
+		rv = -1;
+	}
+	nisstore_close(st);
+	printf("%u added, %u duplicates, %u failed\n", added, dups, failed);
+	return (rv || failed) ? -1 : 0;
+}
+
+static int cmd_ls(const char *stname) {
+	struct nisstore *st = nisstore_open(stname, 0);
+	unsigned idx;
+	uint64_t stored, logical;
+
+	if (!st) return -1;
+
+	for (idx = 0; idx < nisstore_count(st); idx++) {
+		const struct nisstore_img *si = nisstore_get(st, idx);
+		printf("%s\t%s\t%lu\t%s\n", si->md5, si->ecuid[0] ? si->ecuid : "-",
+				(unsigned long) si->siz, si->name);
+	}
+	nisstore_stats(st, &stored, &logical);
+	printf("%u images, %llu bytes in %llu bytes of chunks (%.1f:1)\n", nisstore_count(st),
+			(unsigned long long) logical, (unsigned long long) stored,
+			stored ? ((double) logical / stored) : 0.0);
+	nisstore_close(st);
+	return 0;
+}
+
+static int cmd_get(const char *stname, const char *key, const char *ofname) {
+	struct nisstore *st = nisstore_open(stname, 0);
+	struct rom_image img;
+	int rv = -1;
+
+	if (!st) return -1;
+
+	int idx = nisstore_find(st, key, -1);
+	if (idx < 0) {
+		ERR_PRINTF("no image matching %s\n", key);
+		goto exit;
+	}
+	if (nisstore_map(st, (unsigned) idx, &img)) {
+		ERR_PRINTF("can't read image %s\n", key);
+		goto exit;
+	}
+
+	FILE *fo = fopen(ofname, "wb");
+	if (!fo) {
+		ERR_PRINTF("can't open %s\n", ofname);
+	} else {
+		if (fwrite(img.buf, 1, img.siz, fo) == img.siz) rv = 0;
+		if (fclose(fo)) rv = -1;
+		if (rv) ERR_PRINTF("trouble writing %s\n", ofname);
+	}
+	romimg_close(&img);
+exit:
+	nisstore_close(st);
+	return rv;
+}
+
+int main(int argc, char *argv[]) {
+	dbg_stream = tmpfile();
+	if (!dbg_stream) dbg_stream = stdout;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	const char *stname = argv[1];
+	const char *cmd = argv[2];
+
+	if (!strcmp(cmd, "add") && (argc > 3)) {
+		return cmd_add(stname, argc - 3, &argv[3]);
+	}
+	if (!strcmp(cmd, "ls") && (argc == 3)) {
+		return cmd_ls(stname);
+	}
+	if (!strcmp(cmd, "get") && (argc == 5)) {
+		return cmd_get(stname, argv[3], argv[4]);
+	}
+	usage(argv[0]);
+	return -1;
+}
@@ -0,0 +1,147 @@
+/* test nislib_ckpatch on a synthetic image : nested std / alt / alt2 style regions */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+#include "nislib_ckpatch.h"
+
+__thread FILE *dbg_stream;
+
+#define TEST_SIZ	(256 * 1024UL)
+
+/* like the nisrom layouts : alt values outside the alt block, alt2 block up to the end
+ * (with an unaligned start, to test that too), std over everything
+ */
+#define ALT_START	0x1000
+#define ALT_LEN	0x7000
+#define P_ACS	0x8400
+#define P_ACX	0x8404
+#define ALT2_START	0x20002
+#define P_A2CS	0x30002
+#define P_A2CX	0x30006
+#define P_A2SKIP	0x3000A
+#define P_CKS	0x10010
+#define P_CKX	0x10014
+#define P_CORR	0x10000
+
+static u32 lcg = 12345;
+static u8 rnd8(void) {
+	lcg = lcg * 1103515245 + 12345;
+	return (u8) (lcg >> 16);
+}
+
+static void add_regions(struct ckpatch *cp, enum ckfix stdfix, u32 p_cks) {
+	struct ck_region alt = {
+		.name = "alt", .start = ALT_START, .len = ALT_LEN,
+		.p_sum = P_ACS, .p_xor = P_ACX, .p_skip = UINT32_MAX,
+	};
+	struct ck_region alt2 = {
+		.name = "alt2", .start = ALT2_START, .len = TEST_SIZ - ALT2_START,
+		.p_sum = P_A2CS, .p_xor = P_A2CX, .p_skip = P_A2SKIP,
+	};
+	struct ck_region std = {
+		.name = "std", .start = 0, .len = TEST_SIZ,
+		.p_sum = p_cks, .p_xor = p_cks + 4, .p_skip = UINT32_MAX,
+		.fix = stdfix, .p_corr = P_CORR,
+	};
+	//std first, so that the fix order has to come from the region layout
+	if (ckpatch_addregion(cp, &std) || ckpatch_addregion(cp, &alt) || ckpatch_addregion(cp, &alt2)) {
+		printf("addregion failed\n");
+		exit(-1);
+	}
+}
+
+static void random_patches(struct ckpatch *cp, unsigned n) {
+	while (n--) {
+		u8 data[16];
+		unsigned len = 1 + (rnd8() % sizeof(data));
+		u32 offs = (((u32) rnd8() << 16) | ((u32) rnd8() << 8) | rnd8()) % (TEST_SIZ - len);
+		unsigned idx;
+		for (idx = 0; idx < len; idx++) data[idx] = rnd8();
+		(void) ckpatch_write(cp, offs, data, len);	//refused when hitting check words, that's ok
+	}
+}
+
+/* checks with the nisrom finders, independently of ckpatch */
+static bool verify(const u8 *buf, u32 p_cks) {
+	u32 s, x, ps, px;
+	bool ok = 1;
+
+	sum32(&buf[ALT_START], ALT_LEN, &s, &x);
+	if ((reconst_32(&buf[P_ACS]) != s) || (reconst_32(&buf[P_ACX]) != x)) {
+		printf("alt bad\n");
+		ok = 0;
+	}
+	if (checksum_alt2(&buf[ALT2_START], TEST_SIZ - ALT2_START, &ps, &px, UINT32_MAX, P_A2SKIP - ALT2_START) ||
+		(ps + ALT2_START != P_A2CS) || (px + ALT2_START != P_A2CX)) {
+		printf("alt2 bad\n");
+		ok = 0;
+	}
+	if (checksum_std(buf, TEST_SIZ, &ps, &px) || (ps != p_cks) || (px != p_cks + 4)) {
+		printf("std bad\n");
+		ok = 0;
+	}
+	return ok;
+}
+
+static bool test_one(u8 *buf, enum ckfix stdfix, unsigned npatches) {
+	struct ckpatch cp;
+	u32 pos = 0, len, ndirty = 0;
+
+	if (ckpatch_init(&cp, buf, TEST_SIZ)) return 0;
+	add_regions(&cp, stdfix, P_CKS);
+	random_patches(&cp, npatches);
+	if (ckpatch_fix(&cp)) {
+		ckpatch_done(&cp);
+		return 0;
+	}
+	while (ckpatch_dirty(&cp, pos, &pos, &len)) {
+		ndirty += len;
+		pos += len;
+	}
+	printf("%s : %u patches, %lu bytes changed\n", (stdfix == CKFIX_CORRECT) ? "correct" : "rewrite",
+			npatches, (unsigned long) ndirty);
+	ckpatch_done(&cp);
+	return verify(buf, P_CKS);
+}
+
+int main(void) {
+	u8 *buf = malloc(TEST_SIZ);
+	unsigned idx;
+	bool ok = 1;
+
+	dbg_stream = stdout;
+	if (!buf) return -1;
+	for (idx = 0; idx < TEST_SIZ; idx++) buf[idx] = rnd8();
+
+	//random image : rewriting makes everything valid
+	ok &= test_one(buf, CKFIX_REWRITE, 0);
+	ok &= test_one(buf, CKFIX_REWRITE, 200);
+	//now keep the std values
+	u32 cks = reconst_32(&buf[P_CKS]), ckx = reconst_32(&buf[P_CKX]);
+	ok &= test_one(buf, CKFIX_CORRECT, 200);
+	if ((reconst_32(&buf[P_CKS]) != cks) || (reconst_32(&buf[P_CKX]) != ckx)) {
+		printf("std values changed\n");
+		ok = 0;
+	}
+
+	//std values inside alt2 : they depend on each other
+	struct ckpatch cp;
+	if (ckpatch_init(&cp, buf, TEST_SIZ)) return -1;
+	add_regions(&cp, CKFIX_REWRITE, 0x38000);
+	if (!ckpatch_fix(&cp)) {
+		printf("circular regions not detected\n");
+		ok = 0;
+	}
+	ckpatch_done(&cp);
+
+	free(buf);
+	printf("%s\n", ok ? "all ok" : "FAILED");
+	return ok ? 0 : -1;
+}
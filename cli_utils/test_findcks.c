@@ -10,62 +10,41 @@
 #include <stdlib.h>	//malloc etc
 
 #include "nislib.h"
+#include "nislib_patset.h"
 #include "nislib_shtools.h"
 
 #include "stypes.h"
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
 // generic ROM struct
 struct romfile {
 	FILE *hf;
 	u32 siz;	//in bytes
-	uint8_t *buf;	//copied here
+	const uint8_t *buf;	//points in img; read-only
+	struct rom_image img;
 };
 
 
-//load ROM to a new buffer
+//load ROM, mapped read-only if possible
 //ret 0 if OK
 //caller MUST call close_rom() after
 static int open_rom(struct romfile *rf, const char *fname) {
-	FILE *fbin;
-	uint8_t *buf;	//load whole ROM
-	u32 file_len;
-
 	rf->hf = NULL;	//not needed
 
-	if ((fbin=fopen(fname,"rb"))==NULL) {
-		printf("error opening %s.\n", fname);
+	if (romimg_open(&rf->img, fname, 0)) {
 		return -1;
 	}
 
-	file_len = flen(fbin);
+	u32 file_len = rf->img.siz;
 	if (file_len > 2048*1024L) {
 		/* TODO : add "-f" flag ? */
 		printf("huge file (length %lu)\n", (unsigned long) file_len);
-		fclose(fbin);
+		romimg_close(&rf->img);
 		return -1;
 	}
 	rf->siz = file_len;
-
-	buf = malloc(file_len);
-	if (!buf) {
-		printf("malloc choke\n");
-		fclose(fbin);
-		return -1;
-	}
-
-	/* load whole ROM */
-	if (fread(buf,1,file_len,fbin) != file_len) {
-		printf("trouble reading\n");
-		free(buf);
-		fclose(fbin);
-		return -1;
-	}
-	rf->buf = buf;
-
-	fclose(fbin);
-
+	rf->buf = rf->img.buf;
 
 	if ((file_len != 1024*1024L) && (file_len !=512*1024L)
 		&& (file_len != 256 * 1024L)) {
@@ -78,10 +57,8 @@ static int open_rom(struct romfile *rf, const char *fname) {
 //close & free whatever
 void close_rom(struct romfile *rf) {
 	if (!rf) return;
-	if (rf->buf) {
-		free(rf->buf);
-		rf->buf = NULL;
-	}
+	romimg_close(&rf->img);
+	rf->buf = NULL;
 	return;
 }
 
@@ -112,7 +89,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* add header to dbg log */
-	fprintf(dbg_stream, "\n********************\n**** Started analyzing %s\n", argv[1]);
+	DBG_PRINTF("\n********************\n**** Started analyzing %s\n", argv[1]);
 	find_cksloop(rf.buf, rf.siz);
 
 	printf("\n");
@@ -157,43 +134,88 @@ static long sh_bt_findmemload(const uint8_t *buf, u32 min, u32 start,
 
 #define CKS_MAXBT 20
 #define CKS_MAXDIST_ADD 40
-//TODO : bounds check
+
+/* "add Rm, Rn" : 3<n> <m>C, one pattern per m */
+#define CKS_NREGS 16
+
+struct cks_scan {
+	const uint8_t *buf;
+	u32 siz;
+	const struct sh_patset *addset;
+	int occ;	//occurences
+};
+
+struct add_find {
+	unsigned regno;
+	u32 pos;	//offset of the add in the searched window; (u32) -1 if none
+};
+
+static int found_add(void *ctx, unsigned patid, u32 pos) {
+	struct add_find *af = ctx;
+	if (patid != af->regno) return 0;
+	af->pos = pos;
+	return 1;
+}
+
+/* for every "xor rm, rn" */
+static int found_xor(void *ctx, unsigned patid, u32 cur) {
+	struct cks_scan *cs = ctx;
+	const uint8_t *buf = cs->buf;
+	(void) patid;
+
+	// got one : try to backtrack
+	unsigned regno = (reconst_16(&buf[cur]) >> 4) & 0x0F;
+	long movl_pos;
+	movl_pos = sh_bt_findmemload(buf, cur - CKS_MAXBT, cur, regno);
+	if (!movl_pos) {
+		//no mov.l
+		return 0;
+	}
+
+	//final test : find "add" too, with the same Rm
+	struct add_find af = {regno, (u32) -1};
+	sh_patset_scan(cs->addset, &buf[movl_pos], MIN(CKS_MAXDIST_ADD, cs->siz - (u32) movl_pos), found_add, &af);
+	if (af.pos == (u32) -1) {
+		//printf("\tno add near\n");
+	} else {
+		printf("xor @ %lX, movl @ %lX, add @ %lX !\n", (long unsigned) cur,
+			(long unsigned) movl_pos, (long unsigned) af.pos);
+		cs->occ +=1 ;
+	}
+	return 0;
+}
+
 void find_cksloop(const uint8_t *buf, u32 siz) {
-	uint32_t cur = 0;
-	int occ = 0;	//occurences
+	/* xor rm, rn : 2<rn> <rm>A */
+	static const u16 xorpat = 0x200A;
+	static const u16 xormask = 0xF00F;
+	static const u16 addmask = 0xF0FF;
+	const struct sh_pattern xorsig = {1, &xorpat, &xormask};
+	struct sh_pattern addsigs[CKS_NREGS];
+	u16 addpats[CKS_NREGS];
+	unsigned regno;
 
 	siz &= ~1;
 
-	for (cur = 0; cur < siz; cur += 2) {
-		/* find xor rm, rn : 2<rn> <rm>A */
-		uint16_t opc;
-		int regno;
-
-		opc = reconst_16(&buf[cur]);
-		if ((opc & 0xF00F) != 0x200A) continue;
-
-		// got one : try to backtrack
-		regno = (opc >> 4) & 0x0F;
-		long movl_pos;
-		movl_pos = sh_bt_findmemload(buf, cur - CKS_MAXBT, cur, regno);
-		if (!movl_pos) {
-			//no mov.l
-			continue;
-		}
-
-		//final test : find "add" too. add Rm, Rn : 3<n> <m>C
-		uint32_t add_pos;
-		uint16_t addpat=0x300C | (regno << 4);
-		uint16_t addmask=0xF0FF;
-		add_pos = find_pattern(&buf[movl_pos], CKS_MAXDIST_ADD, 1, &addpat, &addmask);
-		if (add_pos == (u32) -1) {
-			//printf("\tno add near\n");
-		} else {
-			printf("xor @ %lX, movl @ %lX, add @ %lX !\n", (long unsigned) cur,
-				(long unsigned) movl_pos, (long unsigned) add_pos);
-			occ +=1 ;
-		}
+	for (regno = 0; regno < CKS_NREGS; regno++) {
+		addpats[regno] = 0x300C | (regno << 4);
+		addsigs[regno].len = 1;
+		addsigs[regno].pat = &addpats[regno];
+		addsigs[regno].mask = &addmask;
 	}
-	printf("%d xorsum loops found\n", occ);
+	struct sh_patset *xorset = sh_patset_compile(&xorsig, 1);
+	struct sh_patset *addset = sh_patset_compile(addsigs, CKS_NREGS);
+	if (!xorset || !addset) {
+		sh_patset_free(xorset);
+		sh_patset_free(addset);
+		return;
+	}
+
+	struct cks_scan cs = {buf, siz, addset, 0};
+	sh_patset_scan(xorset, buf, siz, found_xor, &cs);
+	printf("%d xorsum loops found\n", cs.occ);
+
+	sh_patset_free(xorset);
+	sh_patset_free(addset);
 	return;
-}
\ No newline at end of file
+}
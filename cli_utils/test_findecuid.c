@@ -6,6 +6,8 @@
  * - frequent false positives (maps have sequences that look a lot like ECUIDs)
  * - misses ECUIDs that are next to valid ASCII characters, and duplicated ECUID, like "1CF43D1CF43D"
  *
+ * See find_ecuid() in nisrom_romfile.c for the scored version used by nisrom.
+ *
  */
 
 #include <stdint.h>
@@ -15,58 +17,36 @@
 
 #include "nislib.h"
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
 // generic ROM struct
 struct romfile {
 	FILE *hf;
 	size_t siz;	//in bytes
-	uint8_t *buf;	//copied here
+	const uint8_t *buf;	//points in img; read-only
+	struct rom_image img;
 };
 
 
-//load ROM to a new buffer
+//load ROM, mapped read-only if possible
 //ret 0 if OK
 //caller MUST call close_rom() after
 static int open_rom(struct romfile *rf, const char *fname) {
-	FILE *fbin;
-	uint8_t *buf;	//load whole ROM
-	size_t file_len;
-
 	rf->hf = NULL;	//not needed
 
-	if ((fbin=fopen(fname,"rb"))==NULL) {
-		printf("error opening %s.\n", fname);
+	if (romimg_open(&rf->img, fname, 0)) {
 		return -1;
 	}
 
-	file_len = flen(fbin);
-	if ((file_len <= 0) || (file_len > 2048*1024L)) {
+	size_t file_len = rf->img.siz;
+	if (file_len > 2048*1024L) {
 		/* TODO : add "-f" flag ? */
-		printf("huge file (length %ld)\n", file_len);
-		fclose(fbin);
+		printf("huge file (length %lu)\n", (unsigned long) file_len);
+		romimg_close(&rf->img);
 		return -1;
 	}
 	rf->siz = file_len;
-
-	buf = malloc(file_len);
-	if (!buf) {
-		printf("malloc choke\n");
-		fclose(fbin);
-		return -1;
-	}
-
-	/* load whole ROM */
-	if (fread(buf,1,file_len,fbin) != file_len) {
-		printf("trouble reading\n");
-		free(buf);
-		fclose(fbin);
-		return -1;
-	}
-	rf->buf = buf;
-
-	fclose(fbin);
-
+	rf->buf = rf->img.buf;
 
 	if ((file_len != 1024*1024L) && (file_len !=512*1024L)
 		&& (file_len != 256 * 1024L)) {
@@ -79,10 +59,8 @@ static int open_rom(struct romfile *rf, const char *fname) {
 //close & free whatever
 void close_rom(struct romfile *rf) {
 	if (!rf) return;
-	if (rf->buf) {
-		free(rf->buf);
-		rf->buf = NULL;
-	}
+	romimg_close(&rf->img);
+	rf->buf = NULL;
 	return;
 }
 
@@ -117,7 +95,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* add header to dbg log */
-	fprintf(dbg_stream, "\n********************\n**** Started analyzing %s\n", argv[1]);
+	DBG_PRINTF("\n********************\n**** Started analyzing %s\n", argv[1]);
 	find_ecuid(rf.buf, rf.siz);
 
 	printf("\n");
@@ -0,0 +1,212 @@
+/* test the SIMD search / checksum kernels against the scalar ones :
+ * every start alignment, every tail length up to 63, and matches at the buffer edges
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+
+__thread FILE *dbg_stream;
+
+#define MAX_ALIGN	64
+#define MAX_TAIL	64
+#define MAX_LEN	(256 + MAX_TAIL)
+#define GUARD	64	//sum32 reads whole words past an unaligned siz
+#define MAX_ERRS	20
+
+static const char *levels[] = {"sse2", "avx2", "neon"};
+static const u32 bases[] = {0, 64, 192};	//+ tail : lengths 0 to 255
+static const unsigned nlens[] = {1, 2, 3, 5, 16, 33};
+
+static u32 lcg = 12345;
+static u8 rnd8(void) {
+	lcg = lcg * 1103515245 + 12345;
+	return (u8) (lcg >> 16);
+}
+
+/* few distinct bytes, so that partial matches and idchar runs are common */
+static const u8 alphabet[] = {0x00, 0x01, 0xA5, '0', '9', 'A', 'Z', '@', '['};
+
+static unsigned nerrs;
+static const char *cur_level;
+
+static void fail(const char *kernel, unsigned align, u32 len, const char *what) {
+	if (nerrs < MAX_ERRS) {
+		printf("%s %s : align %u, len %lu : %s\n", cur_level, kernel, align, (unsigned long) len, what);
+	}
+	nerrs++;
+}
+
+static void check_ptr(const char *kernel, const u8 *buf, unsigned align, u32 len, const u8 *ref, const u8 *got) {
+	if (ref == got) return;
+	char what[80];
+	snprintf(what, sizeof(what), "got %ld, expected %ld", got ? (long) (got - buf) : -1L,
+			ref ? (long) (ref - buf) : -1L);
+	fail(kernel, align, len, what);
+}
+
+/* run <expr> with the scalar kernels, then with the tested ones */
+#define BOTH(ref, got, expr) do { \
+		nislib_simd_force("scalar"); \
+		ref = (expr); \
+		nislib_simd_force(cur_level); \
+		got = (expr); \
+	} while (0)
+
+static void test_u8memstr(u8 *buf, unsigned align, u32 len) {
+	unsigned n;
+	for (n = 0; n < ARRAY_SIZE(nlens); n++) {
+		unsigned nlen = nlens[n];
+		u8 needle[64];
+		unsigned i;
+		if (!len || (nlen > len)) continue;
+
+		//planted at the edges : start, last position tested, the untested one
+		const u32 where[] = {0, 1, len - nlen - 1, len - nlen, len / 2};
+		for (i = 0; i < nlen; i++) needle[i] = 0xC0 + (u8) i;
+		for (i = 0; i < ARRAY_SIZE(where); i++) {
+			u8 save[64];
+			u32 p = where[i];
+			if (p > (len - nlen)) continue;
+			memcpy(save, &buf[p], nlen);
+			memcpy(&buf[p], needle, nlen);
+			const u8 *ref, *got;
+			BOTH(ref, got, u8memstr(buf, len, needle, nlen));
+			check_ptr("u8memstr", buf, align, len, ref, got);
+			memcpy(&buf[p], save, nlen);
+		}
+		//needle from the contents : many candidates that fail in the middle
+		memcpy(needle, &buf[len - nlen], nlen);
+		const u8 *ref, *got;
+		BOTH(ref, got, u8memstr(buf, len, needle, nlen));
+		check_ptr("u8memstr", buf, align, len, ref, got);
+	}
+}
+
+static void test_u16memstr(u8 *buf, unsigned align, u32 len) {
+	if (len < 2) return;
+	const u32 where[] = {0, 1, 2, len - 3, len - 2};
+	unsigned i;
+	for (i = 0; i < ARRAY_SIZE(where); i++) {
+		u32 p = where[i];
+		if (p > (len - 2)) continue;
+		u8 save[2] = {buf[p], buf[p + 1]};
+		buf[p] = 0xC1;
+		buf[p + 1] = 0xC2;
+		const u8 *ref, *got;
+		BOTH(ref, got, u16memstr(buf, len, 0xC1C2));
+		check_ptr("u16memstr", buf, align, len, ref, got);
+		buf[p] = save[0];
+		buf[p + 1] = save[1];
+	}
+	const u8 *ref, *got;
+	BOTH(ref, got, u16memstr(buf, len, reconst_16(&buf[(len - 2) & ~1])));
+	check_ptr("u16memstr", buf, align, len, ref, got);
+}
+
+static void test_u32memstr(u8 *buf, unsigned align, u32 len) {
+	if (len < 4) return;
+	const u32 where[] = {0, 1, 2, 3, 4, len - 7, len - 6, len - 5, len - 4};
+	unsigned i;
+	for (i = 0; i < ARRAY_SIZE(where); i++) {
+		u32 p = where[i];
+		u8 save[4];
+		if (p > (len - 4)) continue;
+		memcpy(save, &buf[p], 4);
+		write_32b(0xC1C2C3C4, &buf[p]);
+		const u8 *ref, *got;
+		BOTH(ref, got, u32memstr(buf, len, 0xC1C2C3C4));
+		check_ptr("u32memstr", buf, align, len, ref, got);
+		memcpy(&buf[p], save, 4);
+	}
+	const u8 *ref, *got;
+	BOTH(ref, got, u32memstr(buf, len, reconst_32(&buf[(len - 4) & ~3])));
+	check_ptr("u32memstr", buf, align, len, ref, got);
+}
+
+static void test_idchar(const u8 *buf, unsigned align, u32 len) {
+	unsigned minlen;
+	if (!len) return;
+	for (minlen = 1; minlen <= IDRUN_MAXMIN; minlen++) {
+		const u32 froms[] = {0, 1, len / 2, len - 1};
+		unsigned i;
+		for (i = 0; i < ARRAY_SIZE(froms); i++) {
+			u32 rlen = 0, glen = 0;
+			nislib_simd_force("scalar");
+			u32 ref = idchar_run(buf, len, froms[i], minlen, &rlen);
+			nislib_simd_force(cur_level);
+			u32 got = idchar_run(buf, len, froms[i], minlen, &glen);
+			if ((ref != got) || ((ref != UINT32_MAX) && (rlen != glen))) {
+				char what[80];
+				snprintf(what, sizeof(what), "minlen %u from %lu : run %ld,%lu vs %ld,%lu", minlen,
+					(unsigned long) froms[i], (long) got, (unsigned long) glen, (long) ref, (unsigned long) rlen);
+				fail("idchar_run", align, len, what);
+			}
+		}
+	}
+}
+
+static void test_sum32(const u8 *buf, unsigned align, u32 len) {
+	u32 rs, rx, gs, gx;
+	if (!len) return;
+	nislib_simd_force("scalar");
+	sum32(buf, len, &rs, &rx);
+	nislib_simd_force(cur_level);
+	sum32(buf, len, &gs, &gx);
+	if ((rs != gs) || (rx != gx)) fail("sum32", align, len, "different sum / xor");
+}
+
+/** every kernel, every alignment and length, on one background pattern */
+static void test_level(u8 *mem, bool zeros) {
+	unsigned align, b, tail;
+	u32 i;
+
+	for (i = 0; i < (MAX_ALIGN + MAX_LEN + GUARD); i++) {
+		mem[i] = zeros ? 0 : alphabet[rnd8() % sizeof(alphabet)];
+	}
+	for (align = 0; align < MAX_ALIGN; align++) {
+		u8 *buf = &mem[align];
+		for (b = 0; b < ARRAY_SIZE(bases); b++) {
+			for (tail = 0; tail < MAX_TAIL; tail++) {
+				u32 len = bases[b] + tail;
+				test_u8memstr(buf, align, len);
+				test_u16memstr(buf, align, len);
+				test_u32memstr(buf, align, len);
+				test_idchar(buf, align, len);
+				test_sum32(buf, align, len);
+			}
+		}
+	}
+}
+
+int main(void) {
+	u8 *mem = malloc(MAX_ALIGN + MAX_LEN + GUARD);
+	unsigned lvl, ntested = 0;
+
+	dbg_stream = stdout;
+	if (!mem) return -1;
+
+	for (lvl = 0; lvl < ARRAY_SIZE(levels); lvl++) {
+		cur_level = levels[lvl];
+		if (nislib_simd_force(cur_level)) {
+			printf("%s : not available here, skipped\n", cur_level);
+			continue;
+		}
+		unsigned before = nerrs;
+		test_level(mem, 1);
+		test_level(mem, 0);
+		printf("%s : %s\n", cur_level, (nerrs == before) ? "same as scalar" : "MISMATCH");
+		ntested++;
+	}
+
+	free(mem);
+	if (!ntested) printf("no SIMD kernels on this build; nothing compared\n");
+	printf("%s\n", nerrs ? "FAILED" : "all ok");
+	return nerrs ? -1 : 0;
+}
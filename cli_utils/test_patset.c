@@ -0,0 +1,246 @@
+/* test nislib_patset on a synthetic image : every match must be what find_pattern() finds,
+ * one pattern at a time
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+#include "nislib_patset.h"
+#include "nislib_shindex.h"
+#include "nislib_shtools.h"
+
+__thread FILE *dbg_stream;
+
+#define TEST_SIZ	(64 * 1024UL)
+#define TEST_NPLANT	200	//copies of each pattern planted in the image
+#define MAX_MATCHES	(256 * 1024UL)
+
+/* a few real signatures, and some with register fields free (mask 0 included) */
+static const u16 p_spf[] = {0x6001, 0x6001, 0x2001, 0x000b, 0x2001};
+static const u16 m_spf[] = {0xf00f, 0xf00f, 0xf00f, 0xffff, 0xf00f};
+static const u16 p_spf2[] = {0x4529, 0x351c, 0x257a};
+static const u16 m_spf2[] = {0xf0ff, 0xf00f, 0xf00f};
+static const u16 p_movs[] = {0xE47B};
+static const u16 m_movs[] = {0xFFFF};
+static const u16 p_rts[] = {0x000b, 0x0009};
+static const u16 m_rts[] = {0xffff, 0xffff};
+static const u16 p_any[] = {0x0000, 0x000b};
+static const u16 m_any[] = {0x0000, 0xffff};
+static const u16 p_add[] = {0x300C, 0x300C};
+static const u16 m_add[] = {0xF00F, 0xF0FF};
+
+static const struct sh_pattern pats[] = {
+	{ARRAY_SIZE(p_spf), p_spf, m_spf},
+	{ARRAY_SIZE(p_spf2), p_spf2, m_spf2},
+	{ARRAY_SIZE(p_movs), p_movs, m_movs},
+	{ARRAY_SIZE(p_rts), p_rts, m_rts},
+	{ARRAY_SIZE(p_any), p_any, m_any},
+	{ARRAY_SIZE(p_add), p_add, m_add},
+	{ARRAY_SIZE(p_rts), p_rts, m_rts},	//duplicate : both ids must be reported
+};
+#define NPATS ARRAY_SIZE(pats)
+
+struct match {
+	u32 pos;
+	unsigned id;
+};
+
+struct match_list {
+	struct match *m;
+	u32 num;
+};
+
+static u32 lcg = 12345;
+static u16 rnd16(void) {
+	lcg = lcg * 1103515245 + 12345;
+	return (u16) (lcg >> 8);
+}
+
+static void put16(u16 val, u8 *buf) {
+	buf[0] = val >> 8;
+	buf[1] = val & 0xFF;
+}
+
+static int add_match(void *ctx, unsigned patid, u32 pos) {
+	struct match_list *ml = ctx;
+	if (ml->num == MAX_MATCHES) return 1;
+	ml->m[ml->num].pos = pos;
+	ml->m[ml->num].id = patid;
+	ml->num++;
+	return 0;
+}
+
+static int cmp_match(const void *a, const void *b) {
+	const struct match *ma = a, *mb = b;
+	if (ma->pos != mb->pos) return (ma->pos < mb->pos) ? -1 : 1;
+	if (ma->id != mb->id) return (ma->id < mb->id) ? -1 : 1;
+	return 0;
+}
+
+/** reference : find_pattern() repeatedly, for each pattern. Sorted like the patset callbacks */
+static void ref_matches(const u8 *buf, u32 siz, struct match_list *ml) {
+	unsigned id;
+
+	ml->num = 0;
+	for (id = 0; id < NPATS; id++) {
+		u32 base = 0;
+		while ((siz - base) > (pats[id].len * 2)) {
+			u32 pos = find_pattern(&buf[base], siz - base, pats[id].len, pats[id].pat, pats[id].mask);
+			if (pos == (u32) -1) break;
+			add_match(ml, id, base + pos);
+			base += pos + 2;
+		}
+	}
+	qsort(ml->m, ml->num, sizeof(*ml->m), cmp_match);
+}
+
+static bool same_matches(const char *name, const struct match_list *a, const struct match_list *ref) {
+	u32 i;
+	if (a->num != ref->num) {
+		printf("%s : %lu matches, expected %lu\n", name, (unsigned long) a->num, (unsigned long) ref->num);
+		return 0;
+	}
+	for (i = 0; i < a->num; i++) {
+		if ((a->m[i].pos != ref->m[i].pos) || (a->m[i].id != ref->m[i].id)) {
+			printf("%s : match %lu is pat %u @ %lX, expected pat %u @ %lX\n", name, (unsigned long) i,
+				a->m[i].id, (unsigned long) a->m[i].pos, ref->m[i].id, (unsigned long) ref->m[i].pos);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+struct bsr_list {
+	u32 pos[8];
+	unsigned num;
+};
+
+static void add_bsr(const u8 *buf, u32 pos, void *ctx) {
+	struct bsr_list *bl = ctx;
+	(void) buf;
+	if (bl->num < ARRAY_SIZE(bl->pos)) bl->pos[bl->num] = pos;
+	bl->num++;
+}
+
+/* calls to the first opcodes : the nearest-first walk must not wrap below 0 */
+static bool test_bsr_low(void) {
+	u8 buf[0x200];
+	//bsr @ pos to tgt : 0xB000 | ((tgt - pos - 4) / 2)
+	static const struct {
+		u32 pos;
+		u32 tgt;
+	} calls[] = {
+		{0x00, 0x02}, {0x06, 0x00}, {0x0A, 0x02}, {0x10, 0x00}, {0x40, 0x00}, {0x1FE, 0x02},
+	};
+	static const u32 want0[] = {0x06, 0x10, 0x40};
+	static const u32 want2[] = {0x00, 0x0A, 0x1FE};
+	unsigned i;
+	bool ok = 1;
+
+	for (i = 0; i < sizeof(buf); i += 2) put16(0x0009, &buf[i]);
+	for (i = 0; i < ARRAY_SIZE(calls); i++) {
+		put16(0xB000 | (((calls[i].tgt - calls[i].pos - 4) / 2) & 0xFFF), &buf[calls[i].pos]);
+	}
+	struct sh_index *idx = sh_index_build(buf, sizeof(buf));
+	if (!idx) return 0;
+
+	struct bsr_list bl = {{0}, 0};
+	sh_index_find_bsr(idx, 0, add_bsr, &bl);
+	if ((bl.num != ARRAY_SIZE(want0)) || memcmp(bl.pos, want0, sizeof(want0))) {
+		printf("find_bsr to 0 : %u sites, wrong order\n", bl.num);
+		ok = 0;
+	}
+	bl.num = 0;
+	sh_index_find_bsr(idx, 2, add_bsr, &bl);
+	if ((bl.num != ARRAY_SIZE(want2)) || memcmp(bl.pos, want2, sizeof(want2))) {
+		printf("find_bsr to 2 : %u sites, wrong order\n", bl.num);
+		ok = 0;
+	}
+	sh_index_free(idx);
+	return ok;
+}
+
+/* scan buf[0..siz[ both ways, compare with the reference */
+static bool test_one(const struct sh_patset *ps, const u8 *buf, u32 siz, struct match_list *ref, struct match_list *got) {
+	bool ok = 1;
+	u32 num;
+
+	ref_matches(buf, siz, ref);
+	if (!ref->num) {
+		printf("no matches at all, bad test image\n");
+		return 0;
+	}
+
+	got->num = 0;
+	num = sh_patset_scan(ps, buf, siz, add_match, got);
+	ok &= (num == got->num) && same_matches("scan", got, ref);
+
+	struct sh_index *idx = sh_index_build(buf, siz);
+	if (!idx) return 0;
+	got->num = 0;
+	num = sh_patset_scan_index(ps, idx, buf, siz, add_match, got);
+	ok &= (num == got->num) && same_matches("scan_index", got, ref);
+	sh_index_free(idx);
+
+	//counting only, and stopping early
+	ok &= (sh_patset_scan(ps, buf, siz, NULL, NULL) == ref->num);
+	got->num = MAX_MATCHES - 1;
+	if (sh_patset_scan(ps, buf, siz, add_match, got) != 2) {
+		printf("scan didn't stop\n");
+		ok = 0;
+	}
+	return ok;
+}
+
+int main(void) {
+	u8 *buf = malloc(TEST_SIZ);
+	struct match_list ref = {malloc(MAX_MATCHES * sizeof(struct match)), 0};
+	struct match_list got = {malloc(MAX_MATCHES * sizeof(struct match)), 0};
+	struct sh_patset *ps = sh_patset_compile(pats, NPATS);
+	unsigned id, n;
+	u32 pos;
+	bool ok = 1;
+
+	dbg_stream = stdout;
+	if (!buf || !ref.m || !got.m || !ps) return -1;
+
+	//random opcodes, from a small alphabet so that masked patterns hit by themselves too
+	for (pos = 0; pos < TEST_SIZ; pos += 2) {
+		u16 opc = rnd16();
+		if (opc & 1) opc = pats[opc % NPATS].pat[0] | (rnd16() & 0x0FF0);
+		put16(opc, &buf[pos]);
+	}
+	//planted copies, some overlapping, with random bits in the masked fields
+	for (id = 0; id < NPATS; id++) {
+		for (n = 0; n < TEST_NPLANT; n++) {
+			unsigned i;
+			pos = (rnd16() % ((TEST_SIZ / 2) - pats[id].len)) * 2;
+			for (i = 0; i < pats[id].len; i++) {
+				u16 opc = (pats[id].pat[i] & pats[id].mask[i]) | (rnd16() & ~pats[id].mask[i]);
+				put16(opc, &buf[pos + i * 2]);
+			}
+		}
+	}
+	//one right at the end, which find_pattern never reports
+	put16(0x000b, &buf[TEST_SIZ - 4]);
+	put16(0x0009, &buf[TEST_SIZ - 2]);
+
+	ok &= test_one(ps, buf, TEST_SIZ, &ref, &got);
+	//odd and short lengths
+	ok &= test_one(ps, buf, TEST_SIZ - 5, &ref, &got);
+	ok &= test_one(ps, buf, 0x101, &ref, &got);
+	ok &= test_bsr_low();
+
+	sh_patset_free(ps);
+	free(ref.m);
+	free(got.m);
+	free(buf);
+	printf("%s\n", ok ? "all ok" : "FAILED");
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,166 @@
+/* test nisrom_progressive : feed a ROM in blocks, in order then backwards, and compare
+ * the results with a normal analysis of the whole ROM.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+#include "nis_romdb.h"
+#include "nisrom_keyfinders.h"
+#include "nisrom_progressive.h"
+#include "nisrom_romfile.h"
+
+#include "uthash/utstring.h"
+
+__thread FILE *dbg_stream;
+
+#define KEYSET_CSV "../romdb/keysets.csv"	//relative to this executable
+#define BLOCK_SIZ	0x1000
+
+/* reference results */
+struct ref {
+	struct romfile rf;
+	enum key_quality keyq;
+	u32 s27k, s36k;
+};
+
+static void progress_cb(const struct romprog *rp, enum romprog_stage st, enum romprog_res res, void *data) {
+	(void) data;
+	printf("\t%-8s %-8s at 0x%06lX / 0x%06lX bytes\n", romprog_stage_name(st),
+			(res == RPR_OK) ? "found" : (res == RPR_NA) ? "n/a" : "FAILED",
+			(unsigned long) rp->nknown, (unsigned long) rp->rf.siz);
+}
+
+static bool analyze_ref(struct ref *r, nis_romdb *romdb, const char *fname) {
+	struct romfile *rf = &r->rf;
+
+	memset(r, 0, sizeof(*r));
+	rf->romdb = romdb;
+	if (open_rom(rf, fname) || romfile_anchors(rf)) return 0;
+	if ((find_loader(rf) == UINT32_MAX) || (find_fid(rf) == UINT32_MAX)) {
+		printf("reference analysis : no LOADER / FID\n");
+		return 0;
+	}
+	(void) find_ramf(rf);
+	if (rf->plan->altcks && (rf->p_acstart != UINT32_MAX)) (void) validate_altcks(rf);
+	if (checksum_std(rf->buf, rf->siz, &rf->p_cks, &rf->p_ckx)) rf->p_cks = rf->p_ckx = 0;
+	if (romfile_index(rf)) return 0;
+	r->keyq = keyfinder_run(romdb, rf->shidx, rf->buf, rf->siz, &r->s27k, &r->s36k);
+	find_eep(rf);
+	return 1;
+}
+
+#define CHECK(name, a, b) do { \
+	if ((a) != (b)) { \
+		printf("\t%s mismatch : 0x%lX, expected 0x%lX\n", name, (unsigned long) (a), (unsigned long) (b)); \
+		ok = 0; \
+	} } while (0)
+
+/** @param backwards : feed the last block first, so nothing resolves before the end */
+static bool test_feed(const struct ref *r, nis_romdb *romdb, const u8 *img, u32 siz, bool backwards) {
+	struct romprog rp;
+	const struct romfile *ref = &r->rf;
+	const struct romfile *rf = &rp.rf;
+	u32 nblocks = (siz + BLOCK_SIZ - 1) / BLOCK_SIZ;
+	u32 bi;
+	bool ok = 1;
+
+	printf("%s :\n", backwards ? "backwards" : "in order");
+	if (romprog_init(&rp, siz, romdb, progress_cb, NULL)) return 0;
+	for (bi = 0; bi < nblocks; bi++) {
+		u32 b = backwards ? (nblocks - 1 - bi) : bi;
+		u32 offs = b * BLOCK_SIZ;
+		if (romprog_feed(&rp, offs, &img[offs], MIN(BLOCK_SIZ, siz - offs))) {
+			romprog_done(&rp);
+			return 0;
+		}
+	}
+	if (!romprog_finished(&rp)) {
+		printf("\tnot finished after the whole ROM\n");
+		ok = 0;
+	}
+
+	CHECK("p_loader", rf->p_loader, ref->p_loader);
+	CHECK("p_fid", rf->p_fid, ref->p_fid);
+	CHECK("fid_ic", rf->fid_ic, ref->fid_ic);
+	CHECK("p_ramf", rf->p_ramf, ref->p_ramf);
+	CHECK("p_ivt2", rf->p_ivt2, ref->p_ivt2);
+	CHECK("p_acstart", rf->p_acstart, ref->p_acstart);
+	CHECK("p_acend", rf->p_acend, ref->p_acend);
+	CHECK("cks_alt_good", rf->cks_alt_good, ref->cks_alt_good);
+	if (!backwards) {
+		//first known occurrence : only the same as the first occurrence when fed in order
+		CHECK("p_acs", rf->p_acs, ref->p_acs);
+		CHECK("p_acx", rf->p_acx, ref->p_acx);
+	}
+	if (ref->p_cks) {
+		CHECK("p_cks", rf->p_cks, ref->p_cks);
+		CHECK("p_ckx", rf->p_ckx, ref->p_ckx);
+	}
+	if (r->keyq >= KEYQ_GOOD) {
+		CHECK("s27k", rp.s27k, r->s27k);
+		CHECK("s36k", rp.s36k, r->s36k);
+	}
+	CHECK("p_eepread", rf->p_eepread, ref->p_eepread);
+
+	romprog_done(&rp);
+	return ok;
+}
+
+static nis_romdb *load_romdb(const char *progname) {
+	nis_romdb *romdb = romdb_new();
+	const char *slash = strrchr(progname, '/');
+	UT_string csvpath;
+	bool ok;
+
+	if (!romdb) return NULL;
+	utstring_init(&csvpath);
+	if (slash) utstring_bincpy(&csvpath, progname, (size_t) (slash + 1 - progname));
+	utstring_printf(&csvpath, "%s", KEYSET_CSV);
+	ok = romdb_keyset_addcsv(romdb, utstring_body(&csvpath));
+	utstring_done(&csvpath);
+	if (!ok) {
+		romdb_close(romdb);
+		return NULL;
+	}
+	return romdb;
+}
+
+int main(int argc, char *argv[]) {
+	struct rom_image img = {0};
+	struct ref r;
+	nis_romdb *romdb;
+	bool ok = 0;
+
+	memset(&r, 0, sizeof(r));
+	if (argc != 2) {
+		printf("usage : %s <rom.bin>\n", argv[0]);
+		return -1;
+	}
+	dbg_stream = tmpfile();
+	if (!dbg_stream) return -1;
+	romdb = load_romdb(argv[0]);
+	if (!romdb) {
+		printf("trouble loading %s\n", KEYSET_CSV);
+		return -1;
+	}
+	if (romimg_open(&img, argv[1], 0)) goto exit;
+	if (!analyze_ref(&r, romdb, argv[1])) goto exit;
+
+	ok = test_feed(&r, romdb, img.buf, img.siz, 0);
+	ok &= test_feed(&r, romdb, img.buf, img.siz, 1);
+
+exit:
+	close_rom(&r.rf);
+	romimg_close(&img);
+	romdb_close(romdb);
+	fclose(dbg_stream);
+	printf("%s\n", ok ? "all ok" : "FAILED");
+	return ok ? 0 : -1;
+}
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "stypes.h"
 
@@ -10,7 +11,67 @@
 #include "nissan_romdefs.h"
 #include "nis_romdb.h"
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
+
+/* pinned nearest-key results : sorted by distance, then ties go to the lower kidx */
+struct nearest_case {
+	const char *ecuid;
+	unsigned num;
+	struct {
+		u32 key;
+		int dist;
+	} k[5];
+};
+
+static const struct nearest_case nearest_cases[] = {
+	//2 keys at 11 and 2 at 12 : list order. The old eviction loop returned 968148AD @ 15 instead of 917B43A8 @ 14
+	{"DVHRD", 5, {{0xBAA56CD1, 11}, {0x8FFD3C82, 11}, {0xC93775BB, 12}, {0x6D571F84, 12}, {0x917B43A8, 14}}},
+	{"DVHRD", 1, {{0xBAA56CD1, 11}}},
+	//tie between the two CSV records, and the built-in 8U0..
+	{"8U00.", 1, {{0x55AA1234, 0}}},
+	{"8U00.", 3, {{0x55AA1234, 0}, {0x0DF7BF25, 0}, {0xE091912E, 2}}},
+};
+
+static bool check_nearest(nis_romdb *romdb, const char *dbname) {
+	unsigned c, i;
+	bool ok = 1;
+
+	for (c = 0; c < ARRAY_SIZE(nearest_cases); c++) {
+		const struct nearest_case *nc = &nearest_cases[c];
+		struct ecuid_keymatch_t k[ARRAY_SIZE(nc->k)];
+
+		unsigned num = romdb_nearest_keys(romdb, nc->ecuid, k, nc->num);
+		for (i = 0; i < nc->num; i++) {
+			if ((num == nc->num) && (k[i].key == nc->k[i].key) && (k[i].dist == nc->k[i].dist)) continue;
+			printf("%s : nearest %u to %s is %08lX @ %d, expected %08lX @ %d\n", dbname, i, nc->ecuid,
+				(unsigned long) k[i].key, k[i].dist, (unsigned long) nc->k[i].key, nc->k[i].dist);
+			ok = 0;
+			break;
+		}
+	}
+	return ok;
+}
+
+/* every fidtypes[] entry must map back to itself; same tail with another prefix must not */
+static bool check_fidtypes(void) {
+	unsigned fti;
+	bool ok = 1;
+
+	for (fti = FID_UNK + 1; fti < FID_MAX; fti++) {
+		u8 fidic[FIDTYPE_LEN];
+		if (get_fidtype(fidtypes[fti].FIDIC) != fti) {
+			printf("get_fidtype(%.8s) != %u\n", (const char *) fidtypes[fti].FIDIC, fti);
+			ok = 0;
+		}
+		memcpy(fidic, fidtypes[fti].FIDIC, FIDTYPE_LEN);
+		fidic[0] ^= 0x20;
+		if (get_fidtype(fidic) != FID_UNK) {
+			printf("get_fidtype(%.8s) found a fidtype\n", (const char *) fidic);
+			ok = 0;
+		}
+	}
+	return ok;
+}
 
 int main(int argc, char * argv[]) {
 	dbg_stream = stdout;
@@ -21,6 +82,10 @@ int main(int argc, char * argv[]) {
 		return -1;
 	}
 
+	if (!check_fidtypes()) {
+		return -1;
+	}
+
 	nis_romdb *romdb = romdb_new();
 	if (!romdb) {
 		printf("bad new\n");
@@ -45,6 +110,65 @@ int main(int argc, char * argv[]) {
 				(unsigned long) keyset->s27k, (unsigned long) keyset->s36k1, (unsigned long) keyset->s36k2);
 	}
 
+	if (!check_nearest(romdb, "csv db")) {
+		return -1;
+	}
+
+	#define NUM_CANDIDATES 3
+	struct ecuid_keymatch_t near[NUM_CANDIDATES], binnear[NUM_CANDIDATES];
+	unsigned nnear = romdb_nearest_keys(romdb, argv[1], near, NUM_CANDIDATES);
+	unsigned i;
+	for (i = 0; i < nnear; i++) {
+		printf("nearest %u : %.5s\t0x%08lX\t%d\n", i, near[i].ecuid,
+				(unsigned long) near[i].key, near[i].dist);
+	}
+
+	/* ECUIDs only in the built-in list must still be found through the db */
+	struct ecuid_keymatch_t lst;
+	ecuid_getkeys(argv[1], &lst, 1);
+	if ((fidtype == FID_UNK) && !keyset && lst.ecuid && !lst.dist &&
+			(romdb_q_s27k(romdb, argv[1]) != lst.key)) {
+		printf("built-in ECUID list : s27k mismatch\n");
+		return -1;
+	}
+
+	/* same queries through a compiled copy of the db */
+	if (!romdb_compile(romdb, "test_romdb.bin")) {
+		return -1;
+	}
+	nis_romdb *bindb = romdb_new();
+	if (!bindb || !romdb_load_compiled(bindb, "test_romdb.bin")) {
+		printf("bad compiled db\n");
+		return -1;
+	}
+	remove("test_romdb.bin");	//stays mapped
+
+	if (romdb_q_fidtype(bindb, argv[1]) != fidtype) {
+		printf("compiled db : fidtype mismatch\n");
+		return -1;
+	}
+	const struct keyset_t *binks = romdb_q_keyset(bindb, argv[1]);
+	if ((!binks != !keyset) ||
+		(keyset && memcmp(binks, keyset, sizeof(*keyset)))) {
+		printf("compiled db : keyset mismatch\n");
+		return -1;
+	}
+	if (romdb_nearest_keys(bindb, argv[1], binnear, NUM_CANDIDATES) != nnear) {
+		printf("compiled db : nearest keys mismatch\n");
+		return -1;
+	}
+	for (i = 0; i < nnear; i++) {
+		if ((binnear[i].key != near[i].key) || (binnear[i].dist != near[i].dist)) {
+			printf("compiled db : nearest keys mismatch\n");
+			return -1;
+		}
+	}
+	if (!check_nearest(bindb, "compiled db")) {
+		return -1;
+	}
+	printf("compiled db : same results\n");
+
+	romdb_close(bindb);
 	romdb_close(romdb);
 	return 0;
 }
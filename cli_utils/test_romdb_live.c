@@ -0,0 +1,155 @@
+/* test hot-reloaded ROM db : queries from several threads while the db is reloaded */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+#include "nis_romdb.h"
+#include "nis_romdb_live.h"
+
+__thread FILE *dbg_stream;
+
+#define NUM_READERS	4
+#define NUM_RELOADS	200
+#define TEST_KEYSETS	"test_romdb_live.csv"
+
+struct reader_ctx {
+	struct romdb_live *live;
+	const char *ecuid;
+	u32 s27k;	//expected
+	const bool *stop;
+	unsigned long queries;
+	unsigned long errors;
+	unsigned long long max_ns;
+};
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+static void *reader_thread(void *arg) {
+	struct reader_ctx *rc = arg;
+	struct romdb_reader *rd = romdb_live_reader(rc->live);
+
+	if (!rd) {
+		rc->errors++;
+		return NULL;
+	}
+	while (!__atomic_load_n(rc->stop, __ATOMIC_RELAXED)) {
+		unsigned long long t0 = now_ns();
+		nis_romdb *db = romdb_live_enter(rd);
+		const struct keyset_t *ks = db ? romdb_q_keyset(db, rc->ecuid) : NULL;
+		if (!ks || (ks->s27k != rc->s27k)) {
+			rc->errors++;
+		}
+		romdb_live_exit(rd);
+		unsigned long long dt = now_ns() - t0;
+		if (dt > rc->max_ns) rc->max_ns = dt;
+		rc->queries++;
+	}
+	romdb_reader_free(rd);
+	return NULL;
+}
+
+/* write keyset csv, atomically replacing the previous one */
+static bool write_keysets(const char *extra) {
+	FILE *f = fopen(TEST_KEYSETS ".tmp", "w");
+	if (!f) return 0;
+	fprintf(f, "s27k,s36k1,s36k2,notes\n0DF7BF25,F4C70C3F,E9E8A966,\n%s", extra);
+	if (fclose(f)) return 0;
+	return (rename(TEST_KEYSETS ".tmp", TEST_KEYSETS) == 0);
+}
+
+int main(void) {
+	struct reader_ctx rcs[NUM_READERS];
+	pthread_t threads[NUM_READERS];
+	bool stop = 0;
+	unsigned i;
+	int rv = -1;
+
+	dbg_stream = fopen("/dev/null", "w");
+	if (!dbg_stream) dbg_stream = stdout;
+
+	if (!write_keysets("")) {
+		printf("can't write %s\n", TEST_KEYSETS);
+		return -1;
+	}
+
+	struct romdb_live *live = romdb_live_new();
+	if (!live ||
+		!romdb_live_addsrc(live, ROMDB_SRC_ECUID, "test_ecuid.csv") ||
+		!romdb_live_addsrc(live, ROMDB_SRC_KEYSET, TEST_KEYSETS) ||
+		!romdb_live_reload(live)) {
+		printf("bad initial load\n");
+		goto exit;
+	}
+
+	for (i = 0; i < NUM_READERS; i++) {
+		rcs[i] = (struct reader_ctx) {.live = live, .ecuid = "8U001", .s27k = 0x0DF7BF25, .stop = &stop};
+		if (pthread_create(&threads[i], NULL, reader_thread, &rcs[i])) {
+			printf("pthread_create failed\n");
+			__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+			while (i--) pthread_join(threads[i], NULL);
+			goto exit;
+		}
+	}
+
+	unsigned long long t0 = now_ns();
+	for (i = 0; i < NUM_RELOADS; i++) {
+		if (!romdb_live_reload(live)) {
+			printf("reload %u failed\n", i);
+			break;
+		}
+	}
+	unsigned long long dt = now_ns() - t0;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	unsigned long queries = 0, errors = 0;
+	unsigned long long max_ns = 0;
+	for (i = 0; i < NUM_READERS; i++) {
+		pthread_join(threads[i], NULL);
+		queries += rcs[i].queries;
+		errors += rcs[i].errors;
+		if (rcs[i].max_ns > max_ns) max_ns = rcs[i].max_ns;
+	}
+	printf("%u reloads in %.1f ms; %lu queries on %u threads, %lu errors, slowest %llu ns\n",
+			NUM_RELOADS, dt / 1e6, queries, NUM_READERS, errors, max_ns);
+	if (errors || (romdb_live_version(live) != NUM_RELOADS + 1)) {
+		goto exit;
+	}
+
+	/* watcher : a new keyset appears after the CSV is replaced */
+	if (romdb_live_watch(live, 10)) goto exit;
+	unsigned long vers = romdb_live_version(live);
+	if (!write_keysets("12345678,9ABCDEF0,,\n")) goto exit;
+	for (i = 0; (i < 500) && (romdb_live_version(live) == vers); i++) {
+		const struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+		nanosleep(&pause, NULL);
+	}
+	struct romdb_reader *rd = romdb_live_reader(live);
+	if (!rd) goto exit;
+	nis_romdb *db = romdb_live_enter(rd);
+	bool found = db && find_knownkey(db, KEY_S36K1, 0x9ABCDEF0);
+	romdb_live_exit(rd);
+	romdb_reader_free(rd);
+	if (!found) {
+		printf("watcher : new keyset not loaded\n");
+		goto exit;
+	}
+	printf("watcher : reloaded after change\n");
+	rv = 0;
+
+exit:
+	if (live) romdb_live_close(live);
+	remove(TEST_KEYSETS);
+	if (dbg_stream != stdout) fclose(dbg_stream);
+	return rv;
+}
@@ -0,0 +1,106 @@
+/* test romimg_open() on non-seekable input : a ROM fed through a pipe, as with
+ * "nisrom <(zcat rom.bin.gz)" or a FIFO
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+
+__thread FILE *dbg_stream;
+
+#define TEST_SIZ	(600 * 1024UL + 3)	//a few read blocks, and not a multiple of anything
+
+static u32 lcg = 12345;
+static u8 rnd8(void) {
+	lcg = lcg * 1103515245 + 12345;
+	return (u8) (lcg >> 16);
+}
+
+struct feeder {
+	int fd;
+	const u8 *buf;
+	u32 siz;
+};
+
+/* write the image in uneven pieces, then close : the reader only sees EOF */
+static void *feed(void *arg) {
+	struct feeder *f = arg;
+	u32 done = 0;
+
+	while (done < f->siz) {
+		u32 piece = MIN(f->siz - done, 1 + (u32) rnd8() * 97);
+		ssize_t rv = write(f->fd, &f->buf[done], piece);
+		if (rv <= 0) break;
+		done += (u32) rv;
+	}
+	close(f->fd);
+	return NULL;
+}
+
+/** feed siz bytes of buf through a pipe, load it back. @return 1 if ok */
+static bool test_pipe(const u8 *buf, u32 siz, bool writable) {
+	int fds[2];
+	char fname[32];
+	pthread_t thr;
+	struct rom_image img;
+	bool ok = 1;
+
+	if (pipe(fds)) return 0;
+	struct feeder f = {fds[1], buf, siz};
+	if (pthread_create(&thr, NULL, feed, &f)) {
+		close(fds[0]);
+		close(fds[1]);
+		return 0;
+	}
+	snprintf(fname, sizeof(fname), "/dev/fd/%d", fds[0]);
+
+	int rv = romimg_open(&img, fname, writable);
+	if (!siz) {
+		//empty input must be refused
+		if (!rv) {
+			printf("empty pipe accepted\n");
+			romimg_close(&img);
+			ok = 0;
+		}
+	} else if (rv) {
+		printf("romimg_open failed on a pipe (writable=%d)\n", writable);
+		ok = 0;
+	} else {
+		if ((img.siz != siz) || memcmp(img.buf, buf, siz)) {
+			printf("pipe contents differ (writable=%d) : got %lu bytes\n", writable, (unsigned long) img.siz);
+			ok = 0;
+		}
+		romimg_close(&img);
+	}
+	pthread_join(thr, NULL);
+	close(fds[0]);
+	return ok;
+}
+
+int main(void) {
+	u8 *buf = malloc(TEST_SIZ);
+	u32 idx;
+	bool ok = 1;
+
+	dbg_stream = stdout;
+	if (!buf) return -1;
+	for (idx = 0; idx < TEST_SIZ; idx++) buf[idx] = rnd8();
+
+	ok &= test_pipe(buf, TEST_SIZ, 0);
+	ok &= test_pipe(buf, TEST_SIZ, 1);
+	ok &= test_pipe(buf, 1, 0);
+	ok &= test_pipe(buf, 0, 0);
+
+	free(buf);
+	printf("%s\n", ok ? "all ok" : "FAILED");
+	return ok ? 0 : -1;
+}
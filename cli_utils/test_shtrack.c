@@ -0,0 +1,248 @@
+/* test sh_track_reg() against the old recursive tracker : on random code full of reg copies
+ * and branches, both must produce the same callback sequence, in the same order
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+
+#include "nislib.h"
+#include "nislib_shtools.h"
+#include "sh_opcodes.h"
+
+__thread FILE *dbg_stream;
+
+#define TEST_SIZ	(16 * 1024UL)
+#define TEST_NSEEDS	2000
+#define MAX_CALLS	(4 * 1024 * 1024UL)
+#define MAX_NEST	3	//nested sh_track_reg() from the callback
+
+struct call {
+	u32 pos;
+	u8 regno;
+	u8 nest;
+};
+
+struct call_log {
+	struct call *c;
+	u32 num;
+	bool overflow;
+
+	//what the callback calls when nesting
+	struct sh_tracker *trk;	//NULL : reference tracker
+	u16 *visited;
+	u32 siz;
+	unsigned nest;
+};
+
+static u32 lcg = 12345;
+static u16 rnd16(void) {
+	lcg = lcg * 1103515245 + 12345;
+	return (u16) (lcg >> 8);
+}
+
+static void put16(u16 val, u8 *buf) {
+	buf[0] = val >> 8;
+	buf[1] = val & 0xFF;
+}
+
+static void log_cb(const uint8_t *buf, uint32_t pos, unsigned regno, void *data);
+
+/* reference : the recursive tracker, as it was before the worklist.
+ * Only differences : no depth limit or printf, GBR accepted, and branches out of
+ * the buffer are dropped instead of asserting. */
+static void ref_track(const u8 *buf, u32 pos, u32 siz, unsigned regno, u16 *visited,
+			void (*tracker_cb)(const uint8_t *buf, uint32_t pos, unsigned regno, void *data), void *cbdata) {
+	if (pos >= siz) return;
+
+	for (; pos < siz; pos += 2) {
+		unsigned aliased_regno = regno;
+		if (aliased_regno > 15) aliased_regno = 15;
+
+		if (visited[pos] & (1 << aliased_regno)) {
+			return;
+		}
+		visited[pos] |= (1 << aliased_regno);
+
+		u16 opc = reconst_16(&buf[pos]);
+
+		if (IS_RTS(opc) || IS_RTE(opc)) {
+			tracker_cb(buf, pos + 2, regno, cbdata);
+			return;
+		}
+
+		if (regno < 16) {
+			if ((opc & 0xF0FF) == ((regno << 4) | 0x6003)) {
+				unsigned newreg = (opc & 0xF00) >> 8;
+				ref_track(buf, pos + 2, siz, newreg, visited, tracker_cb, cbdata);
+			}
+			if (opc == (0x401E | (regno << 8))) {
+				ref_track(buf, pos + 2, siz, GBR, visited, tracker_cb, cbdata);
+			}
+		}
+
+		if (regno == GBR) {
+			if ((opc & 0xF0FF) == 0x0012) {
+				unsigned newreg = (opc >> 8) & 0xF;
+				ref_track(buf, pos + 2, siz, newreg, visited, tracker_cb, cbdata);
+			}
+		}
+
+		if (IS_BT_OR_BF(opc)) {
+			u32 newpos = disarm_8bit_offset(pos, GET_BTF_OFFSET(opc));
+			ref_track(buf, newpos, siz, regno, visited, tracker_cb, cbdata);
+		}
+
+		if (IS_BRA(opc)) {
+			u32 bra_newpos = disarm_12bit_offset(pos, GET_BRA_OFFSET(opc));
+			tracker_cb(buf, pos + 2, regno, cbdata);
+			pos = bra_newpos - 2;
+			continue;
+		}
+		tracker_cb(buf, pos, regno, cbdata);
+
+		if (sh_getopcode_dest(opc) == regno) {
+			return;
+		}
+	}
+}
+
+/* record the call; on some positions, follow another register from there like findrefs does */
+static void log_cb(const uint8_t *buf, uint32_t pos, unsigned regno, void *data) {
+	struct call_log *cl = data;
+
+	if (cl->num == MAX_CALLS) {
+		cl->overflow = 1;
+		return;
+	}
+	cl->c[cl->num].pos = pos;
+	cl->c[cl->num].regno = (u8) regno;
+	cl->c[cl->num].nest = (u8) cl->nest;
+	cl->num++;
+
+	if ((cl->nest == MAX_NEST) || ((pos + 2) >= cl->siz)) return;
+	if (((pos * 2654435761UL) & 0xFFFFFFFF) >> 27) return;	//about 1 in 32
+
+	unsigned newreg = (regno + 1) & 0x0F;
+	cl->nest++;
+	if (cl->trk) {
+		sh_track_reg(cl->trk, buf, pos + 2, cl->siz, newreg, log_cb, cl);
+	} else {
+		ref_track(buf, pos + 2, cl->siz, newreg, cl->visited, log_cb, cl);
+	}
+	cl->nest--;
+}
+
+static bool same_calls(const char *name, const struct call_log *a, const struct call_log *ref) {
+	u32 i;
+	if (a->overflow || ref->overflow) {
+		printf("%s : too many callbacks\n", name);
+		return 0;
+	}
+	for (i = 0; (i < a->num) && (i < ref->num); i++) {
+		if ((a->c[i].pos != ref->c[i].pos) || (a->c[i].regno != ref->c[i].regno) ||
+				(a->c[i].nest != ref->c[i].nest)) {
+			printf("%s : call %lu is r%u @ %lX (nest %u), expected r%u @ %lX (nest %u)\n", name,
+				(unsigned long) i, a->c[i].regno, (unsigned long) a->c[i].pos, a->c[i].nest,
+				ref->c[i].regno, (unsigned long) ref->c[i].pos, ref->c[i].nest);
+			return 0;
+		}
+	}
+	if (a->num != ref->num) {
+		printf("%s : %lu calls, expected %lu\n", name, (unsigned long) a->num, (unsigned long) ref->num);
+		return 0;
+	}
+	return 1;
+}
+
+/* opcodes the tracker cares about, with random registers and short branches */
+static u16 rnd_opcode(void) {
+	u16 r = rnd16();
+	unsigned rn = (r >> 4) & 0x0F, rm = (r >> 8) & 0x0F;
+	switch (r % 16) {
+	case 0:
+	case 1:
+	case 2:
+		return 0x6003 | (rn << 8) | (rm << 4);	//mov Rm, Rn
+	case 3:
+		return 0x401E | (rm << 8);	//ldc Rm, GBR
+	case 4:
+		return 0x0012 | (rn << 8);	//stc GBR, Rn
+	case 5:
+	case 6: {
+		static const u16 btf[] = {0x8900, 0x8B00, 0x8D00, 0x8F00};	//bt, bf, bt/s, bf/s
+		return btf[rn & 3] | (rnd16() & 0xFF);
+	}
+	case 7:
+		return 0xA000 | (((rnd16() % 0x100) - 0x80) & 0x0FFF);	//bra, +-256 bytes
+	case 8:
+		return (rn & 1) ? 0x000B : 0x002B;	//rts, rte
+	case 9:
+	case 10:
+		return 0xE000 | (rn << 8) | (r >> 8);	//mov #imm, Rn : clobbers
+	case 11:
+		return 0x300C | (rn << 8) | (rm << 4);	//add Rm, Rn
+	default:
+		return rnd16();
+	}
+}
+
+int main(void) {
+	u8 *buf = malloc(TEST_SIZ);
+	u16 *visited = malloc(TEST_SIZ * sizeof(*visited));
+	struct sh_opinfo *dec = malloc((TEST_SIZ / 2) * sizeof(*dec));
+	struct call_log ref = {.c = malloc(MAX_CALLS * sizeof(struct call)), .siz = TEST_SIZ, .visited = visited};
+	struct call_log got = {.c = malloc(MAX_CALLS * sizeof(struct call)), .siz = TEST_SIZ};
+	struct sh_tracker *trk = sh_tracker_new(TEST_SIZ);
+	u32 pos, seed, ncalls = 0;
+	bool ok = 1;
+
+	dbg_stream = stdout;
+	if (!buf || !visited || !dec || !ref.c || !got.c || !trk) return -1;
+	got.trk = trk;
+
+	for (pos = 0; pos < TEST_SIZ; pos += 2) {
+		put16(rnd_opcode(), &buf[pos]);
+	}
+	sh_decode_buf(dec, buf, TEST_SIZ);
+
+	for (seed = 0; ok && (seed < TEST_NSEEDS); seed++) {
+		u32 start = (rnd16() % (TEST_SIZ / 2)) * 2;
+		unsigned regno = rnd16() % (GBR + 1);
+		//every few seeds, keep the visited set : later seeds stop where earlier ones went
+		bool reset = (seed % 8) != 7;
+
+		if (reset) {
+			memset(visited, 0, TEST_SIZ * sizeof(*visited));
+			sh_tracker_reset(trk);
+		}
+		//alternate decode table / per-buffer decode
+		sh_tracker_setdecoded(trk, (seed & 1) ? dec : NULL);
+
+		ref.num = got.num = 0;
+		ref_track(buf, start, TEST_SIZ, regno, visited, log_cb, &ref);
+		sh_track_reg(trk, buf, start, TEST_SIZ, regno, log_cb, &got);
+		if (!same_calls("sh_track_reg", &got, &ref)) {
+			printf("seed %lu : r%u from %lX\n", (unsigned long) seed, regno, (unsigned long) start);
+			ok = 0;
+		}
+		ncalls += ref.num;
+	}
+	if (ok && (ncalls < TEST_NSEEDS)) {
+		printf("only %lu callbacks, bad test image\n", (unsigned long) ncalls);
+		ok = 0;
+	}
+
+	sh_tracker_free(trk);
+	free(ref.c);
+	free(got.c);
+	free(dec);
+	free(visited);
+	free(buf);
+	printf("%s\n", ok ? "all ok" : "FAILED");
+	return ok ? 0 : -1;
+}
@@ -1,178 +1,118 @@
-/* (c) fenugrec 2015-2016
+/* (c) fenugrec 2015-2022
  * GPLv3
  * unpack nissan .dat repro files.
- * currently recognizes only one chunk format: "FMT SRC TGT LEN 34 82 AH AM AL CL <CL bytes of data> <CRC1> <CRC2> <CKS>"
- * not very clever about possible variants, plenty of hardcoded junk. Also doesn't check CRC and cks.
+ * Payload frames are "FMT [TGT SRC] [LEN] 34 82 AH AM AL CL <CL bytes of data> <CRC1> <CRC2> <CKS>";
+ * see nislib_dat.h. The input is parsed as a stream, and payloads are written out as they are found,
+ * optionally decrypted with algo 1.
  *
  */
 
+#include <getopt.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>	//malloc etc
-#include <string.h>	//memcpy
+#include <stdlib.h>
+#include <string.h>
 
 #include "nislib.h"
+#include "nislib_dat.h"
 #include "stypes.h"
 
-FILE *dbg_stream;
+__thread FILE *dbg_stream;
 
 
-struct datfile {
-	FILE *hf;
-	u32 siz;	//size of .dat, in bytes
-	uint8_t *buf;	//copied here
-	
-	uint8_t *dbuf;	//unpacked data
+struct unpack_ctx {
+	FILE *outf;
+	bool decrypt;
+	u32 scode;
+	u8 tmp[256];	//decrypted payload
 };
 
+static int unpack_sink(void *ctx, u32 addr, const u8 *pl, unsigned len) {
+	struct unpack_ctx *uc = ctx;
+	(void) addr;
 
-//load ROM to a new buffer
-//ret 0 if OK
-//caller MUST call close_rom() after
-static int open_dat(struct datfile *rf, const char *fname) {
-	FILE *fbin;
-	uint8_t *buf;	//load whole ROM
-	u32 file_len;
-
-	rf->hf = NULL;	//not needed
-
-	if ((fbin=fopen(fname,"rb"))==NULL) {
-		printf("error opening %s.\n", fname);
-		return -1;
-	}
-
-	file_len = flen(fbin);
-	if ((!file_len) || (file_len > 3*1024*1024L)) {
-		printf("empty, or huge file (length %lu)\n", (unsigned long) file_len);
+	if (uc->decrypt) {
+		unsigned alen = len & ~3U;
+		dec1_buf(pl, uc->tmp, alen, uc->scode);
+		memcpy(&uc->tmp[alen], &pl[alen], len - alen);	//can't decrypt a partial u32
+		pl = uc->tmp;
 	}
-	rf->siz = file_len;
-
-	buf = malloc(file_len);
-	if (!buf) {
-		printf("malloc choke\n");
-		fclose(fbin);
-		return -1;
-	}
-
-	rf->dbuf = malloc(file_len);
-	if (!rf->dbuf) {
-		printf("malloc choke\n");
-		free(buf);
-		fclose(fbin);
+	if (fwrite(pl, 1, len, uc->outf) != len) {
+		ERR_PRINTF("write error\n");
 		return -1;
 	}
-
-	/* load whole ROM */
-	if (fread(buf,1,file_len,fbin) != file_len) {
-		printf("trouble reading\n");
-		free(buf);
-		free(rf->dbuf);
-		fclose(fbin);
-		return -1;
-	}
-	rf->buf = buf;
-	fclose(fbin);
-
 	return 0;
 }
 
-//close & free whatever
-void close_dat(struct datfile *rf) {
-	if (!rf) return;
-	if (rf->buf) {
-		free(rf->buf);
-		rf->buf = NULL;
-	}
-	if (rf->dbuf) {
-		free(rf->dbuf);
-		rf->dbuf = NULL;
-	}
-	return;
-}
-
-#define DCHUNK_SIZE 0x8D	//chunk size is very happy
-#define DCHUNK_DLEN 0x80	//bytes of payload
-// "FMT SRC TGT LEN 34 82 AH AM AL CL <CL bytes of data> <CRC1> <CRC2> <CKS>"
-void unpack_dat(FILE *outf, uint8_t *dest, const uint8_t *src, u32 siz) {
-	// 1- search for "88 34 82"
-	const uint8_t pm[]={0x88, 0x34, 0x82};
-	const uint8_t *psrc;	//misc pointer inside src buf
-	uint8_t *orig_dest = dest;
-	uint32_t curaddr = 0;
-
-	unsigned long plsiz = 0;	//total payload bytes
-	unsigned pl_numc = 0;	//# of chunks
-
-	psrc = u8memstr(src, siz, pm, 3);
-	if (!psrc) return;
-
-	//2- point to "AH AM AL..." and start
-	psrc += 3;
-	while ( psrc < &src[siz - 1] ) {
-		// parse AH:AM:AL
-		uint32_t temp_addr = reconst_32(psrc);
-		temp_addr >>= 8;
-		if (temp_addr != (curaddr + DCHUNK_DLEN)) {
-			printf("addr skip @ %lX\n", (unsigned long) temp_addr);
-		}
-		curaddr = temp_addr;
-		psrc += 3;	//seek to "CL"
-		if (*psrc != DCHUNK_DLEN) {
-			printf("bad chunk len ?\n");
-			return;
-		}
-		psrc += 1;	//seek to payload data
-		memcpy(dest, psrc, DCHUNK_DLEN);
-		pl_numc += 1;
-		dest += DCHUNK_DLEN;
-		plsiz += DCHUNK_DLEN;
-		psrc += (DCHUNK_SIZE - 4); //realign to AH
-	}
-	printf("total: %u chunks; %lu (0x%06lX) bytes in PL.\n",
-			pl_numc, plsiz, plsiz);
-	fwrite(orig_dest, 1, plsiz, outf);
-	return;
+static void usage(const char *progname) {
+	printf("%s [-k <scode>] <file.dat> <out.bin> : unpack payload to <out.bin>\n"
+		"\t<file.dat> and <out.bin> can be \"-\" for stdin / stdout\n"
+		"\t-k : decrypt payload with algo 1 and this scode (hex)\n", progname);
 }
 
-
 int main(int argc, char *argv[])
 {
-	bool	dbg_file;	//flag if dbgstream is a real file
-	FILE *pl0;
-	struct datfile rf = {0};
-
-	if (argc !=3) {
-		printf("%s <file.dat> <out.dat> : unpack payload to <out.dat> etc\n",argv[0]);
-		return 0;
+	struct unpack_ctx uc = {0};
+	struct dat_parser dp;
+	FILE *msg = stdout;	//stderr if output goes to stdout
+	int c;
+	int rv;
+
+	while ((c = getopt(argc, argv, "hk:")) != -1) {
+		switch (c) {
+		case 'k':
+			if (sscanf(optarg, "%x", &uc.scode) != 1) {
+				printf("did not understand %s\n", optarg);
+				return -1;
+			}
+			uc.decrypt = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 0;
+		}
 	}
-
-	dbg_file = 1;
-	//dbg_stream = fopen(DBG_OUTFILE, "a");
-	dbg_stream = NULL;
-	if (!dbg_stream) {
-		dbg_file = 0;
-		dbg_stream = stdout;
+	if ((argc - optind) != 2) {
+		usage(argv[0]);
+		return 0;
 	}
-
-	if (open_dat(&rf, argv[1])) {
-		if (dbg_file) fclose(dbg_stream);
-		printf("Trouble in open_dat()\n");
+	const char *ifn = argv[optind];
+	const char *ofn = argv[optind + 1];
+
+	if (strcmp(ofn, "-") == 0) {
+		uc.outf = stdout;
+		msg = stderr;
+	} else if ((uc.outf = fopen(ofn, "wb")) == NULL) {
+		printf("error opening %s.\n", ofn);
 		return -1;
 	}
+	dbg_stream = msg;
 
-	if ((pl0=fopen(argv[2],"wb"))==NULL) {
-		printf("error opening %s.\n", argv[2]);
+	if (dat_init(&dp, unpack_sink, &uc)) {
+		printf("Trouble in dat_init()\n");
+		if (uc.outf != stdout) fclose(uc.outf);
 		return -1;
 	}
 
-	/* add header to dbg log */
-	fprintf(dbg_stream, "\n********************\n**** Started analyzing %s\n", argv[1]);
-	unpack_dat(pl0, rf.dbuf, rf.buf, rf.siz);
+	rv = dat_parse_file(&dp, ifn);
+	if (rv) {
+		fprintf(msg, "Trouble parsing %s\n", ifn);
+	}
 
-	printf("\n");
-	close_dat(&rf);
-	fclose(pl0);
-	if (dbg_file) fclose(dbg_stream);
-	return 0;
+	const struct dat_stats *st = &dp.st;
+	fprintf(msg, "total: %u chunks; %llu (0x%06llX) bytes in PL, %llu bytes skipped.\n",
+			st->frames, st->plbytes, st->plbytes, st->skipped);
+	fprintf(msg, "CRC : %s; %u bad CRC, %u bad CKS, %u address skips\n",
+			st->crc_name[0] ? st->crc_name : "unknown, not verified",
+			st->crc_errs, st->cks_errs, st->addr_skips);
+	if (st->crc_errs || st->cks_errs) rv = -1;
+
+	dat_done(&dp);
+	if (uc.outf != stdout) {
+		if (fclose(uc.outf)) rv = -1;
+	} else if (fflush(stdout)) {
+		rv = -1;
+	}
+	return rv;
 }
-
@@ -167,6 +167,30 @@ def create_ioregs(devtype_base):
 			# create as Primary label
 			createLabel(toAddr(reg_addr), reg_name, 1)
 
+# import function starts and call edges exported by cli_utils/nisgraph
+def import_callgraph():
+	if not askYesNo("Nissan: call graph", "import call graph CSV from nisgraph ?"):
+		return
+
+	from ghidra.program.model.symbol import RefType, SourceType
+	refmgr = currentProgram.getReferenceManager()
+	graph_file = askFile("nisgraph CSV", "Import")
+
+	with open(graph_file.getAbsolutePath(), 'rb') as f:
+		reader = csv.DictReader(f)
+		for row in reader:
+			addr = toAddr(int(row['addr'], base=16))
+			if row['type'] == "func":
+				disassemble(addr)
+				if getFunctionAt(addr) is None:
+					createFunction(addr, None)
+				continue
+			if row['type'] == "ref":
+				reftype = RefType.DATA
+			else:
+				reftype = RefType.UNCONDITIONAL_CALL
+			refmgr.addMemoryReference(addr, toAddr(int(row['target'], base=16)), reftype, SourceType.ANALYSIS, 0)
+
 def mode_basic():
 	device_base = askChoice("CPU memory blocks", "Select device type", devlist, devlist[0])
 	create_memblocks(device_base)
@@ -179,6 +203,7 @@ def mode_semi():
 	create_memblocks(devtype_base)
 	create_vectors(devtype_base, fidtype.IVT2_addr)
 	create_ioregs(devtype_base)
+	import_callgraph()
 
 def mode_auto():
 	fidtype = find_fid()
@@ -186,6 +211,7 @@ def mode_auto():
 	create_memblocks(devtype_base)
 	create_vectors(devtype_base, fidtype.IVT2_addr)
 	create_ioregs(devtype_base)
+	import_callgraph()
 
 def main():
 	#Operation modes :